@@ -51,6 +51,11 @@ int main(int argc,char *argv[])
   n = 500000;
   if (argc >= 2) 
     n = atoi(argv[1]);
+  /* axpy <n> [<pipeline slices> [<pipeline streams>]] */
+  int pipeline_slices = 0;
+  int pipeline_streams = 2;
+  if (argc >= 3) pipeline_slices = atoi(argv[2]);
+  if (argc >= 4) pipeline_streams = atoi(argv[3]);
   y = ((REAL *)(malloc((n * sizeof(REAL )))));
   y_ompacc = ((REAL *)(malloc((n * sizeof(REAL )))));
   x = ((REAL *)(malloc((n * sizeof(REAL )))));
@@ -62,7 +67,7 @@ int main(int argc,char *argv[])
 // reference serial execution for error checking  
   //axpy(x,y,n,a);
   omp_time = (read_timer_ms() - omp_time);
-  REAL ompacc_time = axpy_ompacc_mdev_v2(x,y_ompacc,n,a);
+  REAL ompacc_time = axpy_ompacc_mdev_v2(x,y_ompacc,n,a,pipeline_slices,pipeline_streams);
   omp_fini_devices();
   REAL cksm;
   //cksm = check(y,y_ompacc,n) ;
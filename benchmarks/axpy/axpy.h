@@ -14,7 +14,8 @@ extern "C" {
 
 /* both the omp version and ompacc version */
 extern void axpy(REAL* x, REAL* y,  long n, REAL a); 
-extern double axpy_ompacc_mdev_v2(REAL* x, REAL* y,  long n, REAL a);
+/* pipeline_slices > 1 enables chunked copy/compute pipelining over pipeline_streams streams per device */
+extern double axpy_ompacc_mdev_v2(REAL* x, REAL* y,  long n, REAL a, int pipeline_slices, int pipeline_streams);
 #ifdef __cplusplus
  }
 #endif
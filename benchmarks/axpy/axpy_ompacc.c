@@ -95,7 +95,7 @@ void OUT__3__5904__launcher (omp_offloading_t * off, void *args) {
 	}
 }
 
-REAL axpy_ompacc_mdev_v2(REAL *x, REAL *y,  long n,REAL a)
+double axpy_ompacc_mdev_v2(REAL *x, REAL *y,  long n,REAL a, int pipeline_slices, int pipeline_streams)
 {
 	double ompacc_time = read_timer_ms(); //read_timer_ms();
 	
@@ -143,6 +143,7 @@ REAL axpy_ompacc_mdev_v2(REAL *x, REAL *y,  long n,REAL a)
 	__offloading_info__.offloadings = (omp_offloading_t *) alloca(sizeof(omp_offloading_t) * __num_target_devices__);
 	/* we use universal args and launcher because axpy can do it */
 	omp_offloading_init_info("axpy kernel", &__offloading_info__, &__top__, __target_devices__, 0, OMP_OFFLOADING_DATA_CODE, __num_mapped_array__, __data_map_infos__, OUT__3__5904__launcher, &args, NULL, NULL, NULL);
+	omp_offloading_set_pipeline(&__offloading_info__, pipeline_slices, pipeline_streams);
 
 #if 0
 	/* we could specify dev-specific args and kernel_launcher */
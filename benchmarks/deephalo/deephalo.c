@@ -0,0 +1,317 @@
+/*
+ * deephalo.c
+ *
+ * communication-avoiding stencil with deep halos: a 5-point smoothing of an n x n grid (the border is fixed) is run for a
+ * number of steps with the halo exchanged every step (depth 1), and with a halo depth steps deep exchanged only every
+ * depth steps, the devices computing the ghost band themselves in between (see omp_map_set_halo_depth). For each depth it
+ * reports the exchanges, the time, the us per step and the max difference from the sequential smoothing.
+ *
+ * usage: deephalo [n] [steps] [dist] [depth ...]
+ * dist is 1 for rows (default) or 3 for 2-d, the depths default to 1 2 4 8. A device must have at least depth rows (and
+ * columns for 2-d)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "homp.h"
+
+#define REAL double
+
+void deephalo_seq(REAL * x, REAL * tmp, long n, int steps) {
+	long i, j;
+	int s;
+	memcpy(tmp, x, sizeof(REAL) * n * n);
+	for (s=0; s<steps; s++) {
+		for (i=1; i<n-1; i++) {
+			for (j=1; j<n-1; j++) x[i*n+j] = 0.25 * (tmp[(i-1)*n+j] + tmp[(i+1)*n+j] + tmp[i*n+j-1] + tmp[i*n+j+1]);
+		}
+		memcpy(tmp, x, sizeof(REAL) * n * n);
+	}
+}
+
+#if defined (DEVICE_NVGPU_SUPPORT)
+/* dst[i][j] = src[i][j] for the rows and columns [i0, i0+rows) x [j0, j0+cols), both are pitch elements wide */
+__global__ void deephalo_copy_kernel(REAL * dst, REAL * src, long pitch, long i0, long j0, long rows, long cols) {
+	long k = blockDim.x * blockIdx.x + threadIdx.x;
+	if (k >= rows * cols) return;
+	long i = i0 + k / cols;
+	long j = j0 + k % cols;
+	dst[i*pitch+j] = src[i*pitch+j];
+}
+
+__global__ void deephalo_stencil_kernel(REAL * b, REAL * a, long pitch, long i0, long j0, long rows, long cols) {
+	long k = blockDim.x * blockIdx.x + threadIdx.x;
+	if (k >= rows * cols) return;
+	long i = i0 + k / cols;
+	long j = j0 + k % cols;
+	b[i*pitch+j] = 0.25 * (a[(i-1)*pitch+j] + a[(i+1)*pitch+j] + a[i*pitch+j-1] + a[i*pitch+j+1]);
+}
+#endif
+
+struct deephalo_args {
+	long n;
+	REAL * x; /* the grid, no halo */
+	REAL * a; /* the grid the stencil reads, its deep halo is exchanged */
+	REAL * b; /* the grid the stencil writes, with the same halo for the ghost band */
+};
+
+/* the part [i0, i0+rows) x [j0, j0+cols) of the dev mem of map a the device computes in this step: the interior and the
+ * ghost band still valid, without the border of the grid, which is fixed
+ */
+static void deephalo_range(omp_data_map_t * map_a, long n, long * i0, long * rows, long * j0, long * cols) {
+	long g0 = omp_loop_map_valid_range(map_a, 0, i0, rows);
+	long g1 = omp_loop_map_valid_range(map_a, 1, j0, cols);
+	if (g0 < 1) {
+		*i0 += 1 - g0;
+		*rows -= 1 - g0;
+		g0 = 1;
+	}
+	if (g0 + *rows > n - 1) *rows = n - 1 - g0;
+	if (g1 < 1) {
+		*j0 += 1 - g1;
+		*cols -= 1 - g1;
+		g1 = 1;
+	}
+	if (g1 + *cols > n - 1) *cols = n - 1 - g1;
+}
+
+/* launch dst = src, or dst = stencil(src) if stencil, for the rows and columns of the dev mem of the maps (pitch wide) */
+static void deephalo_launch(omp_offloading_t * off, REAL * dst, REAL * src, long pitch, long i0, long j0, long rows, long cols, int stencil) {
+	if (rows <= 0 || cols <= 0) return;
+	omp_device_type_t devtype = off->dev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		int threads_per_team = omp_get_optimal_threads_per_team(off->dev);
+		int teams_per_league = (rows * cols + threads_per_team - 1) / threads_per_team;
+		if (stencil) deephalo_stencil_kernel<<<teams_per_league, threads_per_team, 0, off->stream->systream.cudaStream>>>(dst, src, pitch, i0, j0, rows, cols);
+		else deephalo_copy_kernel<<<teams_per_league, threads_per_team, 0, off->stream->systream.cudaStream>>>(dst, src, pitch, i0, j0, rows, cols);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		long i, j;
+		if (stencil) {
+#pragma omp parallel for shared(dst, src, pitch, i0, j0, rows, cols) private(i, j)
+			for (i=i0; i<i0+rows; i++) {
+				for (j=j0; j<j0+cols; j++)
+					dst[i*pitch+j] = 0.25 * (src[(i-1)*pitch+j] + src[(i+1)*pitch+j] + src[i*pitch+j-1] + src[i*pitch+j+1]);
+			}
+		} else {
+#pragma omp parallel for shared(dst, src, pitch, i0, j0, rows, cols) private(i, j)
+			for (i=i0; i<i0+rows; i++) {
+				for (j=j0; j<j0+cols; j++) dst[i*pitch+j] = src[i*pitch+j];
+			}
+		}
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+/* a = b on the part the stencil computed in the last step, the exchange of a appended to it refreshes the halo when it is due */
+void deephalo_copy_launcher(omp_offloading_t * off, void * args) {
+	struct deephalo_args * iargs = (struct deephalo_args *) args;
+	omp_data_map_t * map_a = omp_map_get_map(off, iargs->a, -1);
+	omp_data_map_t * map_b = omp_map_get_map(off, iargs->b, -1);
+	long i0, rows, j0, cols;
+	deephalo_range(map_a, iargs->n, &i0, &rows, &j0, &cols);
+	deephalo_launch(off, (REAL *) map_a->map_dev_ptr, (REAL *) map_b->map_dev_ptr, map_a->map_dist[1].length, i0, j0, rows, cols, 0);
+}
+
+/* b = stencil(a) on the part of the grid the device computes, which is the interior plus the ghost band still valid */
+void deephalo_stencil_launcher(omp_offloading_t * off, void * args) {
+	struct deephalo_args * iargs = (struct deephalo_args *) args;
+	omp_data_map_t * map_a = omp_map_get_map(off, iargs->a, -1);
+	omp_data_map_t * map_b = omp_map_get_map(off, iargs->b, -1);
+	long i0, rows, j0, cols;
+	deephalo_range(map_a, iargs->n, &i0, &rows, &j0, &cols);
+	deephalo_launch(off, (REAL *) map_b->map_dev_ptr, (REAL *) map_a->map_dev_ptr, map_a->map_dist[1].length, i0, j0, rows, cols, 1);
+}
+
+/* copy between x and the map of grid (a or b) on the part of the grid of the device (to the map if to_map), x has no halo */
+static void deephalo_copy_x(omp_offloading_t * off, struct deephalo_args * iargs, REAL * grid, int to_map) {
+	omp_data_map_t * map_x = omp_map_get_map(off, iargs->x, -1);
+	omp_data_map_t * map = omp_map_get_map(off, grid, -1);
+	long x0, rows, x1, cols;
+	long g0 = omp_loop_map_range(map_x, 0, -1, -1, &x0, &rows);
+	long g1 = omp_loop_map_range(map_x, 1, -1, -1, &x1, &cols);
+	long m0 = g0 - map->map_dist[0].offset;
+	long m1 = g1 - map->map_dist[1].offset;
+	long pitch_x = map_x->map_dist[1].length;
+	long pitch = map->map_dist[1].length;
+	REAL * x = (REAL *) map_x->map_dev_ptr;
+	REAL * m = (REAL *) map->map_dev_ptr;
+	if (to_map) omp_map_memcpy_2d_DeviceToDevice(&m[m0*pitch+m1], sizeof(REAL) * pitch, off->dev, &x[x0*pitch_x+x1], sizeof(REAL) * pitch_x,
+			off->dev, sizeof(REAL) * cols, rows);
+	else omp_map_memcpy_2d_DeviceToDevice(&x[x0*pitch_x+x1], sizeof(REAL) * pitch_x, off->dev, &m[m0*pitch+m1], sizeof(REAL) * pitch,
+			off->dev, sizeof(REAL) * cols, rows);
+}
+
+/* both a and b start with the grid, the border is not computed */
+void deephalo_init_launcher(omp_offloading_t * off, void * args) {
+	struct deephalo_args * iargs = (struct deephalo_args *) args;
+	deephalo_copy_x(off, iargs, iargs->a, 1);
+	deephalo_copy_x(off, iargs, iargs->b, 1);
+}
+
+void deephalo_store_launcher(omp_offloading_t * off, void * args) {
+	struct deephalo_args * iargs = (struct deephalo_args *) args;
+	deephalo_copy_x(off, iargs, iargs->b, 0);
+}
+
+static void deephalo_run(REAL * x, REAL * x0, REAL * x_seq, REAL * a, REAL * b, long n, int steps, int dist, int depth) {
+	int __num_target_devices__ = omp_get_num_active_devices();
+	omp_device_t *__target_devices__[__num_target_devices__];
+	int i;
+	for (i=0; i<__num_target_devices__; i++) __target_devices__[i] = &omp_devices[i];
+
+	omp_grid_topology_t __top__;
+	int __top_ndims__ = dist == 3 ? 2 : 1;
+	int __top_dims__[__top_ndims__];
+	int __top_periodic__[__top_ndims__];
+	int __id_map__[__num_target_devices__];
+	long __array_dims__[2] = {n, n};
+	long __halo__[2] = {2*depth, 2*depth};
+	omp_grid_topology_init_halo(&__top__, __target_devices__, __num_target_devices__, __top_ndims__, __top_dims__, __top_periodic__, __id_map__,
+			__array_dims__, __halo__);
+
+	memcpy(x, x0, sizeof(REAL) * n * n);
+	omp_data_map_info_t __data_map_infos__[3];
+	long dims[2]; dims[0] = n; dims[1] = n;
+	omp_data_map_t x_maps[__num_target_devices__];
+	omp_dist_info_t x_dist[2];
+	omp_data_map_init_info("x", &__data_map_infos__[0], &__top__, x, 2, dims, sizeof(REAL), x_maps, OMP_DATA_MAP_TOFROM, OMP_DATA_MAP_AUTO, x_dist);
+	omp_dist_init_info(&x_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+	if (dist == 3) omp_dist_init_info(&x_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 1);
+	else omp_dist_init_info(&x_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+
+	/* a and b have a halo of depth steps of the radius 1 stencil */
+	omp_data_map_t a_maps[__num_target_devices__];
+	omp_dist_info_t a_dist[2];
+	omp_data_map_halo_region_info_t a_halo[2];
+	omp_data_map_t b_maps[__num_target_devices__];
+	omp_dist_info_t b_dist[2];
+	omp_data_map_halo_region_info_t b_halo[2];
+	omp_data_map_init_info_with_halo("a", &__data_map_infos__[1], &__top__, a, 2, dims, sizeof(REAL), a_maps, OMP_DATA_MAP_ALLOC, OMP_DATA_MAP_AUTO, a_dist, a_halo);
+	omp_data_map_init_info_with_halo("b", &__data_map_infos__[2], &__top__, b, 2, dims, sizeof(REAL), b_maps, OMP_DATA_MAP_ALLOC, OMP_DATA_MAP_AUTO, b_dist, b_halo);
+	int m;
+	for (m=1; m<3; m++) {
+		omp_dist_info_t * m_dist = m == 1 ? a_dist : b_dist;
+		omp_dist_init_info(&m_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+		omp_map_add_halo_region(&__data_map_infos__[m], 0, depth, depth, 0);
+		if (dist == 3) {
+			omp_dist_init_info(&m_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 1);
+			omp_map_add_halo_region(&__data_map_infos__[m], 1, depth, depth, 0);
+		} else omp_dist_init_info(&m_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+		omp_map_set_halo_depth(&__data_map_infos__[m], depth);
+	}
+
+	omp_offloading_info_t __offloading_info__;
+	omp_offloading_t __offs__[__num_target_devices__];
+	__offloading_info__.offloadings = __offs__;
+	omp_offloading_init_info("data region", &__offloading_info__, &__top__, __target_devices__, 0, OMP_OFFLOADING_DATA, 3, __data_map_infos__, NULL, NULL, NULL, NULL, NULL);
+	omp_offloading_start(&__offloading_info__);
+
+	struct deephalo_args args;
+	args.n = n;
+	args.x = x;
+	args.a = a;
+	args.b = b;
+	omp_offloading_info_t init_info, copy_info, stencil_info, store_info;
+	omp_offloading_t init_offs[__num_target_devices__], copy_offs[__num_target_devices__], stencil_offs[__num_target_devices__], store_offs[__num_target_devices__];
+	init_info.offloadings = init_offs;
+	copy_info.offloadings = copy_offs;
+	stencil_info.offloadings = stencil_offs;
+	store_info.offloadings = store_offs;
+	omp_offloading_init_info("init", &init_info, &__top__, __target_devices__, 0, OMP_OFFLOADING_CODE, 0, NULL, deephalo_init_launcher, &args, NULL, NULL, NULL);
+	omp_offloading_init_info("copy", &copy_info, &__top__, __target_devices__, 1, OMP_OFFLOADING_CODE, 0, NULL, deephalo_copy_launcher, &args, NULL, NULL, NULL);
+	omp_offloading_init_info("stencil", &stencil_info, &__top__, __target_devices__, 1, OMP_OFFLOADING_CODE, 0, NULL, deephalo_stencil_launcher, &args, NULL, NULL, NULL);
+	omp_offloading_init_info("store", &store_info, &__top__, __target_devices__, 0, OMP_OFFLOADING_CODE, 0, NULL, deephalo_store_launcher, &args, NULL, NULL, NULL);
+
+	omp_data_map_halo_exchange_info_t x_halos[1];
+	x_halos[0].map_info = &__data_map_infos__[1];
+	x_halos[0].x_direction = OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT;
+	x_halos[0].x_dim = -1;
+	omp_offloading_append_data_exchange_info(&copy_info, x_halos, 1);
+
+	omp_offloading_start(&init_info);
+	double time = read_timer_ms();
+	int s;
+	for (s=0; s<steps; s++) {
+		omp_offloading_start_async(&copy_info);
+		omp_offloading_start_async(&stencil_info);
+		omp_offloading_wait(&stencil_info);
+		omp_offloading_wait(&copy_info);
+	}
+	time = read_timer_ms() - time;
+	omp_offloading_start(&store_info);
+	omp_offloading_start(&__offloading_info__); /* the end of the data region, x is copied back */
+
+	omp_offloading_fini_info(&init_info);
+	omp_offloading_fini_info(&copy_info);
+	omp_offloading_fini_info(&stencil_info);
+	omp_offloading_fini_info(&store_info);
+	omp_offloading_fini_info(&__offloading_info__);
+
+	double error = 0.0;
+	long k;
+	for (k=0; k<n*n; k++) {
+		double diff = fabs(x[k] - x_seq[k]);
+		if (diff > error) error = diff;
+	}
+	char grid[32];
+	if (__top_ndims__ == 1) sprintf(grid, "%d", __top_dims__[0]);
+	else sprintf(grid, "%dx%d", __top_dims__[0], __top_dims__[1]);
+	printf("%-8d%-10s%12d%12.2f%12.2f%12g\n", depth, grid, (steps + depth - 1) / depth, time, time * 1000.0 / steps, error);
+}
+
+int main(int argc, char * argv[]) {
+	long n = 512;
+	int steps = 64;
+	int dist = 1;
+	if (argc >= 2) n = atol(argv[1]);
+	if (argc >= 3) steps = atoi(argv[2]);
+	if (argc >= 4) dist = atoi(argv[3]);
+	int default_depths[4] = {1, 2, 4, 8};
+	int * depths = default_depths;
+	int num_depths = 4;
+	if (argc >= 5) {
+		num_depths = argc - 4;
+		depths = (int *) malloc(sizeof(int) * num_depths);
+		int d;
+		for (d=0; d<num_depths; d++) depths[d] = atoi(argv[d+4]);
+	}
+
+	REAL * x = (REAL *) malloc(sizeof(REAL) * n * n);
+	REAL * x0 = (REAL *) malloc(sizeof(REAL) * n * n);
+	REAL * x_seq = (REAL *) malloc(sizeof(REAL) * n * n);
+	REAL * a = (REAL *) malloc(sizeof(REAL) * n * n);
+	REAL * b = (REAL *) malloc(sizeof(REAL) * n * n);
+	long i;
+	srand48(1 << 12);
+	for (i=0; i<n*n; i++) x0[i] = drand48();
+	memcpy(x_seq, x0, sizeof(REAL) * n * n);
+	deephalo_seq(x_seq, a, n, steps);
+
+	omp_init_devices();
+	if (omp_get_num_active_devices() == 0) {
+		fprintf(stderr, "no device is available, set OMP_NUM_THSIM_DEVICES or OMP_NUM_NVGPU_DEVICES\n");
+		exit(1);
+	}
+	printf("==============================================================================================\n");
+	printf("deephalo: %d steps of a 5-point stencil on a %ldx%ld grid on %d devices, %s dist\n", steps, n, n, omp_get_num_active_devices(),
+			dist == 3 ? "2-d" : "row");
+	printf("%-8s%-10s%12s%12s%12s%12s\n", "depth", "grid", "exchanges", "time(ms)", "us/step", "error");
+	int d;
+	for (d=0; d<num_depths; d++) deephalo_run(x, x0, x_seq, a, b, n, steps, dist, depths[d]);
+	printf("==============================================================================================\n");
+
+	omp_fini_devices();
+	if (depths != default_depths) free(depths);
+	free(x);
+	free(x0);
+	free(x_seq);
+	free(a);
+	free(b);
+	return 0;
+}
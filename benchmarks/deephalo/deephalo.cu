@@ -0,0 +1 @@
+deephalo.c
\ No newline at end of file
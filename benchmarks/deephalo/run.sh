@@ -0,0 +1,15 @@
+#!/bin/bash
+unset OMP_NVGPU_DEVICES
+export OMP_NUM_NVGPU_DEVICES=0
+
+for nd in 2 4 8; do
+export OMP_NUM_THSIM_DEVICES=$nd
+for exe in deephalo-thsim deephalo-thsim-relay; do
+for dist in 1 3; do
+echo "-------------------------------------------------------------------------------------------------"
+echo "-------------------------------- $exe, $nd devices, dist $dist -------------------------------"
+./$exe 64 512 $dist 1 2 4 8
+echo "-------------------------------------------------------------------------------------------------"
+done
+done
+done
@@ -0,0 +1,162 @@
+/*
+ * dispatch.c
+ *
+ * microbenchmark for the helper thread wake-up path: the latency from omp_offloading_start to the kernel launcher being
+ * called on each device, the round trip time of an empty offloading, and the cpu time burned by idle devices.
+ *
+ * usage: dispatch [iterations] [idle_ms] [num_host_threads]
+ * num_host_threads host threads offload concurrently to the same devices for the submission throughput test
+ * use OMP_HELPER_SPIN to change the spin budget of the helper threads before they park
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "homp.h"
+
+struct dispatch_args {
+	volatile double * entry_time; /* one per device seqid */
+};
+
+/* called by the helper thread, the kernel does nothing except recording when it is reached */
+void dispatch_empty_launcher(omp_offloading_t * off, void * args) {
+	struct dispatch_args * iargs = (struct dispatch_args *) args;
+	iargs->entry_time[off->devseqid] = read_timer_ms();
+}
+
+static double cpu_time_ms() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+}
+
+/**
+ * run iterations of empty offloading, gap_us is the host sleep time before each offloading so we can measure
+ * the dispatch latency of either spinning (gap_us == 0) or parked (large gap) helper threads
+ */
+static void dispatch_run(omp_offloading_info_t * info, struct dispatch_args * args, int ndevs, int iterations, int gap_us,
+		double * avg_latency, double * max_latency, double * avg_roundtrip) {
+	int it, i;
+	double latency_sum = 0.0;
+	double latency_max = 0.0;
+	double roundtrip_sum = 0.0;
+	for (it=0; it<iterations; it++) {
+		if (gap_us) usleep(gap_us);
+		double submit = read_timer_ms();
+		omp_offloading_start(info);
+		double done = read_timer_ms();
+		for (i=0; i<ndevs; i++) {
+			double latency = args->entry_time[i] - submit;
+			latency_sum += latency;
+			if (latency > latency_max) latency_max = latency;
+		}
+		roundtrip_sum += done - submit;
+	}
+	*avg_latency = latency_sum/(iterations*ndevs);
+	*max_latency = latency_max;
+	*avg_roundtrip = roundtrip_sum/iterations;
+}
+
+struct dispatch_submitter {
+	pthread_t th;
+	omp_grid_topology_t * top;
+	omp_device_t ** targets;
+	int iterations;
+};
+
+/* each submitter thread offloads its own empty kernel, they all target the same devices */
+static void * dispatch_submitter_main(void * arg) {
+	struct dispatch_submitter * sub = (struct dispatch_submitter *) arg;
+	int ndevs = sub->top->nnodes;
+	double entry_time[ndevs];
+	struct dispatch_args args;
+	args.entry_time = entry_time;
+	omp_offloading_info_t info;
+	info.offloadings = (omp_offloading_t *) alloca(sizeof(omp_offloading_t) * ndevs);
+	omp_offloading_init_info("empty kernel", &info, sub->top, sub->targets, 1, OMP_OFFLOADING_CODE, 0, NULL, dispatch_empty_launcher, &args, NULL, NULL, NULL);
+	int it;
+	for (it=0; it<sub->iterations; it++) {
+		omp_offloading_start(&info);
+	}
+	omp_offloading_fini_info(&info);
+	return NULL;
+}
+
+int main(int argc, char * argv[]) {
+	int iterations = 2000;
+	int idle_ms = 1000;
+	if (argc >= 2) iterations = atoi(argv[1]);
+	if (argc >= 3) idle_ms = atoi(argv[2]);
+	int num_host_threads = 4;
+	if (argc >= 4) num_host_threads = atoi(argv[3]);
+
+	omp_init_devices();
+	int __num_target_devices__ = omp_get_num_active_devices();
+	if (__num_target_devices__ == 0) {
+		fprintf(stderr, "no device is available, set OMP_NUM_THSIM_DEVICES or OMP_NUM_NVGPU_DEVICES\n");
+		exit(1);
+	}
+	omp_device_t *__target_devices__[__num_target_devices__];
+	int __i__;
+	for (__i__ = 0; __i__ < __num_target_devices__; __i__++) {
+		__target_devices__[__i__] = &omp_devices[__i__];
+	}
+
+	omp_grid_topology_t __top__;
+	int __top_ndims__ = 1;
+	int __top_dims__[__top_ndims__];
+	int __top_periodic__[__top_ndims__];
+	int __id_map__[__num_target_devices__];
+	omp_grid_topology_init_simple (&__top__, __target_devices__, __num_target_devices__, __top_ndims__, __top_dims__, __top_periodic__, __id_map__);
+
+	double entry_time[__num_target_devices__];
+	struct dispatch_args args;
+	args.entry_time = entry_time;
+
+	omp_offloading_info_t __offloading_info__;
+	__offloading_info__.offloadings = (omp_offloading_t *) alloca(sizeof(omp_offloading_t) * __num_target_devices__);
+	omp_offloading_init_info("empty kernel", &__offloading_info__, &__top__, __target_devices__, 1, OMP_OFFLOADING_CODE, 0, NULL, dispatch_empty_launcher, &args, NULL, NULL, NULL);
+
+	double avg_latency, max_latency, avg_roundtrip;
+	/* warm up, the first offloading does init work */
+	dispatch_run(&__offloading_info__, &args, __num_target_devices__, 10, 0, &avg_latency, &max_latency, &avg_roundtrip);
+
+	printf("==============================================================================================\n");
+	printf("dispatch on %d devices, helper spin max: %d, %d iterations\n", __num_target_devices__, omp_helper_spin_max, iterations);
+	printf("\t\t\t\tavg dispatch(us)\tmax dispatch(us)\tavg roundtrip(us)\n");
+	dispatch_run(&__offloading_info__, &args, __num_target_devices__, iterations, 0, &avg_latency, &max_latency, &avg_roundtrip);
+	printf("back-to-back:\t\t\t%.2f\t\t\t%.2f\t\t\t%.2f\n", avg_latency*1000.0, max_latency*1000.0, avg_roundtrip*1000.0);
+	int idle_iterations = iterations/10 > 0 ? iterations/10 : 1;
+	dispatch_run(&__offloading_info__, &args, __num_target_devices__, idle_iterations, 10000, &avg_latency, &max_latency, &avg_roundtrip);
+	printf("after 10ms idle:\t\t%.2f\t\t\t%.2f\t\t\t%.2f\n", avg_latency*1000.0, max_latency*1000.0, avg_roundtrip*1000.0);
+
+	/* idle cpu: the host thread sleeps, so all the cpu time consumed is by the idle helper threads */
+	double cpu = cpu_time_ms();
+	double wall = read_timer_ms();
+	usleep(idle_ms*1000);
+	cpu = cpu_time_ms() - cpu;
+	wall = read_timer_ms() - wall;
+	printf("idle cpu in %.0f ms: %.2f%% total, %.2f%% per device\n", wall, cpu/wall*100.0, cpu/wall*100.0/__num_target_devices__);
+
+	/* submission throughput with multiple host threads offloading to the same devices */
+	int nth;
+	for (nth=1; nth<=num_host_threads; nth*=2) {
+		struct dispatch_submitter subs[nth];
+		double elapsed = read_timer_ms();
+		for (__i__ = 0; __i__ < nth; __i__++) {
+			subs[__i__].top = &__top__;
+			subs[__i__].targets = __target_devices__;
+			subs[__i__].iterations = iterations/nth;
+			pthread_create(&subs[__i__].th, NULL, dispatch_submitter_main, &subs[__i__]);
+		}
+		for (__i__ = 0; __i__ < nth; __i__++) pthread_join(subs[__i__].th, NULL);
+		elapsed = read_timer_ms() - elapsed;
+		printf("%d host threads submitting:\t%.0f offloadings/s\n", nth, (iterations/nth)*nth/elapsed*1000.0);
+	}
+	printf("==============================================================================================\n");
+
+	omp_offloading_fini_info(&__offloading_info__);
+	omp_fini_devices();
+	return 0;
+}
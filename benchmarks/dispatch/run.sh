@@ -0,0 +1,14 @@
+#!/bin/bash
+unset OMP_NVGPU_DEVICES
+export OMP_NUM_NVGPU_DEVICES=0
+
+for nd in 1 2 4 8; do
+export OMP_NUM_THSIM_DEVICES=$nd
+for spin in 0 1000 20000; do
+export OMP_HELPER_SPIN=$spin
+echo "-------------------------------------------------------------------------------------------------"
+echo "-------------------------------- dispatch, $nd devices, spin $spin ------------------------------"
+./dispatch-thsim 2000 1000
+echo "-------------------------------------------------------------------------------------------------"
+done
+done
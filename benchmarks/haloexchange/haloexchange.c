@@ -0,0 +1,248 @@
+/*
+ * haloexchange.c
+ *
+ * microbenchmark for the latency of the halo exchange between devices. maps n x n arrays with a halo of width w are
+ * distributed by rows, by columns and in 2-d over all the devices, and a standalone exchange offloading of all of them is
+ * run back to back. It reports the us per exchange, the halo bytes each device pulls per exchange and checks the halo
+ * against the arrays after the exchanges.
+ *
+ * usage: haloexchange [n] [exchanges] [w] [maps]
+ * Build haloexchange-thsim-relay (-DEXPERIMENT_RELAY_BUFFER_FOR_HALO_EXCHANGE) to relay the exchange of THSIM devices
+ * through the host instead of copying device-to-device. With more than one map, OMP_HALO_AGGREGATE=0 and 2 compare the
+ * exchange of each map separately with packing the halo of all the maps for a neighbor into one transfer
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "homp.h"
+
+#define REAL double
+
+struct haloexchange_args {
+	long n;
+	int num_maps;
+	REAL * a; /* map m is the array at a + m*n*n */
+	int * bad; /* per device, the halo elements that are wrong */
+};
+
+/* the first element and the number of elements in dim of the part of the map a device computes, i.e. without the halo */
+static void haloexchange_interior(omp_data_map_t * map, int dim, long * begin, long * length) {
+	omp_data_map_halo_region_info_t * halo_info = &map->info->halo_info[dim];
+	*begin = 0;
+	*length = map->map_dist[dim].length;
+	if (omp_data_map_get_halo_left_devseqid(map, dim) >= 0) {
+		*begin = halo_info->left;
+		*length -= halo_info->left;
+	}
+	if (omp_data_map_get_halo_right_devseqid(map, dim) >= 0) *length -= halo_info->right;
+}
+
+/* the device computes a[i][j] = i*n+j in its part, the halo is poisoned unless it is the part of a neighbor (SHARED map) */
+static void haloexchange_fill(omp_offloading_t * off, struct haloexchange_args * iargs, int m) {
+	REAL base = (REAL) m * iargs->n * iargs->n;
+	omp_data_map_t * map = omp_map_get_map(off, &iargs->a[m * iargs->n * iargs->n], -1);
+	long rows = map->map_dist[0].length;
+	long cols = map->map_dist[1].length;
+	long begin0, length0, begin1, length1, i, j;
+	haloexchange_interior(map, 0, &begin0, &length0);
+	haloexchange_interior(map, 1, &begin1, &length1);
+	REAL * buf = (REAL *) malloc(sizeof(REAL) * rows * cols);
+	for (i=0; i<rows; i++) {
+		for (j=0; j<cols; j++) buf[i*cols+j] = base + (REAL) ((map->map_dist[0].offset + i) * iargs->n + map->map_dist[1].offset + j);
+	}
+	if (map->map_type != OMP_DATA_MAP_SHARED) {
+		REAL * poison = (REAL *) malloc(sizeof(REAL) * rows * cols);
+		for (i=0; i<rows*cols; i++) poison[i] = -1.0;
+		omp_map_memcpy_to(map->map_dev_ptr, off->dev, poison, sizeof(REAL) * rows * cols);
+		free(poison);
+	}
+	omp_map_memcpy_2d_to(&((REAL *) map->map_dev_ptr)[begin0*cols+begin1], sizeof(REAL) * cols, off->dev, &buf[begin0*cols+begin1],
+			sizeof(REAL) * cols, sizeof(REAL) * length1, length0);
+	free(buf);
+}
+
+void haloexchange_fill_launcher(omp_offloading_t * off, void * args) {
+	struct haloexchange_args * iargs = (struct haloexchange_args *) args;
+	int m;
+	for (m=0; m<iargs->num_maps; m++) haloexchange_fill(off, iargs, m);
+}
+
+/* the wrong elements of map m on the device */
+static int haloexchange_check(omp_offloading_t * off, struct haloexchange_args * iargs, int m) {
+	REAL base = (REAL) m * iargs->n * iargs->n;
+	omp_data_map_t * map = omp_map_get_map(off, &iargs->a[m * iargs->n * iargs->n], -1);
+	long rows = map->map_dist[0].length;
+	long cols = map->map_dist[1].length;
+	long i, j;
+	REAL * buf = (REAL *) malloc(sizeof(REAL) * rows * cols);
+	omp_map_memcpy_from(buf, map->map_dev_ptr, off->dev, sizeof(REAL) * rows * cols);
+	int bad = 0;
+	for (i=0; i<rows; i++) {
+		for (j=0; j<cols; j++) {
+			if (buf[i*cols+j] != base + (REAL) ((map->map_dist[0].offset + i) * iargs->n + map->map_dist[1].offset + j)) bad++;
+		}
+	}
+	free(buf);
+	return bad;
+}
+
+void haloexchange_check_launcher(omp_offloading_t * off, void * args) {
+	struct haloexchange_args * iargs = (struct haloexchange_args *) args;
+	int m, bad = 0;
+	for (m=0; m<iargs->num_maps; m++) bad += haloexchange_check(off, iargs, m);
+	iargs->bad[off->devseqid] = bad;
+}
+
+/* dist: 1 rows, 2 columns, 3 both */
+static void haloexchange_run(REAL * a, long n, int exchanges, long w, int num_maps, int dist) {
+	int __num_target_devices__ = omp_get_num_active_devices();
+	omp_device_t *__target_devices__[__num_target_devices__];
+	int i;
+	for (i=0; i<__num_target_devices__; i++) __target_devices__[i] = &omp_devices[i];
+
+	omp_grid_topology_t __top__;
+	int __top_ndims__ = dist == 3 ? 2 : 1;
+	int __top_dims__[__top_ndims__];
+	int __top_periodic__[__top_ndims__];
+	int __id_map__[__num_target_devices__];
+	long __array_dims__[2] = {n, n};
+	long __halo__[2] = {2*w, 2*w};
+	omp_grid_topology_init_halo(&__top__, __target_devices__, __num_target_devices__, __top_ndims__, __top_dims__, __top_periodic__, __id_map__,
+			__array_dims__, __halo__);
+
+	omp_data_map_info_t __data_map_infos__[num_maps];
+	long a_dims[2]; a_dims[0] = n; a_dims[1] = n;
+	omp_data_map_t a_maps[num_maps][__num_target_devices__];
+	omp_dist_info_t a_dist[num_maps][2];
+	omp_data_map_halo_region_info_t a_halo[num_maps][2];
+	int m;
+	for (m=0; m<num_maps; m++) {
+		omp_data_map_info_t * a_info = &__data_map_infos__[m];
+		omp_data_map_init_info_with_halo("a", a_info, &__top__, &a[m*n*n], 2, a_dims, sizeof(REAL), a_maps[m], OMP_DATA_MAP_ALLOC, OMP_DATA_MAP_AUTO,
+				a_dist[m], a_halo[m]);
+		if (dist == 1) {
+			omp_dist_init_info(&a_dist[m][0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+			omp_dist_init_info(&a_dist[m][1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+			omp_map_add_halo_region(a_info, 0, w, w, 0);
+		} else if (dist == 2) {
+			omp_dist_init_info(&a_dist[m][0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+			omp_dist_init_info(&a_dist[m][1], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+			omp_map_add_halo_region(a_info, 1, w, w, 0);
+		} else {
+			omp_dist_init_info(&a_dist[m][0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+			omp_dist_init_info(&a_dist[m][1], OMP_DIST_POLICY_BLOCK, 0, n, 1);
+			omp_map_add_halo_region(a_info, 0, w, w, 0);
+			omp_map_add_halo_region(a_info, 1, w, w, 0);
+		}
+	}
+
+	omp_offloading_info_t __offloading_info__;
+	omp_offloading_t __offs__[__num_target_devices__];
+	__offloading_info__.offloadings = __offs__;
+	omp_offloading_init_info("data region", &__offloading_info__, &__top__, __target_devices__, 0, OMP_OFFLOADING_DATA, num_maps, __data_map_infos__, NULL, NULL, NULL, NULL, NULL);
+	omp_offloading_start(&__offloading_info__);
+
+	int bad[__num_target_devices__];
+	struct haloexchange_args args;
+	args.n = n;
+	args.num_maps = num_maps;
+	args.a = a;
+	args.bad = bad;
+	omp_offloading_info_t fill_info;
+	omp_offloading_t fill_offs[__num_target_devices__];
+	fill_info.offloadings = fill_offs;
+	omp_offloading_init_info("fill", &fill_info, &__top__, __target_devices__, 0, OMP_OFFLOADING_CODE, 0, NULL, haloexchange_fill_launcher, &args, NULL, NULL, NULL);
+	omp_offloading_info_t check_info;
+	omp_offloading_t check_offs[__num_target_devices__];
+	check_info.offloadings = check_offs;
+	omp_offloading_init_info("check", &check_info, &__top__, __target_devices__, 0, OMP_OFFLOADING_CODE, 0, NULL, haloexchange_check_launcher, &args, NULL, NULL, NULL);
+
+	omp_data_map_halo_exchange_info_t x_halos[num_maps];
+	for (m=0; m<num_maps; m++) {
+		x_halos[m].map_info = &__data_map_infos__[m];
+		x_halos[m].x_direction = OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT;
+		x_halos[m].x_dim = -1;
+	}
+	omp_offloading_info_t x_info;
+	omp_offloading_t x_offs[__num_target_devices__];
+	x_info.offloadings = x_offs;
+	omp_offloading_standalone_data_exchange_init_info("halo exchange", &x_info, &__top__, __target_devices__, 1, 0, NULL, x_halos, num_maps);
+
+	omp_offloading_start(&fill_info);
+	omp_offloading_start(&x_info); /* warm up */
+	double time = read_timer_ms();
+	int k;
+	for (k=0; k<exchanges; k++) omp_offloading_start(&x_info);
+	time = read_timer_ms() - time;
+	omp_offloading_start(&check_info);
+
+	/* the bytes pulled by the device with the most halo, of all the maps */
+	long max_bytes = 0;
+	int d;
+	for (i=0; i<__num_target_devices__; i++) {
+		long bytes = 0;
+		for (d=0; d<2; d++) {
+			omp_data_map_halo_region_mem_t * halo_mem = &a_maps[0][i].halo_mem[d];
+			if (!omp_data_map_has_halo(&__data_map_infos__[0], d)) continue;
+			if (halo_mem->left_dev_seqid >= 0) bytes += halo_mem->left_in_size;
+			if (halo_mem->right_dev_seqid >= 0) bytes += halo_mem->right_in_size;
+		}
+		bytes *= num_maps;
+		if (bytes > max_bytes) max_bytes = bytes;
+	}
+	int total_bad = 0;
+	for (i=0; i<__num_target_devices__; i++) total_bad += bad[i];
+
+	omp_offloading_start(&__offloading_info__); /* the end of the data region */
+	omp_offloading_fini_info(&x_info);
+	omp_offloading_fini_info(&fill_info);
+	omp_offloading_fini_info(&check_info);
+	omp_offloading_fini_info(&__offloading_info__);
+
+	char name[32];
+	if (dist == 1) sprintf(name, "rows");
+	else if (dist == 2) sprintf(name, "columns");
+	else sprintf(name, "2-d");
+	char grid[32];
+	if (__top_ndims__ == 1) sprintf(grid, "%d", __top_dims__[0]);
+	else sprintf(grid, "%dx%d", __top_dims__[0], __top_dims__[1]);
+	printf("%-12s%-10s%14.1f%16.2f%12s\n", name, grid, max_bytes / 1024.0, time * 1000.0 / exchanges, total_bad ? "FAILED" : "ok");
+}
+
+int main(int argc, char * argv[]) {
+	long n = 1024;
+	int exchanges = 1000;
+	long w = 1;
+	if (argc >= 2) n = atol(argv[1]);
+	if (argc >= 3) exchanges = atoi(argv[2]);
+	if (argc >= 4) w = atol(argv[3]);
+	int num_maps = 1;
+	if (argc >= 5) num_maps = atoi(argv[4]);
+	if (num_maps < 1) num_maps = 1;
+
+	REAL * a = (REAL *) malloc(sizeof(REAL) * n * n * num_maps);
+	long i;
+	for (i=0; i<n*n*num_maps; i++) a[i] = (REAL) i;
+
+	omp_init_devices();
+	if (omp_get_num_active_devices() == 0) {
+		fprintf(stderr, "no device is available, set OMP_NUM_THSIM_DEVICES or OMP_NUM_NVGPU_DEVICES\n");
+		exit(1);
+	}
+	printf("==============================================================================================\n");
+	printf("halo exchange of %d %ldx%ld arrays, halo width %ld, %d exchanges on %d devices", num_maps, n, n, w, exchanges, omp_get_num_active_devices());
+	if (num_maps > 1) printf(", aggregation %s", omp_halo_aggregate == OMP_HALO_AGGREGATE_NEVER ? "off" :
+			omp_halo_aggregate == OMP_HALO_AGGREGATE_ALWAYS ? "always" : "auto");
+#if defined EXPERIMENT_RELAY_BUFFER_FOR_HALO_EXCHANGE
+	printf(", THSIM exchange relayed by the host");
+#endif
+	printf("\n%-12s%-10s%14s%16s%12s\n", "dist", "grid", "halo KB/dev", "us/exchange", "check");
+	haloexchange_run(a, n, exchanges, w, num_maps, 1);
+	haloexchange_run(a, n, exchanges, w, num_maps, 2);
+	haloexchange_run(a, n, exchanges, w, num_maps, 3);
+	printf("==============================================================================================\n");
+
+	omp_fini_devices();
+	free(a);
+	return 0;
+}
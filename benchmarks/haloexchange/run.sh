@@ -0,0 +1,20 @@
+#!/bin/bash
+unset OMP_NVGPU_DEVICES
+export OMP_NUM_NVGPU_DEVICES=0
+
+for nd in 2 4 8; do
+export OMP_NUM_THSIM_DEVICES=$nd
+for exe in haloexchange-thsim haloexchange-thsim-relay; do
+echo "-------------------------------------------------------------------------------------------------"
+echo "-------------------------------- $exe, $nd devices -------------------------------"
+# all the devices sync at a barrier around each exchange, and each device with its neighbors only
+for sync in 0 1; do
+OMP_HALO_SYNC=$sync ./$exe 1024 1000 1
+done
+# the halo of 8 small arrays, each map exchanged separately and packed into one transfer per neighbor
+for agg in 0 2; do
+OMP_HALO_AGGREGATE=$agg ./$exe 256 1000 1 8
+done
+echo "-------------------------------------------------------------------------------------------------"
+done
+done
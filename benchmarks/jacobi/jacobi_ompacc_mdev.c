@@ -522,8 +522,11 @@ void OUT__1__10550__launcher(omp_offloading_t * off, void *args) {
 
     REAL * f_p = (REAL *)map_f->map_dev_ptr;
     REAL * u_p = (REAL *)map_u->map_dev_ptr;
-    REAL (*f)[m] = (REAL(*)[m])f_p; /* cast pointer to array */
-    REAL (*u)[m] = (REAL(*)[m])u_p;
+    /* the rows of f and u on the device are as long as their dim-1 dist, which is m only if they are not distributed in dim 1 */
+    int f_1_length = map_f->map_dist[1].length;
+    int u_1_length = map_u->map_dist[1].length;
+    REAL (*f)[f_1_length] = (REAL(*)[f_1_length])f_p; /* cast pointer to array */
+    REAL (*u)[u_1_length] = (REAL(*)[u_1_length])u_p;
 
     /* we need to adjust index offset for those who has halo region because of we use attached halo region memory management */
     REAL * uold_p = (REAL *)map_uold->map_dev_ptr;
@@ -585,7 +588,8 @@ void OUT__1__10550__launcher(omp_offloading_t * off, void *args) {
 		/* for reduction operation */
 		REAL * _dev_per_block_error = (REAL*)omp_map_malloc_dev(off->dev, teams_per_league * sizeof(REAL));
 		//printf("dev: %d teams per league, err block mem: %X\n", teams_per_league, _dev_per_block_error);
-		REAL _host_per_block_error[teams_per_league];
+		/* pinned staging so the copy back is a real async transfer */
+		REAL * _host_per_block_error = (REAL*)omp_map_malloc_staging(off->dev, teams_per_league * sizeof(REAL));
 		//printf("%d device: original offset: %d, mapped_offset: %d, length: %d\n", __i__, offset_n, start_n, length_n);
 		/* Launch CUDA kernel ... */
 		/** since here we do the same mapping, so will reuse the _threads_per_block and _num_blocks */
@@ -601,6 +605,7 @@ void OUT__1__10550__launcher(omp_offloading_t * off, void *args) {
 		iargs->error[off->devseqid] = xomp_beyond_block_reduction_double(_host_per_block_error, teams_per_league, XOMP_REDUCTION_PLUS);
 		//cudaStreamAddCallback(__dev_stream__[__i__].systream.cudaStream, xomp_beyond_block_reduction_double_stream_callback, args, 0);
 		omp_map_free_dev(off->dev, _dev_per_block_error);
+		omp_map_free_staging(off->dev, _host_per_block_error);
 
 	} else
 #endif
@@ -717,7 +722,14 @@ void jacobi_omp_mdev(long n, long m, REAL dx, REAL dy, REAL alpha, REAL omega, R
   	int __top_dims__[__top_ndims__ ];
   	int __top_periodic__[__top_ndims__ ];
   	int __id_map__[__num_target_devices__ ];
-  	omp_grid_topology_init_simple(&__top__, __target_devices__, __num_target_devices__, __top_ndims__, __top_dims__,__top_periodic__, __id_map__);
+  	/* the grid that exchanges the least halo of the n x m arrays (halo width 1 on both sides) between the closest devices */
+  	long __array_dims__[2];
+  	long __halo__[2] = {2, 2};
+  	if (dist == 1) __array_dims__[0] = n;
+  	else if (dist == 2) __array_dims__[0] = m;
+  	else /* dist == 3 */ { __array_dims__[0] = n; __array_dims__[1] = m; }
+  	omp_grid_topology_init_halo(&__top__, __target_devices__, __num_target_devices__, __top_ndims__, __top_dims__,__top_periodic__, __id_map__,
+  			__array_dims__, __halo__);
 
   	int __num_mapped_array__ = 3; /* XXX: need compiler output */
   	omp_data_map_info_t __data_map_infos__[__num_mapped_array__ ];
@@ -813,6 +825,8 @@ void jacobi_omp_mdev(long n, long m, REAL dx, REAL dy, REAL alpha, REAL omega, R
   	args_2.n = n; args_2.m = m; args_2.ax = ax; args_2.ay = ay; args_2.b = b; args_2.omega = omega;args_2.u = (REAL*)u_p; args_2.uold = (REAL*)uold; args_2.f = (REAL*) f_p;
   	REAL __reduction_error__[__num_target_devices__]; args_2.error = __reduction_error__;
 	omp_offloading_init_info("jacobi kernel", &__off_info_2__, &__top__, __target_devices__, 1, OMP_OFFLOADING_CODE, 0, NULL, OUT__1__10550__launcher, &args_2, NULL, NULL, NULL);
+	/* row dist: move rows between neighbor devices when the kernel time of the devices differs by more than 10% */
+	if (dist == 1) omp_offloading_set_rebalance(&__off_info_2__, 0.1, 100);
 
   	/* halo exchange offloading */
   	omp_data_map_halo_exchange_info_t x_halos[1];
@@ -840,17 +854,24 @@ void jacobi_omp_mdev(long n, long m, REAL dx, REAL dy, REAL alpha, REAL omega, R
 
 	while ((k <= mits) && (error > tol)) {
 		error = 0.0;
-		/* Copy new solution into old */
-	  	omp_offloading_start(&__off_info_1__);
+		/* Copy new solution into old. The three offloadings are queued to the devices back to back without
+		 * the host waiting in between, the devices run them in order */
+	  	omp_offloading_start_async(&__off_info_1__);
 
 #if defined (STANDALONE_DATA_X)
 		/** option 2 halo exchange */
 		//printf("----- u <-> uold halo exchange, k: %d, off_info: %X\n", k, &__off_info_1__);
-	  	omp_offloading_start(&uuold_halo_x_off_info);
+	  	omp_offloading_start_async(&uuold_halo_x_off_info);
 #endif
 
 		/* jacobi */
-	  	omp_offloading_start(&__off_info_2__);
+	  	omp_offloading_start_async(&__off_info_2__);
+	  	omp_offloading_wait(&__off_info_2__);
+	  	omp_offloading_wait(&__off_info_1__); /* already done since devices run in order, but it updates the off_info */
+#if defined (STANDALONE_DATA_X)
+	  	omp_offloading_wait(&uuold_halo_x_off_info);
+#endif
+	  	omp_offloading_rebalance(&__off_info_2__); /* no offloading is in flight here */
 		int __i__;
 		for (__i__ = 0; __i__ < __num_target_devices__;__i__++) {
 			error += __reduction_error__[__i__];
@@ -891,7 +912,7 @@ void jacobi_omp_mdev(long n, long m, REAL dx, REAL dy, REAL alpha, REAL omega, R
 	infos[1] = &__off_info_1__;
 	infos[2] = &__off_info_2__;
 #if defined (STANDALONE_DATA_X)
-	infos[3] = &uuold_halo_x_off_inf;
+	infos[3] = &uuold_halo_x_off_info;
 #endif
 	omp_offloading_info_sum_profile(infos, num_infos, start_time, compl_time);
 	omp_offloading_info_report_profile(&__offloading_info__);
@@ -0,0 +1,140 @@
+/*
+ * maplookup.c
+ *
+ * microbenchmark for finding the data map of a host pointer, it reports the ns per lookup of omp_map_get_map (the interval
+ * index of the map cache of an offloading) and of a linear scan of the same map cache, for different numbers of maps, and the
+ * ns per lookup of omp_map_get_map_inheritance when the maps are spread over the nested data offloadings of the offload stack.
+ *
+ * usage: maplookup [max_maps] [levels] [lookups]
+ * the number of maps doubles from levels to max_maps, the pointers looked up are random pointers inside the mapped arrays
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "homp.h"
+
+#define REAL double
+#define MAPLOOKUP_ARRAY_SIZE 64 /* elements of each mapped array */
+#define MAPLOOKUP_NUM_PTRS 4096
+
+/* the linear scan of the map cache, which is how maps were found before the index */
+static omp_data_map_t * maplookup_linear(omp_offloading_t * off, void * host_ptr) {
+	char * ptr = (char *) host_ptr;
+	int i;
+	for (i=0; i<off->num_maps; i++) {
+		if (off->map_cache[i].host_begin <= ptr && ptr < off->map_cache[i].host_end) return off->map_cache[i].map;
+	}
+	return NULL;
+}
+
+static void maplookup_run(int num_maps, int levels, long lookups, REAL * arrays, omp_device_t * dev) {
+	omp_data_map_info_t * infos = (omp_data_map_info_t *) malloc(sizeof(omp_data_map_info_t) * num_maps);
+	omp_data_map_t * maps = (omp_data_map_t *) malloc(sizeof(omp_data_map_t) * num_maps);
+	long * dims = (long *) malloc(sizeof(long) * num_maps);
+	int * order = (int *) malloc(sizeof(int) * num_maps);
+	omp_offloading_t offs[levels];
+	omp_offloading_t * stack[levels];
+	void * ptrs[MAPLOOKUP_NUM_PTRS]; /* inside the maps of all the levels */
+	void * cur_ptrs[MAPLOOKUP_NUM_PTRS]; /* inside the maps of the current offloading */
+	int i, l;
+	long k;
+
+	/* the arrays are appended in random order, and map i goes to level i % levels */
+	for (i=0; i<num_maps; i++) order[i] = i;
+	for (i=num_maps-1; i>0; i--) {
+		int j = rand() % (i+1);
+		int t = order[i]; order[i] = order[j]; order[j] = t;
+	}
+	memset(offs, 0, sizeof(omp_offloading_t) * levels);
+	for (i=0; i<num_maps; i++) {
+		int m = order[i];
+		dims[m] = MAPLOOKUP_ARRAY_SIZE;
+		infos[m].symbol = "a";
+		infos[m].source_ptr = (char *) &arrays[(long) m * MAPLOOKUP_ARRAY_SIZE];
+		infos[m].num_dims = 1;
+		infos[m].dims = &dims[m];
+		infos[m].sizeof_element = sizeof(REAL);
+		maps[m].info = &infos[m];
+		omp_offload_append_map_to_cache(&offs[m % levels], &maps[m], 0);
+	}
+	int per_level = num_maps / levels;
+	for (i=0; i<MAPLOOKUP_NUM_PTRS; i++) {
+		int m = rand() % num_maps;
+		ptrs[i] = &arrays[(long) m * MAPLOOKUP_ARRAY_SIZE + rand() % MAPLOOKUP_ARRAY_SIZE];
+		m = (rand() % per_level) * levels + levels - 1;
+		cur_ptrs[i] = &arrays[(long) m * MAPLOOKUP_ARRAY_SIZE + rand() % MAPLOOKUP_ARRAY_SIZE];
+	}
+
+	/* the last level is the current offloading, the others are the nested data offloadings on the stack */
+	for (l=0; l<levels; l++) stack[l] = &offs[l];
+	dev->offload_stack = stack;
+	dev->offload_stack_size = levels;
+	dev->offload_stack_top = levels - 2;
+	omp_offloading_t * off = &offs[levels-1];
+
+	int error = 0;
+	long found = 0;
+	double t = read_timer_ms();
+	for (k=0; k<lookups; k++) found += omp_map_get_map(off, cur_ptrs[k % MAPLOOKUP_NUM_PTRS], -1) != NULL;
+	double index_time = read_timer_ms() - t;
+	t = read_timer_ms();
+	for (k=0; k<lookups; k++) found -= maplookup_linear(off, cur_ptrs[k % MAPLOOKUP_NUM_PTRS]) != NULL;
+	double linear_time = read_timer_ms() - t;
+	if (found != 0) error = 1;
+	found = 0;
+
+	/* all the levels, as done for a map inherited from the enclosing data offloadings */
+	dev->offload_stack_top = levels - 1;
+	t = read_timer_ms();
+	for (k=0; k<lookups; k++) found += omp_map_get_map_inheritance(dev, ptrs[k % MAPLOOKUP_NUM_PTRS]) != NULL;
+	double stack_time = read_timer_ms() - t;
+	if (found != lookups) error = 1;
+	for (i=0; i<MAPLOOKUP_NUM_PTRS; i++) {
+		omp_data_map_t * map = omp_map_get_map_inheritance(dev, ptrs[i]);
+		long m = ((REAL *) ptrs[i] - arrays) / MAPLOOKUP_ARRAY_SIZE;
+		if (map != &maps[m]) error = 1;
+	}
+
+	double ns = 1.0e6 / lookups;
+	printf("%d\t\t%d\t\t%.1f\t\t%.1f\t\t%.1f\t\t%s\n", num_maps, off->num_maps, index_time * ns, linear_time * ns,
+			stack_time * ns, error ? "FAILED" : "ok");
+
+	for (l=0; l<levels; l++) omp_offloading_fini_map_cache(&offs[l]);
+	dev->offload_stack = NULL;
+	dev->offload_stack_size = 0;
+	dev->offload_stack_top = -1;
+	free(infos);
+	free(maps);
+	free(dims);
+	free(order);
+}
+
+int main(int argc, char * argv[]) {
+	int max_maps = 4096;
+	int levels = 1;
+	long lookups = 1000000;
+	if (argc >= 2) max_maps = atoi(argv[1]);
+	if (argc >= 3) levels = atoi(argv[2]);
+	if (argc >= 4) lookups = atol(argv[3]);
+	if (levels < 1) levels = 1;
+	if (max_maps < levels) max_maps = levels;
+
+	/* no device needs to be initialized, the lookup only touches the offloading objects and the offload stack of a device */
+	omp_device_t dev;
+	memset(&dev, 0, sizeof(omp_device_t));
+	dev.offload_stack_top = -1;
+	REAL * arrays = (REAL *) malloc(sizeof(REAL) * MAPLOOKUP_ARRAY_SIZE * max_maps);
+	srand(1 << 12);
+
+	int num_maps;
+	printf("==============================================================================================\n");
+	printf("map lookup of %ld random pointers, maps spread over %d nesting levels\n", lookups, levels);
+	printf("maps\t\tmaps/level\tindex(ns)\tlinear(ns)\tall levels(ns)\tcheck\n");
+	for (num_maps = levels; num_maps <= max_maps; num_maps *= 2) {
+		maplookup_run(num_maps, levels, lookups, arrays, &dev);
+	}
+	printf("==============================================================================================\n");
+
+	free(arrays);
+	return 0;
+}
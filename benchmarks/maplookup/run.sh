@@ -0,0 +1,10 @@
+#!/bin/bash
+unset OMP_NVGPU_DEVICES
+export OMP_NUM_NVGPU_DEVICES=0
+
+for levels in 1 2 4 8; do
+echo "-------------------------------------------------------------------------------------------------"
+echo "-------------------------------- map lookup, $levels nesting levels ---------------------------"
+./maplookup-thsim 4096 $levels 1000000
+echo "-------------------------------------------------------------------------------------------------"
+done
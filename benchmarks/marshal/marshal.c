@@ -0,0 +1,211 @@
+/*
+ * marshal.c
+ *
+ * microbenchmark for marshalling/unmarshalling the noncontiguous region of a distributed array, it reports the GB/s of
+ * omp_map_marshal and omp_map_unmarshal for different region shapes, the GB/s of copying the region between the array and
+ * the dev mem with strided memcpy (OMP_STRIDED_COPY=1, the default), and a contiguous memcpy of the same size.
+ *
+ * usage: marshal [array_MB] [num_parts] [repeats]
+ * the array is distributed onto num_parts parts and the region of the first part is marshalled
+ * use OMP_MARSHAL_THREADS to change the number of threads that help marshalling
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "homp.h"
+
+#define REAL double
+
+struct marshal_shape {
+	const char * name;
+	int ndims;
+	int top_ndims;
+	omp_dist_policy_t policy[3];
+	int topdim[3];
+};
+
+static struct marshal_shape marshal_shapes[] = {
+	{"2-D column block", 2, 1, {OMP_DIST_POLICY_DUPLICATE, OMP_DIST_POLICY_BLOCK}, {0, 0}},
+	{"2-D 2-D block", 2, 2, {OMP_DIST_POLICY_BLOCK, OMP_DIST_POLICY_BLOCK}, {0, 1}},
+	{"3-D dim 1 block", 3, 1, {OMP_DIST_POLICY_DUPLICATE, OMP_DIST_POLICY_BLOCK, OMP_DIST_POLICY_DUPLICATE}, {0, 0, 0}},
+	{"3-D dim 2 block", 3, 1, {OMP_DIST_POLICY_DUPLICATE, OMP_DIST_POLICY_DUPLICATE, OMP_DIST_POLICY_BLOCK}, {0, 0, 0}},
+	{"3-D dim 1,2 block", 3, 2, {OMP_DIST_POLICY_DUPLICATE, OMP_DIST_POLICY_BLOCK, OMP_DIST_POLICY_BLOCK}, {0, 0, 1}},
+	{"3-D 3-D block", 3, 3, {OMP_DIST_POLICY_BLOCK, OMP_DIST_POLICY_BLOCK, OMP_DIST_POLICY_BLOCK}, {0, 1, 2}},
+};
+
+/* the element offset in the original array of the k-th element of the region */
+static long marshal_full_offset(omp_data_map_t * map, long k) {
+	omp_data_map_info_t * info = map->info;
+	long off = 0;
+	long mt = 1;
+	int i;
+	for (i=info->num_dims-1; i>=0; i--) {
+		long idx = k % map->map_dist[i].length;
+		k /= map->map_dist[i].length;
+		off += (map->map_dist[i].offset + idx) * mt;
+		mt *= info->dims[i];
+	}
+	return off;
+}
+
+/**
+ * check sampled elements of the region, a[k] == k initially and both the region buffer and the array region hold
+ * sign * k after the region is marshalled (sign == 1) or the negated buffer is unmarshalled (sign == -1)
+ */
+static int marshal_check(omp_data_map_t * map, REAL * a, REAL * buffer, long num_elements, REAL sign) {
+	long k;
+	for (k=0; k<num_elements; k+=97) {
+		long off = marshal_full_offset(map, k);
+		if (buffer[k] != sign * off || a[off] != sign * off) return 1;
+	}
+	long off = marshal_full_offset(map, num_elements-1);
+	if (buffer[num_elements-1] != sign * off || a[off] != sign * off) return 1;
+	return 0;
+}
+
+static void marshal_negate(REAL * buffer, long num_elements) {
+	long k;
+	for (k=0; k<num_elements; k++) buffer[k] = -buffer[k];
+}
+
+static void marshal_run(struct marshal_shape * shape, long array_mb, omp_device_t ** devs, int nparts, int repeats) {
+	int ndims = shape->ndims;
+	long num_elements = array_mb * 1024 * 1024 / sizeof(REAL);
+	long n = (long) floor(pow((double) num_elements, 1.0 / ndims) + 0.5);
+	long dims[ndims];
+	long total = 1;
+	int i, r;
+	for (i=0; i<ndims; i++) {
+		dims[i] = n;
+		total *= n;
+	}
+
+	omp_grid_topology_t top;
+	int top_dims[shape->top_ndims];
+	int top_periodic[shape->top_ndims];
+	int id_map[nparts];
+	omp_grid_topology_init_simple(&top, devs, nparts, shape->top_ndims, top_dims, top_periodic, id_map);
+
+	REAL * a = (REAL *) malloc(sizeof(REAL) * total);
+	long k;
+	for (k=0; k<total; k++) a[k] = (REAL) k;
+
+	omp_data_map_info_t info;
+	omp_data_map_t maps[nparts];
+	omp_dist_info_t dist[ndims];
+	omp_data_map_init_info("a", &info, &top, a, ndims, dims, sizeof(REAL), maps, OMP_DATA_MAP_TOFROM, OMP_DATA_MAP_COPY, dist);
+	for (i=0; i<ndims; i++) omp_dist_init_info(&dist[i], shape->policy[i], 0, n, shape->topdim[i]);
+
+	omp_data_map_t * map = &maps[0];
+	omp_data_map_init_map(map, &info, devs[0]);
+	omp_data_map_dist(map, 0);
+	omp_map_buffer(map, NULL); /* the dev mem, and the marshal buffer if the region is not copied by strided memcpy */
+	if (!map->mem_noncontiguous) {
+		printf("%-20s\tcontiguous region, no marshalling\n", shape->name);
+		goto cleanup;
+	}
+	long region_elements = map->map_size / sizeof(REAL);
+	int error = 0;
+	int strided_copy = map->strided_copy;
+	char * dev_ptr = map->map_dev_ptr;
+
+	/* strided memcpy between the array and the dev mem, the dev mem is checked only if it is host accessible */
+	double strided_to_time = 0.0;
+	double strided_from_time = 0.0;
+	if (strided_copy) {
+		int host_accessible = !omp_device_mem_discrete(map->dev->mem_type);
+		for (r=0; r<repeats; r++) {
+			double t = read_timer_ms();
+			omp_map_mapto(map);
+			strided_to_time += read_timer_ms() - t;
+		}
+		if (host_accessible) {
+			error += marshal_check(map, a, (REAL *) dev_ptr, region_elements, 1.0);
+			marshal_negate((REAL *) dev_ptr, region_elements);
+		}
+		for (r=0; r<repeats; r++) {
+			double t = read_timer_ms();
+			omp_map_mapfrom(map);
+			strided_from_time += read_timer_ms() - t;
+		}
+		if (host_accessible) {
+			error += marshal_check(map, a, (REAL *) dev_ptr, region_elements, -1.0);
+			marshal_negate((REAL *) dev_ptr, region_elements);
+			omp_map_mapfrom(map);
+		}
+		map->strided_copy = 0; /* marshal the same region below */
+	} else omp_map_free_staging(map->dev, map->map_buffer);
+
+	double marshal_time = 0.0;
+	for (r=0; r<repeats; r++) {
+		if (r > 0) omp_map_free_staging(map->dev, map->map_buffer);
+		double t = read_timer_ms();
+		omp_map_marshal(map);
+		marshal_time += read_timer_ms() - t;
+	}
+	REAL * buffer = (REAL *) map->map_buffer;
+	error += marshal_check(map, a, buffer, region_elements, 1.0);
+
+	marshal_negate(buffer, region_elements);
+	double unmarshal_time = 0.0;
+	for (r=0; r<repeats; r++) {
+		double t = read_timer_ms();
+		omp_map_unmarshal(map);
+		unmarshal_time += read_timer_ms() - t;
+	}
+	error += marshal_check(map, a, buffer, region_elements, -1.0);
+
+	/* contiguous copy of the same size for reference */
+	double memcpy_time = 0.0;
+	for (r=0; r<repeats; r++) {
+		double t = read_timer_ms();
+		memcpy(buffer, a, map->map_size);
+		memcpy_time += read_timer_ms() - t;
+	}
+
+	char region[64];
+	int len = 0;
+	for (i=0; i<ndims; i++) len += sprintf(&region[len], i == 0 ? "%ld" : "x%ld", map->map_dist[i].length);
+	double gb = map->map_size * (double) repeats / (1024.0*1024.0*1024.0) * 1000.0;
+	printf("%-20s\t%-16s\t%.2f\t%.2f\t\t%.2f\t\t", shape->name, region, map->map_size / (1024.0*1024.0),
+			gb / marshal_time, gb / unmarshal_time);
+	if (strided_copy) printf("%.2f\t\t%.2f\t\t", gb / strided_to_time, gb / strided_from_time);
+	else printf("-\t\t-\t\t");
+	printf("%.2f\t\t%s\n", gb / memcpy_time, error ? "FAILED" : "ok");
+
+	if (dev_ptr != map->map_buffer) omp_map_free_dev(map->dev, dev_ptr);
+	omp_map_free_staging(map->dev, map->map_buffer);
+cleanup:
+	free(a);
+}
+
+int main(int argc, char * argv[]) {
+	long array_mb = 64;
+	int nparts = 4;
+	int repeats = 10;
+	if (argc >= 2) array_mb = atol(argv[1]);
+	if (argc >= 3) nparts = atoi(argv[2]);
+	if (argc >= 4) repeats = atoi(argv[3]);
+
+	omp_init_devices();
+	if (omp_get_num_active_devices() == 0) {
+		fprintf(stderr, "no device is available, set OMP_NUM_THSIM_DEVICES or OMP_NUM_NVGPU_DEVICES\n");
+		exit(1);
+	}
+	/* all the parts are on device 0, we only marshal the region of the first part */
+	omp_device_t * devs[nparts];
+	int i;
+	for (i=0; i<nparts; i++) devs[i] = &omp_devices[0];
+
+	printf("==============================================================================================\n");
+	printf("marshal of a %ld MB array distributed onto %d parts, %d marshal threads, %d repeats\n", array_mb, nparts, omp_marshal_num_threads, repeats);
+	printf("shape\t\t\tregion\t\t\tMB\tmarshal(GB/s)\tunmarshal(GB/s)\tstrided to(GB/s)\tstrided from(GB/s)\tmemcpy(GB/s)\tcheck\n");
+	for (i=0; i<sizeof(marshal_shapes)/sizeof(marshal_shapes[0]); i++) {
+		marshal_run(&marshal_shapes[i], array_mb, devs, nparts, repeats);
+	}
+	printf("==============================================================================================\n");
+
+	omp_fini_devices();
+	return 0;
+}
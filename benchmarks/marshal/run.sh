@@ -0,0 +1,14 @@
+#!/bin/bash
+unset OMP_NVGPU_DEVICES
+export OMP_NUM_NVGPU_DEVICES=0
+export OMP_NUM_THSIM_DEVICES=1
+
+for th in 0 1 3 7; do
+export OMP_MARSHAL_THREADS=$th
+for mb in 4 64 256; do
+echo "-------------------------------------------------------------------------------------------------"
+echo "-------------------------------- marshal, $mb MB, $th marshal threads ---------------------------"
+./marshal-thsim $mb 4 10
+echo "-------------------------------------------------------------------------------------------------"
+done
+done
@@ -166,7 +166,8 @@ void ompacc_matmul_mdev_v3(REAL *A, REAL *B, REAL *C, long n)
  * dist = 2: B/C column dist,
  * dist = 3: A-row, B-column dist
  */
-void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C,  long n, int dist);
+void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C,  long n, int dist, int pipeline_slices, int pipeline_streams, int resident, int plan_report);
+int matmul_plan(REAL *A, REAL *B, REAL *C, long n);
 
 int main(int argc,char *argv[])
 {
@@ -178,15 +179,25 @@ int main(int argc,char *argv[])
   double seq_elapsed;
   double ompacc_elapsed;
   if (argc < 2) {
-    fprintf(stderr,"Usage: matmul <n> [<1|2|3>]\n");
-    fprintf(stderr,"\t 1: row dist; 2: column dist; 3: both row/column dist; default 1\n");
+    fprintf(stderr,"Usage: matmul <n> [<0|1|2|3|4>] [<pipeline slices> [<pipeline streams> [<calls>]]]\n");
+    fprintf(stderr,"\t 1: row dist; 2: column dist; 3: both row/column dist; 4: row dist in proportion to device speed (AUTO); default 1\n");
+    fprintf(stderr,"\t 0: the dist is picked by the cost model from the calibrated devices, and the predicted and measured time are reported\n");
+    fprintf(stderr,"\t pipeline slices > 1 overlaps copy and compute of the row slices of A and C (row dist only), default 2 streams\n");
+    fprintf(stderr,"\t calls > 1 calls the kernel that many times with A and B resident on the devices, the average time is reported\n");
     fprintf(stderr,"\t num of active devices can be controlled by OMP_NUM_ACTIVE_DEVICES variable\n");
     exit(1);
   }
   n = atoi(argv[1]);
   int dist = 1;
-  if (argc == 3) dist = atoi(argv[2]);
-  if (dist != 1 && dist != 2 && dist != 3) {
+  if (argc >= 3) dist = atoi(argv[2]);
+  int pipeline_slices = 0;
+  int pipeline_streams = 2;
+  if (argc >= 4) pipeline_slices = atoi(argv[3]);
+  if (argc >= 5) pipeline_streams = atoi(argv[4]);
+  int calls = 1;
+  if (argc >= 6) calls = atoi(argv[5]);
+  if (calls < 1) calls = 1;
+  if (dist != 0 && dist != 1 && dist != 2 && dist != 3 && dist != 4) {
 	  fprintf(stderr, "Unknown dist policy: %d, now fall to default (1)\n", dist);
 	  dist = 1;
   }
@@ -218,17 +229,25 @@ int main(int argc,char *argv[])
 /* we currently cannot do the OpenMP acc and OpenACC run in once */
 /* openmp acc version */
   omp_init_devices();
+  int plan = dist == 0;
+  if (plan) dist = matmul_plan(A, B, C_ompacc, n);
   ompacc_elapsed = read_timer();
-  matmul_ompacc_mdev(A,B,C_ompacc,n, dist);
-  ompacc_elapsed = (read_timer() - ompacc_elapsed);
+  int call;
+  for (call = 0; call < calls; call++)
+	  matmul_ompacc_mdev(A,B,C_ompacc,n, dist, pipeline_slices, pipeline_streams, calls > 1, plan && call == calls - 1);
+  ompacc_elapsed = (read_timer() - ompacc_elapsed) / calls;
 #if CORRECTNESS_CHECK
   print_array("Array C_ompacc", "C", C_ompacc, n, n);
 #endif
 
+  if (calls > 1) {
+	  omp_map_release_resident(A, n * n * sizeof(float));
+	  omp_map_release_resident(B, n * n * sizeof(float));
+  }
   omp_fini_devices();
 
   printf("======================================================================================================\n");
-  printf("\tmatmul(%dx%d) example on %d devices, dist policy: %d (1: row; 2: column; 3: row-column)\n",
+  printf("\tmatmul(%dx%d) example on %d devices, dist policy: %d (1: row; 2: column; 3: row-column; 4: row AUTO)\n",
 		  n,n,omp_get_num_active_devices(), dist);
   printf("------------------------------------------------------------------------------------------------------\n");
   printf("Error: %g\n", maxerror(C_seq,C_ompacc,n));
@@ -319,7 +338,7 @@ void OUT__1__11058__launcher (omp_offloading_t * off, void *args) {
 #endif
 
 	long start;
-	if (dist == 1) {
+	if (dist == 1 || dist == 4) {
 		omp_loop_map_range(map_A, 0, -1, -1, &start, &i);
 	} else if (dist == 2) {
 		omp_loop_map_range(map_B, 1, -1, -1, &start, &j);
@@ -357,7 +376,101 @@ void OUT__1__11058__launcher (omp_offloading_t * off, void *args) {
 #endif
 }
 
-void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C, long n, int dist) {
+/* the dist of A, B and C for each of the dist policies, see matmul_ompacc_mdev */
+void matmul_dist_init(int dist, long n, omp_dist_info_t * A_dist, omp_dist_info_t * B_dist, omp_dist_info_t * C_dist) {
+	if (dist == 1 || dist == 4) {
+		omp_dist_policy_t row_policy = dist == 1 ? OMP_DIST_POLICY_BLOCK : OMP_DIST_POLICY_AUTO;
+        omp_dist_init_info(&A_dist[0], row_policy, 0, n, 0);
+        omp_dist_init_info(&A_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+
+        omp_dist_init_info(&B_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+        omp_dist_init_info(&B_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+
+        omp_dist_init_info(&C_dist[0], row_policy, 0, n, 0);
+        omp_dist_init_info(&C_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+	} else if (dist == 2) {
+        omp_dist_init_info(&A_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+        omp_dist_init_info(&A_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+
+        omp_dist_init_info(&B_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+        omp_dist_init_info(&B_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+
+        omp_dist_init_info(&C_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+        omp_dist_init_info(&C_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+	} else /* dist == 3 */{
+        omp_dist_init_info(&A_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+        omp_dist_init_info(&A_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 1);
+
+        omp_dist_init_info(&B_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+        omp_dist_init_info(&B_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 1);
+
+        omp_dist_init_info(&C_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
+        omp_dist_init_info(&C_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 1);
+	}
+}
+
+/* the profile of the kernel, each of the n*n iterations computes an element of C with a dot product of length n */
+void matmul_profile(long n, omp_kernel_profile_info_t * profile) {
+	profile->num_iterations = n * n;
+	profile->num_load = 2 * n;
+	profile->num_store = 1;
+	profile->num_fp_operations = 2 * n;
+}
+
+/**
+ * pick the dist policy (1-4) with the cost model of the runtime, from the kernel profile and the calibrated devices. The
+ * map infos are only used for the array shapes, map types and directions, each candidate has its own topology and dists
+ */
+int matmul_plan(REAL *A, REAL *B, REAL *C, long n) {
+	int __num_target_devices__ = omp_get_num_active_devices();
+	omp_device_t *__target_devices__[__num_target_devices__];
+	int __i__;
+	for (__i__ = 0; __i__ < __num_target_devices__; __i__++) __target_devices__[__i__] = &omp_devices[__i__];
+
+	omp_grid_topology_t __top__;
+	int __top_dims__[1];
+	int __top_periodic__[1];
+	int __id_map__[__num_target_devices__];
+	omp_grid_topology_init_simple(&__top__, __target_devices__, __num_target_devices__, 1, __top_dims__, __top_periodic__, __id_map__);
+
+	omp_data_map_info_t __data_map_infos__[3];
+	omp_data_map_t __maps__[3][__num_target_devices__];
+	long A_dims[2];A_dims[0] = n;A_dims[1] = n;
+	long B_dims[2];B_dims[0] = n;B_dims[1] = n;
+	long C_dims[2];C_dims[0] = n;C_dims[1] = n;
+	omp_data_map_init_info("A", &__data_map_infos__[0], &__top__, A, 2, A_dims, sizeof(REAL), __maps__[0], OMP_DATA_MAP_TO, OMP_DATA_MAP_AUTO, NULL);
+	omp_data_map_init_info("B", &__data_map_infos__[1], &__top__, B, 2, B_dims, sizeof(REAL), __maps__[1], OMP_DATA_MAP_TO, OMP_DATA_MAP_AUTO, NULL);
+	omp_data_map_init_info("C", &__data_map_infos__[2], &__top__, C, 2, C_dims, sizeof(REAL), __maps__[2], OMP_DATA_MAP_FROM, OMP_DATA_MAP_AUTO, NULL);
+
+	const char * names[4] = {"1: row", "2: column", "3: row-column", "4: row AUTO"};
+	omp_dist_info_t dists[4][3][2];
+	omp_dist_info_t * cand_dists[4][3];
+	omp_plan_candidate_t candidates[4];
+	int c;
+	for (c=0; c<4; c++) {
+		matmul_dist_init(c+1, n, dists[c][0], dists[c][1], dists[c][2]);
+		cand_dists[c][0] = dists[c][0];
+		cand_dists[c][1] = dists[c][1];
+		cand_dists[c][2] = dists[c][2];
+		candidates[c].name = names[c];
+		candidates[c].top_ndims = c == 2 ? 2 : 1;
+		candidates[c].dists = cand_dists[c];
+		candidates[c].iteration_map = 2; /* C */
+	}
+	omp_kernel_profile_info_t profile;
+	matmul_profile(n, &profile);
+	int best = omp_offloading_plan(&profile, __target_devices__, __num_target_devices__, 3, __data_map_infos__, candidates, 4);
+
+	printf("------------------------------------------------------------------------------------------------------\n");
+	printf("matmul plan on %d devices, predicted ms of the slowest device:\n", __num_target_devices__);
+	printf("%-16s%12s%12s%12s%12s\n", "dist", "compute", "transfer", "halo", "total");
+	for (c=0; c<4; c++) printf("%-16s%12.3f%12.3f%12.3f%12.3f%s\n", candidates[c].name, candidates[c].compute, candidates[c].transfer,
+			candidates[c].halo, candidates[c].total, c == best ? "  <-- picked" : "");
+	printf("------------------------------------------------------------------------------------------------------\n");
+	return best + 1;
+}
+
+void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C, long n, int dist, int pipeline_slices, int pipeline_streams, int resident, int plan_report) {
 	double ompacc_time = read_timer_ms();
 	/* get number of target devices specified by the programmers */
 	int __num_target_devices__ = omp_get_num_active_devices(); /*XXX: = runtime or compiler generated code */
@@ -373,7 +486,7 @@ void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C, long n, int dist) {
 	omp_grid_topology_t __top__;
 	int __top_ndims__;
 	/**************************************** dist-specific *****************************************/
-	if (dist == 1 || dist == 2) __top_ndims__ = 1;
+	if (dist == 1 || dist == 2 || dist == 4) __top_ndims__ = 1;
 	else /* dist == 3 */__top_ndims__ = 2;
 	/************************************************************************************************/
 
@@ -398,6 +511,11 @@ void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C, long n, int dist) {
 	omp_data_map_t B_maps[__num_target_devices__];
 	omp_dist_info_t B_dist[2];
 	omp_data_map_init_info("B", __info__, &__top__, B, 2, B_dims, sizeof(REAL),B_maps, OMP_DATA_MAP_TO, OMP_DATA_MAP_AUTO, B_dist);
+	/* A and B are not changed between calls, they stay on the devices and are copied only at the first call */
+	if (resident) {
+		omp_data_map_set_resident(&__data_map_infos__[0]);
+		omp_data_map_set_resident(&__data_map_infos__[1]);
+	}
 
 	__info__ = &__data_map_infos__[2];
 	long C_dims[2];C_dims[0] = n; C_dims[1] = n;
@@ -406,34 +524,7 @@ void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C, long n, int dist) {
 	omp_data_map_init_info("C", __info__, &__top__, C, 2, C_dims, sizeof(REAL),C_maps, OMP_DATA_MAP_FROM, OMP_DATA_MAP_AUTO, C_dist);
 
 	/**************************************** dist-specific *****************************************/
-	if (dist == 1) {
-        omp_dist_init_info(&A_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
-        omp_dist_init_info(&A_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-
-        omp_dist_init_info(&B_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-        omp_dist_init_info(&B_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-
-        omp_dist_init_info(&C_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
-        omp_dist_init_info(&C_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-	} else if (dist == 2) {
-        omp_dist_init_info(&A_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-        omp_dist_init_info(&A_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-
-        omp_dist_init_info(&B_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-        omp_dist_init_info(&B_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 0);
-
-        omp_dist_init_info(&C_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-        omp_dist_init_info(&C_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 0);
-	} else /* dist == 3 */{
-        omp_dist_init_info(&A_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
-        omp_dist_init_info(&A_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 1);
-
-        omp_dist_init_info(&B_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
-        omp_dist_init_info(&B_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 1);
-
-        omp_dist_init_info(&C_dist[0], OMP_DIST_POLICY_BLOCK, 0, n, 0);
-        omp_dist_init_info(&C_dist[1], OMP_DIST_POLICY_BLOCK, 0, n, 1);
-	}
+	matmul_dist_init(dist, n, A_dist, B_dist, C_dist);
 	/************************************************************************************************/
 
 	struct OUT__1__11058__args args;
@@ -448,6 +539,7 @@ void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C, long n, int dist) {
 	__offloading_info__.offloadings = (omp_offloading_t *) alloca(sizeof(omp_offloading_t) * __num_target_devices__);
 	/* we use universal args and launcher because axpy can do it */
     omp_offloading_init_info("matmul kernel", &__offloading_info__, &__top__, __target_devices__, 0, OMP_OFFLOADING_DATA_CODE, __num_mapped_array__, __data_map_infos__, OUT__1__11058__launcher, &args, NULL, NULL, NULL);
+    omp_offloading_set_pipeline(&__offloading_info__, pipeline_slices, pipeline_streams);
 
 	/*********** NOW notifying helper thread to work on this offload ******************/
 #if DEBUG_MSG
@@ -459,6 +551,11 @@ void matmul_ompacc_mdev(REAL *A, REAL *B, REAL *C, long n, int dist) {
     ompacc_time = read_timer_ms() - ompacc_time;
 #if defined (OMP_BREAKDOWN_TIMING)
 	omp_offloading_info_report_profile(&__offloading_info__);
+	if (plan_report) {
+		omp_kernel_profile_info_t profile;
+		matmul_profile(n, &profile);
+		omp_offloading_plan_report(&__offloading_info__, &profile, 2);
+	}
 #endif
 
 	double cpu_total = ompacc_time;
@@ -0,0 +1,13 @@
+#!/bin/bash
+unset OMP_NVGPU_DEVICES
+export OMP_NUM_NVGPU_DEVICES=0
+
+for nd in 2 4; do
+export OMP_NUM_THSIM_DEVICES=$nd
+for size in 2048 4096 8192; do
+echo "-------------------------------------------------------------------------------------------------"
+echo "-------------------------------- trimv ${size}x${size}, $nd devices -------------------------------"
+./trimv-thsim $size 1 16 64
+echo "-------------------------------------------------------------------------------------------------"
+done
+done
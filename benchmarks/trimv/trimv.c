@@ -0,0 +1,209 @@
+/*
+ * trimv.c
+ *
+ * triangular workload for comparing BLOCK, (block-)CYCLIC and dynamically scheduled rows: y = L * x with L a
+ * lower-triangular matrix, so the work of row i is i+1 and a BLOCK distribution leaves the last device with most of the work.
+ * For each policy it reports the offloading time, the kernel time of the fastest and slowest device and the imbalance,
+ * (max-avg)/avg of the kernel time of the devices.
+ *
+ * usage: trimv [n] [chunk_size ...]
+ * BLOCK is run first, then CYCLIC with each of the chunk sizes (default 1 16 64), then DYNAMIC, where the devices claim
+ * chunks of rows at runtime (see omp_offloading_set_dynamic)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "homp.h"
+
+#define REAL double
+
+void trimv_seq(REAL * L, REAL * x, REAL * y, long n) {
+	long i, j;
+	for (i=0; i<n; i++) {
+		REAL sum = 0.0;
+		for (j=0; j<=i; j++) sum += L[i*n+j] * x[j];
+		y[i] = sum;
+	}
+}
+
+#if defined (DEVICE_NVGPU_SUPPORT)
+/* the rows [row, row+length) of L and y, L points to the first of the rows */
+__global__ void trimv_chunk_kernel(long n, long row, long length, REAL * L, REAL * x, REAL * y) {
+	long r = blockDim.x * blockIdx.x + threadIdx.x;
+	if (r >= length) return;
+	REAL sum = 0.0;
+	long j;
+	for (j=0; j<=row+r; j++) sum += L[r*n+j] * x[j];
+	y[r] = sum;
+}
+#endif
+
+struct trimv_args {
+	long n;
+	REAL * L;
+	REAL * x;
+	REAL * y;
+};
+
+void trimv_launcher(omp_offloading_t * off, void * args) {
+	struct trimv_args * iargs = (struct trimv_args *) args;
+	long n = iargs->n;
+	omp_data_map_t * map_L = omp_map_get_map(off, iargs->L, 0);
+	omp_data_map_t * map_x = omp_map_get_map(off, iargs->x, 1);
+	omp_data_map_t * map_y = omp_map_get_map(off, iargs->y, 2);
+	REAL * x = (REAL *) map_x->map_dev_ptr;
+
+	/* walk the row chunks the device owns, a BLOCK dist has one */
+	long row, local_start, length;
+	int k;
+	for (k=0; (row = omp_loop_map_chunk(map_L, 0, k, &local_start, &length)) >= 0; k++) {
+		REAL * L = (REAL *) omp_map_chunk_dev_ptr(map_L, k);
+		REAL * y = (REAL *) omp_map_chunk_dev_ptr(map_y, k);
+		omp_device_type_t devtype = off->dev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+		if (devtype == OMP_DEVICE_NVGPU) {
+			int threads_per_team = omp_get_optimal_threads_per_team(off->dev);
+			int teams_per_league = (length + threads_per_team - 1) / threads_per_team;
+			if (teams_per_league > 0)
+				trimv_chunk_kernel<<<teams_per_league, threads_per_team, 0, off->stream->systream.cudaStream>>>(n, row, length, L, x, y);
+		} else
+#endif
+		if (devtype == OMP_DEVICE_THSIM) {
+			long r, j;
+#pragma omp parallel for shared(L, x, y, n, row, length) private(r, j)
+			for (r=0; r<length; r++) {
+				REAL sum = 0.0;
+				for (j=0; j<=row+r; j++) sum += L[r*n+j] * x[j];
+				y[r] = sum;
+			}
+		} else {
+			fprintf(stderr, "device type is not supported for this call\n");
+			abort();
+		}
+	}
+}
+
+static void trimv_run(REAL * L, REAL * x, REAL * y, REAL * y_seq, long n, omp_dist_policy_t policy, long chunk_size, int dynamic) {
+	int __num_target_devices__ = omp_get_num_active_devices();
+	omp_device_t *__target_devices__[__num_target_devices__];
+	int i;
+	for (i=0; i<__num_target_devices__; i++) __target_devices__[i] = &omp_devices[i];
+
+	omp_grid_topology_t __top__;
+	int __top_dims__[1];
+	int __top_periodic__[1];
+	int __id_map__[__num_target_devices__];
+	omp_grid_topology_init_simple(&__top__, __target_devices__, __num_target_devices__, 1, __top_dims__, __top_periodic__, __id_map__);
+
+	omp_data_map_info_t __data_map_infos__[3];
+	long L_dims[2]; L_dims[0] = n; L_dims[1] = n;
+	omp_data_map_t L_maps[__num_target_devices__];
+	omp_dist_info_t L_dist[2];
+	omp_data_map_init_info("L", &__data_map_infos__[0], &__top__, L, 2, L_dims, sizeof(REAL), L_maps, OMP_DATA_MAP_TO, OMP_DATA_MAP_AUTO, L_dist);
+	omp_dist_init_info_chunk(&L_dist[0], policy, 0, n, chunk_size, 0);
+	omp_dist_init_info(&L_dist[1], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+
+	long x_dims[1]; x_dims[0] = n;
+	omp_data_map_t x_maps[__num_target_devices__];
+	omp_dist_info_t x_dist[1];
+	omp_data_map_init_info("x", &__data_map_infos__[1], &__top__, x, 1, x_dims, sizeof(REAL), x_maps, OMP_DATA_MAP_TO, OMP_DATA_MAP_AUTO, x_dist);
+	omp_dist_init_info(&x_dist[0], OMP_DIST_POLICY_DUPLICATE, 0, n, 0);
+
+	long y_dims[1]; y_dims[0] = n;
+	omp_data_map_t y_maps[__num_target_devices__];
+	omp_dist_info_t y_dist[1];
+	omp_data_map_init_info("y", &__data_map_infos__[2], &__top__, y, 1, y_dims, sizeof(REAL), y_maps, OMP_DATA_MAP_FROM, OMP_DATA_MAP_AUTO, y_dist);
+	omp_dist_init_info_chunk(&y_dist[0], policy, 0, n, chunk_size, 0);
+
+	struct trimv_args args;
+	args.n = n;
+	args.L = L;
+	args.x = x;
+	args.y = y;
+	omp_offloading_info_t __offloading_info__;
+	omp_offloading_t __offs__[__num_target_devices__];
+	__offloading_info__.offloadings = __offs__;
+	omp_offloading_init_info("trimv kernel", &__offloading_info__, &__top__, __target_devices__, 0, OMP_OFFLOADING_DATA_CODE, 3,
+			__data_map_infos__, trimv_launcher, &args, NULL, NULL, NULL);
+	if (dynamic) omp_offloading_set_dynamic(&__offloading_info__, 0, 0);
+
+	memset(y, 0, sizeof(REAL) * n);
+	double time = read_timer_ms();
+	omp_offloading_start(&__offloading_info__);
+	time = read_timer_ms() - time;
+
+	double kern_min = 0.0, kern_max = 0.0, kern_sum = 0.0;
+#if defined (OMP_BREAKDOWN_TIMING)
+	for (i=0; i<__num_target_devices__; i++) {
+		omp_event_t * ev = &__offs__[i].events[kernel_exe_event_index];
+		double kern = ev->record_method == OMP_EVENT_HOST_RECORD ? ev->elapsed_host : ev->elapsed_dev;
+		if (i == 0 || kern < kern_min) kern_min = kern;
+		if (i == 0 || kern > kern_max) kern_max = kern;
+		kern_sum += kern;
+	}
+#endif
+	omp_offloading_fini_info(&__offloading_info__);
+
+	double error = 0.0;
+	long r;
+	for (r=0; r<n; r++) {
+		double diff = fabs(y[r] - y_seq[r]);
+		if (diff > error) error = diff;
+	}
+	double kern_avg = kern_sum / __num_target_devices__;
+	char name[32];
+	if (dynamic) sprintf(name, "DYNAMIC");
+	else if (policy == OMP_DIST_POLICY_BLOCK) sprintf(name, "BLOCK");
+	else sprintf(name, "CYCLIC(%ld)", chunk_size);
+	printf("%-16s%12.2f%14.2f%14.2f%13.1f%%%12g\n", name, time, kern_min, kern_max,
+			kern_avg > 0.0 ? (kern_max - kern_avg) / kern_avg * 100.0 : 0.0, error);
+}
+
+int main(int argc, char * argv[]) {
+	long n = 4096;
+	if (argc >= 2) n = atol(argv[1]);
+	long default_chunks[3] = {1, 16, 64};
+	long * chunks = default_chunks;
+	int num_chunks = 3;
+	if (argc >= 3) {
+		num_chunks = argc - 2;
+		chunks = (long *) malloc(sizeof(long) * num_chunks);
+		int c;
+		for (c=0; c<num_chunks; c++) chunks[c] = atol(argv[c+2]);
+	}
+
+	REAL * L = (REAL *) malloc(sizeof(REAL) * n * n);
+	REAL * x = (REAL *) malloc(sizeof(REAL) * n);
+	REAL * y = (REAL *) malloc(sizeof(REAL) * n);
+	REAL * y_seq = (REAL *) malloc(sizeof(REAL) * n);
+	long i, j;
+	srand48(1 << 12);
+	for (i=0; i<n; i++) {
+		x[i] = drand48();
+		for (j=0; j<n; j++) L[i*n+j] = j <= i ? drand48() : 0.0;
+	}
+	trimv_seq(L, x, y_seq, n);
+
+	omp_init_devices();
+	if (omp_get_num_active_devices() == 0) {
+		fprintf(stderr, "no device is available, set OMP_NUM_THSIM_DEVICES or OMP_NUM_NVGPU_DEVICES\n");
+		exit(1);
+	}
+	printf("==============================================================================================\n");
+	printf("trimv: y = L * x with lower-triangular L (%ldx%ld) on %d devices, row dist\n", n, n, omp_get_num_active_devices());
+	printf("%-16s%12s%14s%14s%14s%12s\n", "policy", "time(ms)", "KERN min(ms)", "KERN max(ms)", "imbalance", "error");
+	trimv_run(L, x, y, y_seq, n, OMP_DIST_POLICY_BLOCK, 0, 0);
+	int c;
+	for (c=0; c<num_chunks; c++) trimv_run(L, x, y, y_seq, n, OMP_DIST_POLICY_CYCLIC, chunks[c], 0);
+	trimv_run(L, x, y, y_seq, n, OMP_DIST_POLICY_BLOCK, 0, 1);
+	printf("==============================================================================================\n");
+
+	omp_fini_devices();
+	if (chunks != default_chunks) free(chunks);
+	free(L);
+	free(x);
+	free(y);
+	free(y_seq);
+	return 0;
+}
@@ -0,0 +1 @@
+trimv.c
\ No newline at end of file
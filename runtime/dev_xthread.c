@@ -2,45 +2,119 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/timeb.h>
+#include <sched.h>
 
 #include "homp.h"
 
+/* serialize the queuing of multi-device offloadings so all the devices see them in the same order,
+ * otherwise two offloadings that sync their devices could wait for each other */
+static pthread_mutex_t omp_offloading_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * notifying the helper threads to work on the offloading specified in off_info arg
- * It always start with copyto and may stops after copyto for target data
- * master is just the thread that will store
+ * push an offloading object to the device queue, lock-free for multiple producers.
+ * A push-only cas stack does not suffer ABA, the helper reverses it to get the submission order
  */
-void omp_offloading_start(omp_offloading_info_t * off_info) {
-	omp_device_t ** targets = off_info->targets;
-	int num_targets = off_info->top->nnodes;
-    /* generate master trace file */
+static void omp_offloading_queue_push(omp_device_t * dev, omp_offloading_t * off) {
+	omp_offloading_t * head;
+	do {
+		head = dev->offload_queue;
+		off->qnext = head;
+	} while (!__sync_bool_compare_and_swap(&dev->offload_queue, head, off));
+	omp_helper_notify(dev);
+}
 
+/**
+ * test whether the last submission of off_info is completed, i.e. all the per-device completion counters have caught up.
+ * The first one (there could be multiple waiters) that sees the completion records the completion time and updates
+ * the recurring count; all of them write the same value so this is not a race
+ */
+int omp_offloading_test(omp_offloading_info_t * off_info) {
+	int n = off_info->num_submitted;
+	if (off_info->num_completed == n) return 1;
+	int i;
+	for (i = 0; i < off_info->top->nnodes; i++) {
+		if (off_info->offloadings[i].num_completed != n) return 0;
+	}
+	__sync_synchronize();
 #if defined (OMP_BREAKDOWN_TIMING)
-	if (off_info->count <= 1) off_info->start_time = read_timer_ms(); /* only for the first time */
+	off_info->compl_time = read_timer_ms();
 #endif
+	if (off_info->count) off_info->count = n + 1; /* recurring, the number of offloading */
+	__sync_synchronize();
+	off_info->num_completed = n;
+	return 1;
+}
+
+/* spin a while then yield the cpu, used by host threads waiting for devices */
+static void omp_offloading_wait_relax(int * spin) {
+	if ((*spin)++ < 1000) omp_cpu_relax();
+	else sched_yield();
+}
 
+void omp_offloading_wait(omp_offloading_info_t * off_info) {
+	int spin = 0;
+	while (!omp_offloading_test(off_info)) omp_offloading_wait_relax(&spin);
+}
+
+/* wait for any of the offloadings to complete, return its index in the off_infos array */
+int omp_offloading_wait_any(omp_offloading_info_t ** off_infos, int count) {
+	int spin = 0;
+	while (1) {
+		int i;
+		for (i = 0; i < count; i++) {
+			if (omp_offloading_test(off_infos[i])) return i;
+		}
+		omp_offloading_wait_relax(&spin);
+	}
+	return -1;
+}
+
+/**
+ * queue the offloading specified in off_info to the helper thread of each target device.
+ * Each target gets the per-device offloading object of the off_info. The previous submission of the off_info must
+ * be completed.
+ */
+static void omp_offloading_queue(omp_offloading_info_t * off_info) {
+	omp_device_t ** targets = off_info->targets;
+	int num_targets = off_info->top->nnodes;
 	int i;
 	for (i = 0; i < num_targets; i++) {
-		if (targets[i]->offload_request != NULL) {
-			fprintf(stderr, "device %d is not ready for answering your request, offloading_start: %X. It is a bug so far\n", targets[i]->id, off_info);
-		}
-		targets[i]->offload_request = off_info;
-		/* TODO: this is data race if multiple host threads try to offload to the same devices,
-		 * FIX is to use cas operation to update this field
-		 */
+		omp_offloading_t * off = &off_info->offloadings[i];
+		off->off_info = off_info;
+		off->devseqid = i;
+		off->dev = targets[i];
 	}
-	pthread_barrier_wait(&off_info->barrier);
+	off_info->dynamic_next = 0; /* the chunks of a dynamic offloading are claimed anew for each submission */
+	off_info->num_submitted++;
 
-	if (off_info->type != OMP_OFFLOADING_STANDALONE_DATA_EXCHANGE && off_info->halo_x_info != NULL) { /* appended halo exchange */
-		pthread_barrier_wait(&off_info->barrier);
+	if (num_targets > 1) pthread_mutex_lock(&omp_offloading_queue_lock);
+	for (i = 0; i < num_targets; i++) {
+		omp_offloading_queue_push(targets[i], &off_info->offloadings[i]);
 	}
-	if (off_info->count) off_info->count++; /* recurring, increment the number of offloading */
+	if (num_targets > 1) pthread_mutex_unlock(&omp_offloading_queue_lock);
+}
 
+/**
+ * notifying the helper threads to work on the offloading specified in off_info arg, and return without waiting for
+ * the completion. The returned handle (the off_info) is used for omp_offloading_wait/test/wait_any.
+ * If the off_info is still in flight from a previous submission, we wait for it first.
+ * It always start with copyto and may stops after copyto for target data
+ */
+omp_offloading_info_t * omp_offloading_start_async(omp_offloading_info_t * off_info) {
+	omp_offloading_wait(off_info);
 #if defined (OMP_BREAKDOWN_TIMING)
-	pthread_barrier_wait(&off_info->barrier); /* this one make sure the profiling is collected */
-	off_info->compl_time = read_timer_ms();
+	if (off_info->count <= 1) off_info->start_time = read_timer_ms(); /* only for the first time */
 #endif
+	omp_offloading_queue(off_info);
+	return off_info;
+}
 
+/**
+ * notifying the helper threads to work on the offloading specified in off_info arg and wait for the completion
+ */
+void omp_offloading_start(omp_offloading_info_t * off_info) {
+	omp_offloading_start_async(off_info);
+	omp_offloading_wait(off_info);
 }
 
 #if defined (OMP_BREAKDOWN_TIMING)
@@ -64,15 +138,145 @@ int misc_event_index_start = 10;        /* other events, e.g. mapto/from for eac
 /**
  * called by the shepherd thread
  */
-void omp_offloading_run(omp_device_t * dev) {
-	omp_offloading_info_t * off_info = dev->offload_request;
-	omp_grid_topology_t * top = off_info->top;
-	int seqid = omp_grid_topology_get_seqid(top, dev->id); /* we assume this is tiny for timing, so not included */
-	omp_offloading_t * off = &off_info->offloadings[seqid];
+/**
+ * the copy-in, kernel and copy-out of the sliced maps of a pipelined offloading (see omp_offloading_pipeline_slice). Slice s is
+ * issued to stream s % K, so the copy-in of a slice overlaps the kernel of the slice before it and the copy-out of the one
+ * before that. The maps that are not sliced, and the resident ones which are moved as a whole if at all, are copied in on the
+ * offloading stream before the slices and copied out after.
+ * All the slice streams are synced before return.
+ */
+static void omp_offloading_run_slices(omp_offloading_t * off, void (*kernel_launcher)(omp_offloading_t *, void *), void * args) {
+	int s, i;
+	for (s=0; s<off->num_slice_streams; s++) {
+#if defined (OMP_BREAKDOWN_TIMING)
+		/* wait for the copy-in of the maps that are not sliced */
+		omp_stream_wait_event(&off->slice_streams[s], &off->events[acc_mapto_event_index]);
+#else
+		omp_stream_sync(off->stream);
+#endif
+	}
+
+	for (s=0; s<off->num_slices; s++) {
+		omp_offloading_t * slice = &off->slices[s];
+		omp_dev_stream_t * stream = slice->stream;
+#if defined (OMP_BREAKDOWN_TIMING)
+		omp_event_t * events = &off->slice_events[s*3];
+		omp_event_record_start(&events[0], stream, "SLICE_TO", "Time for mapto data movement of slice %d", s);
+#endif
+		for (i=0; i<slice->num_maps; i++) {
+			omp_data_map_t * map = slice->map_cache[i].map;
+			if (slice->map_cache[i].inherited || !map->sliced || map->resident != NULL) continue;
+			omp_data_map_direction_t direction = map->info->map_direction;
+			if (direction == OMP_DATA_MAP_TO || direction == OMP_DATA_MAP_TOFROM) omp_map_mapto_async(map, stream);
+		}
+#if defined (OMP_BREAKDOWN_TIMING)
+		omp_event_record_stop(&events[0]);
+		omp_event_record_start(&events[1], stream, "SLICE_KERN", "Time for kernel execution of slice %d", s);
+#endif
+		omp_stream_launch_kernel(stream, kernel_launcher, slice, args);
+#if defined (OMP_BREAKDOWN_TIMING)
+		omp_event_record_stop(&events[1]);
+		omp_event_record_start(&events[2], stream, "SLICE_FROM", "Time for mapfrom data movement of slice %d", s);
+#endif
+		for (i=0; i<slice->num_maps; i++) {
+			omp_data_map_t * map = slice->map_cache[i].map;
+			if (slice->map_cache[i].inherited || !map->sliced || map->resident != NULL) continue;
+			omp_data_map_direction_t direction = map->info->map_direction;
+			if (direction == OMP_DATA_MAP_FROM || direction == OMP_DATA_MAP_TOFROM) omp_map_mapfrom_async(map, stream);
+		}
+#if defined (OMP_BREAKDOWN_TIMING)
+		omp_event_record_stop(&events[2]);
+#endif
+	}
+
+	for (s=0; s<off->num_slice_streams; s++) omp_stream_sync(&off->slice_streams[s]);
+}
+
+/**
+ * the chunk loop of a dynamic offloading (see omp_offloading_set_dynamic): the device claims the next chunk of the dim-0 range
+ * from the shared cursor of the off_info, points the split maps to it, copies in the chunk, runs the kernel on it and copies
+ * out the chunk, until the range is exhausted. The next chunk is sized to take about OMP_DYNAMIC_CHUNK_MS at the smoothed
+ * rate of this device, but no more than its share of what is left so the devices finish together, and within
+ * [dynamic_min_chunk, dynamic_capacity]
+ */
+static void omp_offloading_run_dynamic(omp_offloading_t * off, void (*kernel_launcher)(omp_offloading_t *, void *), void * args) {
+	omp_offloading_info_t * off_info = off->off_info;
+	omp_dev_stream_t * stream = off->stream;
+	int nnodes = off_info->top->nnodes;
+	omp_data_map_t * ref = NULL;
+	int i;
+	for (i=0; i<off->num_maps; i++) {
+		omp_data_map_t * map = off->map_cache[i].map;
+		if (off->map_cache[i].inherited || !map->sliced) continue;
+		if (ref != NULL && (map->info->dist[0].start != ref->info->dist[0].start || map->info->dist[0].length != ref->info->dist[0].length)) {
+			fprintf(stderr, "dynamic offloading %s: maps %s and %s are not distributed over the same dim-0 range\n", off_info->name,
+					ref->info->symbol, map->info->symbol);
+			abort();
+		}
+		if (ref == NULL) ref = map;
+	}
+	off->dynamic_chunks = 0;
+	off->dynamic_iterations = 0;
+	if (ref == NULL) { /* nothing to split, every device runs the kernel once */
+		omp_stream_launch_kernel(stream, kernel_launcher, off, args);
+		omp_stream_sync(stream);
+		return;
+	}
+
+	long start = ref->info->dist[0].start;
+	long total = ref->info->dist[0].length;
+	long min_chunk = off_info->dynamic_min_chunk > 0 ? off_info->dynamic_min_chunk : 1;
+	if (min_chunk > off->dynamic_capacity) min_chunk = off->dynamic_capacity;
+	/* the first run starts with a guided chunk, later runs with the rate measured before */
+	long chunk = off->dynamic_rate > 0.0 ? (long) (off->dynamic_rate * OMP_DYNAMIC_CHUNK_MS) : total / (4 * nnodes);
+	if (chunk < min_chunk) chunk = min_chunk;
+	if (chunk > off->dynamic_capacity) chunk = off->dynamic_capacity;
+	while (1) {
+		long begin = __sync_fetch_and_add(&off_info->dynamic_next, chunk);
+		if (begin >= total) break;
+		long length = total - begin < chunk ? total - begin : chunk;
+		double chunk_time = read_timer_ms();
+		for (i=0; i<off->num_maps; i++) {
+			omp_data_map_t * map = off->map_cache[i].map;
+			if (off->map_cache[i].inherited || !map->sliced) continue;
+			omp_map_dynamic_chunk(map, start + begin, length);
+			omp_data_map_direction_t direction = map->info->map_direction;
+			if (direction == OMP_DATA_MAP_TO || direction == OMP_DATA_MAP_TOFROM) omp_map_mapto_async(map, stream);
+		}
+		omp_stream_launch_kernel(stream, kernel_launcher, off, args);
+		for (i=0; i<off->num_maps; i++) {
+			omp_data_map_t * map = off->map_cache[i].map;
+			if (off->map_cache[i].inherited || !map->sliced) continue;
+			omp_data_map_direction_t direction = map->info->map_direction;
+			if (direction == OMP_DATA_MAP_FROM || direction == OMP_DATA_MAP_TOFROM) omp_map_mapfrom_async(map, stream);
+		}
+		omp_stream_sync(stream); /* the chunk buffers are reused by the next chunk */
+		chunk_time = read_timer_ms() - chunk_time;
+
+		if (off->dynamic_chunks == 0 || length < off->dynamic_min) off->dynamic_min = length;
+		if (off->dynamic_chunks == 0 || length > off->dynamic_max) off->dynamic_max = length;
+		off->dynamic_chunks++;
+		off->dynamic_iterations += length;
+		if (chunk_time > 0.0) {
+			double rate = length / chunk_time;
+			off->dynamic_rate = off->dynamic_rate > 0.0 ? 0.5 * off->dynamic_rate + 0.5 * rate : rate;
+			chunk = (long) (off->dynamic_rate * OMP_DYNAMIC_CHUNK_MS);
+		} else chunk *= 2;
+		long share = (total - off_info->dynamic_next) / (2 * nnodes);
+		if (chunk > share) chunk = share;
+		if (chunk < min_chunk) chunk = min_chunk;
+		if (chunk > off->dynamic_capacity) chunk = off->dynamic_capacity;
+	}
+}
+
+void omp_offloading_run(omp_device_t * dev, omp_offloading_t * off) {
+	omp_offloading_info_t * off_info = off->off_info;
+	int seqid = off->devseqid; /* set when queued */
 	//printf("devid: %d --> seqid: %d in top: %X, off: %X, off_info: %X\n", dev->id, seqid, top, off, off_info);
 
 	int devid = dev->id;
 	int i = 0;
+	int halo_x_due = 0; /* the maps of the exchange whose halo is updated in this run */
 
 #if defined (OMP_BREAKDOWN_TIMING)
 	/* the num_mapped_vars * 2 +4 is the rough number of events needed */
@@ -93,9 +297,13 @@ void omp_offloading_run(omp_device_t * dev) {
 	omp_event_t *events;
 	if (off_info->count <= 1) { /* the first time of recurring offloading or a non-recurring offloading */
 		num_events = off_info->num_mapped_vars * 2 + 10; /* the max posibble # of events to be used */
-		events = (omp_event_t *) malloc(sizeof(omp_event_t) * num_events); /**TODO: free this memory somewhere later */
+		/* a non-recurring off_info that is offloaded again reuses its events. They are kept after omp_offloading_fini_info for the report */
+		if (off->events == NULL || off->num_events < num_events) {
+			free(off->events);
+			off->events = (omp_event_t *) malloc(sizeof(omp_event_t) * num_events);
+		}
+		events = off->events;
 		off->num_events = num_events;
-		off->events = events;
 	} else { /* second time and later recurring offloading */
 		num_events = off->num_events;
 		events = off->events;
@@ -162,12 +370,27 @@ void omp_offloading_run(omp_device_t * dev) {
 				map = &map_info->maps[seqid];
 				omp_data_map_init_map(map, map_info, dev);
 				omp_data_map_dist(map, seqid);
+				if (off_info->dynamic) omp_map_dynamic_dist(map, off); /* a chunk buffer instead of the static range */
 				omp_map_buffer(map, off);
 				inherited = 0;
 			}
 			omp_offload_append_map_to_cache(off, map, inherited);
 			//omp_print_data_map(map);
 		}
+		off->buffers_mapped = 1;
+		if (off_info->pipeline_slices > 1 && off_info->type != OMP_OFFLOADING_DATA && !off_info->dynamic) {
+			omp_offloading_pipeline_slice(off);
+#if defined (OMP_BREAKDOWN_TIMING)
+			if (off->num_slices > 0) { /* the kernel event measures the whole pipeline from the host */
+				omp_event_init(&events[kernel_exe_event_index], omp_host_dev, OMP_EVENT_HOST_RECORD);
+				for (i=0; i<off->num_slices*3; i++) omp_event_init(&off->slice_events[i], dev, OMP_EVENT_DEV_RECORD);
+			}
+#endif
+		}
+#if defined (OMP_BREAKDOWN_TIMING)
+		/* the kernel event measures the whole chunk loop from the host */
+		if (off_info->dynamic) omp_event_init(&events[kernel_exe_event_index], omp_host_dev, OMP_EVENT_HOST_RECORD);
+#endif
 #if defined (OMP_BREAKDOWN_TIMING)
 		omp_event_record_stop(&events[map_init_event_index]);
 #endif
@@ -175,7 +398,7 @@ void omp_offloading_run(omp_device_t * dev) {
 
 	omp_dev_stream_t *stream = off->stream;
 
-	if (off_info->type == OMP_OFFLOADING_STANDALONE_DATA_EXCHANGE) goto data_exchange;
+	if (off_info->type == OMP_OFFLOADING_STANDALONE_DATA_EXCHANGE) goto omp_offloading_mdev_barrier;
 	if (off_info->type == OMP_OFFLOADING_DATA && off_info->count > 1) {
 		goto omp_offloading_copyfrom;
 	}
@@ -192,6 +415,8 @@ omp_offloading_copyto: ;
 			omp_data_map_info_t * map_info = &off_info->data_map_info[i];
 			omp_data_map_t * map = &map_info->maps[seqid];
 			if (omp_map_is_map_inherited(off, map)) continue;
+			if (off->num_slices > 0 && map->sliced && map->resident == NULL) continue; /* moved slice by slice */
+			if (off_info->dynamic && map->sliced) continue; /* moved chunk by chunk */
 
 			if (map_info->map_direction == OMP_DATA_MAP_TO || map_info->map_direction == OMP_DATA_MAP_TOFROM) {
 #if defined (OMP_BREAKDOWN_TIMING)
@@ -220,15 +445,27 @@ omp_offloading_copyto: ;
 
 //	case OMP_OFFLOADING_KERNEL:
 	{
-#if defined (OMP_BREAKDOWN_TIMING)
-		omp_event_record_start(&events[kernel_exe_event_index], stream, "KERN", "Time for kernel (%s) execution", off_info->name);
-#endif
 		/* launching the kernel */
 		void * args = off_info->args;
 		void (*kernel_launcher)(omp_offloading_t *, void *) = off_info->kernel_launcher;
 		if (args == NULL) args = off->args;
 		if (kernel_launcher == NULL) kernel_launcher = off->kernel_launcher;
-		kernel_launcher(off, args);
+		if (off->num_slices > 0) {
+#if defined (OMP_BREAKDOWN_TIMING)
+			omp_event_record_start(&events[kernel_exe_event_index], NULL, "PIPELINE", "Time for pipelined copy and kernel (%s) of %d slices", off_info->name, off->num_slices);
+#endif
+			omp_offloading_run_slices(off, kernel_launcher, args);
+		} else if (off_info->dynamic) {
+#if defined (OMP_BREAKDOWN_TIMING)
+			omp_event_record_start(&events[kernel_exe_event_index], NULL, "DYNAMIC", "Time for dynamically scheduled copy and kernel (%s) chunks", off_info->name);
+#endif
+			omp_offloading_run_dynamic(off, kernel_launcher, args);
+		} else {
+#if defined (OMP_BREAKDOWN_TIMING)
+			omp_event_record_start(&events[kernel_exe_event_index], stream, "KERN", "Time for kernel (%s) execution", off_info->name);
+#endif
+			omp_stream_launch_kernel(stream, kernel_launcher, off, args);
+		}
 #if defined (OMP_BREAKDOWN_TIMING)
 		omp_event_record_stop(&events[kernel_exe_event_index]);
 #endif
@@ -251,6 +488,8 @@ omp_offloading_copyfrom: ;
 			omp_data_map_info_t * map_info = &off_info->data_map_info[i];
 			omp_data_map_t * map = &map_info->maps[seqid];
 			if (omp_map_is_map_inherited(off, map)) continue;
+			if (off->num_slices > 0 && map->sliced && map->resident == NULL) continue;
+			if (off_info->dynamic && map->sliced) continue;
 
 			if (map_info->map_direction == OMP_DATA_MAP_FROM || map_info->map_direction == OMP_DATA_MAP_TOFROM) {
 #if defined (OMP_BREAKDOWN_TIMING)
@@ -281,13 +520,21 @@ omp_offloading_sync_cleanup: ;
 		omp_stream_sync(off->stream);
 		if (off->stage == OMP_OFFLOADING_SYNC) {
 			if (off_info->type == OMP_OFFLOADING_DATA) { /* this should be just an assertation */
-				/* put in the offloading stack */
+				/* put in the offloading stack, which grows for deeper nesting */
+				if (dev->offload_stack_top + 1 >= dev->offload_stack_size) {
+					dev->offload_stack_size = dev->offload_stack_size == 0 ? 4 : dev->offload_stack_size * 2;
+					dev->offload_stack = (omp_offloading_t **) realloc(dev->offload_stack, sizeof(omp_offloading_t *) * dev->offload_stack_size);
+				}
 				dev->offload_stack_top++;
 				dev->offload_stack[dev->offload_stack_top] = off;
 				//printf("pushing an off %X onto offload stack at position %d\n", off, dev->offload_stack_top);
 			}
 		} else {
 			if (off_info->type == OMP_OFFLOADING_DATA) { /* pop up this offload stack */
+				/* offloadings from different host threads may interleave, so remove this one instead of the top */
+				int j;
+				for (j=dev->offload_stack_top; j>=0 && dev->offload_stack[j] != off; j--);
+				for (; j>=0 && j<dev->offload_stack_top; j++) dev->offload_stack[j] = dev->offload_stack[j+1];
 				dev->offload_stack_top--;
 				//printf("pop an off %X onto offload stack at position %d\n", off, dev->offload_stack_top+1);
 			}
@@ -301,38 +548,67 @@ omp_offloading_sync_cleanup: ;
 		off->stage = OMP_OFFLOADING_MDEV_BARRIER;
 	}
 //	case OMP_OFFLOADING_MDEV_BARRIER:
-	{
+	/* devices only need to wait for their neighbors if they will exchange data, the host waits for the completion counters */
+	if (off_info->halo_x_info != NULL) {
+omp_offloading_mdev_barrier: ;
+		/* a deep halo is exchanged every few runs, the devices skip the syncs when no map is due */
+		halo_x_due = omp_halo_exchange_due(off);
+	}
+	if (halo_x_due) {
+		/* the buffers of the aggregated exchange must be there before a neighbor pushes to them after the sync */
+		omp_halo_exchange_aggregate_plan(off);
 #if defined (OMP_BREAKDOWN_TIMING)
 		omp_event_record_start(&events[barrier_wait_event_index], NULL, "BAR_FINI_2", "Time for barrier wait for other to complete");
 #endif
-		dev->offload_request = NULL; /* release this dev */
-		pthread_barrier_wait(&off_info->barrier);
+		omp_halo_exchange_sync(off);
 #if defined (OMP_BREAKDOWN_TIMING)
 		omp_event_record_stop(&events[barrier_wait_event_index]);
 #endif
 		//off_info->stage = OMP_OFFLOADING_COMPLETE; /* data race for any access to off_info
 	}
-data_exchange:;
 	/* for data exchange, either a standalone or an appended exchange */
-	if (off_info->halo_x_info != NULL) {
+	if (halo_x_due) {
 #if defined (OMP_BREAKDOWN_TIMING)
 		omp_event_record_start(&events[acc_ex_event_index], NULL, "DATA_X", "Time for data exchange between devices");
 #endif
+		/* the dims are exchanged one after another, with a neighbor sync in between, so the regions of a higher dim, which span
+		 * the halo of the lower dims, carry the corners. Which dims exchange is the same on all the devices */
+		int xdim, last_xdim = -1;
 		for (i=0; i<off_info->num_maps_halo_x; i++) {
 			omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
-			omp_data_map_info_t * map_info = x_halos->map_info;
-			//int devseqid = omp_grid_topology_get_seqid(map_info->top, dev->id);
-
-			omp_data_map_t * map = &map_info->maps[seqid];
-			//printf("dev: %d (seqid: %d) holo region pull\n", dev->id, devseqid);
-			omp_halo_region_pull(map, x_halos->x_dim, x_halos->x_direction);
+			for (xdim=0; xdim<x_halos->map_info->num_dims; xdim++) {
+				if ((x_halos->x_dim < 0 || x_halos->x_dim == xdim) && omp_data_map_has_halo(x_halos->map_info, xdim) && xdim > last_xdim &&
+						x_halos->map_info->maps[seqid].halo_x_due)
+					last_xdim = xdim;
+			}
 		}
+		for (xdim=0; xdim<=last_xdim; xdim++) {
+			int exchanged = 0;
+			omp_halo_exchange_aggregate_push(off, xdim);
+			for (i=0; i<off_info->num_maps_halo_x; i++) {
+				omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
+				omp_data_map_info_t * map_info = x_halos->map_info;
+				if (xdim >= map_info->num_dims || (x_halos->x_dim >= 0 && x_halos->x_dim != xdim) || !omp_data_map_has_halo(map_info, xdim)) continue;
+
+				omp_data_map_t * map = &map_info->maps[seqid];
+				if (!map->halo_x_due) continue;
+				//printf("dev: %d (seqid: %d) holo region pull\n", dev->id, seqid);
+				omp_halo_region_pull(map, xdim, x_halos->x_direction, off->stream);
+				exchanged = 1;
+			}
+			omp_halo_exchange_aggregate_pull(off, xdim);
+			if (exchanged && xdim < last_xdim) {
+				omp_stream_sync(off->stream); /* the relay copies are async */
+				omp_halo_exchange_sync(off);
+			}
+		}
+		omp_stream_sync(off->stream);
 #if defined (OMP_BREAKDOWN_TIMING)
 		omp_event_record_stop(&events[acc_ex_event_index]);
 		omp_event_record_start(&events[acc_ex_barrier_event_index], NULL, "BAR_DATA_X", "Time for barrier sync for data exchange between devices");
 #endif
-		dev->offload_request = NULL; /* release this dev */
-		pthread_barrier_wait(&off_info->barrier);
+		omp_halo_exchange_sync(off);
+		omp_halo_exchange_aggregate_fini(off);
 
 #if defined (OMP_BREAKDOWN_TIMING)
 		omp_event_record_stop(&events[acc_ex_barrier_event_index]);
@@ -349,22 +625,101 @@ data_exchange:;
 	for (i=0; i<num_events; i++) {
 		omp_event_accumulate_elapsed_ms(&events[i]);
 	}
-	pthread_barrier_wait(&off_info->barrier);
+	for (i=0; i<off->num_slices*3; i++) {
+		omp_event_t * ev = &off->slice_events[i];
+		if (!ev->recorded) continue;
+		omp_event_elapsed_ms(ev);
+		off->slice_elapsed[i%3] += ev->elapsed_dev;
+	}
 #endif
+	/* this dev is done with the submission, nothing of off and off_info can be touched after this */
+	__sync_synchronize();
+	off->num_completed++;
+}
+
+int omp_helper_spin_max = OMP_HELPER_SPIN_DEFAULT;
+
+/**
+ * wake up the helper thread of dev if it is parked. This must be called after the request (or omp_device_complete)
+ * is published. The full barrier pairs with the one in helper_thread_wait so that either the helper sees the request
+ * before parking, or we see the parked flag and signal it
+ */
+void omp_helper_notify(omp_device_t * dev) {
+	__sync_synchronize();
+	if (dev->helper_parked) {
+		pthread_mutex_lock(&dev->helper_mutex);
+		pthread_cond_signal(&dev->helper_cond);
+		pthread_mutex_unlock(&dev->helper_mutex);
+	}
+}
+
+/**
+ * wait for an offload request (or termination). The helper spins with cpu relax for up to dev->helper_spin iterations so
+ * back-to-back offloadings are dispatched with low latency, then parks on the condvar so an idle device costs no cpu.
+ * The spin budget is doubled if a request arrived while spinning, and halved if the helper had to park.
+ * return 0 if the runtime is terminating
+ */
+static int helper_thread_wait(omp_device_t * dev) {
+	int i;
+	for (i=0; i<dev->helper_spin; i++) {
+		if (dev->offload_queue != NULL) {
+			dev->helper_spin *= 2;
+			if (dev->helper_spin > omp_helper_spin_max) dev->helper_spin = omp_helper_spin_max;
+			return 1;
+		}
+		if (omp_device_complete) return 0;
+		omp_cpu_relax();
+	}
+
+	pthread_mutex_lock(&dev->helper_mutex);
+	dev->helper_parked = 1;
+	__sync_synchronize();
+	while (dev->offload_queue == NULL && omp_device_complete == 0) {
+		pthread_cond_wait(&dev->helper_cond, &dev->helper_mutex);
+	}
+	dev->helper_parked = 0;
+	pthread_mutex_unlock(&dev->helper_mutex);
+
+	dev->helper_spin /= 2;
+	if (dev->helper_spin < 16) dev->helper_spin = omp_helper_spin_max < 16 ? omp_helper_spin_max : 16;
+	return dev->offload_queue != NULL;
+}
+
+/**
+ * take the next offloading of the device in submission order. When the pending list is used up, grab all the queued ones
+ * at once and reverse them (the queue is LIFO)
+ */
+static omp_offloading_t * helper_thread_next(omp_device_t * dev) {
+	omp_offloading_t * off = dev->offload_pending;
+	if (off == NULL) {
+		omp_offloading_t * list = __sync_lock_test_and_set(&dev->offload_queue, NULL);
+		while (list != NULL) {
+			omp_offloading_t * next = list->qnext;
+			list->qnext = off;
+			off = list;
+			list = next;
+		}
+		if (off == NULL) return NULL;
+	}
+	dev->offload_pending = off->qnext;
+	return off;
 }
 
 /* helper thread main */
 void helper_thread_main(void * arg) {
 	omp_device_t * dev = (omp_device_t*)arg;
+	omp_thsim_bind_self(dev);
 	omp_set_current_device_dev(dev);
 	omp_stream_create(dev, &dev->devstream, 1);
 
 	/*************** loop *******************/
-	while (omp_device_complete == 0) {
+	while (1) {
 		//	printf("helper threading (devid: %d) waiting ....\n", devid);
-		while (dev->offload_request == NULL) {
-			if (omp_device_complete) return;
+		omp_offloading_t * off = helper_thread_next(dev);
+		if (off == NULL) {
+			if (!helper_thread_wait(dev)) return;
+			continue;
 		}
-		omp_offloading_run(dev);
+		omp_offloading_run(dev, off);
 	}
 }
@@ -10,6 +10,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <sched.h>
 
 #include "homp.h"
 
@@ -91,6 +93,51 @@ int omp_get_num_active_devices() {
 	 return num_dev;
 }
 
+/**
+ * release the buffers of the maps of off (not the inherited ones): the marshalling buffer, dev memory and the halo relay
+ * buffers, they go back to the pools of the device. This is done in omp_cleanup for a non-recurring or data offloading, and
+ * in omp_offloading_fini_info for a recurring offloading, which keeps the buffers across all its offloadings.
+ */
+void omp_map_release_buffers(omp_offloading_t * off) {
+	int i, j;
+	if (!off->buffers_mapped) return;
+	for (i = 0; i < off->num_maps; i++) {
+		if (off->map_cache[i].inherited) continue;
+		omp_data_map_t * map = off->map_cache[i].map;
+		omp_data_map_info_t * info = map->info;
+		if (map->map_type == OMP_DATA_MAP_COPY) {
+			/* see omp_map_buffer, the marshalled buffer is used as the dev mem for non-discrete dev */
+			if (map->resident != NULL) omp_map_resident_release(map);
+			else if (map->map_dev_ptr != map->map_buffer) omp_map_free_dev(map->dev, map->map_dev_ptr);
+			if (map->mem_noncontiguous && !map->strided_copy) omp_map_free_staging(map->dev, map->map_buffer);
+		}
+		if (info->halo_info == NULL) continue;
+		for (j = 0; j < info->num_dims; j++) {
+			omp_data_map_halo_region_info_t * halo_info = &info->halo_info[j];
+			omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[j];
+			if (halo_info->left == 0 && halo_info->right == 0) continue;
+			int s;
+			if (halo_mem->left_dev_seqid >= 0) {
+				for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_destroy(&halo_mem->left_out_relay_push_events[s]);
+				if (halo_mem->left_in_host_relay_ptr != NULL) {
+					for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_destroy(&halo_mem->left_in_relay_pull_events[s]);
+				}
+				omp_map_free_staging(map->dev, halo_mem->left_in_host_relay_ptr);
+				halo_mem->left_in_host_relay_ptr = NULL;
+			}
+			if (halo_mem->right_dev_seqid >= 0) {
+				for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_destroy(&halo_mem->right_out_relay_push_events[s]);
+				if (halo_mem->right_in_host_relay_ptr != NULL) {
+					for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_destroy(&halo_mem->right_in_relay_pull_events[s]);
+				}
+				omp_map_free_staging(map->dev, halo_mem->right_in_host_relay_ptr);
+				halo_mem->right_in_host_relay_ptr = NULL;
+			}
+		}
+	}
+	off->buffers_mapped = 0;
+}
+
 /**
  * seqid is the sequence id of the device in the top, it is also used as index to access maps
  *
@@ -101,19 +148,16 @@ void omp_cleanup(omp_offloading_t * off) {
 	omp_stream_sync(off->stream);
 	omp_stream_destroy(off->stream);
 
-	for (i = 0; i < off_info->num_mapped_vars; i++) {
-		omp_data_map_t * map = &off_info->data_map_info[i].maps[off->devseqid];
-		if (map->map_type == OMP_DATA_MAP_COPY) {
-			if (map->mem_noncontiguous) {
-				omp_map_unmarshal(map);
-				free(map->map_buffer);
-			}
-
-			if (omp_device_mem_discrete(map->dev->mem_type)) {
-				omp_map_free_dev(map->dev, map->map_dev_ptr);
-			}
+	for (i = 0; i < off->num_maps; i++) {
+		if (off->map_cache[i].inherited) continue;
+		omp_data_map_t * map = off->map_cache[i].map;
+		omp_data_map_direction_t direction = map->info->map_direction;
+		if (map->map_type == OMP_DATA_MAP_COPY && map->mem_noncontiguous && !map->strided_copy &&
+				(direction == OMP_DATA_MAP_FROM || direction == OMP_DATA_MAP_TOFROM)) {
+			omp_map_unmarshal(map);
 		}
 	}
+	if (off_info->count == 0 || off_info->type == OMP_OFFLOADING_DATA) omp_map_release_buffers(off);
 }
 
 void omp_offloading_init_info(const char *name, omp_offloading_info_t *info, omp_grid_topology_t *top,
@@ -137,14 +181,275 @@ void omp_offloading_init_info(const char *name, omp_offloading_info_t *info, omp
 	info->loop_dist_info[0] = loop_nest1_dist;
 	info->loop_dist_info[1] = loop_nest2_dist;
 	info->loop_dist_info[2] = loop_nest3_dist;
+	info->loop_depth = (loop_nest1_dist != NULL) + (loop_nest2_dist != NULL) + (loop_nest3_dist != NULL);
+
+	int i;
+	for (i=0; i<top->nnodes; i++) {
+		omp_offloading_t * off = &info->offloadings[i];
+		off->num_completed = 0;
+		off->halo_x_phase = 0;
+		off->halo_x_parked = 0;
+		off->halo_x_spin = omp_helper_spin_max;
+		pthread_mutex_init(&off->halo_x_mutex, NULL);
+		pthread_cond_init(&off->halo_x_cond, NULL);
+		off->slices = NULL;
+		off->num_slices = 0;
+		off->slice_maps = NULL;
+		off->slice_map_cache = NULL;
+		off->slice_map_index = NULL;
+		off->slice_streams = NULL;
+		off->num_slice_streams = 0;
+		off->slice_events = NULL;
+		off->slice_elapsed[0] = off->slice_elapsed[1] = off->slice_elapsed[2] = 0.0;
+		off->rebalance_kern_mark = 0.0;
+		off->rebalance_kern_count = 0;
+		off->rebalance_kern_ms = 0.0;
+		off->dynamic_capacity = 0;
+		off->dynamic_chunks = 0;
+		off->dynamic_iterations = 0;
+		off->dynamic_min = 0;
+		off->dynamic_max = 0;
+		off->dynamic_rate = 0.0;
+		off->buffers_mapped = 0;
+		off->events = NULL;
+		off->num_events = 0;
+		off->map_cache = NULL;
+		off->map_index = NULL;
+		off->map_cache_size = 0;
+		off->num_maps = 0;
+	}
+	info->pipeline_slices = 0;
+	info->pipeline_streams = 0;
+	info->rebalance_threshold = 0.0;
+	info->rebalance_interval = 0;
+	info->rebalance_runs = 0;
+	info->num_rebalances = 0;
+	info->rebalance_rows_migrated = 0;
+	info->dynamic = 0;
+	info->dynamic_min_chunk = 0;
+	info->dynamic_max_chunk = 0;
+	info->dynamic_next = 0;
+	info->num_submitted = 0;
+	info->num_completed = 0;
+	pthread_barrier_init(&info->barrier, NULL, top->nnodes);
+}
+
+/* the length of the first AUTO distributed dim of the maps used by off on its device, without halo, 0 if there is none */
+static long omp_offloading_auto_share(omp_offloading_t * off) {
+	int i, d;
+	for (i=0; i<off->num_maps; i++) {
+		omp_data_map_info_t * info = off->map_cache[i].map->info;
+		for (d=0; d<info->num_dims; d++) {
+			omp_dist_info_t * dist = &info->dist[d];
+			if (dist->policy != OMP_DIST_POLICY_AUTO) continue;
+			int coords[info->top->ndims];
+			long offset, length;
+			omp_topology_get_coords(info->top, omp_grid_topology_get_seqid(info->top, off->dev->id), info->top->ndims, coords);
+			omp_dist_auto(info->top, dist->dim_index, 0, dist->length, coords[dist->dim_index], &offset, &length);
+			return length;
+		}
+	}
+	return 0;
+}
+
+#if defined (OMP_BREAKDOWN_TIMING)
+/* the accumulated kernel time of off and the number of runs it is accumulated over, -1 if the kernel is not timed */
+static double omp_offloading_kernel_elapsed(omp_offloading_t * off, int * count) {
+	if (off->events == NULL || off->num_events <= kernel_exe_event_index) return -1.0;
+	omp_event_t * ev = &off->events[kernel_exe_event_index];
+	*count = ev->count;
+	return ev->record_method == OMP_EVENT_HOST_RECORD ? ev->elapsed_host : ev->elapsed_dev;
+}
+#endif
 
-	pthread_barrier_init(&info->barrier, NULL, top->nnodes+1);
+/**
+ * update dist_weight of the devices of a recurring offloading with AUTO distributed maps to the measured throughput, i.e. the
+ * length of the AUTO dim a device got over its average kernel time, so the next AUTO distribution onto these devices is
+ * balanced. The new weights are scaled to the same sum as the old ones so they stay comparable to those of other devices
+ */
+static void omp_offloading_update_dist_weights(omp_offloading_info_t * info) {
+#if defined (OMP_BREAKDOWN_TIMING)
+	int nnodes = info->top->nnodes;
+	double throughput[nnodes];
+	double old_sum = 0.0;
+	double new_sum = 0.0;
+	int i;
+	/* a rebalanced offloading already keeps the weights to the throughput measured with its current partition */
+	/* a dynamic offloading does not use its static distribution */
+	if (info->count <= 1 || info->type == OMP_OFFLOADING_DATA || info->num_rebalances > 0 || info->dynamic) return;
+	for (i=0; i<nnodes; i++) {
+		omp_offloading_t * off = &info->offloadings[i];
+		int count = 0;
+		double elapsed = omp_offloading_kernel_elapsed(off, &count);
+		long share = omp_offloading_auto_share(off);
+		if (share <= 0 || count <= 0 || elapsed <= 0.0) return;
+		throughput[i] = share / (elapsed / count);
+		old_sum += off->dev->dist_weight;
+		new_sum += throughput[i];
+	}
+	for (i=0; i<nnodes; i++) info->offloadings[i].dev->dist_weight = throughput[i] * old_sum / new_sum;
+#endif
 }
 
 void omp_offloading_fini_info(omp_offloading_info_t * info) {
+	int i;
+	omp_offloading_update_dist_weights(info);
+	for (i=0; i<info->top->nnodes; i++) {
+		omp_offloading_t * off = &info->offloadings[i];
+		omp_offloading_pipeline_fini(off);
+		if (off->buffers_mapped) {
+			omp_set_current_device_dev(off->dev);
+			omp_map_release_buffers(off);
+		}
+		omp_offloading_fini_map_cache(off);
+		pthread_mutex_destroy(&off->halo_x_mutex);
+		pthread_cond_destroy(&off->halo_x_cond);
+	}
 	pthread_barrier_destroy(&info->barrier);
 }
 
+void omp_offloading_set_pipeline(omp_offloading_info_t * info, int nslices, int nstreams) {
+	if (nslices <= 1) {
+		info->pipeline_slices = 0;
+		info->pipeline_streams = 0;
+		return;
+	}
+	if (nstreams <= 0) nstreams = 2;
+	if (nstreams > nslices) nstreams = nslices;
+	info->pipeline_slices = nslices;
+	info->pipeline_streams = nstreams;
+}
+
+/* a map can be sliced if it is distributed in dim 0 with the same range as the reference map (if given) and has no halo */
+static int omp_offloading_pipeline_sliceable(omp_offloading_t * off, int index, omp_data_map_t * ref) {
+	omp_data_map_t * map = off->map_cache[index].map;
+	omp_data_map_info_t * info = map->info;
+	if (off->map_cache[index].inherited || info->halo_info != NULL) return 0;
+	if (info->dist[0].policy == OMP_DIST_POLICY_DUPLICATE || info->dist[0].policy == OMP_DIST_POLICY_CYCLIC || map->map_dist[0].length <= 0) return 0;
+	if (ref != NULL && (map->map_dist[0].offset != ref->map_dist[0].offset || map->map_dist[0].length != ref->map_dist[0].length)) return 0;
+	return 1;
+}
+
+static void omp_offloading_pipeline_release_slices(omp_offloading_t * off) {
+	free(off->slices);
+	free(off->slice_maps);
+	free(off->slice_events);
+	free(off->slice_map_cache);
+	free(off->slice_map_index);
+	off->slices = NULL;
+	off->slice_maps = NULL;
+	off->slice_map_cache = NULL;
+	off->slice_map_index = NULL;
+	off->slice_events = NULL;
+	off->num_slices = 0;
+}
+
+/**
+ * cut the maps of an offloading into slices for pipelining, called by the helper thread after the maps are buffered.
+ *
+ * The dim-0 range of the first sliceable map is the reference. It is cut into off_info->pipeline_slices slices and each slice
+ * gets its own offloading object (a copy of off) whose map cache points to the slice of every map aligned with the reference, so
+ * the kernel launcher gets the slice range from omp_loop_map_range. The other maps (duplicated, with halo or inherited) are
+ * shared by all the slices. num_slices is left 0 if there is nothing to slice, and the offloading runs in phases.
+ */
+void omp_offloading_pipeline_slice(omp_offloading_t * off) {
+	omp_offloading_info_t * off_info = off->off_info;
+	omp_data_map_t * ref = NULL;
+	int i, s;
+
+	for (i=0; i<off->num_maps; i++) {
+		if (off->map_cache[i].inherited) continue;
+		omp_data_map_t * map = off->map_cache[i].map;
+		map->sliced = omp_offloading_pipeline_sliceable(off, i, ref);
+		if (map->sliced && ref == NULL) ref = map;
+	}
+	if (ref == NULL) {
+		omp_offloading_pipeline_release_slices(off);
+		return;
+	}
+
+	int nslices = off_info->pipeline_slices;
+	long length = ref->map_dist[0].length;
+	if (nslices > length) nslices = length;
+	/* the slice objects are reused if the off_info is offloaded again with the same slicing */
+	if (off->slices != NULL && (off->num_slices != nslices || off->slices[0].num_maps != off->num_maps))
+		omp_offloading_pipeline_release_slices(off);
+	int nstreams = off_info->pipeline_streams;
+	if (nstreams > nslices) nstreams = nslices;
+
+	/* the streams are kept across recurring offloadings, they are released in omp_offloading_fini_info */
+	if (off->slice_streams != NULL && off->num_slice_streams != nstreams) {
+		for (s=0; s<off->num_slice_streams; s++) omp_stream_destroy(&off->slice_streams[s]);
+		free(off->slice_streams);
+		off->slice_streams = NULL;
+	}
+	if (off->slice_streams == NULL) {
+		off->slice_streams = (omp_dev_stream_t *) malloc(sizeof(omp_dev_stream_t) * nstreams);
+		for (s=0; s<nstreams; s++) omp_stream_create(off->dev, &off->slice_streams[s], 0);
+		off->num_slice_streams = nstreams;
+	}
+
+	if (off->slices == NULL) {
+		off->slices = (omp_offloading_t *) malloc(sizeof(omp_offloading_t) * nslices);
+		off->slice_maps = (omp_data_map_t *) malloc(sizeof(omp_data_map_t) * nslices * off->num_maps);
+		off->slice_events = (omp_event_t *) malloc(sizeof(omp_event_t) * nslices * 3);
+		off->slice_map_cache = (omp_map_cache_entry_t *) malloc(sizeof(omp_map_cache_entry_t) * nslices * off->num_maps);
+		off->slice_map_index = (omp_map_index_entry_t *) malloc(sizeof(omp_map_index_entry_t) * nslices * off->num_maps);
+	}
+
+	long esize = length / nslices;
+	long remaint = length % nslices;
+	long start = 0;
+	for (s=0; s<nslices; s++) {
+		long slength = s < remaint ? esize + 1 : esize;
+		omp_offloading_t * slice = &off->slices[s];
+		memcpy(slice, off, sizeof(omp_offloading_t));
+		slice->stream = &off->slice_streams[s % nstreams];
+		slice->slices = NULL;
+		slice->num_slices = 0;
+		/* each slice has its own copy of the map cache, which is fixed since all the maps are already in it */
+		slice->map_cache = &off->slice_map_cache[s * off->num_maps];
+		slice->map_index = &off->slice_map_index[s * off->num_maps];
+		slice->map_cache_size = 0;
+		memcpy(slice->map_cache, off->map_cache, sizeof(omp_map_cache_entry_t) * off->num_maps);
+		memcpy(slice->map_index, off->map_index, sizeof(omp_map_index_entry_t) * off->num_maps);
+		for (i=0; i<off->num_maps; i++) {
+			omp_data_map_t * map = off->map_cache[i].map;
+			if (off->map_cache[i].inherited || !map->sliced) continue;
+			omp_data_map_t * smap = &off->slice_maps[s * off->num_maps + i];
+			long row_size = map->map_size / map->map_dist[0].length;
+			/* a strided map copies from the original array, whose rows are the full rows */
+			long host_row_size = row_size;
+			if (map->strided_copy) {
+				int d;
+				host_row_size = map->info->sizeof_element;
+				for (d=1; d<map->info->num_dims; d++) host_row_size *= map->info->dims[d];
+			}
+			memcpy(smap, map, sizeof(omp_data_map_t));
+			smap->map_dist[0].offset = map->map_dist[0].offset + start;
+			smap->map_dist[0].length = slength;
+			smap->map_size = slength * row_size;
+			smap->map_dev_ptr = map->map_dev_ptr + start * row_size;
+			smap->map_buffer = map->map_buffer + start * host_row_size;
+			slice->map_cache[i].map = smap;
+		}
+		start += slength;
+	}
+	off->num_slices = nslices;
+}
+
+void omp_offloading_pipeline_fini(omp_offloading_t * off) {
+	int s;
+	omp_offloading_pipeline_release_slices(off);
+	if (off->slice_streams == NULL) return;
+	for (s=0; s<off->num_slice_streams; s++) {
+		omp_stream_sync(&off->slice_streams[s]);
+		omp_stream_destroy(&off->slice_streams[s]);
+	}
+	free(off->slice_streams);
+	off->slice_streams = NULL; /* num_slice_streams is kept for the report */
+}
+
 #if defined (OMP_BREAKDOWN_TIMING)
 /**
  * sum up all the profiling info of the infos to a info at location 0, all the infos should have the same target and topology.
@@ -324,6 +629,30 @@ set ytics out nomirror ("device 0" 3, "device 1" 6, "device 2" 9, "device 3" 12,
 #endif
             }
 		}
+		if (off->num_slice_streams > 0) {
+			/* the serialized time is what the slices would take if copy and kernel did not overlap */
+			double serialized = off->slice_elapsed[0] + off->slice_elapsed[1] + off->slice_elapsed[2];
+			double pipelined = off->events[kernel_exe_event_index].elapsed_host;
+			printf("--------------------- Pipeline Report: %d slices over %d streams -------------------------------\n", info->pipeline_slices, off->num_slice_streams);
+			printf("%*s%10.2f\n", OMP_EVENT_NAME_LENGTH, "SLICE_TO", off->slice_elapsed[0]);
+			printf("%*s%10.2f\n", OMP_EVENT_NAME_LENGTH, "SLICE_KERN", off->slice_elapsed[1]);
+			printf("%*s%10.2f\n", OMP_EVENT_NAME_LENGTH, "SLICE_FROM", off->slice_elapsed[2]);
+			printf("%*s%10.2f\n", OMP_EVENT_NAME_LENGTH, "SERIALIZED", serialized);
+			printf("%*s%10.2f\n", OMP_EVENT_NAME_LENGTH, "PIPELINED", pipelined);
+			if (pipelined > 0.0)
+				printf("%*s%10.2f\tx (%.1f%% of the serialized time hidden)\n", OMP_EVENT_NAME_LENGTH, "OVERLAP", serialized/pipelined,
+						serialized > pipelined ? (serialized - pipelined)/serialized*100.0 : 0.0);
+		}
+		if (info->dynamic && off->dynamic_chunks > 0) {
+			long total = 0;
+			int k;
+			for (k=0; k<info->top->nnodes; k++) total += info->offloadings[k].dynamic_iterations;
+			printf("--------------------- Dynamic Report: %ld chunks of %ld-%ld iterations -------------------------------\n",
+					off->dynamic_chunks, off->dynamic_min, off->dynamic_max);
+			printf("%*s%10ld\t(%.1f%% of the last run)\n", OMP_EVENT_NAME_LENGTH, "ITERATIONS", off->dynamic_iterations,
+					total > 0 ? off->dynamic_iterations * 100.0 / total : 0.0);
+			printf("%*s%10.2f\titerations/ms\n", OMP_EVENT_NAME_LENGTH, "RATE", off->dynamic_rate);
+		}
 		printf("---------------- End Profiling Report for Offloading(%s) on dev: %d ----------------------------\n", info->name, devid);
 
 #if defined(PROFILE_PLOT)
@@ -331,6 +660,24 @@ set ytics out nomirror ("device 0" 3, "device 1" 6, "device 2" 9, "device 3" 12,
 #endif
 		//free(off->events);
 	}
+	if (info->num_rebalances > 0) {
+		int first = info->num_rebalances > OMP_REBALANCE_HISTORY ? info->num_rebalances - OMP_REBALANCE_HISTORY : 0;
+		printf("\n-------------- Rebalance Report for Offloading(%s): %d rebalances, %ld rows migrated ---------------\n", info->name,
+				info->num_rebalances, info->rebalance_rows_migrated);
+		printf("%10s%20s%20s%16s\n", "run", "imbalance before", "imbalance after", "rows migrated");
+		for (i=first; i<info->num_rebalances; i++) {
+			omp_rebalance_record_t * rec = &info->rebalance_history[i % OMP_REBALANCE_HISTORY];
+			printf("%10d%19.1f%%", rec->run, rec->imbalance_before*100.0);
+			if (rec->imbalance_after < 0.0) printf("%20s", "-");
+			else printf("%19.1f%%", rec->imbalance_after*100.0);
+			printf("%16ld\n", rec->rows_migrated);
+		}
+		for (i=0; i<info->top->nnodes; i++) {
+			omp_offloading_t * off = &info->offloadings[i];
+			printf("dev %d: dist_weight %g, KERN %.3f ms/run at the last check\n", off->dev->id, off->dev->dist_weight, off->rebalance_kern_ms);
+		}
+		printf("---------------- End Rebalance Report for Offloading(%s) ----------------------------\n", info->name);
+	}
 #if defined(PROFILE_PLOT)
 	fprintf(plotscript_file, "plot 0\n");
 	fclose(plotscript_file);
@@ -382,8 +729,57 @@ void omp_offloading_standalone_data_exchange_init_info(const char * name, omp_of
 	info->data_map_info = data_map_info;
 	info->halo_x_info = halo_x_info;
 	info->num_maps_halo_x = num_maps_halo_x;
+	info->loop_depth = 0;
 
-	pthread_barrier_init(&info->barrier, NULL, top->nnodes+1);
+	int i;
+	for (i=0; i<top->nnodes; i++) {
+		omp_offloading_t * off = &info->offloadings[i];
+		off->num_completed = 0;
+		off->halo_x_phase = 0;
+		off->halo_x_parked = 0;
+		off->halo_x_spin = omp_helper_spin_max;
+		pthread_mutex_init(&off->halo_x_mutex, NULL);
+		pthread_cond_init(&off->halo_x_cond, NULL);
+		off->slices = NULL;
+		off->num_slices = 0;
+		off->slice_maps = NULL;
+		off->slice_map_cache = NULL;
+		off->slice_map_index = NULL;
+		off->slice_streams = NULL;
+		off->num_slice_streams = 0;
+		off->slice_events = NULL;
+		off->slice_elapsed[0] = off->slice_elapsed[1] = off->slice_elapsed[2] = 0.0;
+		off->rebalance_kern_mark = 0.0;
+		off->rebalance_kern_count = 0;
+		off->rebalance_kern_ms = 0.0;
+		off->dynamic_capacity = 0;
+		off->dynamic_chunks = 0;
+		off->dynamic_iterations = 0;
+		off->dynamic_min = 0;
+		off->dynamic_max = 0;
+		off->dynamic_rate = 0.0;
+		off->buffers_mapped = 0;
+		off->events = NULL;
+		off->num_events = 0;
+		off->map_cache = NULL;
+		off->map_index = NULL;
+		off->map_cache_size = 0;
+		off->num_maps = 0;
+	}
+	info->pipeline_slices = 0;
+	info->pipeline_streams = 0;
+	info->rebalance_threshold = 0.0;
+	info->rebalance_interval = 0;
+	info->rebalance_runs = 0;
+	info->num_rebalances = 0;
+	info->rebalance_rows_migrated = 0;
+	info->dynamic = 0;
+	info->dynamic_min_chunk = 0;
+	info->dynamic_max_chunk = 0;
+	info->dynamic_next = 0;
+	info->num_submitted = 0;
+	info->num_completed = 0;
+	pthread_barrier_init(&info->barrier, NULL, top->nnodes);
 }
 
 char * omp_get_device_typename(omp_device_t * dev) {
@@ -397,8 +793,8 @@ char * omp_get_device_typename(omp_device_t * dev) {
 // Initialize data_map_info
 void omp_data_map_init_info(const char * symbol, omp_data_map_info_t *info, omp_grid_topology_t * top, void * source_ptr, int num_dims, long* dims, int sizeof_element,
 		omp_data_map_t * maps, omp_data_map_direction_t map_direction, omp_data_map_type_t map_type, omp_dist_info_t * dist) {
-	if (num_dims > 3) {
-		fprintf(stderr, "%d dimension array is not supported in this implementation!\n", num_dims);
+	if (num_dims > OMP_NUM_ARRAY_DIMENSIONS) {
+		fprintf(stderr, "%d dimension array is not supported in this implementation, see OMP_NUM_ARRAY_DIMENSIONS!\n", num_dims);
 		exit(1);
 	}
 	info->symbol = symbol;
@@ -409,7 +805,9 @@ void omp_data_map_init_info(const char * symbol, omp_data_map_info_t *info, omp_
 	info->maps = maps; memset(maps, 0, sizeof(omp_data_map_t) * top->nnodes);
 	info->map_direction = map_direction;
 	info->map_type = map_type;
+	info->resident = 0;
 	info->halo_info = NULL;
+	info->halo_depth = 1;
 	info->sizeof_element = sizeof_element;
 	info->dist = dist;
 #if ENABLE_DIST_TARGET_INFO
@@ -422,10 +820,18 @@ void omp_data_map_init_info(const char * symbol, omp_data_map_info_t *info, omp_
 #endif
 }
 
+/**
+ * keep the dev mem of the maps of info across offloadings, see omp_resident_map_t. It only applies to COPY maps without halo
+ * region that are not marshalled, and it must be called before the offloading starts
+ */
+void omp_data_map_set_resident(omp_data_map_info_t * info) {
+	info->resident = 1;
+}
+
 void omp_data_map_init_info_with_halo(const char * symbol, omp_data_map_info_t *info, omp_grid_topology_t * top, void * source_ptr, int num_dims, long* dims, int sizeof_element,
 		omp_data_map_t * maps, omp_data_map_direction_t map_direction, omp_data_map_type_t map_type, omp_dist_info_t * dist, omp_data_map_halo_region_info_t * halo_info) {
-	if (num_dims > 3) {
-		fprintf(stderr, "%d dimension array is not supported in this implementation!\n", num_dims);
+	if (num_dims > OMP_NUM_ARRAY_DIMENSIONS) {
+		fprintf(stderr, "%d dimension array is not supported in this implementation, see OMP_NUM_ARRAY_DIMENSIONS!\n", num_dims);
 		exit(1);
 	}
 	int i;
@@ -443,9 +849,11 @@ void omp_data_map_init_info_with_halo(const char * symbol, omp_data_map_info_t *
 	info->maps = maps; memset(maps, 0, sizeof(omp_data_map_t) * top->nnodes);
 	info->map_direction = map_direction;
 	info->map_type = map_type;
+	info->resident = 0;
 	info->dist = dist;
 	info->sizeof_element = sizeof_element;
 	info->halo_info = halo_info;
+	info->halo_depth = 1;
 }
 
 #if ENABLE_DIST_TARGET_INFO
@@ -466,9 +874,17 @@ void omp_dist_init_info(omp_dist_info_t *dist_info, omp_dist_policy_t dist_polic
 	dist_info->start = start;
 	dist_info->length = length;
 	dist_info->policy = dist_policy;
+	dist_info->stride = 1;
+	dist_info->chunk_size = 0;
 	dist_info->dim_index = topdim;
 }
 
+/* for CYCLIC and FIX, chunk_size <= 0 is 1 for CYCLIC, i.e. plain cyclic, and is required for FIX */
+void omp_dist_init_info_chunk(omp_dist_info_t *dist_info, omp_dist_policy_t dist_policy, long start, long length, long chunk_size, int topdim) {
+	omp_dist_init_info(dist_info, dist_policy, start, length, topdim);
+	dist_info->chunk_size = chunk_size;
+}
+
 void omp_align_dist_init_info(omp_dist_info_t *dist_info, omp_dist_policy_t dist_policy, omp_dist_target_type_t alignee_type, void *alignee, int alignee_dim) {
 	dist_info->policy = dist_policy; /* TODO assert dist_type == OMP_DIST_POLICY_ALIGN */
 	if (alignee_type == OMP_DIST_TARGET_DATA_MAP) {
@@ -507,8 +923,8 @@ void omp_data_map_init_info_straight_dist(const char *symbol, omp_data_map_info_
  */
 void omp_data_map_init_info_straight_dist_and_halo(const char *symbol, omp_data_map_info_t *info, omp_grid_topology_t *top, void *source_ptr, int num_dims, long *dims, int sizeof_element,
 		omp_data_map_t *maps, omp_data_map_direction_t map_direction, omp_data_map_type_t map_type, omp_dist_info_t *dist, omp_dist_policy_t dist_policy, omp_data_map_halo_region_info_t *halo_info, int halo_left, int halo_right, int halo_cyclic) {
-	if (dist_policy != OMP_DIST_POLICY_BLOCK) {
-		fprintf(stderr, "%s: we currently only handle halo region for even distribution of arrays\n", __func__);
+	if (dist_policy != OMP_DIST_POLICY_BLOCK && dist_policy != OMP_DIST_POLICY_AUTO) {
+		fprintf(stderr, "%s: we currently only handle halo region for block distribution of arrays\n", __func__);
 	}
 	int i;
 	for (i=0; i<num_dims; i++) {
@@ -529,9 +945,11 @@ void omp_data_map_init_info_straight_dist_and_halo(const char *symbol, omp_data_
 	info->maps = maps; memset(maps, 0, sizeof(omp_data_map_t) * top->nnodes);
 	info->map_direction = map_direction;
 	info->map_type = map_type;
+	info->resident = 0;
 	info->dist = dist;
 	info->sizeof_element = sizeof_element;
 	info->halo_info = halo_info;
+	info->halo_depth = 1;
 }
 
 int omp_data_map_has_halo(omp_data_map_info_t * info, int dim) {
@@ -550,29 +968,93 @@ int omp_data_map_get_halo_right_devseqid(omp_data_map_t * map, int dim) {
 	return (map->halo_mem[dim].right_dev_seqid);
 }
 
-static omp_data_map_t * omp_map_get_map_from_cache (omp_offloading_t *off, void * host_ptr) {
-	int i;
-	for (i=0; i<off->num_maps; i++) {
-		omp_data_map_t * map = off->map_cache[i].map;
-		if (map->info->source_ptr == host_ptr) return map;
+/* the position in off->map_index of the last entry whose host_begin <= ptr, -1 if none */
+static int omp_map_index_search(omp_offloading_t *off, char * ptr) {
+	int lo = 0;
+	int hi = off->num_maps - 1;
+	int pos = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (off->map_index[mid].host_begin <= ptr) {
+			pos = mid;
+			lo = mid + 1;
+		} else hi = mid - 1;
+	}
+	return pos;
+}
+
+/**
+ * find the entry of the map cache whose host range contains host_ptr, in O(log n). The search only walks back over the entries
+ * whose range may still contain host_ptr (max_end > host_ptr), which is at most one entry unless the mapped ranges are nested
+ */
+omp_map_cache_entry_t * omp_map_cache_lookup(omp_offloading_t *off, void * host_ptr) {
+	char * ptr = (char *) host_ptr;
+	int pos = omp_map_index_search(off, ptr);
+	for (; pos >= 0 && off->map_index[pos].max_end > ptr; pos--) {
+		omp_map_cache_entry_t * entry = &off->map_cache[off->map_index[pos].slot];
+		if (ptr < entry->host_end) return entry;
 	}
+	return NULL;
+}
 
+static omp_data_map_t * omp_map_get_map_from_cache (omp_offloading_t *off, void * host_ptr) {
+	omp_map_cache_entry_t * entry = omp_map_cache_lookup(off, host_ptr);
+	if (entry != NULL) return entry->map;
 	return NULL;
 }
 
 void omp_offload_append_map_to_cache (omp_offloading_t *off, omp_data_map_t *map, int inherited) {
-	if (off->num_maps >= OFF_MAP_CACHE_SIZE) { /* error, report */
-		fprintf(stderr, "map cache is full for off (%X), cannot add map %X\n", off, map);
-		exit(1);
+	if (off->num_maps >= off->map_cache_size) {
+		if (off->map_cache != NULL && off->map_cache_size == 0) { /* error, report */
+			fprintf(stderr, "map cache of pipeline slice (%p) is fixed, cannot add map %p\n", off, map);
+			abort();
+		}
+		int size = off->map_cache_size == 0 ? OFF_MAP_CACHE_INIT_SIZE : off->map_cache_size * 2;
+		off->map_cache = (omp_map_cache_entry_t *) realloc(off->map_cache, sizeof(omp_map_cache_entry_t) * size);
+		off->map_index = (omp_map_index_entry_t *) realloc(off->map_index, sizeof(omp_map_index_entry_t) * size);
+		off->map_cache_size = size;
+	}
+	omp_data_map_info_t * info = map->info;
+	long size = info->sizeof_element;
+	int i;
+	for (i=0; i<info->num_dims; i++) size *= info->dims[i];
+	if (size <= 0) size = 1;
+
+	int slot = off->num_maps;
+	omp_map_cache_entry_t * entry = &off->map_cache[slot];
+	entry->map = map;
+	entry->inherited = inherited;
+	entry->host_begin = (char *) info->source_ptr;
+	entry->host_end = entry->host_begin + size;
+
+	/* insert it after the entries that begin at or before it, and update max_end from there */
+	int pos = omp_map_index_search(off, entry->host_begin) + 1;
+	memmove(&off->map_index[pos+1], &off->map_index[pos], sizeof(omp_map_index_entry_t) * (off->num_maps - pos));
+	off->map_index[pos].host_begin = entry->host_begin;
+	off->map_index[pos].slot = slot;
+	char * max_end = pos > 0 ? off->map_index[pos-1].max_end : NULL;
+	for (i=pos; i<=off->num_maps; i++) {
+		char * end = off->map_cache[off->map_index[i].slot].host_end;
+		if (max_end == NULL || end > max_end) max_end = end;
+		off->map_index[i].max_end = max_end;
 	}
-	off->map_cache[off->num_maps].map = map;
-	off->map_cache[off->num_maps].inherited = inherited;
 
 	off->num_maps++;
 }
 
+/* free the map cache of an offloading, called by omp_offloading_fini_info */
+void omp_offloading_fini_map_cache(omp_offloading_t *off) {
+	free(off->map_cache);
+	free(off->map_index);
+	off->map_cache = NULL;
+	off->map_index = NULL;
+	off->map_cache_size = 0;
+	off->num_maps = 0;
+}
 
 int omp_map_is_map_inherited(omp_offloading_t *off, omp_data_map_t *map) {
+	omp_map_cache_entry_t * entry = omp_map_cache_lookup(off, map->info->source_ptr);
+	if (entry != NULL && entry->map == map) return entry->inherited;
 	int i;
 	for (i=0; i<off->num_maps; i++) {
 		if (off->map_cache[i].map == map) return off->map_cache[i].inherited;
@@ -584,7 +1066,7 @@ int omp_map_is_map_inherited(omp_offloading_t *off, omp_data_map_t *map) {
 }
 
 
-/* get map from inheritance (off stack) */
+/* get map from inheritance (off stack), each level is searched with its own index */
 omp_data_map_t * omp_map_get_map_inheritance (omp_device_t * dev, void * host_ptr) {
 	int i;
 	for (i=dev->offload_stack_top; i>=0; i--) {
@@ -652,6 +1134,30 @@ void omp_map_add_halo_region(omp_data_map_info_t * info, int dim, int left, int
 	info->halo_info[dim].topdim = info->dist[dim].dim_index;
 }
 
+/**
+ * make the halo regions of info depth steps of the stencil deep, for trading redundant computation for fewer exchanges: the
+ * widths given to omp_map_add_halo_region are depth times the radius of the stencil, and the maps are exchanged only every
+ * depth runs of the exchange they are in. In between, the device computes the ghost band itself, one radius narrower every
+ * step, see omp_loop_map_valid_range. A map that the band is computed into needs the same depth even if it is not exchanged.
+ * The halo of such maps is private dev mem, not shared with the neighbor, and since the copy back of a map includes its
+ * halo, they are meant to be ALLOC maps. It must be called after the halo regions are added
+ */
+void omp_map_set_halo_depth(omp_data_map_info_t * info, int depth) {
+	int i;
+	if (depth < 1 || info->halo_info == NULL) {
+		fprintf(stderr, "halo depth %d is not valid for map %s, which needs a halo region and a depth of at least 1\n", depth, info->symbol);
+		abort();
+	}
+	for (i=0; i<info->num_dims; i++) {
+		if (info->halo_info[i].left % depth != 0 || info->halo_info[i].right % depth != 0) {
+			fprintf(stderr, "the halo of dim %d of map %s (%d, %d) is not a multiple of its depth %d\n", i, info->symbol,
+					info->halo_info[i].left, info->halo_info[i].right, depth);
+			abort();
+		}
+	}
+	info->halo_depth = depth;
+}
+
 /**
  * after initialization
  */
@@ -660,6 +1166,9 @@ void omp_data_map_init_map(omp_data_map_t *map, omp_data_map_info_t *info, omp_d
 	map->info = info;
 	map->dev = dev;
 	map->mem_noncontiguous = 0;
+	map->strided_copy = 0;
+	map->sliced = 0;
+	map->resident = NULL;
 	map->map_type = info->map_type;
 
 	if (map->map_type == OMP_DATA_MAP_AUTO) {
@@ -698,6 +1207,59 @@ void omp_dist_block(long start, long full_length, long position, int dim, long *
 	*length = len;
 }
 
+/* each position gets one chunk of chunk_size in order, the last position also gets what is left */
+void omp_dist_fix(long start, long full_length, long chunk_size, long position, int dim, long * offstart, long * length) {
+	long begin = chunk_size * position;
+	long end = position == dim - 1 ? full_length : begin + chunk_size;
+	if (begin > full_length) begin = full_length;
+	if (end > full_length) end = full_length;
+	*offstart = start + begin;
+	*length = end - begin;
+}
+
+/**
+ * the chunks of chunk_size of [start, start+full_length) are dealt out to the dim positions round-robin, position gets
+ * the chunks starting at *offstart + k * *chunk_stride, *length elements in total (only the last chunk of the range may be short)
+ */
+void omp_dist_cyclic(long start, long full_length, long chunk_size, long position, int dim, long * offstart, long * length, long * chunk_stride) {
+	long num_chunks = (full_length + chunk_size - 1) / chunk_size;
+	long owned = position < num_chunks ? (num_chunks - position + dim - 1) / dim : 0;
+	long len = owned * chunk_size;
+	if (owned > 0 && (num_chunks - 1) % dim == position) len -= num_chunks * chunk_size - full_length; /* the short last chunk */
+	*offstart = owned > 0 ? start + chunk_size * position : start + full_length;
+	*length = len;
+	*chunk_stride = chunk_size * dim;
+}
+
+/**
+ * cut [start, start+full_length) into top->dims[topdim] pieces in proportion to the weight of each slice of the topology along
+ * topdim, i.e. the sum of dist_weight of the devices with that coordinate, and return the piece at position. Every map and
+ * loop distributed with AUTO onto the same topology gets the same boundaries since they only depend on the weights.
+ */
+void omp_dist_auto(omp_grid_topology_t * top, int topdim, long start, long full_length, int position, long * offstart, long * length) {
+	int topdimsize = top->dims[topdim];
+	double weights[topdimsize];
+	int coords[top->ndims];
+	int i;
+	for (i=0; i<topdimsize; i++) weights[i] = 0.0;
+	for (i=0; i<top->nnodes; i++) {
+		omp_topology_get_coords(top, i, top->ndims, coords);
+		double w = omp_devices[top->idmap[i]].dist_weight;
+		weights[coords[topdim]] += w > 0.0 ? w : 1.0;
+	}
+	double total = 0.0;
+	double before = 0.0;
+	for (i=0; i<topdimsize; i++) {
+		if (i < position) before += weights[i];
+		total += weights[i];
+	}
+	long begin = (long) (full_length * before / total + 0.5);
+	long end = (long) (full_length * (before + weights[position]) / total + 0.5);
+	if (position == topdimsize - 1) end = full_length;
+	*offstart = start + begin;
+	*length = end - begin;
+}
+
 /**
  * The general dist algorithm that applies to both data distribution and iteration distribution
  */
@@ -709,24 +1271,24 @@ void omp_dist(omp_dist_info_t * dist_infos, omp_dist_t * dist, int num_dims, omp
 	for (i = 0; i < num_dims; i++) { /* process each dimension */
 		omp_dist_info_t *info = &dist_infos[i];
 		dist[i].info = info;
+		dist[i].chunk_size = 0;
+		dist[i].chunk_stride = 0;
 		long n = info->length;
 
 		int dim_index = info->dim_index;
-		if (info->policy == OMP_DIST_POLICY_BLOCK) { /* even distributions */
+		if (info->policy == OMP_DIST_POLICY_BLOCK || info->policy == OMP_DIST_POLICY_AUTO || info->policy == OMP_DIST_POLICY_FIX) { /* one range per device */
 			int topdimcoord = coords[dim_index]; /* dim_indx is top dim the dist is applied onto */
 			int topdimsize = top->dims[dim_index];
-			/* partition the array region into subregion and save it to the map */
-			long remaint = n % topdimsize;
-			long esize = n / topdimsize;
-			//	printf("n: %d, seqid: %d, map_dist: topdimsize: %d, remaint: %d, esize: %d\n", n, seqid, topdimsize, remaint, esize);
 			long map_dim, map_offset;
-			if (topdimcoord < remaint) { /* each of the first remaint dev has one more element */
-				map_dim = esize + 1;
-				map_offset = (esize + 1) * topdimcoord;
-			} else {
-				map_dim = esize;
-				map_offset = esize * topdimcoord + remaint;
-			}
+			/* partition the array region into subregion and save it to the map */
+			if (info->policy == OMP_DIST_POLICY_AUTO) omp_dist_auto(top, dim_index, 0, n, topdimcoord, &map_offset, &map_dim);
+			else if (info->policy == OMP_DIST_POLICY_FIX) {
+				if (info->chunk_size <= 0) {
+					fprintf(stderr, "FIX dist needs a chunk_size > 0, see omp_dist_init_info_chunk\n");
+					exit(1);
+				}
+				omp_dist_fix(0, n, info->chunk_size, topdimcoord, topdimsize, &map_offset, &map_dim);
+			} else omp_dist_block(0, n, topdimcoord, topdimsize, &map_offset, &map_dim);
 			if (target_type == OMP_DIST_TARGET_DATA_MAP) {
 				omp_data_map_t * map = (omp_data_map_t *) target;
 				omp_data_map_info_t * map_info = map->info;
@@ -752,6 +1314,16 @@ void omp_dist(omp_dist_info_t * dist_infos, omp_dist_t * dist, int num_dims, omp
 
 			dist[i].offset = info->start + map_offset;
 			dist[i].length = map_dim;
+		} else if (info->policy == OMP_DIST_POLICY_CYCLIC) { /* (block-)cyclic, multiple chunks per device and no halo */
+			long chunk_size = info->chunk_size > 0 ? info->chunk_size : 1;
+			long map_offset;
+			if (target_type == OMP_DIST_TARGET_DATA_MAP && omp_data_map_has_halo(((omp_data_map_t *) target)->info, i)) {
+				fprintf(stderr, "halo region is not supported for CYCLIC dist\n");
+				exit(1);
+			}
+			omp_dist_cyclic(0, n, chunk_size, coords[dim_index], top->dims[dim_index], &map_offset, &dist[i].length, &dist[i].chunk_stride);
+			dist[i].offset = info->start + map_offset;
+			dist[i].chunk_size = chunk_size;
 		} else if (info->policy == OMP_DIST_POLICY_DUPLICATE) { /* full rang dist_info */
 			dist[i].length = n;
 			dist[i].offset = info->start;
@@ -799,8 +1371,8 @@ void omp_dist(omp_dist_info_t * dist_infos, omp_dist_t * dist, int num_dims, omp
 			}
 			dist[i].length = alignee_dist->length;
 			dist[i].offset = alignee_dist->offset;
-		} else if (info->policy == OMP_DIST_POLICY_AUTO) {
-			/* TODO the AUTO polic */
+			dist[i].chunk_size = alignee_dist->chunk_size;
+			dist[i].chunk_stride = alignee_dist->chunk_stride;
 		} else {
 			fprintf(stderr, "other dist_info type %d is not yet supported\n",
 					info->policy);
@@ -833,78 +1405,321 @@ void omp_data_map_dist(omp_data_map_t *map, int seqid) {
 	 */
 }
 
-void omp_map_unmarshal(omp_data_map_t * map) {
-	if (!map->mem_noncontiguous) return;
+/**
+ * The marshal engine: the region of a map is viewed as a set of lines, a line is the longest run of elements that is
+ * contiguous in both the original array and the marshal buffer, i.e. the innermost dimension of the region plus all the
+ * outer dimensions that are fully covered. Lines are copied with wide stores, and with non-temporal stores when the region
+ * is larger than the cache, and a large region is split across the threads of the marshal pool.
+ */
+#define OMP_MARSHAL_PARALLEL_MIN (1024*1024) /* bytes, smaller regions are marshalled by the calling thread only */
+#define OMP_MARSHAL_NT_MIN (8*1024*1024) /* bytes, larger regions are copied with non-temporal stores */
+#define OMP_MARSHAL_CHUNK (256*1024) /* bytes, the unit of work handed out to the marshal threads */
+
+typedef struct omp_map_copy_job {
+	omp_data_map_t * map;
+	int to_buffer; /* 1 for marshal, 0 for unmarshal */
+	int nontemporal;
+	int line_dim; /* the outermost dimension of a line */
+	long line_size; /* in bytes */
+	long num_lines;
+	long chunk; /* in lines */
+	volatile long next; /* the next line to be copied */
+	volatile long done; /* number of lines copied */
+} omp_map_copy_job_t;
+
+typedef struct omp_marshal_pool {
+	pthread_mutex_t lock; /* one job at a time, the caller that fails to get it does the job by itself */
+	pthread_mutex_t job_mutex;
+	pthread_cond_t job_cond;
+	omp_map_copy_job_t * volatile job;
+	volatile int job_id;
+	volatile int num_working;
+	volatile int complete;
+	pthread_t * workers;
+} omp_marshal_pool_t;
+
+int omp_marshal_num_threads = 0;
+static omp_marshal_pool_t omp_marshal_pool;
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* copy a line using non-temporal stores, falls back to memcpy for short lines or when there is no SSE2 */
+static void omp_map_copy_line_nt(char * dst, const char * src, long size) {
+#if defined(__SSE2__)
+	if (size >= 256) {
+		long head = (16 - ((unsigned long)dst & 15)) & 15;
+		memcpy(dst, src, head);
+		dst += head; src += head; size -= head;
+		long i;
+		for (i=0; i+64<=size; i+=64) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(src+i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(src+i+16));
+			__m128i c = _mm_loadu_si128((const __m128i *)(src+i+32));
+			__m128i d = _mm_loadu_si128((const __m128i *)(src+i+48));
+			_mm_stream_si128((__m128i *)(dst+i), a);
+			_mm_stream_si128((__m128i *)(dst+i+16), b);
+			_mm_stream_si128((__m128i *)(dst+i+32), c);
+			_mm_stream_si128((__m128i *)(dst+i+48), d);
+		}
+		dst += i; src += i; size -= i;
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+/* copy lines [first, last) of the job */
+static void omp_map_copy_lines(omp_map_copy_job_t * job, long first, long last) {
+	omp_data_map_t * map = job->map;
 	omp_data_map_info_t * info = map->info;
 	int sizeof_element = info->sizeof_element;
+	int line_dim = job->line_dim;
+	long idx[OMP_NUM_ARRAY_DIMENSIONS];
+	long stride[OMP_NUM_ARRAY_DIMENSIONS];
 	int i;
-	switch (info->num_dims) {
-	case 1: {
-		fprintf(stderr, "data unmarshall can only do 2-d or 3-d array, currently is 1-d\n");
-		break;
-	}
-	case 2: {
-		long region_line_size = map->map_dist[1].length*sizeof_element;
-		long full_line_size = info->dims[1]*sizeof_element;
-		long region_off = 0;
-		long full_off = 0;
-		char * src_ptr = &info->source_ptr[sizeof_element*info->dims[1]*map->map_dist[0].offset + sizeof_element*map->map_dist[1].offset];
-		for (i=0; i<map->map_dist[0].length; i++) {
-			memcpy((void*)&src_ptr[full_off], (void*)&map->map_buffer[region_off], region_line_size);
-			region_off += region_line_size;
-			full_off += full_line_size;
+
+	/* stride of the dimensions in the original array, in elements */
+	long mt = 1;
+	for (i=info->num_dims-1; i>=0; i--) {
+		stride[i] = mt;
+		mt *= info->dims[i];
+	}
+	/* the region index of the first line and its element offset in the original array */
+	long rest = first;
+	long full_off = map->map_dist[line_dim].offset * stride[line_dim];
+	for (i=line_dim-1; i>=0; i--) {
+		idx[i] = rest % map->map_dist[i].length;
+		rest /= map->map_dist[i].length;
+		full_off += (map->map_dist[i].offset + idx[i]) * stride[i];
+	}
+
+	char * full_ptr = &info->source_ptr[full_off * sizeof_element];
+	char * region_ptr = &map->map_buffer[first * job->line_size];
+	long l;
+	for (l=first; l<last; l++) {
+		if (job->to_buffer) {
+			if (job->nontemporal) omp_map_copy_line_nt(region_ptr, full_ptr, job->line_size);
+			else memcpy(region_ptr, full_ptr, job->line_size);
+		} else {
+			if (job->nontemporal) omp_map_copy_line_nt(full_ptr, region_ptr, job->line_size);
+			else memcpy(full_ptr, region_ptr, job->line_size);
+		}
+		region_ptr += job->line_size;
+		/* advance the region index, the innermost outer dimension first */
+		for (i=line_dim-1; i>=0; i--) {
+			full_ptr += stride[i] * sizeof_element;
+			if (++idx[i] < map->map_dist[i].length) break;
+			full_ptr -= map->map_dist[i].length * stride[i] * sizeof_element;
+			idx[i] = 0;
+		}
+	}
+#if defined(__SSE2__)
+	if (job->nontemporal) _mm_sfence();
+#endif
+}
+
+/* take chunks of lines of the job until there is none left */
+static void omp_map_copy_job_run(omp_map_copy_job_t * job) {
+	while (1) {
+		long first = __sync_fetch_and_add(&job->next, job->chunk);
+		if (first >= job->num_lines) break;
+		long last = first + job->chunk;
+		if (last > job->num_lines) last = job->num_lines;
+		omp_map_copy_lines(job, first, last);
+		__sync_fetch_and_add(&job->done, last - first);
+	}
+}
+
+static void * omp_marshal_worker_main(void * arg) {
+	omp_marshal_pool_t * pool = &omp_marshal_pool;
+	int job_id = 0;
+	while (1) {
+		pthread_mutex_lock(&pool->job_mutex);
+		while (!pool->complete && pool->job_id == job_id) pthread_cond_wait(&pool->job_cond, &pool->job_mutex);
+		if (pool->complete) {
+			pthread_mutex_unlock(&pool->job_mutex);
+			break;
+		}
+		job_id = pool->job_id;
+		omp_map_copy_job_t * job = pool->job;
+		if (job == NULL) { /* woke up after the job is done */
+			pthread_mutex_unlock(&pool->job_mutex);
+			continue;
 		}
-		break;
+		pool->num_working++;
+		pthread_mutex_unlock(&pool->job_mutex);
+
+		omp_map_copy_job_run(job);
+		__sync_fetch_and_sub(&pool->num_working, 1);
 	}
-	case 3: {
-		break;
+	return NULL;
+}
+
+/**
+ * start the marshal threads, OMP_MARSHAL_THREADS sets the number of threads in addition to the thread that marshals,
+ * the default is the number of cores not used by the host thread and the helper threads, up to 8
+ */
+void omp_marshal_pool_init(int num_devices) {
+	char * num_threads_str = getenv("OMP_MARSHAL_THREADS");
+	if (num_threads_str != NULL) sscanf(num_threads_str, "%d", &omp_marshal_num_threads);
+	else {
+		omp_marshal_num_threads = sysconf(_SC_NPROCESSORS_ONLN) - num_devices - 1;
+		if (omp_marshal_num_threads > 8) omp_marshal_num_threads = 8;
 	}
-	default: {
-		fprintf(stderr, "data unmarshall can only do 2-d or 3-d array\n");
-		break;
+	if (omp_marshal_num_threads < 0) omp_marshal_num_threads = 0;
+
+	omp_marshal_pool_t * pool = &omp_marshal_pool;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->job_mutex, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pool->job = NULL;
+	pool->job_id = 0;
+	pool->num_working = 0;
+	pool->complete = 0;
+	pool->workers = NULL;
+	if (omp_marshal_num_threads == 0) return;
+	pool->workers = (pthread_t *) malloc(sizeof(pthread_t) * omp_marshal_num_threads);
+	int i;
+	for (i=0; i<omp_marshal_num_threads; i++) {
+		int rt = pthread_create(&pool->workers[i], NULL, omp_marshal_worker_main, NULL);
+		if (rt) {fprintf(stderr, "cannot create marshal threads.\n"); exit(1); }
 	}
+}
+
+void omp_marshal_pool_fini() {
+	omp_marshal_pool_t * pool = &omp_marshal_pool;
+	pthread_mutex_lock(&pool->job_mutex);
+	pool->complete = 1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->job_mutex);
+	int i;
+	for (i=0; i<omp_marshal_num_threads; i++) pthread_join(pool->workers[i], NULL);
+	free(pool->workers);
+	pool->workers = NULL;
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->job_mutex);
+	pthread_cond_destroy(&pool->job_cond);
+}
+
+/* the lines of the region of a map, return the outermost dimension of a line, see omp_map_copy_job_t */
+static int omp_map_region_lines(omp_data_map_t * map, long * line_size, long * num_lines) {
+	omp_data_map_info_t * info = map->info;
+	int i = info->num_dims - 1;
+	int line_dim;
+	long line_length = map->map_dist[i].length;
+	while (i > 0 && map->map_dist[i].length == info->dims[i]) {
+		i--;
+		line_length *= map->map_dist[i].length;
 	}
-//	printf("total %ld bytes of data unmarshalled\n", region_off);
+	line_dim = i;
+	*line_size = line_length * info->sizeof_element;
+	*num_lines = 1;
+	for (i=0; i<line_dim; i++) *num_lines *= map->map_dist[i].length;
+	return line_dim;
 }
 
 /**
- *  so far works for at most 2D
+ * the region of a map as a strided copy of depth x height lines of width bytes, spitch is the distance between two lines
+ * in the original array and sheight is the number of lines between two slices of the array, both as in cudaMemcpy3D.
+ * Return the number of dimensions of the copy, or 0 if the region has more than 3 dimensions after collapsing the
+ * contiguous ones, which has to be marshalled.
  */
-void omp_map_marshal(omp_data_map_t * map) {
+int omp_map_region_pitch(omp_data_map_t * map, long * width, long * height, long * depth, long * spitch, long * sheight) {
 	omp_data_map_info_t * info = map->info;
-	int sizeof_element = info->sizeof_element;
+	long num_lines;
+	int line_dim = omp_map_region_lines(map, width, &num_lines);
+	if (line_dim > 2) return 0;
+	long stride = info->sizeof_element; /* the stride of line_dim-1 dimension in bytes */
 	int i;
-	map->map_buffer = (void*) malloc(map->map_size);
-	switch (info->num_dims) {
-	case 1: {
-		fprintf(stderr,
-				"data marshall can only do 2-d or 3-d array, currently is 1-d\n");
-		break;
-	}
-	case 2: {
-		long region_line_size = map->map_dist[1].length * sizeof_element;
-		long full_line_size = info->dims[1] * sizeof_element;
-		long region_off = 0;
-		long full_off = 0;
-		char * src_ptr = &info->source_ptr[sizeof_element * info->dims[1] * map->map_dist[0].offset
-				+ sizeof_element * map->map_dist[1].offset];
-		for (i = 0; i < map->map_dist[0].length; i++) {
-			memcpy((void*)&map->map_buffer[region_off], (void*)&src_ptr[full_off], region_line_size);
-			region_off += region_line_size;
-			full_off += full_line_size;
-		}
-		break;
+	for (i=info->num_dims-1; i>=line_dim; i--) stride *= info->dims[i];
+	*spitch = line_dim > 0 ? stride : *width;
+	*height = line_dim > 0 ? map->map_dist[line_dim-1].length : 1;
+	*depth = line_dim > 1 ? map->map_dist[0].length : 1;
+	*sheight = line_dim > 1 ? info->dims[1] : *height;
+	return line_dim + 1;
+}
+
+/* marshal (to_buffer == 1) or unmarshal the region of a map of any number of dimensions */
+static void omp_map_copy_box(omp_data_map_t * map, int to_buffer) {
+	omp_map_copy_job_t job;
+	job.map = map;
+	job.to_buffer = to_buffer;
+	job.line_dim = omp_map_region_lines(map, &job.line_size, &job.num_lines);
+	long region_size = job.num_lines * job.line_size;
+	if (job.line_size == 0 || job.num_lines == 0) return;
+	job.nontemporal = region_size >= OMP_MARSHAL_NT_MIN;
+	job.chunk = OMP_MARSHAL_CHUNK / job.line_size;
+	if (job.chunk == 0) job.chunk = 1;
+	job.next = 0;
+	job.done = 0;
+
+	omp_marshal_pool_t * pool = &omp_marshal_pool;
+	if (omp_marshal_num_threads == 0 || region_size < OMP_MARSHAL_PARALLEL_MIN || job.num_lines == 1
+			|| pthread_mutex_trylock(&pool->lock) != 0) {
+		omp_map_copy_lines(&job, 0, job.num_lines);
+		return;
 	}
-	case 3: {
-		break;
+	pthread_mutex_lock(&pool->job_mutex);
+	pool->job = &job;
+	pool->job_id++;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->job_mutex);
+
+	omp_map_copy_job_run(&job);
+	while (job.done < job.num_lines) sched_yield();
+	/* the job is on our stack, wait for the threads that have joined it to leave */
+	pthread_mutex_lock(&pool->job_mutex);
+	pool->job = NULL;
+	pthread_mutex_unlock(&pool->job_mutex);
+	while (pool->num_working > 0) sched_yield();
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* the dim of a map that has more than one chunk, -1 if the region of the map is a single box */
+static int omp_map_cyclic_dim(omp_data_map_t * map) {
+	int i;
+	for (i=0; i<map->info->num_dims; i++) {
+		if (omp_dist_num_chunks(&map->map_dist[i]) > 1) return i;
 	}
-	default: {
-		fprintf(stderr, "data marshall can only do 2-d or 3-d array\n");
-		break;
+	return -1;
+}
+
+/* the region of a map with a cyclic dim is copied a chunk box at a time, the boxes are packed one after another in the buffer */
+static void omp_map_copy_region(omp_data_map_t * map, int to_buffer) {
+	int cdim = omp_map_cyclic_dim(map);
+	if (cdim < 0) {
+		omp_map_copy_box(map, to_buffer);
+		return;
 	}
+	omp_data_map_info_t * info = map->info;
+	long box_elements = 1; /* elements of a chunk box per element of the cyclic dim */
+	int i;
+	for (i=0; i<info->num_dims; i++) if (i != cdim) box_elements *= map->map_dist[i].length;
+
+	omp_data_map_t chunk_map = *map;
+	long start, local_start, length;
+	int k;
+	for (k=0; (start = omp_dist_chunk(&map->map_dist[cdim], k, &local_start, &length)) >= 0; k++) {
+		chunk_map.map_dist[cdim].offset = start;
+		chunk_map.map_dist[cdim].length = length;
+		chunk_map.map_dist[cdim].chunk_size = 0;
+		chunk_map.map_buffer = &map->map_buffer[local_start * box_elements * info->sizeof_element];
+		omp_map_copy_box(&chunk_map, to_buffer);
 	}
+}
+
+void omp_map_unmarshal(omp_data_map_t * map) {
+	if (!map->mem_noncontiguous) return;
+	omp_map_copy_region(map, 0);
+}
 
-//	printf("total %ld bytes of data marshalled\n", region_off);
+/**
+ * marshal the region of the map into a staging buffer, for any number of dimensions
+ */
+void omp_map_marshal(omp_data_map_t * map) {
+	map->map_buffer = (char *) omp_map_malloc_staging(map->dev, map->map_size);
+	omp_map_copy_region(map, 1);
 }
 
 /**
@@ -953,6 +1768,37 @@ long omp_map_element_offset(omp_data_map_t * map) {
 	return off;
 }
 
+/**
+ * set the in/out pointers of the halo regions of dim in the dev mem of a map, which is a dense box of the map_dist lengths
+ * including the halo. The halo region of dim is the halo width in dim and the full lengths, with the halo, of the other
+ * dims, so exchanging the dims one after another also fills the corners. It is blocks blocks (the product of the lengths
+ * of the lower dims) of width * (the product of the lengths of the higher dims) elements, pitch bytes apart
+ */
+static void omp_map_halo_region_ptrs(omp_data_map_t * map, int dim) {
+	omp_data_map_info_t * info = map->info;
+	omp_data_map_halo_region_info_t * halo_info = &info->halo_info[dim];
+	omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[dim];
+	long inner = info->sizeof_element; /* the bytes of one element of dim */
+	long blocks = 1;
+	int i;
+	for (i=0; i<dim; i++) blocks *= map->map_dist[i].length;
+	for (i=dim+1; i<info->num_dims; i++) inner *= map->map_dist[i].length;
+	halo_mem->blocks = blocks;
+	halo_mem->pitch = map->map_dist[dim].length * inner;
+	if (halo_mem->left_dev_seqid >= 0) {
+		halo_mem->left_in_size = halo_info->left * inner * blocks;
+		halo_mem->left_in_ptr = map->map_dev_ptr;
+		halo_mem->left_out_size = halo_info->right * inner * blocks;
+		halo_mem->left_out_ptr = &((char *) map->map_dev_ptr)[halo_info->left * inner];
+	}
+	if (halo_mem->right_dev_seqid >= 0) {
+		halo_mem->right_in_size = halo_info->right * inner * blocks;
+		halo_mem->right_in_ptr = &((char *) map->map_dev_ptr)[halo_mem->pitch - halo_info->right * inner];
+		halo_mem->right_out_size = halo_info->left * inner * blocks;
+		halo_mem->right_out_ptr = &((char *) halo_mem->right_in_ptr)[0 - halo_info->left * inner];
+	}
+}
+
 /**
  * this function creates host buffer, if needed, and marshall data to the host buffer,
  *
@@ -977,18 +1823,54 @@ void omp_map_buffer(omp_data_map_t * map, omp_offloading_t * off) {
 		map_size *= map->map_dist[i].length;
 
 	}
+	/* the chunks of a cyclic dim are apart in the original array, only one dim may have more than one chunk */
+	int num_cyclic_dims = 0;
+	for (i=0; i<info->num_dims; i++) {
+		if (omp_dist_num_chunks(&map->map_dist[i]) > 1) num_cyclic_dims++;
+	}
+	if (num_cyclic_dims > 1) {
+		fprintf(stderr, "map %s has more than one dimension with multiple CYCLIC chunks, which is not supported\n", info->symbol);
+		abort();
+	}
+	if (num_cyclic_dims) map->mem_noncontiguous = 1;
 	map->map_size = map_size;
 	map->map_buffer = &info->source_ptr[sizeof_element * omp_map_element_offset(map)];
 
+	/* the cyclic halo of a device at the end of a dim wraps around the array, so the map covers elements out of the array.
+	 * It gets its own dev mem (see below) and is only filled by the exchange, it cannot be copied to or from the array
+	 */
+	int halo_outside = 0;
+	for (i=0; i<info->num_dims; i++) {
+		if (map->map_dist[i].offset < 0 || map->map_dist[i].offset + map->map_dist[i].length > info->dims[i]) halo_outside = 1;
+	}
+	if (halo_outside) {
+		if (info->map_direction != OMP_DATA_MAP_ALLOC) {
+			fprintf(stderr, "map %s has a cyclic halo region out of the array, which is only supported for ALLOC maps\n", info->symbol);
+			abort();
+		}
+		map->map_type = OMP_DATA_MAP_COPY;
+		map->mem_noncontiguous = 0;
+	}
+
 	/* so far, for noncontiguous mem space, we will do copy */
 	if (map->map_type == OMP_DATA_MAP_SHARED) {
 		if (map->mem_noncontiguous) {
 			map->map_type = OMP_DATA_MAP_COPY;
 		}
 	}
+	/* the device computes the ghost band of a deep halo itself, it cannot be the part of the neighbor */
+	if (map->map_type == OMP_DATA_MAP_SHARED && info->halo_depth > 1) map->map_type = OMP_DATA_MAP_COPY;
 
+	long width, height, depth, spitch, sheight;
 	if (map->map_type == OMP_DATA_MAP_COPY) {
-		if (map->mem_noncontiguous) {
+		/* the region is copied between the array and the dev mem by strided memcpy, see omp_map_mapto, no marshalling */
+		if (map->mem_noncontiguous && omp_map_strided_copy_enabled && !num_cyclic_dims &&
+				omp_map_region_pitch(map, &width, &height, &depth, &spitch, &sheight) > 0) map->strided_copy = 1;
+		if (info->resident && info->halo_info == NULL && (!map->mem_noncontiguous || map->strided_copy)) {
+			map->map_dev_ptr = omp_map_resident_acquire(map);
+		} else if (map->strided_copy) {
+			map->map_dev_ptr = omp_map_malloc_dev(map->dev, map->map_size);
+		} else if (map->mem_noncontiguous) {
 			omp_map_marshal(map);
 			if (omp_device_mem_discrete(map->dev->mem_type)) {
 				map->map_dev_ptr = omp_map_malloc_dev(map->dev, map->map_size);
@@ -1002,17 +1884,11 @@ void omp_map_buffer(omp_data_map_t * map, omp_offloading_t * off) {
 
 	if (info->halo_info == NULL) return;
 
-	/** memory management for halo region */
-
-	/** TODO:  this is only for 2-d array
-	 * For 3-D array, it becomes more complicated
-	 * For 1-D array, we will not need allocate buffer for the halo region. but we still need to update the left/right in/out ptr to the
-	 * correct location.
-	 *
-	 * There may be a uniformed way of dealing with this (for at least 1/2/3-d array
+	/** memory management for halo region
 	 *
 	 * The halo memory management is use a attached approach, i.e. the halo region is part of the main computation subregion, and those
-	 * left/right in/out are buffers for gathering and scattering halo region elements to its correct location.
+	 * left/right in/out pointers point to where the halo regions are in the dev mem of the map, see omp_map_halo_region_ptrs.
+	 * The regions of dims other than 0 are noncontiguous and are copied by strided memcpy, see omp_halo_region_pull.
 	 *
 	 * We may use a detached approach, i.e. just use the halo buffer for computation, however, that will involve more complicated
 	 * array index calculation.
@@ -1022,32 +1898,26 @@ void omp_map_buffer(omp_data_map_t * map, omp_offloading_t * off) {
 	/************************* Barrier will be needed among all participating devs since we are now using neighborhood devs **********************************/
 	/*********************************************************************************************************************************************************/
 
-	/** FIXME: so far, we only have 2-d row distribution working, i.e. no need to allocate halo region buffer */
 //        BEGIN_SERIALIZED_PRINTF(off->devseqid);
 	for (i=0; i<info->num_dims; i++) {
 		omp_data_map_halo_region_info_t * halo_info = &info->halo_info[i];
 		if (halo_info->left != 0 || halo_info->right != 0) { /* there is halo region in this dimension */
 			omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[i];
+			omp_map_halo_region_ptrs(map, i);
 			if (halo_mem->left_dev_seqid >= 0) {
-				if (i==0 && !map->mem_noncontiguous && info->num_dims == 2) { /* this is only for row-dist, 2-d array, i.e. no marshalling */
-					halo_mem->left_in_size = halo_info->left*map->map_dist[1].length*sizeof_element;
-					halo_mem->left_in_ptr = map->map_dev_ptr;
-					halo_mem->left_out_size = halo_info->right*map->map_dist[1].length*sizeof_element;
-					halo_mem->left_out_ptr = &((char*)map->map_dev_ptr)[halo_mem->left_in_size];
 #if CORRECTNESS_CHECK
-
-					printf("dev: %d, halo left in size: %d, left in ptr: %X, left out size: %d, left out ptr: %X\n", off->devseqid,
-							halo_mem->left_in_size,halo_mem->left_in_ptr,halo_mem->left_out_size,halo_mem->left_out_ptr);
+				printf("dev: %d, halo left in size: %d, left in ptr: %X, left out size: %d, left out ptr: %X\n", off->devseqid,
+						halo_mem->left_in_size,halo_mem->left_in_ptr,halo_mem->left_out_size,halo_mem->left_out_ptr);
 #endif
-				} else {
-					fprintf(stderr, "current dist/map setting does not support halo region\n");
-				}
-
 				omp_device_t * leftdev = off->off_info->targets[halo_mem->left_dev_seqid];
+				int s;
+				/* the neighbor may relay what it pulls from this map even if this map does not relay, so the push events are always there */
+				for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_init(&halo_mem->left_out_relay_push_events[s], map->dev, OMP_EVENT_DEV_RECORD);
 				if (!omp_map_enable_memcpy_DeviceToDevice(leftdev, map->dev)) { /* no peer2peer access available, use host relay */
-					halo_mem->left_in_host_relay_ptr = (char*)malloc(halo_mem->left_in_size); /** FIXME, mem leak here and we have not thought where to free */
+					halo_mem->left_in_host_relay_ptr = (char*)omp_map_malloc_staging(map->dev, OMP_HALO_RELAY_SLOTS * halo_mem->left_in_size); /* released by omp_map_release_buffers */
 					halo_mem->left_in_data_in_relay_pushed = 0;
 					halo_mem->left_in_data_in_relay_pulled = 0;
+					for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_init(&halo_mem->left_in_relay_pull_events[s], map->dev, OMP_EVENT_DEV_RECORD);
 
 					//printf("dev: %d, map: %X, left: %d, left host relay buffer allocated\n", off->devseqid, map, halo_mem->left_dev_seqid);
 				} else {
@@ -1056,23 +1926,19 @@ void omp_map_buffer(omp_data_map_t * map, omp_offloading_t * off) {
 				}
 			}
 			if (halo_mem->right_dev_seqid >= 0) {
-				if (i==0 && !map->mem_noncontiguous && info->num_dims == 2) { /* this is only for row-dist, 2-d array, i.e. no marshalling */
-					halo_mem->right_in_size = halo_info->right*map->map_dist[1].length*sizeof_element;
-					halo_mem->right_in_ptr = &((char *)map->map_dev_ptr)[map->map_size - halo_mem->right_in_size];
-					halo_mem->right_out_size = halo_info->left*map->map_dist[1].length*sizeof_element;
-					halo_mem->right_out_ptr = &((char *)halo_mem->right_in_ptr)[0 - halo_mem->right_out_size];
 #if CORRECTNESS_CHECK
-					printf("dev: %d, halo right in size: %d, right in ptr: %X, right out size: %d, right out ptr: %X\n", off->devseqid,
-												halo_mem->right_in_size,halo_mem->right_in_ptr,halo_mem->right_out_size,halo_mem->right_out_ptr);
+				printf("dev: %d, halo right in size: %d, right in ptr: %X, right out size: %d, right out ptr: %X\n", off->devseqid,
+						halo_mem->right_in_size,halo_mem->right_in_ptr,halo_mem->right_out_size,halo_mem->right_out_ptr);
 #endif
-				} else {
-					fprintf(stderr, "current dist/map setting does not support halo region\n");
-				}
 				omp_device_t * rightdev = off->off_info->targets[halo_mem->right_dev_seqid];
+				int s;
+				/* the neighbor may relay what it pulls from this map even if this map does not relay, so the push events are always there */
+				for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_init(&halo_mem->right_out_relay_push_events[s], map->dev, OMP_EVENT_DEV_RECORD);
 				if (!omp_map_enable_memcpy_DeviceToDevice(rightdev, map->dev)) { /* no peer2peer access available, use host relay */
-					halo_mem->right_in_host_relay_ptr = (char*)malloc(halo_mem->right_in_size); /** FIXME, mem leak here and we have not thought where to free */
+					halo_mem->right_in_host_relay_ptr = (char*)omp_map_malloc_staging(map->dev, OMP_HALO_RELAY_SLOTS * halo_mem->right_in_size); /* released by omp_map_release_buffers */
 					halo_mem->right_in_data_in_relay_pushed = 0;
 					halo_mem->right_in_data_in_relay_pulled = 0;
+					for (s=0; s<OMP_HALO_RELAY_SLOTS; s++) omp_event_init(&halo_mem->right_in_relay_pull_events[s], map->dev, OMP_EVENT_DEV_RECORD);
 
 					//printf("dev: %d, map: %X, right: %d, right host relay buffer allocated\n", off->devseqid, map, halo_mem->right_dev_seqid);
 				} else {
@@ -1142,104 +2008,630 @@ printf("allocating dim %d halo:%d * %d\n",1, (map->map_dim[0]+(&halo_info[1])->r
 #endif
 }
 
-void omp_print_data_map(omp_data_map_t * map) {
-	omp_data_map_info_t * info = map->info;
-	printf("devid: %d, MAP: %X, source ptr: %X, dim[0]: %ld, dim[1]: %ld, dim[2]: %ld, map_dim[0]: %ld, map_dim[1]: %ld, map_dim[2]: %ld, "
-				"map_offset[0]: %ld, map_offset[1]: %ld, map_offset[2]: %ld, sizeof_element: %d, map_buffer: %X, marshall_or_not: %d,"
-				"map_dev_ptr: %X, map_size: %ld\n\n", map->dev->id, map, info->source_ptr, info->dims[0], info->dims[1], info->dims[2],
-				map->map_dist[0].length, map->map_dist[1].length, map->map_dist[2].length, map->map_dist[0].offset, map->map_dist[1].offset, map->map_dist[2].offset,
-				info->sizeof_element, map->map_buffer, map->mem_noncontiguous, map->map_dev_ptr, map->map_size);
-}
+/**
+ * adaptive rebalancing of a recurring offloading: every rebalance_interval runs the average kernel time of each device since
+ * the last check is compared, and if (max-avg)/avg exceeds rebalance_threshold, the dim-0 partition of the maps used by the
+ * offloading is moved so each device gets rows in proportion to its measured throughput (rows per ms). The new throughput
+ * is kept in dist_weight, so the boundaries are those of omp_dist_auto.
+ */
+#define OMP_REBALANCE_DEFAULT_THRESHOLD 0.1
 
-void omp_print_off_maps(omp_offloading_t * off) {
+/* a map can be rebalanced if it is contiguous and only distributed in dim 0, by BLOCK or AUTO, with non-cyclic halo in dim 0 only */
+static int omp_map_rebalanceable(omp_data_map_info_t * info, omp_grid_topology_t * top) {
 	int i;
-	printf("off %X maps: ", off);
-	for (i=0; i<off->num_maps; i++) printf("%X, ", off->map_cache[i]);
-	printf("\n");
+	if (info->top != top || info->resident) return 0;
+	if (info->dist[0].policy != OMP_DIST_POLICY_BLOCK && info->dist[0].policy != OMP_DIST_POLICY_AUTO) return 0;
+	for (i=1; i<info->num_dims; i++) {
+		if (info->dist[i].policy != OMP_DIST_POLICY_DUPLICATE) return 0;
+		if (info->halo_info != NULL && (info->halo_info[i].left != 0 || info->halo_info[i].right != 0)) return 0;
+	}
+	if (info->halo_info != NULL && info->halo_info[0].cyclic) return 0;
+	for (i=0; i<top->nnodes; i++) {
+		omp_data_map_t * map = &info->maps[i];
+		if (map->mem_noncontiguous) return 0;
+		if (map->map_type != OMP_DATA_MAP_SHARED && map->map_type != OMP_DATA_MAP_COPY) return 0;
+	}
+	return 1;
+}
+
+static int omp_map_has_halo_dim0(omp_data_map_info_t * info) {
+	return info->halo_info != NULL && (info->halo_info[0].left != 0 || info->halo_info[0].right != 0);
+}
+
+/* the dim-0 range of a map without its halo rows */
+static void omp_map_rebalance_interior(omp_data_map_t * map, long * offset, long * length) {
+	omp_data_map_info_t * info = map->info;
+	*offset = map->map_dist[0].offset;
+	*length = map->map_dist[0].length;
+	if (!omp_map_has_halo_dim0(info)) return;
+	if (map->halo_mem[0].left_dev_seqid >= 0) {
+		*offset += info->halo_info[0].left;
+		*length -= info->halo_info[0].left;
+	}
+	if (map->halo_mem[0].right_dev_seqid >= 0) *length -= info->halo_info[0].right;
+}
+
+/* copy between the dev mem of two devices, through a host relay if they cannot copy to each other directly */
+static void omp_map_rebalance_copy(void * dst, omp_device_t * dstdev, void * src, omp_device_t * srcdev, long size) {
+	if (dstdev == srcdev || (dstdev->type == srcdev->type && omp_map_enable_memcpy_DeviceToDevice(dstdev, srcdev))) {
+		omp_set_current_device_dev(srcdev);
+		omp_map_memcpy_DeviceToDevice(dst, dstdev, src, srcdev, size);
+	} else {
+		void * relay = omp_map_malloc_staging(srcdev, size);
+		omp_set_current_device_dev(srcdev);
+		omp_map_memcpy_from(relay, src, srcdev, size);
+		omp_set_current_device_dev(dstdev);
+		omp_map_memcpy_to(dst, dstdev, relay, size);
+		omp_map_free_staging(srcdev, relay);
+	}
+}
+
+/**
+ * move the maps of info onto the new interior dim-0 ranges. The dev mem of a COPY map is reallocated and filled from the
+ * devices that own the rows in the old partition, so the rows that stay are copied within a device and only the rows that
+ * change the owner cross devices. Halo rows are taken from their owner as well, thus the halo stays valid, and the halo
+ * in/out pointers are moved with the dev mem (the sizes do not change). A SHARED map only needs its range updated.
+ */
+static void omp_map_rebalance(omp_data_map_info_t * info, long * old_offset, long * old_length, long * new_offset, long * new_length) {
+	int nnodes = info->top->nnodes;
+	long row_size = info->sizeof_element;
+	char * old_ptr[nnodes];
+	long old_map_offset[nnodes];
+	int has_halo = omp_map_has_halo_dim0(info);
+	int i, j;
+	for (i=1; i<info->num_dims; i++) row_size *= info->dims[i];
+	for (i=0; i<nnodes; i++) {
+		old_ptr[i] = (char *) info->maps[i].map_dev_ptr;
+		old_map_offset[i] = info->maps[i].map_dist[0].offset;
+	}
+
+	for (i=0; i<nnodes; i++) {
+		omp_data_map_t * map = &info->maps[i];
+		omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[0];
+		long offset = new_offset[i];
+		long length = new_length[i];
+		if (has_halo) {
+			if (halo_mem->left_dev_seqid >= 0) {
+				offset -= info->halo_info[0].left;
+				length += info->halo_info[0].left;
+			}
+			if (halo_mem->right_dev_seqid >= 0) length += info->halo_info[0].right;
+		}
+		map->map_dist[0].offset = offset;
+		map->map_dist[0].length = length;
+		map->map_size = length * row_size;
+		map->map_buffer = &info->source_ptr[info->sizeof_element * omp_map_element_offset(map)];
+		if (map->map_type == OMP_DATA_MAP_SHARED) {
+			map->map_dev_ptr = map->map_buffer;
+		} else {
+			omp_set_current_device_dev(map->dev);
+			map->map_dev_ptr = omp_map_malloc_dev(map->dev, map->map_size);
+			for (j=0; j<nnodes; j++) {
+				long begin = offset > old_offset[j] ? offset : old_offset[j];
+				long end = offset + length < old_offset[j] + old_length[j] ? offset + length : old_offset[j] + old_length[j];
+				if (begin >= end) continue;
+				omp_map_rebalance_copy(&((char *) map->map_dev_ptr)[(begin - offset) * row_size], map->dev,
+						&old_ptr[j][(begin - old_map_offset[j]) * row_size], info->maps[j].dev, (end - begin) * row_size);
+			}
+		}
+		if (has_halo) omp_map_halo_region_ptrs(map, 0);
+		map->halo_valid = 0; /* the halo is stale, the next run of its exchange updates it even if it is deep */
+	}
+
+	for (i=0; i<nnodes; i++) {
+		omp_data_map_t * map = &info->maps[i];
+		if (map->map_type != OMP_DATA_MAP_COPY) continue;
+		omp_set_current_device_dev(map->dev);
+		omp_map_free_dev(map->dev, old_ptr[i]);
+	}
+}
+
+/**
+ * repartition the maps in the map cache of the offloading onto the devices according to their measured kernel time,
+ * return the number of rows moved to another device, 0 if the partition does not change and -1 if the maps cannot be rebalanced
+ */
+static long omp_offloading_rebalance_maps(omp_offloading_info_t * off_info, double * kern_ms) {
+	omp_grid_topology_t * top = off_info->top;
+	int nnodes = top->nnodes;
+	omp_offloading_t * off0 = &off_info->offloadings[0];
+	omp_data_map_info_t * infos[off0->num_maps];
+	int num_infos = 0;
+	int i, j;
+
+	/* a distributed loop (see omp_loop_iteration_dist) would not be repartitioned with the maps */
+	if (top->ndims != 1 || off_info->loop_depth > 0) return -1;
+	for (i=0; i<off0->num_maps; i++) {
+		omp_data_map_info_t * info = off0->map_cache[i].map->info;
+		int duplicated = 1;
+		for (j=0; j<info->num_dims; j++) if (info->dist[j].policy != OMP_DIST_POLICY_DUPLICATE) duplicated = 0;
+		if (duplicated) continue;
+		if (!omp_map_rebalanceable(info, top)) return -1;
+		infos[num_infos++] = info;
+	}
+	if (num_infos == 0) return -1;
+
+	/* all the maps must have the same interior partition, which is the one the kernel iterates over */
+	long old_offset[nnodes], old_length[nnodes];
+	long new_offset[nnodes], new_length[nnodes];
+	long min_length = 1;
+	for (j=0; j<num_infos; j++) {
+		omp_data_map_info_t * info = infos[j];
+		if (info->dist[0].start != infos[0]->dist[0].start || info->dist[0].length != infos[0]->dist[0].length) return -1;
+		for (i=0; i<nnodes; i++) {
+			long offset, length;
+			omp_map_rebalance_interior(&info->maps[i], &offset, &length);
+			if (j == 0) {
+				old_offset[i] = offset;
+				old_length[i] = length;
+			} else if (offset != old_offset[i] || length != old_length[i]) return -1;
+		}
+		if (omp_map_has_halo_dim0(info)) {
+			if (info->halo_info[0].left > min_length) min_length = info->halo_info[0].left;
+			if (info->halo_info[0].right > min_length) min_length = info->halo_info[0].right;
+		}
+	}
+
+	/* the throughput of each device becomes its weight, scaled to the same sum as the old weights */
+	double old_weight[nnodes];
+	double throughput[nnodes];
+	double old_sum = 0.0;
+	double new_sum = 0.0;
+	for (i=0; i<nnodes; i++) {
+		omp_device_t * dev = off_info->offloadings[i].dev;
+		if (kern_ms[i] <= 0.0 || old_length[i] <= 0) return 0;
+		old_weight[i] = dev->dist_weight;
+		old_sum += old_weight[i] > 0.0 ? old_weight[i] : 1.0;
+		throughput[i] = old_length[i] / kern_ms[i];
+		new_sum += throughput[i];
+	}
+	for (i=0; i<nnodes; i++) off_info->offloadings[i].dev->dist_weight = throughput[i] * old_sum / new_sum;
+
+	int changed = 0;
+	int coords[top->ndims];
+	for (i=0; i<nnodes; i++) {
+		omp_topology_get_coords(top, i, top->ndims, coords);
+		omp_dist_auto(top, 0, infos[0]->dist[0].start, infos[0]->dist[0].length, coords[0], &new_offset[i], &new_length[i]);
+		if (new_length[i] < min_length) { /* a device would be left without room for the halo, keep the old partition */
+			for (j=0; j<nnodes; j++) off_info->offloadings[j].dev->dist_weight = old_weight[j];
+			return 0;
+		}
+		if (new_offset[i] != old_offset[i] || new_length[i] != old_length[i]) changed = 1;
+	}
+	if (!changed) return 0;
+
+	long rows_migrated = 0;
+	for (i=0; i<nnodes; i++) {
+		long begin = new_offset[i] > old_offset[i] ? new_offset[i] : old_offset[i];
+		long end = new_offset[i] + new_length[i] < old_offset[i] + old_length[i] ? new_offset[i] + new_length[i] : old_offset[i] + old_length[i];
+		rows_migrated += new_length[i] - (end > begin ? end - begin : 0);
+	}
+	for (j=0; j<num_infos; j++) omp_map_rebalance(infos[j], old_offset, old_length, new_offset, new_length);
+	return rows_migrated;
+}
+
+void omp_offloading_set_rebalance(omp_offloading_info_t * info, double threshold, int interval) {
+	if (interval <= 0) {
+		info->rebalance_interval = 0;
+		return;
+	}
+#if defined (OMP_BREAKDOWN_TIMING)
+	info->rebalance_threshold = threshold > 0.0 ? threshold : OMP_REBALANCE_DEFAULT_THRESHOLD;
+	info->rebalance_interval = interval;
+#else
+	fprintf(stderr, "offloading %s: rebalancing needs the kernel time measured with OMP_BREAKDOWN_TIMING, it is disabled\n", info->name);
+	info->rebalance_interval = 0;
+#endif
+}
+
+int omp_offloading_rebalance(omp_offloading_info_t * info) {
+#if defined (OMP_BREAKDOWN_TIMING)
+	int nnodes = info->top->nnodes;
+	double kern_ms[nnodes];
+	double max = 0.0;
+	double avg = 0.0;
+	int i;
+	if (info->rebalance_interval <= 0 || info->count <= 1 || info->pipeline_slices > 0 || info->dynamic || nnodes < 2) return 0;
+	int runs = info->count - 1;
+	if (runs - info->rebalance_runs < info->rebalance_interval) return 0;
+	info->rebalance_runs = runs;
+
+	/* the average kernel time of each device since the last check */
+	for (i=0; i<nnodes; i++) {
+		omp_offloading_t * off = &info->offloadings[i];
+		int count = 0;
+		double elapsed = omp_offloading_kernel_elapsed(off, &count);
+		if (elapsed < 0.0 || count <= off->rebalance_kern_count) return 0;
+		kern_ms[i] = (elapsed - off->rebalance_kern_mark) / (count - off->rebalance_kern_count);
+		off->rebalance_kern_mark = elapsed;
+		off->rebalance_kern_count = count;
+		off->rebalance_kern_ms = kern_ms[i];
+		if (kern_ms[i] > max) max = kern_ms[i];
+		avg += kern_ms[i];
+	}
+	avg /= nnodes;
+	if (avg <= 0.0) return 0;
+	double imbalance = (max - avg) / avg;
+	if (info->num_rebalances > 0) {
+		omp_rebalance_record_t * last = &info->rebalance_history[(info->num_rebalances - 1) % OMP_REBALANCE_HISTORY];
+		if (last->imbalance_after < 0.0) last->imbalance_after = imbalance;
+	}
+	if (imbalance <= info->rebalance_threshold) return 0;
+
+	long rows_migrated = omp_offloading_rebalance_maps(info, kern_ms);
+	if (rows_migrated < 0) {
+		fprintf(stderr, "offloading %s: its maps cannot be rebalanced (only contiguous maps distributed in dim 0 onto a 1-D topology), "
+				"rebalancing is disabled\n", info->name);
+		info->rebalance_interval = 0;
+		return 0;
+	}
+	if (rows_migrated == 0) return 0;
+
+	omp_rebalance_record_t * rec = &info->rebalance_history[info->num_rebalances % OMP_REBALANCE_HISTORY];
+	rec->run = runs;
+	rec->imbalance_before = imbalance;
+	rec->imbalance_after = -1.0;
+	rec->rows_migrated = rows_migrated;
+	info->num_rebalances++;
+	info->rebalance_rows_migrated += rows_migrated;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void omp_offloading_set_dynamic(omp_offloading_info_t * info, long min_chunk, long max_chunk) {
+	if (info->type == OMP_OFFLOADING_DATA || info->type == OMP_OFFLOADING_STANDALONE_DATA_EXCHANGE) {
+		fprintf(stderr, "offloading %s has no kernel to be scheduled dynamically\n", info->name);
+		return;
+	}
+	info->dynamic = 1;
+	info->dynamic_min_chunk = min_chunk > 0 ? min_chunk : 0;
+	info->dynamic_max_chunk = max_chunk > 0 ? max_chunk : 0;
+	if (info->dynamic_max_chunk > 0 && info->dynamic_max_chunk < info->dynamic_min_chunk) info->dynamic_max_chunk = info->dynamic_min_chunk;
+}
+
+/**
+ * called after omp_data_map_dist for a map of a dynamic offloading. A map distributed in dim 0 is split into the chunks the
+ * devices claim (see omp_offloading_run_dynamic) and marked as sliced. Instead of its static range, the device maps a chunk
+ * buffer of dynamic_capacity rows (max_chunk, by default half of an even share of the range) which each chunk is moved through.
+ * The other dims must be duplicated in full so a chunk is contiguous
+ */
+void omp_map_dynamic_dist(omp_data_map_t * map, omp_offloading_t * off) {
+	omp_offloading_info_t * off_info = off->off_info;
+	omp_data_map_info_t * info = map->info;
+	int distributed = 0;
+	int i;
+	for (i=0; i<info->num_dims; i++) if (info->dist[i].policy != OMP_DIST_POLICY_DUPLICATE) distributed = 1;
+	if (!distributed) return;
+	for (i=1; i<info->num_dims; i++) {
+		if (info->dist[i].policy != OMP_DIST_POLICY_DUPLICATE || map->map_dist[i].length != info->dims[i]) distributed = 0;
+	}
+	if (!distributed || info->dist[0].policy == OMP_DIST_POLICY_CYCLIC || info->halo_info != NULL || info->resident) {
+		fprintf(stderr, "map %s of dynamic offloading %s: only a map distributed in dim 0, with the other dims duplicated in full, "
+				"without halo and not resident can be scheduled dynamically\n", info->symbol, off_info->name);
+		abort();
+	}
+
+	long total = info->dist[0].length;
+	if (off->dynamic_capacity <= 0) {
+		int nnodes = off_info->top->nnodes;
+		long capacity = off_info->dynamic_max_chunk;
+		if (capacity <= 0) capacity = (total + 2*nnodes - 1) / (2*nnodes);
+		if (capacity > total) capacity = total;
+		if (capacity < 1) capacity = 1;
+		off->dynamic_capacity = capacity;
+	}
+	map->sliced = 1;
+	map->map_dist[0].offset = info->dist[0].start;
+	map->map_dist[0].length = off->dynamic_capacity;
+	map->map_dist[0].chunk_size = 0;
+}
+
+/* point a split map of a dynamic offloading to the rows [offset, offset+length) of dim 0, length is at most the capacity of its chunk buffer */
+void omp_map_dynamic_chunk(omp_data_map_t * map, long offset, long length) {
+	omp_data_map_info_t * info = map->info;
+	long row_size = info->sizeof_element;
+	int i;
+	for (i=1; i<info->num_dims; i++) row_size *= map->map_dist[i].length;
+	map->map_dist[0].offset = offset;
+	map->map_dist[0].length = length;
+	map->map_size = length * row_size;
+	map->map_buffer = &info->source_ptr[info->sizeof_element * omp_map_element_offset(map)];
+	if (map->map_type == OMP_DATA_MAP_SHARED) map->map_dev_ptr = map->map_buffer;
+}
+
+/**
+ * the cost model of the planner for device seqid of top: the time in ms of the kernel (the iterations of the region of the iteration
+ * map, bound by the calibrated flops or memory bandwidth), of the copies of the array regions between host and device, and of the
+ * halo exchange with the neighbors, whose bandwidth is the calibrated dev-to-dev bandwidth. Return 0 if it cannot be predicted,
+ * i.e. a map has an ALIGN dist
+ */
+static int omp_plan_predict(omp_kernel_profile_info_t * profile, omp_grid_topology_t * top, int seqid, int num_mapped_vars,
+		omp_data_map_info_t * data_map_info, omp_dist_info_t ** dists, int iteration_map, double * compute, double * transfer, double * halo) {
+	omp_device_t * dev = &omp_devices[top->idmap[seqid]];
+	int m, d;
+	*compute = 0.0;
+	*transfer = 0.0;
+	*halo = 0.0;
+	for (m=0; m<num_mapped_vars; m++) {
+		/* dist the region of the array onto the device with a scratch map, as omp_data_map_dist would do */
+		omp_data_map_info_t info = data_map_info[m];
+		omp_data_map_t map;
+		memset(&map, 0, sizeof(omp_data_map_t));
+		info.top = top;
+		info.dist = dists[m];
+		map.info = &info;
+		map.dev = dev;
+		for (d=0; d<info.num_dims; d++) {
+			if (info.dist[d].policy == OMP_DIST_POLICY_ALIGN) return 0;
+			/* no neighbor unless omp_dist finds one, which it does for the BLOCK dims only */
+			map.halo_mem[d].left_dev_seqid = -1;
+			map.halo_mem[d].right_dev_seqid = -1;
+		}
+		omp_dist(info.dist, map.map_dist, info.num_dims, top, seqid, &map, OMP_DIST_TARGET_DATA_MAP);
+		double elements = 1.0;
+		for (d=0; d<info.num_dims; d++) elements *= map.map_dist[d].length;
+		double bytes = elements * info.sizeof_element;
+
+		if (m == iteration_map) {
+			/* the interior of the region, without halo */
+			double interior = 1.0;
+			for (d=0; d<info.num_dims; d++) {
+				long length = map.map_dist[d].length;
+				if (info.halo_info != NULL) {
+					if (map.halo_mem[d].left_dev_seqid >= 0) length -= info.halo_info[d].left;
+					if (map.halo_mem[d].right_dev_seqid >= 0) length -= info.halo_info[d].right;
+				}
+				interior *= (double) length / info.dims[d];
+			}
+			double iterations = profile->num_iterations * interior;
+			double flop_ms = dev->real_flopss > 0.0 ? iterations * profile->num_fp_operations / dev->real_flopss * 1000.0 : 0.0;
+			double mem_ms = dev->mem_bandwidth > 0.0 ? iterations * (profile->num_load + profile->num_store) * info.sizeof_element / dev->mem_bandwidth * 1000.0 : 0.0;
+			*compute = flop_ms > mem_ms ? flop_ms : mem_ms;
+		}
+
+		/* an AUTO map onto a device sharing the host memory is not copied */
+		omp_data_map_type_t map_type = info.map_type;
+		if (map_type == OMP_DATA_MAP_AUTO) map_type = omp_device_mem_discrete(dev->mem_type) ? OMP_DATA_MAP_COPY : OMP_DATA_MAP_SHARED;
+		else if (map_type == OMP_DATA_MAP_SHARED && omp_device_mem_discrete(dev->mem_type)) map_type = OMP_DATA_MAP_COPY;
+		if (map_type == OMP_DATA_MAP_COPY) {
+			double h2d = dev->h2d_bandwidth > 0.0 ? dev->h2d_bandwidth : (double) dev->bandwidth;
+			double d2h = dev->d2h_bandwidth > 0.0 ? dev->d2h_bandwidth : (double) dev->bandwidth;
+			if ((info.map_direction == OMP_DATA_MAP_TO || info.map_direction == OMP_DATA_MAP_TOFROM) && h2d > 0.0)
+				*transfer += (bytes / h2d + dev->h2d_latency) * 1000.0;
+			if ((info.map_direction == OMP_DATA_MAP_FROM || info.map_direction == OMP_DATA_MAP_TOFROM) && d2h > 0.0)
+				*transfer += (bytes / d2h + dev->d2h_latency) * 1000.0;
+		}
+
+		if (info.halo_info == NULL) continue;
+		for (d=0; d<info.num_dims; d++) {
+			omp_data_map_halo_region_info_t * halo_info = &info.halo_info[d];
+			if (halo_info->left == 0 && halo_info->right == 0) continue;
+			double face = elements / map.map_dist[d].length * info.sizeof_element; /* bytes of one layer of dim d */
+			int side;
+			for (side=0; side<2; side++) {
+				int neighbor = side == 0 ? map.halo_mem[d].left_dev_seqid : map.halo_mem[d].right_dev_seqid;
+				if (neighbor < 0) continue;
+				int width = side == 0 ? halo_info->left : halo_info->right; /* received from this neighbor */
+				omp_device_t * ndev = &omp_devices[top->idmap[neighbor]];
+				double bw = ndev->d2d_bandwidth != NULL ? ndev->d2d_bandwidth[dev->id] : 0.0;
+				if (bw > 0.0) *halo += (face * width / bw + ndev->d2h_latency) * 1000.0;
+			}
+		}
+	}
+	return 1;
+}
+
+int omp_offloading_plan(omp_kernel_profile_info_t * profile, omp_device_t ** targets, int num_targets, int num_mapped_vars,
+		omp_data_map_info_t * data_map_info, omp_plan_candidate_t * candidates, int num_candidates) {
+	int best = -1;
+	int c, i;
+	for (c=0; c<num_candidates; c++) {
+		omp_plan_candidate_t * cand = &candidates[c];
+		omp_grid_topology_t top;
+		int dims[cand->top_ndims];
+		int periodic[cand->top_ndims];
+		int idmap[num_targets];
+		omp_grid_topology_init_simple(&top, targets, num_targets, cand->top_ndims, dims, periodic, idmap);
+		cand->compute = cand->transfer = cand->halo = cand->total = 0.0;
+		cand->slowest = 0;
+		for (i=0; i<num_targets; i++) {
+			double compute, transfer, halo;
+			if (!omp_plan_predict(profile, &top, i, num_mapped_vars, data_map_info, cand->dists, cand->iteration_map, &compute, &transfer, &halo)) {
+				fprintf(stderr, "candidate %s: ALIGN dist is not supported by the planner, the candidate is skipped\n", cand->name);
+				cand->total = -1.0;
+				cand->slowest = -1;
+				break;
+			}
+			double total = compute + transfer + halo;
+			if (i == 0 || total > cand->total) {
+				cand->compute = compute;
+				cand->transfer = transfer;
+				cand->halo = halo;
+				cand->total = total;
+				cand->slowest = i;
+			}
+		}
+		if (cand->slowest < 0) continue;
+		if (best < 0 || cand->total < candidates[best].total) best = c;
+	}
+	return best;
+}
+
+#if defined (OMP_BREAKDOWN_TIMING)
+/* the average elapsed time of an event per run, 0 if it is not recorded */
+static double omp_event_average(omp_offloading_t * off, int index) {
+	if (off->events == NULL || index >= off->num_events) return 0.0;
+	omp_event_t * ev = &off->events[index];
+	if (ev->event_name == NULL || ev->count <= 0) return 0.0;
+	return (ev->record_method == OMP_EVENT_HOST_RECORD ? ev->elapsed_host : ev->elapsed_dev) / ev->count;
+}
+#endif
+
+void omp_offloading_plan_report(omp_offloading_info_t * info, omp_kernel_profile_info_t * profile, int iteration_map) {
+#if defined (OMP_BREAKDOWN_TIMING)
+	int nnodes = info->top->nnodes;
+	omp_dist_info_t * dists[info->num_mapped_vars];
+	int i;
+	for (i=0; i<info->num_mapped_vars; i++) dists[i] = info->data_map_info[i].dist;
+	double compute, transfer, halo;
+	if (!omp_plan_predict(profile, info->top, 0, info->num_mapped_vars, info->data_map_info, dists, iteration_map, &compute, &transfer, &halo)) {
+		printf("\n-------------- Plan Report for Offloading(%s): ALIGN dist cannot be predicted -----------------------\n", info->name);
+		return;
+	}
+	printf("\n-------------- Plan Report (ms) for Offloading(%s): predicted/measured per run -----------------------\n", info->name);
+	printf("%6s%24s%24s%24s%24s\n", "dev", "KERN", "MAPTO+MAPFROM", "HALO_EX", "TOTAL");
+	for (i=0; i<nnodes; i++) {
+		omp_offloading_t * off = &info->offloadings[i];
+		omp_plan_predict(profile, info->top, i, info->num_mapped_vars, info->data_map_info, dists, iteration_map, &compute, &transfer, &halo);
+		double kern = omp_event_average(off, kernel_exe_event_index);
+		double copy = omp_event_average(off, acc_mapto_event_index) + omp_event_average(off, acc_mapfrom_event_index);
+		double ex = omp_event_average(off, acc_ex_event_index);
+		printf("%6d%11.3f/%-12.3f%11.3f/%-12.3f%11.3f/%-12.3f%11.3f/%-12.3f\n", off->dev->id, compute, kern, transfer, copy, halo, ex,
+				compute + transfer + halo, kern + copy + ex);
+	}
+	printf("---------------- End Plan Report for Offloading(%s) ----------------------------\n", info->name);
+#endif
+}
+
+void omp_print_data_map(omp_data_map_t * map) {
+	omp_data_map_info_t * info = map->info;
+	printf("devid: %d, MAP: %X, source ptr: %X, dim[0]: %ld, dim[1]: %ld, dim[2]: %ld, map_dim[0]: %ld, map_dim[1]: %ld, map_dim[2]: %ld, "
+				"map_offset[0]: %ld, map_offset[1]: %ld, map_offset[2]: %ld, sizeof_element: %d, map_buffer: %X, marshall_or_not: %d,"
+				"map_dev_ptr: %X, map_size: %ld\n\n", map->dev->id, map, info->source_ptr, info->dims[0], info->dims[1], info->dims[2],
+				map->map_dist[0].length, map->map_dist[1].length, map->map_dist[2].length, map->map_dist[0].offset, map->map_dist[1].offset, map->map_dist[2].offset,
+				info->sizeof_element, map->map_buffer, map->mem_noncontiguous, map->map_dev_ptr, map->map_size);
+}
+
+void omp_print_off_maps(omp_offloading_t * off) {
+	int i;
+	printf("off %X maps: ", off);
+	for (i=0; i<off->num_maps; i++) printf("%X, ", off->map_cache[i].map);
+	printf("\n");
+}
+
+/* wait until the relay counter reaches value, see omp_data_map_halo_region_mem_t */
+static void omp_halo_relay_wait(volatile int * count, int value) {
+	int spin = 0;
+	while (__atomic_load_n(count, __ATOMIC_ACQUIRE) < value) {
+		if (spin++ < 1000) omp_cpu_relax();
+		else sched_yield();
+	}
+}
+
+/**
+ * push the out halo region of map (out_size bytes at out_ptr, see omp_map_halo_region_ptrs) to the next slot of the
+ * relay of the neighbor's in-edge. Only map pushes to the relay, so the pushed counter is its own
+ */
+static void omp_halo_relay_push(omp_data_map_t * map, int dim, char * out_ptr, long out_size, char * relay, volatile int * pushed,
+		volatile int * pulled, omp_event_t * pull_events, omp_event_t * push_events, omp_dev_stream_t * stream) {
+	omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[dim];
+	long width = out_size / halo_mem->blocks;
+	int k = *pushed;
+	int slot = k % OMP_HALO_RELAY_SLOTS;
+	/* the receiver has submitted the pull of the exchange that used the slot before, and the pull must be done before
+	 * the slot is overwritten */
+	omp_halo_relay_wait(pulled, k - OMP_HALO_RELAY_SLOTS + 1);
+	if (k >= OMP_HALO_RELAY_SLOTS) omp_stream_wait_event(stream, &pull_events[slot]);
+	omp_map_memcpy_2d_from_async(&relay[slot * out_size], width, out_ptr, halo_mem->pitch, map->dev, width, halo_mem->blocks, stream);
+	omp_stream_record_event(stream, &push_events[slot]);
+	__atomic_store_n(pushed, k + 1, __ATOMIC_RELEASE);
+}
+
+/* pull the next slot of the relay of an in-edge of map to its in halo region, the counterpart of omp_halo_relay_push */
+static void omp_halo_relay_pull(omp_data_map_t * map, int dim, char * in_ptr, long in_size, char * relay, volatile int * pushed,
+		volatile int * pulled, omp_event_t * pull_events, omp_event_t * push_events, omp_dev_stream_t * stream) {
+	omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[dim];
+	long width = in_size / halo_mem->blocks;
+	int k = *pulled;
+	int slot = k % OMP_HALO_RELAY_SLOTS;
+	omp_halo_relay_wait(pushed, k + 1);
+	omp_stream_wait_event(stream, &push_events[slot]);
+	omp_map_memcpy_2d_to_async(in_ptr, halo_mem->pitch, map->dev, &relay[slot * in_size], width, width, halo_mem->blocks, stream);
+	omp_stream_record_event(stream, &pull_events[slot]);
+	__atomic_store_n(pulled, k + 1, __ATOMIC_RELEASE);
 }
 
 /* do a halo regin pull for data map of devid. If top is not NULL, devid will be translated to coordinate of the
  * virtual topology and the halo region pull will be based on this coordinate.
  * @param: int dim[ specify which dimension to do the halo region update.
- *      If dim < 0, do all the update of map dimensions that has halo region
- * @param: from_left_right, to do in which direction
-
+ *      If dim < 0, do all the update of map dimensions that has halo region, in the order of the dims. The corners come
+ *      with the higher dims only if the neighbors have finished the lower dims before, which is how the exchange of an
+ *      offloading does it (with a sync between the dims, see omp_halo_exchange_sync)
+ * @param: from_left_right, to do in which direction, the same for all the devices of the exchange
+ * @param: stream, the copies are asynchronous on it, the caller syncs the stream before it lets the neighbors use the halo
+ *
+ * The regions of dims other than 0 are noncontiguous, they are copied by strided memcpy between devices, and packed
+ * into and unpacked from the host relay buffer (see omp_map_halo_region_ptrs).
  *
+ * A map first pushes to the relays of the neighbors that pull from it, then pulls. Since a push only waits for the pull of
+ * two exchanges ago (the relay is double-buffered), no device waits for a neighbor that waits for another neighbor
  */
-void omp_halo_region_pull(omp_data_map_t * map, int dim, omp_data_map_exchange_direction_t from_left_right) {
+void omp_halo_region_pull(omp_data_map_t * map, int dim, omp_data_map_exchange_direction_t from_left_right, omp_dev_stream_t * stream) {
 	omp_data_map_info_t * info = map->info;
-	/*FIXME: let us only handle 2-D array now */
-	if (info->num_dims != 2 || dim != 0 || map->mem_noncontiguous) {
-		fprintf(stderr, "we only handle 2-d array, dist/halo at 0-d and non-marshalling so far!\n");
-		omp_print_data_map(map);
+	if (dim < 0) {
+		for (dim=0; dim<info->num_dims; dim++) omp_halo_region_pull(map, dim, from_left_right, stream);
 		return;
 	}
+	if (!omp_data_map_has_halo(info, dim)) return;
 
 	omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[dim];
+	long blocks = halo_mem->blocks;
+	int from_left = from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_ONLY || from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT;
+	int from_right = from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_RIGHT_ONLY || from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT;
+	omp_data_map_t * left_map = halo_mem->left_dev_seqid >= 0 ? &info->maps[halo_mem->left_dev_seqid] : NULL;
+	omp_data_map_t * right_map = halo_mem->right_dev_seqid >= 0 ? &info->maps[halo_mem->right_dev_seqid] : NULL;
 #if CORRECTNESS_CHECK
     BEGIN_SERIALIZED_PRINTF(map->dev->id);
-	printf("dev: %d, map: %X, left: %d, right: %d\n", map->dev->id, map, halo_mem->left_dev_seqid, halo_mem->right_dev_seqid);
+	printf("dev: %d, map: %X, dim: %d, left: %d, right: %d\n", map->dev->id, map, dim, halo_mem->left_dev_seqid, halo_mem->right_dev_seqid);
 #endif
 
-	if (halo_mem->left_dev_seqid >= 0 && (from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_ONLY || from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT)) { /* pull from left */
-		omp_data_map_t * left_map = &info->maps[halo_mem->left_dev_seqid];
+	/* push to the host relay of the neighbors that pull from this map, the others pull directly device-to-device */
+	if (from_right && left_map != NULL) { /* the left neighbor pulls my left_out as its right_in */
 		omp_data_map_halo_region_mem_t * left_halo_mem = &left_map->halo_mem[dim];
-
-		/* if I need to push right_out data to the host relay buffer for the left_map, I should do it first */
-		if (left_halo_mem->right_in_host_relay_ptr != NULL) {
-			/* wait make sure the data in the right_in_host_relay buffer is already pulled */
-			while (left_halo_mem->right_in_data_in_relay_pushed > left_halo_mem->right_in_data_in_relay_pulled);
-			omp_map_memcpy_from((void*)left_halo_mem->right_in_host_relay_ptr, (void*)halo_mem->left_out_ptr, map->dev, halo_mem->left_out_size);
-			left_halo_mem->right_in_data_in_relay_pushed ++;
-		} else {
-			/* do nothing here because the left_map helper thread will do a direct device-to-device pull */
+		if (left_halo_mem->right_in_host_relay_ptr != NULL && !halo_mem->left_out_aggregated) {
+			omp_halo_relay_push(map, dim, halo_mem->left_out_ptr, left_halo_mem->right_in_size, left_halo_mem->right_in_host_relay_ptr,
+					&left_halo_mem->right_in_data_in_relay_pushed, &left_halo_mem->right_in_data_in_relay_pulled,
+					left_halo_mem->right_in_relay_pull_events, halo_mem->left_out_relay_push_events, stream);
 		}
+	}
+	if (from_left && right_map != NULL) { /* the right neighbor pulls my right_out as its left_in */
+		omp_data_map_halo_region_mem_t * right_halo_mem = &right_map->halo_mem[dim];
+		if (right_halo_mem->left_in_host_relay_ptr != NULL && !halo_mem->right_out_aggregated) {
+			omp_halo_relay_push(map, dim, halo_mem->right_out_ptr, right_halo_mem->left_in_size, right_halo_mem->left_in_host_relay_ptr,
+					&right_halo_mem->left_in_data_in_relay_pushed, &right_halo_mem->left_in_data_in_relay_pulled,
+					right_halo_mem->left_in_relay_pull_events, halo_mem->right_out_relay_push_events, stream);
+		}
+	}
 
+	if (from_left && left_map != NULL && !halo_mem->left_in_aggregated) { /* pull from left */
+		omp_data_map_halo_region_mem_t * left_halo_mem = &left_map->halo_mem[dim];
 		if (halo_mem->left_in_host_relay_ptr == NULL) { /* no need host relay */
-			omp_map_memcpy_DeviceToDevice((void*)halo_mem->left_in_ptr, map->dev, (void*)left_halo_mem->right_out_ptr, left_map->dev, halo_mem->left_in_size);
+			if (halo_mem->left_in_ptr != left_halo_mem->right_out_ptr) /* they are the same for SHARED maps of the array */
+				omp_map_memcpy_2d_DeviceToDevice((void*)halo_mem->left_in_ptr, halo_mem->pitch, map->dev, (void*)left_halo_mem->right_out_ptr,
+						left_halo_mem->pitch, left_map->dev, halo_mem->left_in_size / blocks, blocks);
 #if CORRECTNESS_CHECK
 			printf("dev: %d, dev2dev memcpy from left: %X <----- %X\n", map->dev->id, halo_mem->left_in_ptr, left_halo_mem->right_out_ptr);
 #endif
 		} else { /* need host relay */
-			/*
-			omp_set_current_device_dev(left_map->dev);
-			omp_map_memcpy_from(halo_mem->left_in_host_relay_ptr, left_map->halo_mem[dim].right_out_ptr, left_map->dev, halo_mem->left_in_size);
-			omp_set_current_device_dev(map->dev);
-			*/
-			while (halo_mem->left_in_data_in_relay_pushed <= halo_mem->left_in_data_in_relay_pulled); /* wait for the data to be ready in the relay buffer on host */
-			/* wait for the data in the relay buffer is ready */
-			omp_map_memcpy_to((void*)halo_mem->left_in_ptr, map->dev, (void*)halo_mem->left_in_host_relay_ptr, halo_mem->left_in_size);
-			halo_mem->left_in_data_in_relay_pulled++;
+			omp_halo_relay_pull(map, dim, halo_mem->left_in_ptr, halo_mem->left_in_size, halo_mem->left_in_host_relay_ptr,
+					&halo_mem->left_in_data_in_relay_pushed, &halo_mem->left_in_data_in_relay_pulled,
+					halo_mem->left_in_relay_pull_events, left_halo_mem->right_out_relay_push_events, stream);
 		}
 	}
-	if (halo_mem->right_dev_seqid >= 0 && (from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_RIGHT_ONLY || from_left_right == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT)) {
-		omp_data_map_t * right_map = &info->maps[halo_mem->right_dev_seqid];
+	if (from_right && right_map != NULL && !halo_mem->right_in_aggregated) {
 		omp_data_map_halo_region_mem_t * right_halo_mem = &right_map->halo_mem[dim];
-
-		/* if I need to push left_out data to the host relay buffer for the right_map, I should do it first */
-		if (right_halo_mem->left_in_host_relay_ptr != NULL) {
-			while (right_halo_mem->left_in_data_in_relay_pushed > right_halo_mem->left_in_data_in_relay_pulled);
-			omp_map_memcpy_from((void*)right_halo_mem->left_in_host_relay_ptr, (void*)halo_mem->right_out_ptr, map->dev, halo_mem->right_out_size);
-			right_halo_mem->left_in_data_in_relay_pushed ++;
-		} else {
-			/* do nothing here because the left_map helper thread will do a direct device-to-device pull */
-		}
-
 		if (halo_mem->right_in_host_relay_ptr == NULL) {
-			omp_map_memcpy_DeviceToDevice((void*)halo_mem->right_in_ptr, map->dev, (void*)right_halo_mem->left_out_ptr, right_map->dev, halo_mem->right_in_size);
+			if (halo_mem->right_in_ptr != right_halo_mem->left_out_ptr)
+				omp_map_memcpy_2d_DeviceToDevice((void*)halo_mem->right_in_ptr, halo_mem->pitch, map->dev, (void*)right_halo_mem->left_out_ptr,
+						right_halo_mem->pitch, right_map->dev, halo_mem->right_in_size / blocks, blocks);
 #if CORRECTNESS_CHECK
 			printf("dev: %d, dev2dev memcpy from right: %X <----- %X\n", map->dev->id, halo_mem->right_in_ptr, right_halo_mem->left_out_ptr);
 #endif
-
 		} else {
-			/*
-			omp_set_current_device_dev(right_map->dev);
-			omp_map_memcpy_from(halo_mem->right_in_host_relay_ptr, right_map->halo_mem[dim].left_out_ptr, right_map->dev, halo_mem->right_in_size);
-			omp_set_current_device_dev(map->dev);
-			*/
-			while (halo_mem->right_in_data_in_relay_pushed <= halo_mem->right_in_data_in_relay_pulled); /* wait for the data to be ready in the relay buffer on host */
-			omp_map_memcpy_to((void*)halo_mem->right_in_ptr, map->dev, (void*)halo_mem->right_in_host_relay_ptr, halo_mem->right_in_size);
-			halo_mem->right_in_data_in_relay_pulled++;
+			omp_halo_relay_pull(map, dim, halo_mem->right_in_ptr, halo_mem->right_in_size, halo_mem->right_in_host_relay_ptr,
+					&halo_mem->right_in_data_in_relay_pushed, &halo_mem->right_in_data_in_relay_pulled,
+					halo_mem->right_in_relay_pull_events, right_halo_mem->left_out_relay_push_events, stream);
 		}
 	}
 #if CORRECTNESS_CHECK
@@ -1248,6 +2640,319 @@ void omp_halo_region_pull(omp_data_map_t * map, int dim, omp_data_map_exchange_d
 	return;
 }
 
+/**
+ * count down the deep halos of the maps of the exchange of off on its device, and return how many of them are due for the
+ * exchange in this run, see omp_map_set_halo_depth. A map is due when its halo cannot serve another step, and its halo is
+ * then valid for halo_depth steps again. All the devices run the same exchanges, so they agree on it without talking
+ */
+int omp_halo_exchange_due(omp_offloading_t * off) {
+	omp_offloading_info_t * off_info = off->off_info;
+	int i, due = 0;
+	for (i=0; i<off_info->num_maps_halo_x; i++) off_info->halo_x_info[i].map_info->maps[off->devseqid].halo_x_due = -1;
+	for (i=0; i<off_info->num_maps_halo_x; i++) {
+		omp_data_map_info_t * map_info = off_info->halo_x_info[i].map_info;
+		omp_data_map_t * map = &map_info->maps[off->devseqid];
+		if (map->halo_x_due < 0) { /* once per run for a map listed more than once */
+			if (map->halo_valid > 1) {
+				map->halo_valid--;
+				map->halo_x_due = 0;
+			} else {
+				map->halo_valid = map_info->halo_depth > 1 ? map_info->halo_depth : 1;
+				map->halo_x_due = 1;
+			}
+		}
+		due += map->halo_x_due;
+	}
+	return due;
+}
+
+int omp_halo_aggregate = OMP_HALO_AGGREGATE_AUTO;
+
+/* the cost of handing a relay buffer over to the neighbor (the flag handshake between two helper threads), in seconds */
+#define OMP_HALO_X_HANDSHAKE_LATENCY 1.0e-6
+
+/* whether the exchange x_halos includes dim in this run on device seqid */
+static int omp_halo_x_has_dim(omp_data_map_halo_exchange_info_t * x_halos, int seqid, int dim) {
+	omp_data_map_info_t * map_info = x_halos->map_info;
+	return dim < map_info->num_dims && (x_halos->x_dim < 0 || x_halos->x_dim == dim) && omp_data_map_has_halo(map_info, dim) &&
+			map_info->maps[seqid].halo_x_due;
+}
+
+static int omp_halo_x_from_left(omp_data_map_halo_exchange_info_t * x_halos) {
+	return x_halos->x_direction == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_ONLY || x_halos->x_direction == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT;
+}
+
+static int omp_halo_x_from_right(omp_data_map_halo_exchange_info_t * x_halos) {
+	return x_halos->x_direction == OMP_DATA_MAP_EXCHANGE_FROM_RIGHT_ONLY || x_halos->x_direction == OMP_DATA_MAP_EXCHANGE_FROM_LEFT_RIGHT;
+}
+
+/**
+ * the halo region of dim of a map that goes over an edge of the aggregated exchange: in from (out to) the left (side 0) or
+ * right (side 1) neighbor, NULL if the map does not exchange it. flag is the aggregated flag of the region in halo_mem
+ */
+static char * omp_halo_x_region(omp_data_map_halo_exchange_info_t * x_halos, omp_data_map_t * map, int dim, int in, int side, long * size, char ** flag) {
+	omp_data_map_halo_region_mem_t * halo_mem = &map->halo_mem[dim];
+	/* a map pulls from the left if the exchange is from left, and pushes to the right for its right neighbor */
+	int used = (in == (side == 0)) ? omp_halo_x_from_left(x_halos) : omp_halo_x_from_right(x_halos);
+	int peer = side == 0 ? halo_mem->left_dev_seqid : halo_mem->right_dev_seqid;
+	if (!used || peer < 0) return NULL;
+	if (in && side == 0) { *size = halo_mem->left_in_size; *flag = &halo_mem->left_in_aggregated; return halo_mem->left_in_ptr; }
+	if (in) { *size = halo_mem->right_in_size; *flag = &halo_mem->right_in_aggregated; return halo_mem->right_in_ptr; }
+	if (side == 0) { *size = halo_mem->left_out_size; *flag = &halo_mem->left_out_aggregated; return halo_mem->left_out_ptr; }
+	*size = halo_mem->right_out_size; *flag = &halo_mem->right_out_aggregated; return halo_mem->right_out_ptr;
+}
+
+/**
+ * whether the halo regions of dim of the maps of the exchange can share the edges to the neighbors, i.e. they all are
+ * distributed by the same dim of the topology with the same cyclic halo, so they have the same neighbors on every device
+ */
+static int omp_halo_x_dim_aggregatable(omp_offloading_info_t * off_info, int seqid, int dim) {
+	omp_data_map_halo_region_info_t * first = NULL;
+	int i;
+	for (i=0; i<off_info->num_maps_halo_x; i++) {
+		omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
+		if (!omp_halo_x_has_dim(x_halos, seqid, dim)) continue;
+		omp_data_map_halo_region_info_t * halo_info = &x_halos->map_info->halo_info[dim];
+		if (first == NULL) first = halo_info;
+		else if (halo_info->topdim != first->topdim || halo_info->cyclic != first->cyclic) return 0;
+	}
+	return first != NULL;
+}
+
+/**
+ * whether to pack the num_regions halo regions (size bytes) going from src to dst: it saves num_regions-1 transfers (and
+ * relay handshakes) for packing and unpacking the regions. src and dst decide it from the same numbers
+ */
+static int omp_halo_x_aggregate_edge(omp_device_t * src, omp_device_t * dst, int relay, int num_regions, long size) {
+	if (num_regions < 2 || omp_halo_aggregate == OMP_HALO_AGGREGATE_NEVER) return 0;
+	if (omp_halo_aggregate == OMP_HALO_AGGREGATE_ALWAYS) return 1;
+	double latency = relay ? src->d2h_latency + dst->h2d_latency + OMP_HALO_X_HANDSHAKE_LATENCY : dst->h2d_latency;
+	double pack = 0.0;
+	if (src->mem_bandwidth > 0.0) pack += size / src->mem_bandwidth;
+	if (dst->mem_bandwidth > 0.0) pack += size / dst->mem_bandwidth;
+	return (num_regions - 1) * latency > pack;
+}
+
+/**
+ * plan the aggregated halo exchange of off for this run, before the devices sync for the exchange. For each dim and side, the
+ * halo regions of all the maps of the exchange that go over the edge to the neighbor are packed into one buffer and moved
+ * with a single transfer (the relay of the receiver is used if the source cannot copy to it), when it is latency-bound
+ * (see omp_halo_x_aggregate_edge and OMP_HALO_AGGREGATE). The source and the receiver of an edge take the same decision
+ * from the same maps. The regions are packed in the order of the maps in the exchange
+ */
+void omp_halo_exchange_aggregate_plan(omp_offloading_t * off) {
+	omp_offloading_info_t * off_info = off->off_info;
+	int seqid = off->devseqid;
+	int dim, side, in, i;
+	for (dim=0; dim<OMP_NUM_ARRAY_DIMENSIONS; dim++) {
+		int aggregatable = omp_halo_x_dim_aggregatable(off_info, seqid, dim);
+		for (side=0; side<2; side++) {
+			for (in=0; in<2; in++) {
+				omp_halo_x_edge_t * edge = in ? &off->halo_x_in[dim][side] : &off->halo_x_out[dim][side];
+				edge->peer = -1;
+				edge->num_regions = 0;
+				edge->size = 0;
+				edge->buf = NULL;
+				edge->host_relay_ptr = NULL;
+				edge->ready = 0;
+				int relay = 0;
+				omp_data_map_t * first = NULL;
+				for (i=0; i<off_info->num_maps_halo_x; i++) {
+					omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
+					if (!omp_halo_x_has_dim(x_halos, seqid, dim)) continue;
+					omp_data_map_t * map = &x_halos->map_info->maps[seqid];
+					long size;
+					char * flag;
+					if (omp_halo_x_region(x_halos, map, dim, in, side, &size, &flag) == NULL) continue;
+					*flag = 0;
+					if (!aggregatable) continue;
+					if (first == NULL) {
+						first = map;
+						edge->peer = side == 0 ? map->halo_mem[dim].left_dev_seqid : map->halo_mem[dim].right_dev_seqid;
+						/* the receiver of the edge relays what comes from the source */
+						omp_data_map_t * recv_map = in ? map : &x_halos->map_info->maps[edge->peer];
+						omp_data_map_halo_region_mem_t * recv_halo_mem = &recv_map->halo_mem[dim];
+						relay = (in == (side == 0)) ? recv_halo_mem->left_in_host_relay_ptr != NULL : recv_halo_mem->right_in_host_relay_ptr != NULL;
+					}
+					edge->num_regions++;
+					edge->size += size;
+				}
+				if (edge->peer < 0) continue;
+				omp_device_t * peerdev = off_info->targets[edge->peer];
+				if (!omp_halo_x_aggregate_edge(in ? peerdev : off->dev, in ? off->dev : peerdev, relay, edge->num_regions, edge->size)) {
+					edge->peer = -1;
+					continue;
+				}
+				for (i=0; i<off_info->num_maps_halo_x; i++) {
+					omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
+					if (!omp_halo_x_has_dim(x_halos, seqid, dim)) continue;
+					long size;
+					char * flag;
+					if (omp_halo_x_region(x_halos, &x_halos->map_info->maps[seqid], dim, in, side, &size, &flag) != NULL) *flag = 1;
+				}
+				edge->buf = (char *) omp_map_malloc_dev(off->dev, edge->size);
+				if (in && relay) edge->host_relay_ptr = (char *) omp_map_malloc_staging(off->dev, edge->size);
+			}
+		}
+	}
+}
+
+/**
+ * pack the halo regions of dim of the out edges of off and move them to the receivers, then let the receivers know. The
+ * receivers have planned their edges before the devices synced for the exchange
+ */
+void omp_halo_exchange_aggregate_push(omp_offloading_t * off, int dim) {
+	omp_offloading_info_t * off_info = off->off_info;
+	omp_dev_stream_t * stream = off->stream;
+	int side, i;
+	int pushed = 0;
+	for (side=0; side<2; side++) {
+		omp_halo_x_edge_t * edge = &off->halo_x_out[dim][side];
+		if (edge->peer < 0) continue;
+		long offset = 0;
+		for (i=0; i<off_info->num_maps_halo_x; i++) {
+			omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
+			if (!omp_halo_x_has_dim(x_halos, off->devseqid, dim)) continue;
+			omp_data_map_t * map = &x_halos->map_info->maps[off->devseqid];
+			long size;
+			char * flag;
+			char * ptr = omp_halo_x_region(x_halos, map, dim, 0, side, &size, &flag);
+			if (ptr == NULL || !*flag) continue;
+			long width = size / map->halo_mem[dim].blocks;
+			omp_map_memcpy_2d_DeviceToDeviceAsync(&edge->buf[offset], width, off->dev, ptr, map->halo_mem[dim].pitch, off->dev, width, map->halo_mem[dim].blocks, stream);
+			offset += size;
+		}
+		omp_halo_x_edge_t * recv_edge = &off_info->offloadings[edge->peer].halo_x_in[dim][1-side];
+		omp_device_t * peerdev = off_info->targets[edge->peer];
+		if (recv_edge->host_relay_ptr != NULL) omp_map_memcpy_from_async(recv_edge->host_relay_ptr, edge->buf, off->dev, edge->size, stream);
+		else omp_map_memcpy_DeviceToDeviceAsync(recv_edge->buf, peerdev, edge->buf, off->dev, edge->size, stream);
+		pushed = 1;
+	}
+	if (!pushed) return;
+	omp_stream_sync(stream);
+	for (side=0; side<2; side++) {
+		omp_halo_x_edge_t * edge = &off->halo_x_out[dim][side];
+		if (edge->peer >= 0) __atomic_store_n(&off_info->offloadings[edge->peer].halo_x_in[dim][1-side].ready, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* wait for the packed halo regions of dim of the in edges of off and unpack them, asynchronously on the stream of off */
+void omp_halo_exchange_aggregate_pull(omp_offloading_t * off, int dim) {
+	omp_offloading_info_t * off_info = off->off_info;
+	omp_dev_stream_t * stream = off->stream;
+	int side, i;
+	for (side=0; side<2; side++) {
+		omp_halo_x_edge_t * edge = &off->halo_x_in[dim][side];
+		if (edge->peer < 0) continue;
+		omp_halo_relay_wait(&edge->ready, 1);
+		if (edge->host_relay_ptr != NULL) omp_map_memcpy_to_async(edge->buf, off->dev, edge->host_relay_ptr, edge->size, stream);
+		long offset = 0;
+		for (i=0; i<off_info->num_maps_halo_x; i++) {
+			omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
+			if (!omp_halo_x_has_dim(x_halos, off->devseqid, dim)) continue;
+			omp_data_map_t * map = &x_halos->map_info->maps[off->devseqid];
+			long size;
+			char * flag;
+			char * ptr = omp_halo_x_region(x_halos, map, dim, 1, side, &size, &flag);
+			if (ptr == NULL || !*flag) continue;
+			long width = size / map->halo_mem[dim].blocks;
+			omp_map_memcpy_2d_DeviceToDeviceAsync(ptr, map->halo_mem[dim].pitch, off->dev, &edge->buf[offset], width, off->dev, width, map->halo_mem[dim].blocks, stream);
+			offset += size;
+		}
+	}
+}
+
+/* release the buffers of the aggregated exchange of off, after the neighbors are done with the exchange */
+void omp_halo_exchange_aggregate_fini(omp_offloading_t * off) {
+	int dim, side;
+	for (dim=0; dim<OMP_NUM_ARRAY_DIMENSIONS; dim++) {
+		for (side=0; side<2; side++) {
+			omp_halo_x_edge_t * edge = &off->halo_x_in[dim][side];
+			if (edge->buf != NULL) omp_map_free_dev(off->dev, edge->buf);
+			if (edge->host_relay_ptr != NULL) omp_map_free_staging(off->dev, edge->host_relay_ptr);
+			edge->buf = edge->host_relay_ptr = NULL;
+			edge->peer = -1;
+			edge = &off->halo_x_out[dim][side];
+			if (edge->buf != NULL) omp_map_free_dev(off->dev, edge->buf);
+			edge->buf = NULL;
+			edge->peer = -1;
+		}
+	}
+}
+
+int omp_halo_sync = OMP_HALO_SYNC_NEIGHBOR;
+
+/**
+ * wait on the device of off until the halo_x_phase of the neighbor peer reaches value. As helper_thread_wait does, it spins
+ * for up to off->halo_x_spin and then parks on the cond of peer. The spin budget is doubled if the neighbor arrived while
+ * spinning and halved if it had to park, so it stays low when the devices share too few cpus for spinning to pay off
+ */
+static void omp_halo_phase_wait(omp_offloading_t * off, omp_offloading_t * peer, int value) {
+	int spin;
+	for (spin=0; spin<off->halo_x_spin; spin++) {
+		if (__atomic_load_n(&peer->halo_x_phase, __ATOMIC_ACQUIRE) >= value) {
+			if (spin > 0) {
+				off->halo_x_spin *= 2;
+				if (off->halo_x_spin > omp_helper_spin_max) off->halo_x_spin = omp_helper_spin_max;
+			}
+			return;
+		}
+		omp_cpu_relax();
+	}
+	pthread_mutex_lock(&peer->halo_x_mutex);
+	peer->halo_x_parked++;
+	__sync_synchronize();
+	while (__atomic_load_n(&peer->halo_x_phase, __ATOMIC_ACQUIRE) < value) pthread_cond_wait(&peer->halo_x_cond, &peer->halo_x_mutex);
+	peer->halo_x_parked--;
+	pthread_mutex_unlock(&peer->halo_x_mutex);
+
+	off->halo_x_spin /= 2;
+	if (off->halo_x_spin < 16) off->halo_x_spin = omp_helper_spin_max < 16 ? omp_helper_spin_max : 16;
+}
+
+/**
+ * sync the device of off with the neighbors it exchanges halo with in this run, at a step of the exchange: before it (the
+ * neighbors have completed the kernel, and planned the aggregated edges), between the dims, and after it (the neighbors
+ * have pulled from this device, so the next kernel can write the interior). Each device counts the sync points of the
+ * exchanges of the off_info in its halo_x_phase, and all the devices pass the same points in the same order, so a device
+ * only waits until the phase of its left and right neighbors of each exchanged dim has caught up with its own. The data
+ * a device gets through a neighbor (e.g., the corners) comes after the neighbor has synced with its own neighbors, so no
+ * device waits for the slowest one of the grid. With OMP_HALO_SYNC=0, all the devices wait at the barrier of the off_info.
+ * A waiting device spins for a while and then parks, see omp_halo_phase_wait, only the neighbors that wait for a device are
+ * woken up when it passes a sync point
+ */
+void omp_halo_exchange_sync(omp_offloading_t * off) {
+	omp_offloading_info_t * off_info = off->off_info;
+	if (omp_halo_sync == OMP_HALO_SYNC_BARRIER) {
+		pthread_barrier_wait(&off_info->barrier);
+		return;
+	}
+	int seqid = off->devseqid;
+	int phase = off->halo_x_phase + 1;
+	__atomic_store_n(&off->halo_x_phase, phase, __ATOMIC_RELEASE);
+	/* pairs with the full barrier in omp_halo_phase_wait, see omp_helper_notify */
+	__sync_synchronize();
+	if (off->halo_x_parked) {
+		pthread_mutex_lock(&off->halo_x_mutex);
+		pthread_cond_broadcast(&off->halo_x_cond);
+		pthread_mutex_unlock(&off->halo_x_mutex);
+	}
+
+	int i, dim, side;
+	for (i=0; i<off_info->num_maps_halo_x; i++) {
+		omp_data_map_halo_exchange_info_t * x_halos = &off_info->halo_x_info[i];
+		for (dim=0; dim<OMP_NUM_ARRAY_DIMENSIONS; dim++) {
+			if (!omp_halo_x_has_dim(x_halos, seqid, dim)) continue;
+			omp_data_map_halo_region_mem_t * halo_mem = &x_halos->map_info->maps[seqid].halo_mem[dim];
+			for (side=0; side<2; side++) {
+				int peer = side == 0 ? halo_mem->left_dev_seqid : halo_mem->right_dev_seqid;
+				/* waiting again for a neighbor that has caught up returns right away */
+				if (peer >= 0 && peer != seqid) omp_halo_phase_wait(off, &off_info->offloadings[peer], phase);
+			}
+		}
+	}
+}
+
 #if 0
 void omp_halo_region_pull_async(omp_data_map_t * map, int dim, int from_left_right) {
         cudaError_t result;
@@ -1366,101 +3071,151 @@ long omp_loop_map_range (omp_data_map_t * map, int dim, long start, long length,
 	return -1;
 }
 
+int omp_dist_num_chunks(omp_dist_t * dist) {
+	if (dist->chunk_size <= 0) return 1;
+	return (dist->length + dist->chunk_size - 1) / dist->chunk_size;
+}
+
+long omp_dist_chunk(omp_dist_t * dist, int chunk, long * local_start, long * length) {
+	if (dist->chunk_size <= 0) {
+		if (chunk != 0) return -1;
+		*local_start = 0;
+		*length = dist->length;
+		return dist->offset;
+	}
+	long begin = chunk * dist->chunk_size;
+	if (chunk < 0 || begin >= dist->length) return -1;
+	*local_start = begin;
+	*length = dist->length - begin < dist->chunk_size ? dist->length - begin : dist->chunk_size;
+	return dist->offset + chunk * dist->chunk_stride;
+}
+
 /**
- * utilities
+ * the part of dim of a map the device computes in this step, as omp_loop_map_range returns it: the range without the halo,
+ * widened into each halo the device has by the band of a deep halo that is still valid for one more step (see
+ * omp_map_set_halo_depth), which shrinks by the radius of the stencil every step until the next exchange. It is the whole
+ * mapped range for a dim without halo
  */
+long omp_loop_map_valid_range(omp_data_map_t * map, int dim, long * map_start, long * map_length) {
+	omp_data_map_info_t * info = map->info;
+	if (!omp_data_map_has_halo(info, dim)) return omp_loop_map_range(map, dim, -1, -1, map_start, map_length);
+	omp_data_map_halo_region_info_t * halo_info = &info->halo_info[dim];
+	int depth = info->halo_depth > 1 ? info->halo_depth : 1;
+	int band = map->halo_valid > 1 ? map->halo_valid - 1 : 0;
+	*map_start = 0;
+	*map_length = map->map_dist[dim].length;
+	if (map->halo_mem[dim].left_dev_seqid >= 0) {
+		*map_start = halo_info->left - band * (halo_info->left / depth);
+		*map_length -= *map_start;
+	}
+	if (map->halo_mem[dim].right_dev_seqid >= 0) *map_length -= halo_info->right - band * (halo_info->right / depth);
+	return map->map_dist[dim].offset + *map_start;
+}
+
+long omp_loop_map_chunk(omp_data_map_t * map, int dim, int chunk, long * map_start, long * map_length) {
+	return omp_dist_chunk(&map->map_dist[dim], chunk, map_start, map_length);
+}
+
+int omp_map_num_chunks(omp_data_map_t * map) {
+	int cdim = omp_map_cyclic_dim(map);
+	return cdim < 0 ? 1 : omp_dist_num_chunks(&map->map_dist[cdim]);
+}
+
+void * omp_map_chunk_dev_ptr(omp_data_map_t * map, int chunk) {
+	omp_data_map_info_t * info = map->info;
+	int cdim = omp_map_cyclic_dim(map);
+	long local_start, length;
+	int i;
+	if (cdim < 0) return chunk == 0 ? map->map_dev_ptr : NULL;
+	if (omp_dist_chunk(&map->map_dist[cdim], chunk, &local_start, &length) < 0) return NULL;
+	long box_offset = local_start;
+	for (i=0; i<info->num_dims; i++) if (i != cdim) box_offset *= map->map_dist[i].length;
+	return &((char *) map->map_dev_ptr)[box_offset * info->sizeof_element];
+}
 
 /**
- * factor n into dims number of numbers whose multiplication equals to n
+ * utilities
  */
-void omp_factor(int n, int factor[], int dims) {
-	switch (dims) {
-	case 1:
-	{
-		factor[0] = n;
+
+/* the total halo surface, in elements, of cutting an array of extents dims[] with halo widths halo[] (left + right) into the
+ * grid factor[], dims and halo are per topology dim and NULL for 1. Each of the factor[d]-1 cuts of dim d exchanges a face of
+ * the full array with the halo width of dim d
+ */
+static double omp_factor_surface(int factor[], int ndims, long * dims, long * halo) {
+	double surface = 0.0;
+	int d, e;
+	for (d=0; d<ndims; d++) {
+		double face = 1.0;
+		for (e=0; e<ndims; e++) if (e != d && dims != NULL) face *= dims[e];
+		surface += (double) (factor[d] - 1) * (halo != NULL ? halo[d] : 1) * face;
+	}
+	return surface;
+}
+
+/* whether the grid cand is better than best: a grid that cuts a dim into more parts than its extent loses, then the smaller
+ * surface wins, then the more even grid and then the grid with the larger parts counts first
+ */
+static int omp_factor_better(int cand[], int best[], int ndims, long * dims, long * halo) {
+	int d;
+	int cand_fits = 1, best_fits = 1;
+	int cand_max = 0, best_max = 0;
+	for (d=0; d<ndims; d++) {
+		if (dims != NULL && cand[d] > dims[d]) cand_fits = 0;
+		if (dims != NULL && best[d] > dims[d]) best_fits = 0;
+		if (cand[d] > cand_max) cand_max = cand[d];
+		if (best[d] > best_max) best_max = best[d];
+	}
+	if (cand_fits != best_fits) return cand_fits;
+	double cand_surface = omp_factor_surface(cand, ndims, dims, halo);
+	double best_surface = omp_factor_surface(best, ndims, dims, halo);
+	if (cand_surface != best_surface) return cand_surface < best_surface;
+	if (cand_max != best_max) return cand_max < best_max;
+	for (d=0; d<ndims; d++) if (cand[d] != best[d]) return cand[d] > best[d];
+	return 0;
+}
+
+/* try all the ways of factoring n into dims d to ndims-1 of cand */
+static void omp_factor_search(int n, int d, int ndims, int cand[], int best[], long * dims, long * halo) {
+	if (d == ndims - 1) {
+		cand[d] = n;
+		if (omp_factor_better(cand, best, ndims, dims, halo)) memcpy(best, cand, sizeof(int) * ndims);
 		return;
 	}
-	case 2:
-	{
-		switch (n) {
-		case 1:
-		case 2:
-		case 3:
-		case 5:
-		case 7:
-		case 11:
-		case 13:
-		{
-			factor[0] = n;
-			factor[1] = 1;
-			return;
-		}
-		case 4:
-		case 6:
-		case 8:
-		case 10:
-		case 14:
-		{
-			factor[0] = n/2;
-			factor[1] = 2;
-			return;
-		}
-		case 9:
-		case 15:
-		{
-			factor[0] = n/3;
-			factor[1] = 3;
-			return;
-		}
-		case 12:
-		case 16:
-		{
-			factor[0] = n/4;
-			factor[1] = 4;
-			return;
-		}
-		}
-		break;
-	}
-	case 3:
-	{
-		switch (n) {
-		case 1:
-		case 2:
-		case 3:
-		case 5:
-		case 7:
-		case 11:
-		case 13:
-		{
-			factor[0] = n;
-			factor[1] = 1;
-			factor[2] = 1;
-			return;
-		}
-		case 4:
-		case 6:
-		{
-			factor[0] = n/2;
-			factor[1] = 2;
-			factor[2] = 1;
-			return;
-		}
-		case 8:
-		{
-			factor[0] = 2;
-			factor[1] = 2;
-			factor[2] = 2;
-			return;
-		}
-		default: break;
-		}
-		break;
+	int f;
+	for (f=1; f<=n; f++) {
+		if (n % f != 0) continue;
+		cand[d] = f;
+		omp_factor_search(n / f, d + 1, ndims, cand, best, dims, halo);
+	}
+}
+
+/**
+ * factor n devices into a grid of ndims dims (1-3) that minimizes the total halo surface of an array of extents dims[] with halo
+ * widths halo[] (left + right), both per topology dim, e.g. a 512x128 array with halo 1 on 4 devices is cut as 4x1. A prime n
+ * is n x 1 x 1. dims and halo may be NULL, then all the extents and widths are the same and the grid is the most even one, e.g.
+ * 12 in 2 dims is 4x3
+ */
+void omp_factor_halo(int n, int factor[], int ndims, long * dims, long * halo) {
+	int d;
+	if (ndims < 1 || ndims > 3) {
+		fprintf(stderr, "%d dimensions of the device topology, only 1 to 3 are supported\n", ndims);
+		abort();
 	}
-	default:
-		fprintf(stderr, "more than 3 dimensions are not supported\n");
-		break;
+	if (n < 1) {
+		fprintf(stderr, "cannot factor %d devices into a grid\n", n);
+		abort();
 	}
+	int cand[ndims];
+	factor[0] = n;
+	for (d=1; d<ndims; d++) factor[d] = 1;
+	omp_factor_search(n, 0, ndims, cand, factor, dims, halo);
+}
+
+/**
+ * factor n into dims number of numbers whose multiplication equals to n
+ */
+void omp_factor(int n, int factor[], int dims) {
+	omp_factor_halo(n, factor, dims, NULL, NULL);
 }
 
 /**
@@ -1525,6 +3280,164 @@ void omp_grid_topology_init_simple (omp_grid_topology_t * top, omp_device_t **de
 	top->idmap = idmap;
 }
 
+/* the neighbors of the grid of a topology, the devices at positions p and q exchange a halo of weight elements */
+typedef struct omp_placement_edge {
+	int p;
+	int q;
+	double weight;
+} omp_placement_edge_t;
+
+/* the halo exchange cost of putting device order[p] at each position p, in halo elements x hops */
+static double omp_placement_cost(omp_placement_edge_t * edges, int num_edges, int * order, int * distance, int nnodes) {
+	double cost = 0.0;
+	int i;
+	for (i=0; i<num_edges; i++) cost += edges[i].weight * distance[order[edges[i].p] * nnodes + order[edges[i].q]];
+	return cost;
+}
+
+/* try all the orders of positions k to nnodes-1 */
+static void omp_placement_search(omp_placement_edge_t * edges, int num_edges, int * order, int k, int * distance, int nnodes,
+		int * best, double * best_cost) {
+	if (k == nnodes) {
+		double cost = omp_placement_cost(edges, num_edges, order, distance, nnodes);
+		if (cost < *best_cost) {
+			*best_cost = cost;
+			memcpy(best, order, sizeof(int) * nnodes);
+		}
+		return;
+	}
+	int i, t;
+	for (i=k; i<nnodes; i++) {
+		t = order[k]; order[k] = order[i]; order[i] = t;
+		omp_placement_search(edges, num_edges, order, k + 1, distance, nnodes, best, best_cost);
+		t = order[k]; order[k] = order[i]; order[i] = t;
+	}
+}
+
+/**
+ * place the devices in the grid of top so that the halo neighbors are close in the machine, see omp_device_distance. devs
+ * and top->idmap are reordered so the device at grid position (seqid) i is devs[i]. array_dims and halo are per topology dim as
+ * for omp_factor_halo (NULL for 1), they weigh the hops between the neighbors along each dim by the halo they exchange. All the
+ * orders are tried for up to OMP_PLACEMENT_EXHAUSTIVE devices, otherwise a greedy placement (or the given order if it is
+ * better) is improved by swapping pairs.
+ * returns the exchange cost of the placement in halo elements x hops, and that of the given order in *naive_cost
+ */
+double omp_grid_topology_place(omp_grid_topology_t * top, omp_device_t ** devs, long * array_dims, long * halo, double * naive_cost) {
+	int nnodes = top->nnodes;
+	int ndims = top->ndims;
+	int i, j, d, e;
+	int * distance = (int *) malloc(sizeof(int) * nnodes * nnodes);
+	for (i=0; i<nnodes; i++)
+		for (j=0; j<nnodes; j++) distance[i*nnodes+j] = omp_device_distance(devs[i], devs[j]);
+
+	omp_placement_edge_t * edges = (omp_placement_edge_t *) malloc(sizeof(omp_placement_edge_t) * nnodes * ndims);
+	int num_edges = 0;
+	int coords[ndims];
+	for (i=0; i<nnodes; i++) {
+		omp_topology_get_coords(top, i, ndims, coords);
+		for (d=0; d<ndims; d++) {
+			int c = coords[d];
+			if (c + 1 < top->dims[d]) coords[d] = c + 1;
+			else if (top->periodic[d] && top->dims[d] > 2) coords[d] = 0;
+			else continue;
+			double weight = halo != NULL ? halo[d] : 1;
+			for (e=0; e<ndims; e++) if (e != d && array_dims != NULL) weight *= (double) array_dims[e] / top->dims[e];
+			edges[num_edges].p = i;
+			edges[num_edges].q = omp_grid_topology_get_seqid_coords(top, coords);
+			edges[num_edges].weight = weight;
+			num_edges++;
+			coords[d] = c;
+		}
+	}
+
+	int order[nnodes];
+	int best[nnodes];
+	for (i=0; i<nnodes; i++) order[i] = best[i] = i;
+	double cost = omp_placement_cost(edges, num_edges, order, distance, nnodes);
+	if (naive_cost != NULL) *naive_cost = cost;
+	if (nnodes <= OMP_PLACEMENT_EXHAUSTIVE) {
+		omp_placement_search(edges, num_edges, order, 0, distance, nnodes, best, &cost);
+	} else {
+		/* start from the greedy placement, each position gets the device closest to the neighbors already placed */
+		int placed_dev[nnodes];
+		memset(placed_dev, 0, sizeof(int) * nnodes);
+		for (i=0; i<nnodes; i++) {
+			int pick = -1;
+			double pick_cost = 0.0;
+			for (j=0; j<nnodes; j++) {
+				if (placed_dev[j]) continue;
+				double c = 0.0;
+				for (e=0; e<num_edges; e++) {
+					if (edges[e].p == i && edges[e].q < i) c += edges[e].weight * distance[j*nnodes + order[edges[e].q]];
+					else if (edges[e].q == i && edges[e].p < i) c += edges[e].weight * distance[order[edges[e].p]*nnodes + j];
+				}
+				if (pick < 0 || c < pick_cost) {
+					pick = j;
+					pick_cost = c;
+				}
+			}
+			order[i] = pick;
+			placed_dev[pick] = 1;
+		}
+		double c = omp_placement_cost(edges, num_edges, order, distance, nnodes);
+		if (c < cost) {
+			cost = c;
+			memcpy(best, order, sizeof(int) * nnodes);
+		}
+		/* then swap pairs as long as it helps */
+		int improved = 1;
+		while (improved) {
+			improved = 0;
+			for (i=0; i<nnodes; i++) {
+				for (j=i+1; j<nnodes; j++) {
+					int t = best[i]; best[i] = best[j]; best[j] = t;
+					c = omp_placement_cost(edges, num_edges, best, distance, nnodes);
+					if (c < cost) {
+						cost = c;
+						improved = 1;
+					} else {
+						t = best[i]; best[i] = best[j]; best[j] = t;
+					}
+				}
+			}
+		}
+	}
+
+	omp_device_t * placed[nnodes];
+	for (i=0; i<nnodes; i++) placed[i] = devs[best[i]];
+	for (i=0; i<nnodes; i++) {
+		devs[i] = placed[i];
+		top->idmap[i] = devs[i]->id;
+	}
+	free(edges);
+	free(distance);
+	return cost;
+}
+
+/**
+ * the same as omp_grid_topology_init_simple, but the grid minimizes the halo surface of an array, see omp_factor_halo, and the
+ * devices are placed in the grid by omp_grid_topology_place (devs is reordered) unless OMP_DEV_PLACEMENT=0
+ */
+void omp_grid_topology_init_halo (omp_grid_topology_t * top, omp_device_t **devs, int nnodes, int ndims, int *dims, int *periodic, int * idmap,
+		long * array_dims, long * halo) {
+	omp_grid_topology_init_simple(top, devs, nnodes, ndims, dims, periodic, idmap);
+	omp_factor_halo(nnodes, dims, ndims, array_dims, halo);
+
+	int placement = 1;
+	char * placement_str = getenv("OMP_DEV_PLACEMENT");
+	if (placement_str != NULL) sscanf(placement_str, "%d", &placement);
+	if (placement == 0) return;
+	double naive_cost;
+	double cost = omp_grid_topology_place(top, devs, array_dims, halo, &naive_cost);
+	if (placement < 2) return;
+	int i;
+	printf("placement of %d devices in the grid", nnodes);
+	for (i=0; i<ndims; i++) printf("%s%d", i == 0 ? " " : "x", dims[i]);
+	printf(": devs");
+	for (i=0; i<nnodes; i++) printf(" %d(%s)", devs[i]->id, devs[i]->locality != NULL && devs[i]->locality[0] != '\0' ? devs[i]->locality : "host");
+	printf("\n\testimated halo exchange cost %.0f, %.0f in the given order (halo elements x hops)\n", cost, naive_cost);
+}
+
 void omp_topology_print(omp_grid_topology_t * top) {
 	printf("top: %X (%d): ", top, top->nnodes);
 	int i;
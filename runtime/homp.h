@@ -31,6 +31,7 @@ typedef struct omp_data_map omp_data_map_t;
 typedef struct omp_data_map_info omp_data_map_info_t;
 typedef struct omp_offloading_info omp_offloading_info_t;
 typedef struct omp_offloading omp_offloading_t;
+typedef struct omp_resident_map omp_resident_map_t;
 
 /**
  * multiple device support
@@ -63,6 +64,9 @@ extern omp_device_type_info_t omp_device_types[];
 /**
  * each stream also provide a limited number of event objects for collecting timing
  * information.
+ *
+ * For NVGPU, it is the cuda stream. For THSIM, myStream is NULL for the dev default stream whose operations are executed right away
+ * by the calling thread, or a in-order queue of operations executed by a stream worker thread (see homp_dev.c)
  */
 typedef struct omp_dev_stream {
 	omp_device_t * dev;
@@ -88,6 +92,47 @@ typedef enum omp_device_mem_type { /* the mem type related to the host mem */
 #define omp_device_mem_vas(mem_type) (mem_type == OMP_DEVICE_MEM_VIRTUAL_AS)
 #define omp_device_mem_discrete(mem_type) (mem_type == OMP_DEVICE_MEM_DISCRETE)
 
+/**
+ * caching allocator of device memory, one per device. Blocks freed by omp_map_free_dev are kept in bins of size classes (4 classes
+ * for each power of two) and reused by later omp_map_malloc_dev of the same class instead of calling cudaMalloc/malloc again.
+ * The pool never holds more memory (used + cached) than the high-water mark of the used memory, cached blocks (the largest
+ * class first) are released to make room if a new block has to be allocated. OMP_DEV_MEM_POOL_MAX_CACHED (MB) also caps the cached memory.
+ *
+ * A block must only be freed when all the work using it completed, the same requirement as for cudaFree which syncs the device.
+ *
+ * Each device also has a pool of the same kind for page-locked host staging buffers, see omp_map_malloc_staging.
+ */
+#define OMP_DEV_MEM_POOL_NUM_BINS 161
+#define OMP_DEV_MEM_POOL_HASH_SIZE 256
+typedef struct omp_dev_mem_block omp_dev_mem_block_t;
+struct omp_dev_mem_block {
+	void * ptr;
+	long size; /* the size of its size class */
+	int bin;
+	omp_dev_mem_block_t * next;
+};
+
+typedef struct omp_dev_mem_pool {
+	pthread_mutex_t lock;
+	omp_dev_mem_block_t * bins[OMP_DEV_MEM_POOL_NUM_BINS]; /* the cached blocks of each size class */
+	omp_dev_mem_block_t * used[OMP_DEV_MEM_POOL_HASH_SIZE]; /* the blocks in use, hashed by ptr */
+	omp_dev_mem_block_t * spare; /* unused block descriptors */
+	int host_staging; /* a pool of page-locked host staging buffers, not device memory */
+
+	long bytes_used;
+	long bytes_cached;
+	long high_water; /* the max of bytes_used */
+	long max_cached; /* the cap of bytes_cached, <0 for no cap */
+
+	/* statistics */
+	long num_allocs;
+	long num_hits; /* allocations served from the cache */
+	long num_frees;
+	long num_dev_allocs; /* calls to the device allocator, i.e. misses */
+	long num_dev_frees;
+	long num_trims; /* cached blocks released to keep under the high-water mark or the cap */
+} omp_dev_mem_pool_t;
+
 /**
  ********************* Runtime notes ***********************************************
  * runtime may want to have internal array to supports the programming APIs for multiple devices, e.g.
@@ -120,13 +165,45 @@ struct omp_device {
 	unsigned long bandwidth; /* between host memory and dev memory for profile data movement cost */
 
 	double real_flopss; /* the sustained flops/s after testing */
+	/* measured by the calibration at init or loaded from the calibration cache, see omp_calibrate_devices. Bandwidths are in
+	 * bytes/s and latencies in seconds, d2d_bandwidth[i] is for the copies from this device to device i
+	 */
+	int calibrated;
+	double h2d_bandwidth;
+	double h2d_latency;
+	double d2h_bandwidth;
+	double d2h_latency;
+	double mem_bandwidth;
+	double * d2d_bandwidth;
+	/* where the device sits in the machine: the NUMA node (-1 if not known) and the path of the node and the PCIe hierarchy from
+	 * sysfs, e.g. "node0/pci0000:00/0000:00:02.0/0000:03:08.0/0000:05:00.0" for a GPU behind a switch, see omp_device_distance
+	 */
+	int numa_node;
+	char * locality;
+	/* the cpus (a cpu_set_t) a THSIM device owns with OMP_THSIM_BIND, NULL if it is not bound. Its helper thread and kernel team
+	 * run on them and its memory is allocated on numa_node
+	 */
+	void * bind_cpus;
+	int num_bind_cpus;
+	/* the relative throughput of the device for OMP_DIST_POLICY_AUTO, from OMP_DIST_WEIGHTS or estimated from real_flopss at
+	 * init, and updated from the measured kernel time of recurring offloadings (see omp_offloading_fini_info). It is only
+	 * changed between offloadings so all the maps of an offloading are distributed with the same weights
+	 */
+	double dist_weight;
 
 	int status;
 	struct omp_device * next; /* the device list */
-	volatile omp_offloading_info_t * offload_request; /* this is the notification flag that the helper thread will pick up the offloading request */
+	/* the offloading queue of this device. Host threads push the per-device offloading object (omp_offloading_t) of their requests
+	 * onto offload_queue using lock-free cas (multiple producers), and the helper thread (single consumer) takes the whole
+	 * list at once, reverses it into offload_pending and runs them in the order of submission. offload_pending is only touched by
+	 * the helper thread.
+	 */
+	omp_offloading_t * volatile offload_queue;
+	omp_offloading_t * offload_pending;
 
-	omp_offloading_t * offload_stack[4];
-	/* the stack for keeping the nested but unfinished offloading request, we actually only need 2 so far.
+	omp_offloading_t ** offload_stack;
+	int offload_stack_size; /* allocated entries, the stack grows as needed so the nesting depth is not limited */
+	/* the stack for keeping the nested but unfinished offloading request.
 	 * However, if we know the current offload (being processed) is one that the device will run to completion, we will not put into the stack
 	 * for the purpose of saving the cost of push/pop. Thus the stack only keep those pending offload (e.g. inside a "target data" offload, we have
 	 * a "target" offload, the "target data" offload will be pushed to the stack. The purpose of this stack is to help data mapping inheritance, i.e.
@@ -136,11 +213,41 @@ struct omp_device {
 
 	omp_dev_stream_t devstream; /* per dev stream */
 
-	omp_data_map_t ** resident_data_maps; /* a link-list or an array for resident data maps (data maps cross multiple offloading region */
+	/* the resident data maps that live across offloadings, see omp_data_map_set_resident. It is a list in LRU order, most
+	 * recently used first, protected by resident_lock since host threads may update or release them.
+	 */
+	omp_resident_map_t * resident_data_maps;
+	pthread_mutex_t resident_lock;
+	long resident_bytes;
+	long resident_max_bytes; /* the budget of dev mem for unreferenced resident maps, <0 for no limit */
+	long resident_hits; /* statistics */
+	long resident_misses;
+	long resident_evictions;
+	long resident_bytes_saved; /* the bytes of transfers skipped */
+
+	omp_dev_mem_pool_t mem_pool; /* see omp_map_malloc_dev */
+	omp_dev_mem_pool_t staging_pool; /* see omp_map_malloc_staging */
 
 	pthread_t helperth;
+	/* the helper thread spins (with cpu relax) for a short while waiting for a request, and then parks on the condvar.
+	 * helper_spin is adapted between 0 and omp_helper_spin_max depending on whether requests arrive while spinning.
+	 */
+	pthread_mutex_t helper_mutex;
+	pthread_cond_t helper_cond;
+	volatile int helper_parked;
+	int helper_spin;
 };
 
+/* a hint to the cpu in a spin-wait loop, e.g. pause on x86 so the spinning thread does not starve its hyperthread sibling */
+#if defined (__i386__) || defined (__x86_64__)
+#define omp_cpu_relax() __builtin_ia32_pause()
+#else
+#define omp_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+/* the default max number of spin iterations before parking a helper thread, can be changed by OMP_HELPER_SPIN env */
+#define OMP_HELPER_SPIN_DEFAULT 20000
+extern int omp_helper_spin_max;
+
 /**
  * we organize record and timing as a sequence of event, recording could be done by host side or by device-specific approach
  */
@@ -162,6 +269,7 @@ typedef struct omp_event {
 	char event_description[OMP_EVENT_MSG_LENGTH];
 	int count; /* a counter for accumulating recurring event */
 	int recorded; /* everytime stop_record is called, this flag is set, and when a elapsed is calculated, this flag is reset */
+	long stream_ticket; /* for THSIM stream, the position of the stop record in the stream */
 
 
 #if defined (DEVICE_NVGPU_SUPPORT)
@@ -266,10 +374,10 @@ typedef enum omp_data_map_type {
 typedef enum omp_dist_policy {
 	OMP_DIST_POLICY_BLOCK,
 	OMP_DIST_POLICY_DUPLICATE,
-	OMP_DIST_POLICY_AUTO, /* the balanced data distribution so computation is balanced distributed, ideally */
+	OMP_DIST_POLICY_AUTO, /* the balanced data distribution so computation is balanced distributed, ideally. The range is cut in proportion to dist_weight of the devices */
 	OMP_DIST_POLICY_ALIGN,
-	OMP_DIST_POLICY_CYCLIC, /* user defined */
-	OMP_DIST_POLICY_FIX, /* fixed dist */
+	OMP_DIST_POLICY_CYCLIC, /* block-cyclic, chunks of chunk_size (default 1) are dealt out to the devices round-robin */
+	OMP_DIST_POLICY_FIX, /* fixed dist, each device gets one chunk of chunk_size in order and the last one also gets the rest */
 } omp_dist_policy_t;
 
 typedef enum omp_dist_target_type {
@@ -312,6 +420,12 @@ typedef struct omp_dist {
 	omp_dist_info_t * info; /* not yet used so far */
 	long offset;
 	long length;
+	/* for CYCLIC, the subregion is the chunks of chunk_size starting at offset + k*chunk_stride, length is the total of the
+	 * chunks and only the last one may be shorter. chunk_size is 0 for a single range. The chunks are packed one after
+	 * another in the dev mem, see omp_dist_chunk and omp_loop_map_chunk
+	 */
+	long chunk_size;
+	long chunk_stride;
 } omp_dist_t;
 
 /**
@@ -325,6 +439,7 @@ typedef struct omp_data_map_halo_region {
 	int topdim; /* which dimension of the device topology this halo region is related to, it is the same as the dim_index of dist object of the same dimension */
 } omp_data_map_halo_region_info_t;
 
+#define OMP_HALO_RELAY_SLOTS 2 /* the buffers of a halo relay, see omp_data_map_halo_region_mem_t */
 typedef struct omp_data_map_halo_region_mem {
 	/* the mem for halo management */
 	/* the in/out pointer is the buffer for the halo regions.
@@ -335,6 +450,12 @@ typedef struct omp_data_map_halo_region_mem {
 	int left_dev_seqid; /* left devseqid, can be used to access left_map and left_dev */
 	int right_dev_seqid;
 
+	/* a halo region spans the other dims of the map, so it is blocks blocks (the product of the lengths of the lower dims)
+	 * of size/blocks bytes, pitch bytes apart, e.g. the columns of a 2-d map for dim 1. blocks is 1 for dim 0
+	 */
+	long blocks;
+	long pitch;
+
 	char * left_in_ptr;
 	long left_in_size; /* for pull update, == right_out_size if push protocol is used */
 	char * left_out_ptr;
@@ -348,19 +469,37 @@ typedef struct omp_data_map_halo_region_mem {
 	/* if p2p communication is not available, we will need buffer at host to relay the halo exchange.
 	 * Each data map only maintains the relay pointers for halo that they need, i.e. a pull
 	 * protocol should be applied for halo exchange.
+	 *
+	 * The relay is double-buffered: exchange k goes through slot k%2 (OMP_HALO_RELAY_SLOTS slots of in_size bytes), so the
+	 * source can push the next exchange before the receiver has pulled the last one. pushed/pulled count the exchanges
+	 * the source and the receiver have submitted to their streams. They are published with release and read with acquire
+	 * ordering. The copies themselves are async, the receiver stream waits for the push event of the slot and the source
+	 * stream for the pull event of the slot before overwriting it, see omp_halo_region_pull
 	 */
 	char * left_in_host_relay_ptr;
 	volatile int left_in_data_in_relay_pushed;
 	volatile int left_in_data_in_relay_pulled;
-	/* the push flag is set when the data is pushed by the source to the host relay so the receiver side can pull,
-	 * a simple busy-wait is used to wait for the data to arrive
-	 */
+	omp_event_t left_in_relay_pull_events[OMP_HALO_RELAY_SLOTS]; /* recorded by the receiver (this map) */
+	omp_event_t left_out_relay_push_events[OMP_HALO_RELAY_SLOTS]; /* recorded by this map when it pushes to its left neighbor */
 	char * right_in_host_relay_ptr;
 	volatile int right_in_data_in_relay_pushed;
 	volatile int right_in_data_in_relay_pulled;
+	omp_event_t right_in_relay_pull_events[OMP_HALO_RELAY_SLOTS];
+	omp_event_t right_out_relay_push_events[OMP_HALO_RELAY_SLOTS];
+
+	/* set for the exchange being run if the halo region from (in) or to (out) the neighbor is packed with those of the
+	 * other maps of the exchange, see omp_halo_exchange_aggregate_plan. omp_halo_region_pull skips them
+	 */
+	char left_in_aggregated;
+	char left_out_aggregated;
+	char right_in_aggregated;
+	char right_out_aggregated;
 } omp_data_map_halo_region_mem_t;
 
+/* max rank of mapped arrays, marshalling and halo regions work for any rank up to it */
+#ifndef OMP_NUM_ARRAY_DIMENSIONS
 #define OMP_NUM_ARRAY_DIMENSIONS 3
+#endif
 
 /* for each mapped host array, we have one such object */
 struct omp_data_map_info {
@@ -386,6 +525,8 @@ struct omp_data_map_info {
 	  * arithmetic will make sure we do not go out of memory bound
 	  */
 	omp_data_map_halo_region_info_t * halo_info; /* it is an num_dims array */
+	int halo_depth; /* the steps of the stencil the halo serves between two exchanges, see omp_map_set_halo_depth */
+	int resident; /* the dev mem of the maps is kept across offloadings, see omp_data_map_set_resident */
 };
 
 /** a data map can only be changed by the shepherd thread of the device that map is belong to, but
@@ -418,9 +559,36 @@ struct omp_data_map {
 
 	int mem_noncontiguous;
 	omp_data_map_type_t map_type;
+	int strided_copy; /* the noncontiguous region is copied by strided memcpy between the array and dev mem, no marshalling */
+	int sliced; /* the map is cut into slices for pipelined offloading (see omp_offloading_pipeline_slice) or chunks for dynamic offloading (see omp_map_dynamic_dist) */
+	omp_resident_map_t * resident; /* the resident map whose dev mem this map uses, if the map info is resident */
+	/* for a deep halo (see omp_map_set_halo_depth), the steps the halo of the map can still serve since it was last exchanged,
+	 * and whether the current run of the exchange it is in updates it
+	 */
+	int halo_valid;
+	int halo_x_due;
 	//omp_dev_stream_t * stream; /* the stream operations of this data map are registered with, mostly it will be the stream created for an offloading */
 };
 
+/**
+ * A resident map keeps the dev mem of an array region after the offloading that maps it completes, so later offloadings
+ * mapping the same region of the same array onto the device reuse it and skip the transfer if the data is unchanged.
+ * Host changes must be announced with omp_map_update_to, and results written on the device are only copied back by
+ * omp_map_update_from, omp_map_release_resident, or when the map is evicted (LRU, under the budget of the device).
+ */
+struct omp_resident_map {
+	omp_data_map_info_t info; /* a copy of the info of the first map, the original may be gone after the offloading */
+	long dims[OMP_NUM_ARRAY_DIMENSIONS];
+	omp_data_map_t map; /* a copy of the map for transfers outside offloadings */
+	char * host_begin; /* the host address range covered by the region */
+	char * host_end;
+	int refcount; /* the number of offloadings using it, only unreferenced maps are evicted */
+	int host_dirty; /* the host copy is newer, the region is copied to the device at its next use */
+	int dev_dirty; /* the device copy is newer */
+	omp_resident_map_t * prev;
+	omp_resident_map_t * next;
+};
+
 /**
  * the data exchange direction, FROM is for pull, TO is for push
  */
@@ -492,13 +660,42 @@ typedef struct omp_kernel_profile_info {
 
 } omp_kernel_profile_info_t;
 
+/**
+ * a candidate distribution of the arrays of an offloading for omp_offloading_plan. num_load, num_store and num_fp_operations of the
+ * kernel profile are per iteration, loads and stores in elements of the iteration map
+ */
+typedef struct omp_plan_candidate {
+	const char * name;
+	int top_ndims; /* the devices are arranged as a top_ndims grid, see omp_grid_topology_init_simple */
+	omp_dist_info_t ** dists; /* the dist info of the dims of each mapped array, in the order of the data map infos. ALIGN is not supported */
+	int iteration_map; /* the mapped array whose distribution the iterations follow, a device runs the iterations of its region */
+
+	/* the prediction in ms for the slowest device, filled in by omp_offloading_plan */
+	double compute;
+	double transfer;
+	double halo;
+	double total;
+	int slowest; /* the seqid of the slowest device, -1 if the candidate cannot be predicted (ALIGN dist) and is skipped */
+} omp_plan_candidate_t;
+
+/* one adaptive repartitioning of a recurring offloading, see omp_offloading_rebalance */
+typedef struct omp_rebalance_record {
+	int run; /* the number of runs of the offloading when it is rebalanced */
+	double imbalance_before; /* (max-avg)/avg of the per-device kernel time, measured before and after the repartitioning */
+	double imbalance_after; /* < 0 until it is measured at the next check */
+	long rows_migrated; /* the rows of dim 0 that moved to another device */
+} omp_rebalance_record_t;
+
+#define OMP_REBALANCE_HISTORY 16
+#define OMP_DYNAMIC_CHUNK_MS 2.0 /* the kernel time a chunk of a dynamic offloading is sized for */
+
 /**
   * info per kernel/data offloading
   *
   * For each offloading to one or multiple devices, we will maintain an object of omp_offloading_info
   * that keeps track of the topology of target devices, the mapped variables and other info.
   *
-  * The barrier is used for syncing target devices
+  * The barrier is used for syncing target devices, and the host waits for completion using the per-device completion counters
   *
   * Also each device maintains its own offloading stack, the nest offloading operations to the device, see omp_device object.
   *
@@ -538,11 +735,62 @@ struct omp_offloading_info {
 	omp_data_map_halo_exchange_info_t * halo_x_info;
 	int num_maps_halo_x;
 
+	/* submission and completion: an off_info has at most one submission in flight. Each target device bumps its own
+	 * completion counter (num_completed in its omp_offloading_t) when it is done, and the submission is completed when all the
+	 * counters reach num_submitted. The host never joins the barrier, which only syncs target devices within an offloading,
+	 * e.g. around halo exchange.
+	 */
+	volatile int num_submitted;
+	volatile int num_completed;
+
+	/* opt-in chunked copy/compute pipelining (see omp_offloading_set_pipeline), 0 if the offloading runs in phases.
+	 * Each device cuts its dim-0 range into pipeline_slices slices which are rotated over pipeline_streams streams
+	 */
+	int pipeline_slices;
+	int pipeline_streams;
+
+	/* opt-in adaptive rebalancing (see omp_offloading_set_rebalance), the per-device kernel time is checked every
+	 * rebalance_interval runs and the dim-0 partition of the maps is moved when the imbalance exceeds rebalance_threshold
+	 */
+	double rebalance_threshold;
+	int rebalance_interval;
+	int rebalance_runs; /* the number of runs at the last check */
+	int num_rebalances;
+	long rebalance_rows_migrated;
+	omp_rebalance_record_t rebalance_history[OMP_REBALANCE_HISTORY];
+
+	/* opt-in dynamic scheduling (see omp_offloading_set_dynamic), the dim-0 range of the maps is not split statically, but
+	 * claimed chunk by chunk by the devices from the shared cursor dynamic_next, which is reset for each submission
+	 */
+	int dynamic;
+	long dynamic_min_chunk;
+	long dynamic_max_chunk;
+	volatile long dynamic_next;
+
 	/* the participating barrier */
 	pthread_barrier_t barrier;
 };
 
-#define OFF_MAP_CACHE_SIZE 64
+/**
+ * an entry of the map cache of an offloading. [host_begin, host_end) is the host address range of the whole mapped array, so a
+ * pointer anywhere inside the array finds the map
+ */
+typedef struct omp_map_cache_entry {
+	omp_data_map_t * map;
+	int inherited; /* flag to mark whether this is an inherited map or not */
+	char * host_begin;
+	char * host_end;
+} omp_map_cache_entry_t;
+
+/* an entry of the interval index of a map cache, sorted by host_begin */
+typedef struct omp_map_index_entry {
+	char * host_begin;
+	char * max_end; /* the max host_end of this and all the entries before it, to stop the search for nested ranges */
+	int slot; /* the entry in map_cache */
+} omp_map_index_entry_t;
+
+#define OFF_MAP_CACHE_INIT_SIZE 16
+
 /**
  * info for per device
  *
@@ -551,6 +799,32 @@ struct omp_offloading_info {
  *
  * The next pointer is used to form the offloading queue (see omp_device struct)
  */
+/**
+ * a directed edge of the aggregated halo exchange of an offloading on a device: the halo regions of a dim of all the maps of
+ * the exchange that go to (out) or come from (in) the neighbor on one side are packed into buf and moved with a single
+ * transfer, see omp_halo_exchange_aggregate_plan. The source copies into the buf (or host_relay_ptr if it cannot copy to
+ * the device) of the in edge of the receiver and then sets its ready
+ */
+typedef struct omp_halo_x_edge {
+	int peer; /* the seqid of the neighbor, -1 if the edge is not aggregated */
+	int num_regions;
+	long size; /* of all the halo regions */
+	char * buf; /* dev mem */
+	char * host_relay_ptr; /* in edge only */
+	volatile int ready; /* in edge only */
+} omp_halo_x_edge_t;
+
+/* OMP_HALO_AGGREGATE, when to aggregate the halo exchange of the maps of an offloading */
+#define OMP_HALO_AGGREGATE_NEVER 0
+#define OMP_HALO_AGGREGATE_AUTO 1 /* if the transfers saved cost more than packing, see omp_halo_exchange_aggregate_plan */
+#define OMP_HALO_AGGREGATE_ALWAYS 2
+extern int omp_halo_aggregate;
+
+/* OMP_HALO_SYNC, how the devices sync for the halo exchange of an offloading, see omp_halo_exchange_sync */
+#define OMP_HALO_SYNC_BARRIER 0 /* all the devices of the offloading */
+#define OMP_HALO_SYNC_NEIGHBOR 1 /* each device with its neighbors only */
+extern int omp_halo_sync;
+
 struct omp_offloading {
 	/* per-offloading info */
 	omp_offloading_info_t * off_info;
@@ -562,13 +836,15 @@ struct omp_offloading {
 	omp_device_t * dev; /* the dev object, as cached info */
 	omp_offloading_stage_t stage;
 
-	/* we will use a simple fix-sized array for simplicity and performance (than a linked list) */
-	/* an offload can has as many as OFFLOADING_MAP_CACHE_SIZE mapped variable */
-	struct {
-		omp_data_map_t * map;
-		int * inherited; /* flag to mark whether this is an inherited map or not */
-	} map_cache[OFF_MAP_CACHE_SIZE];
+	/* the maps used by this offloading, in the order they are appended, and map_index, the slots of map_cache sorted by
+	 * host_begin, which is the interval index searched by omp_map_get_map. Both grow as needed (see
+	 * omp_offload_append_map_to_cache) and are freed by omp_offloading_fini_info
+	 */
+	omp_map_cache_entry_t * map_cache;
+	omp_map_index_entry_t * map_index;
 	int num_maps;
+	int map_cache_size; /* allocated entries, 0 for the fixed cache of a pipeline slice */
+	int buffers_mapped; /* the host/dev buffers of the maps are allocated and not yet released, see omp_map_release_buffers */
 
 	omp_dist_t loop_dist[3];
 
@@ -581,12 +857,65 @@ struct omp_offloading {
 	long X2, Y2, Z2; /* the second level kernel thread config, e.g. CUDA gridDim */
 	void *args;
 	void (*kernel_launcher)(omp_offloading_t *, void *); /* device specific kernel, if any */
+
+	/* for pipelined offloading: an offloading object per slice whose map cache points to the slices of the maps,
+	 * the streams the slices are rotated over, and three events (copy-in, kernel, copy-out) per slice
+	 */
+	omp_offloading_t * slices;
+	int num_slices;
+	omp_data_map_t * slice_maps;
+	omp_map_cache_entry_t * slice_map_cache;
+	omp_map_index_entry_t * slice_map_index;
+	omp_dev_stream_t * slice_streams;
+	int num_slice_streams;
+	omp_event_t * slice_events;
+	double slice_elapsed[3]; /* accumulated copy-in, kernel and copy-out time of all the slices, for the overlap report */
+
+	/* the accumulated kernel time and count at the last rebalance check, and the average kernel time since the check before */
+	double rebalance_kern_mark;
+	int rebalance_kern_count;
+	double rebalance_kern_ms;
+
+	/* for dynamic scheduling: the dim-0 capacity of the chunk buffers, the chunks and iterations this device claimed in the
+	 * last run, the smallest and largest of its chunks and the smoothed iterations per ms used to size the next chunk
+	 */
+	long dynamic_capacity;
+	long dynamic_chunks;
+	long dynamic_iterations;
+	long dynamic_min;
+	long dynamic_max;
+	double dynamic_rate;
+
+	/* the aggregated halo exchange, [dim][0] for the left neighbor and [dim][1] for the right, planned for each run */
+	omp_halo_x_edge_t halo_x_in[OMP_NUM_ARRAY_DIMENSIONS][2];
+	omp_halo_x_edge_t halo_x_out[OMP_NUM_ARRAY_DIMENSIONS][2];
+	/* the number of the halo exchange sync points this device has passed, see omp_halo_exchange_sync. The neighbors that
+	 * wait for it park on the cond after spinning
+	 */
+	volatile int halo_x_phase;
+	volatile int halo_x_parked;
+	int halo_x_spin; /* the spin budget of this device for waiting on a neighbor */
+	pthread_mutex_t halo_x_mutex;
+	pthread_cond_t halo_x_cond;
+
+	/* the link of the device offloading queue */
+	omp_offloading_t * qnext;
+	/* per-device completion counter, the number of submissions of the off_info this dev has completed */
+	volatile int num_completed;
 };
 
 /* init the device objects, num_of_devices, helper threads, default_device_var ICV etc 
     return # of devices initialized 
 */
 extern int omp_init_devices(); 
+/* measure the devices, or load the measurements from the calibration cache, called by omp_init_devices */
+extern void omp_calibrate_devices();
+/* find the NUMA node and PCIe path of the devices from sysfs or OMP_DEV_LOCALITY, called by omp_init_devices */
+extern void omp_device_locality_init();
+/* the number of hops between two devices in the machine topology, crossing NUMA nodes costs OMP_NUMA_CROSS_HOPS more */
+extern int omp_device_distance(omp_device_t * dev, omp_device_t * peer);
+/* pin the calling helper thread of a THSIM device to the cpus of the device, see OMP_THSIM_BIND */
+extern void omp_thsim_bind_self(omp_device_t * dev);
 
 /* terminate helper threads
  */
@@ -600,18 +929,50 @@ extern void omp_offloading_init_info(const char *name, omp_offloading_info_t *in
 extern void omp_offloading_fini_info(omp_offloading_info_t * info);
 extern void omp_offloading_info_report_profile(omp_offloading_info_t * info);
 
+/* enable chunked copy/compute pipelining for the offloading, must be called after omp_offloading_init_info. nslices <= 1 disables it */
+extern void omp_offloading_set_pipeline(omp_offloading_info_t * info, int nslices, int nstreams);
+/* enable adaptive rebalancing of a recurring offloading, checked every interval runs by omp_offloading_rebalance. interval <= 0 disables it.
+ * It needs OMP_BREAKDOWN_TIMING for the per-device kernel time, without it rebalancing stays disabled with a warning */
+extern void omp_offloading_set_rebalance(omp_offloading_info_t * info, double threshold, int interval);
+/* must be called when no offloading that uses the maps of info is in flight, return 1 if the maps are repartitioned */
+extern int omp_offloading_rebalance(omp_offloading_info_t * info);
+/* enable dynamic scheduling of the dim-0 range of the maps, chunk sizes are bounded by [min_chunk, max_chunk], 0 for the
+ * defaults. Must be called after omp_offloading_init_info
+ */
+extern void omp_offloading_set_dynamic(omp_offloading_info_t * info, long min_chunk, long max_chunk);
+extern void omp_map_dynamic_dist(omp_data_map_t * map, omp_offloading_t * off);
+extern void omp_map_dynamic_chunk(omp_data_map_t * map, long offset, long length);
+/* predict the time of each candidate on the targets from the profile and the calibrated devices, return the fastest one, -1 if none can be predicted */
+extern int omp_offloading_plan(omp_kernel_profile_info_t * profile, omp_device_t ** targets, int num_targets, int num_mapped_vars,
+		omp_data_map_info_t * data_map_info, omp_plan_candidate_t * candidates, int num_candidates);
+/* the predicted versus the measured time of each device of an offloading after it ran, needs OMP_BREAKDOWN_TIMING */
+extern void omp_offloading_plan_report(omp_offloading_info_t * info, omp_kernel_profile_info_t * profile, int iteration_map);
+extern void omp_offloading_pipeline_slice(omp_offloading_t * off);
+extern void omp_offloading_pipeline_fini(omp_offloading_t * off);
 extern void omp_offloading_append_data_exchange_info (omp_offloading_info_t * info, omp_data_map_halo_exchange_info_t * halo_x_info, int num_maps_halo_x);
 extern void omp_offloading_standalone_data_exchange_init_info(const char * name, omp_offloading_info_t * info,
 		omp_grid_topology_t * top, omp_device_t **targets, int recurring, int num_mapped_vars, omp_data_map_info_t * data_map_info, omp_data_map_halo_exchange_info_t * halo_x_info, int num_maps_halo_x );
 extern void omp_offloading_start(omp_offloading_info_t * off_info);
+/* asynchronous offloading, the off_info itself is the handle to wait on or test for the completion of the submission */
+extern omp_offloading_info_t * omp_offloading_start_async(omp_offloading_info_t * off_info);
+extern void omp_offloading_wait(omp_offloading_info_t * off_info);
+extern int omp_offloading_test(omp_offloading_info_t * off_info);
+extern int omp_offloading_wait_any(omp_offloading_info_t ** off_infos, int count);
 extern void helper_thread_main(void * arg);
+extern void omp_helper_notify(omp_device_t * dev);
 
 extern void omp_stream_create(omp_device_t * d, omp_dev_stream_t * stream, int using_dev_default);
 extern void omp_stream_destroy(omp_dev_stream_t * st);
 extern void omp_stream_sync(omp_dev_stream_t *st);
+extern void omp_stream_launch_kernel(omp_dev_stream_t * stream, void (*kernel_launcher)(omp_offloading_t *, void *), omp_offloading_t * off, void * args);
+extern void omp_stream_wait_event(omp_dev_stream_t * stream, omp_event_t * ev);
+extern void omp_stream_record_event(omp_dev_stream_t * stream, omp_event_t * ev);
+extern void omp_event_sync(omp_event_t * ev);
 extern void omp_cleanup(omp_offloading_t * off);
+extern void omp_map_release_buffers(omp_offloading_t * off);
 
 extern void omp_event_init(omp_event_t * ev, omp_device_t * dev, omp_event_record_method_t record_method);
+extern void omp_event_destroy(omp_event_t * ev);
 extern void omp_event_print(omp_event_t * ev);
 extern void omp_event_record_start(omp_event_t * ev, omp_dev_stream_t * stream, const char * event_name, const char * event_msg, ...);
 extern void omp_event_record_stop(omp_event_t * ev);
@@ -622,10 +983,20 @@ extern void omp_event_accumulate_elapsed_ms(omp_event_t * ev);
 extern void omp_offloading_clear_report_info(omp_offloading_info_t * info);
 
 extern void omp_grid_topology_init_simple (omp_grid_topology_t * top, omp_device_t ** devs, int nnodes, int ndims, int *dims, int *periodic, int * idmap);
+/* the grid minimizes the halo surface of an array of extents array_dims with halo widths halo (left + right), per topology dim,
+ * and devs is reordered so the halo neighbors are close in the machine, see omp_grid_topology_place */
+extern void omp_grid_topology_init_halo (omp_grid_topology_t * top, omp_device_t ** devs, int nnodes, int ndims, int *dims, int *periodic, int * idmap,
+		long * array_dims, long * halo);
 /*  factor input n into dims number of numbers (store into factor[]) whose multiplication equals to n */
 extern void omp_factor(int n, int factor[], int dims);
+/* the factoring of n into ndims (1-3) numbers that minimizes the halo surface of an array, see omp_grid_topology_init_halo */
+extern void omp_factor_halo(int n, int factor[], int ndims, long * dims, long * halo);
+#define OMP_PLACEMENT_EXHAUSTIVE 8 /* the max number of devices all of whose placements in a grid are tried */
+/* order devs in the grid so the halo neighbors are close in the machine, returns the estimated exchange cost */
+extern double omp_grid_topology_place(omp_grid_topology_t * top, omp_device_t ** devs, long * array_dims, long * halo, double * naive_cost);
 extern void omp_topology_print(omp_grid_topology_t * top);
 extern int omp_grid_topology_get_seqid(omp_grid_topology_t * top, int devid);
+extern int omp_topology_get_coords(omp_grid_topology_t * top, int sid, int ndims, int coords[]);
 
 extern void omp_data_map_init_info(const char * symbol, omp_data_map_info_t *info, omp_grid_topology_t * top, void * source_ptr, int num_dims, long* dims, int sizeof_element,
 		omp_data_map_t *maps, omp_data_map_direction_t map_direction, omp_data_map_type_t map_type, omp_dist_info_t * dist);
@@ -638,10 +1009,16 @@ extern void omp_data_map_init_info_straight_dist(const char *symbol, omp_data_ma
 extern void omp_data_map_init_info_straight_dist_and_halo(const char *symbol, omp_data_map_info_t *info, omp_grid_topology_t *top, void *source_ptr, int num_dims, long *dims, int sizeof_element,
 		omp_data_map_t *maps, omp_data_map_direction_t map_direction, omp_data_map_type_t map_type, omp_dist_info_t *dist, omp_dist_policy_t dist_policy, omp_data_map_halo_region_info_t *halo_info, int halo_left, int halo_right, int halo_cyclic);
 extern void omp_dist_init_info(omp_dist_info_t *dist_info, omp_dist_policy_t dist_policy, long start, long length, int topdim);
+extern void omp_dist_init_info_chunk(omp_dist_info_t *dist_info, omp_dist_policy_t dist_policy, long start, long length, long chunk_size, int topdim);
 extern void omp_data_map_init_map(omp_data_map_t *map, omp_data_map_info_t *info, omp_device_t *dev);
 extern void omp_data_map_dist(omp_data_map_t *map, int seqid);
 extern void omp_loop_iteration_dist(omp_offloading_t * off);
+extern void omp_dist_auto(omp_grid_topology_t * top, int topdim, long start, long full_length, int position, long * offstart, long * length);
+extern void omp_dist_fix(long start, long full_length, long chunk_size, long position, int dim, long * offstart, long * length);
+extern void omp_dist_cyclic(long start, long full_length, long chunk_size, long position, int dim, long * offstart, long * length, long * chunk_stride);
 extern void omp_map_add_halo_region(omp_data_map_info_t * info, int dim, int left, int right, int cyclic);
+extern void omp_map_set_halo_depth(omp_data_map_info_t * info, int depth);
+extern int omp_halo_exchange_due(omp_offloading_t * off);
 extern int omp_data_map_has_halo(omp_data_map_info_t * info, int dim);
 extern int omp_data_map_get_halo_left_devseqid(omp_data_map_t * map, int dim);
 extern int omp_data_map_get_halo_right_devseqid(omp_data_map_t * map, int dim);
@@ -649,6 +1026,8 @@ extern int omp_data_map_get_halo_right_devseqid(omp_data_map_t * map, int dim);
 extern void omp_offload_append_map_to_cache (omp_offloading_t *off, omp_data_map_t *map, int inherited);
 extern int omp_map_is_map_inherited(omp_offloading_t *off, omp_data_map_t *map);
 extern omp_data_map_t * omp_map_get_map_inheritance (omp_device_t * dev, void * host_ptr);
+extern omp_map_cache_entry_t * omp_map_cache_lookup(omp_offloading_t *off, void * host_ptr);
+extern void omp_offloading_fini_map_cache(omp_offloading_t *off);
 extern omp_data_map_t * omp_map_get_map(omp_offloading_t *off, void * host_ptr, int map_index);
 extern void omp_print_data_map(omp_data_map_t * map);
 extern void omp_map_buffer(omp_data_map_t * map, omp_offloading_t * off);
@@ -657,6 +1036,16 @@ extern void omp_map_marshal(omp_data_map_t * map);
 extern void omp_map_unmarshal(omp_data_map_t * map);
 extern void omp_map_free_dev(omp_device_t * dev, void * ptr);
 extern void * omp_map_malloc_dev(omp_device_t * dev, long size);
+extern void * omp_map_malloc_staging(omp_device_t * dev, long size);
+extern void omp_map_free_staging(omp_device_t * dev, void * ptr);
+extern void omp_dev_mem_pool_init(omp_device_t * dev);
+extern void omp_dev_mem_pool_fini(omp_device_t * dev);
+extern void omp_dev_mem_pool_trim(omp_device_t * dev, long max_cached);
+extern void omp_dev_mem_pool_print_stats(omp_device_t * dev);
+extern int omp_dev_mem_pool_enabled;
+extern void omp_marshal_pool_init(int num_devices);
+extern void omp_marshal_pool_fini();
+extern int omp_marshal_num_threads;
 extern void omp_map_mapto(omp_data_map_t * map);
 extern void omp_map_mapto_async(omp_data_map_t * map, omp_dev_stream_t * stream);
 extern void omp_map_mapfrom(omp_data_map_t * map);
@@ -665,11 +1054,38 @@ extern void omp_map_memcpy_to(void * dst, omp_device_t * dstdev, const void * sr
 extern void omp_map_memcpy_to_async(void * dst, omp_device_t * dstdev, const void * src, long size, omp_dev_stream_t * stream);
 extern void omp_map_memcpy_from(void * dst, const void * src, omp_device_t * srcdev, long size);
 extern void omp_map_memcpy_from_async(void * dst, const void * src, omp_device_t * srcdev, long size, omp_dev_stream_t * stream);
+extern void omp_map_memcpy_2d_to(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, long width, long height);
+extern void omp_map_memcpy_2d_to_async(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, long width, long height, omp_dev_stream_t * stream);
+extern void omp_map_memcpy_2d_from(void * dst, long dpitch, const void * src, long spitch, omp_device_t * srcdev, long width, long height);
+extern void omp_map_memcpy_2d_from_async(void * dst, long dpitch, const void * src, long spitch, omp_device_t * srcdev, long width, long height, omp_dev_stream_t * stream);
+extern void omp_map_memcpy_2d_DeviceToDevice(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, omp_device_t * srcdev, long width, long height);
+extern void omp_map_memcpy_2d_DeviceToDeviceAsync(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, omp_device_t * srcdev,
+		long width, long height, omp_dev_stream_t * stream);
+extern void omp_map_memcpy_3d_to(void * dst, long dpitch, long dheight, omp_device_t * dstdev, const void * src, long spitch, long sheight, long width, long height, long depth);
+extern void omp_map_memcpy_3d_to_async(void * dst, long dpitch, long dheight, omp_device_t * dstdev, const void * src, long spitch, long sheight, long width, long height, long depth, omp_dev_stream_t * stream);
+extern void omp_map_memcpy_3d_from(void * dst, long dpitch, long dheight, const void * src, long spitch, long sheight, omp_device_t * srcdev, long width, long height, long depth);
+extern void omp_map_memcpy_3d_from_async(void * dst, long dpitch, long dheight, const void * src, long spitch, long sheight, omp_device_t * srcdev, long width, long height, long depth, omp_dev_stream_t * stream);
+extern int omp_map_region_pitch(omp_data_map_t * map, long * width, long * height, long * depth, long * spitch, long * sheight);
+extern int omp_map_strided_copy_enabled;
+extern void omp_data_map_set_resident(omp_data_map_info_t * info);
+extern char * omp_map_resident_acquire(omp_data_map_t * map);
+extern void omp_map_resident_release(omp_data_map_t * map);
+extern int omp_map_resident_need_mapto(omp_data_map_t * map);
+extern void omp_map_resident_set_dev_dirty(omp_data_map_t * map);
+extern void omp_map_update_to(void * host_ptr, long size);
+extern void omp_map_update_from(void * host_ptr, long size);
+extern void omp_map_release_resident(void * host_ptr, long size);
+extern void omp_resident_maps_fini(omp_device_t * dev);
 extern int omp_map_enable_memcpy_DeviceToDevice(omp_device_t * dstdev, omp_device_t * srcdev);
 extern void omp_map_memcpy_DeviceToDevice(void * dst, omp_device_t * dstdev, void * src, omp_device_t * srcdev, int size) ;
 extern void omp_map_memcpy_DeviceToDeviceAsync(void * dst, omp_device_t * dstdev, void * src, omp_device_t * srcdev, int size, omp_dev_stream_t * srcstream);
 
-extern void omp_halo_region_pull(omp_data_map_t * map, int dim, omp_data_map_exchange_direction_t from_left_right);
+extern void omp_halo_region_pull(omp_data_map_t * map, int dim, omp_data_map_exchange_direction_t from_left_right, omp_dev_stream_t * stream);
+extern void omp_halo_exchange_aggregate_plan(omp_offloading_t * off);
+extern void omp_halo_exchange_aggregate_push(omp_offloading_t * off, int dim);
+extern void omp_halo_exchange_aggregate_pull(omp_offloading_t * off, int dim);
+extern void omp_halo_exchange_aggregate_fini(omp_offloading_t * off);
+extern void omp_halo_exchange_sync(omp_offloading_t * off);
 extern void omp_halo_region_pull_async(omp_data_map_t * map, int dim, int from_left_right);
 
 extern int omp_get_max_threads_per_team(omp_device_t * dev);
@@ -698,6 +1114,25 @@ extern void xomp_beyond_block_reduction_float_stream_callback(cudaStream_t strea
  *
  */
 extern long omp_loop_map_range (omp_data_map_t * map, int dim, long start, long length, long * map_start, long * map_length);
+/* the range of dim of map the device computes in this step, without the halo but with the still valid band of a deep halo */
+extern long omp_loop_map_valid_range(omp_data_map_t * map, int dim, long * map_start, long * map_length);
+
+/**
+ * the chunk iterator of a (block-)cyclic dist, a dist of any other policy has one chunk which is the whole range.
+ * omp_dist_chunk returns the start index of chunk k in the original array, and *local_start and *length give where the chunk is
+ * in the subregion (i.e. the dev mem of a map, or the iterations of the device). It returns -1 if there is no chunk k, so
+ * a launcher walks the chunks it owns with:
+ *
+ *   for (k=0; omp_loop_map_chunk(map, 0, k, &start, &length) >= 0; k++) ...
+ *
+ * For a map with a cyclic dim, the chunks are packed in the dev mem one box after another, omp_map_chunk_dev_ptr gives the
+ * box of chunk k, whose extent is that of the map with the cyclic dim replaced by the chunk length
+ */
+extern int omp_dist_num_chunks(omp_dist_t * dist);
+extern long omp_dist_chunk(omp_dist_t * dist, int chunk, long * local_start, long * length);
+extern long omp_loop_map_chunk(omp_data_map_t * map, int dim, int chunk, long * map_start, long * map_length);
+extern int omp_map_num_chunks(omp_data_map_t * map);
+extern void * omp_map_chunk_dev_ptr(omp_data_map_t * map, int chunk);
 
 /* util */
 extern double read_timer_ms();
@@ -16,10 +16,21 @@
 
 #endif
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* cpu_set_t and pthread_setaffinity_np for binding THSIM devices */
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined (_OPENMP)
+#include <omp.h>
+#endif
 #include "homp.h"
 
 inline void devcall_errchk(int code, char *file, int line, int ab) {
@@ -36,6 +47,32 @@ inline void devcall_errchk(int code, char *file, int line, int ab) {
 #endif
 }
 
+#define OMP_THSIM_FLOPS_PER_CYCLE 8 /* the estimate of a core with 256-bit SIMD, used if the device is not calibrated */
+
+#if defined (DEVICE_NVGPU_SUPPORT)
+/* the number of cores per SM for the compute capability */
+static int omp_nvgpu_cores_per_sm(int major, int minor) {
+	if (major == 2) return minor == 0 ? 32 : 48;
+	if (major == 3) return 192;
+	if (major == 5) return 128;
+	if (major == 6) return minor == 0 ? 64 : 128;
+	if (major == 7) return 64;
+	if (major == 8) return minor == 0 ? 64 : 128;
+	return 128;
+}
+#endif
+
+/* the max frequency of the host cores in Hz from sysfs, or 2GHz if it is not available */
+static unsigned long omp_host_core_frequency() {
+	unsigned long khz = 0;
+	FILE * fp = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%lu", &khz) != 1) khz = 0;
+		fclose(fp);
+	}
+	return khz > 0 ? khz * 1000 : 2000000000UL;
+}
+
 void * omp_init_dev_specific(omp_device_t * dev) {
 	omp_device_type_t devtype = dev->type;
 	dev->devstream.dev = dev;
@@ -46,6 +83,15 @@ void * omp_init_dev_specific(omp_device_t * dev) {
 		cudaSetDevice(dev->sysid);
 		cudaGetDeviceProperties(dev->dev_properties, dev->sysid);
 		dev->devstream.systream.cudaStream = 0;
+		struct cudaDeviceProp * prop = (struct cudaDeviceProp*)dev->dev_properties;
+		dev->mem_size = prop->totalGlobalMem;
+		dev->num_chips = prop->multiProcessorCount;
+		dev->num_cores = prop->multiProcessorCount * omp_nvgpu_cores_per_sm(prop->major, prop->minor);
+		dev->core_frequency = prop->clockRate * 1000UL;
+		dev->bandwidth = 2UL * prop->memoryClockRate * 1000UL * (prop->memoryBusWidth / 8);
+		dev->real_flopss = 2.0 * dev->num_cores * dev->core_frequency; /* peak with fma */
+		dev->max_teams = prop->maxGridSize[0];
+		dev->max_threads = prop->maxThreadsPerBlock;
 
 		/* warm up the device */
 		void * dummy_dev;
@@ -58,12 +104,174 @@ void * omp_init_dev_specific(omp_device_t * dev) {
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
 		dev->dev_properties = &dev->helperth; /* make it point to the thread id */
+		dev->mem_size = (unsigned long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE); /* the host memory */
+		dev->max_teams = 1;
+		dev->max_threads = dev->bind_cpus != NULL ? dev->num_bind_cpus : 1;
+		dev->num_chips = 1;
+		dev->num_cores = dev->bind_cpus != NULL ? dev->num_bind_cpus : 1; /* the helper thread, or the cpus it is bound to */
+		dev->core_frequency = omp_host_core_frequency();
+		dev->bandwidth = 0; /* shared with the host */
+		dev->real_flopss = (double) OMP_THSIM_FLOPS_PER_CYCLE * dev->core_frequency;
 	} else {
 
 	}
 	return dev->dev_properties;
 }
 
+/**************************** THSIM binding, see OMP_THSIM_BIND *******************************/
+#define OMP_MAX_NUMA_NODES 64
+#define OMP_MPOL_PREFERRED 1 /* from linux/mempolicy.h */
+
+/* add the cpus of a cpulist, e.g. "0-3,8,10-11", to set. returns the number of cpus added */
+static int omp_cpulist_parse(const char * list, cpu_set_t * set) {
+	int count = 0;
+	while (*list != '\0') {
+		int first, last, n;
+		if (sscanf(list, "%d%n", &first, &n) != 1) break;
+		list += n;
+		last = first;
+		if (*list == '-') {
+			if (sscanf(list + 1, "%d%n", &last, &n) != 1) break;
+			list += n + 1;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++) {
+			if (!CPU_ISSET(first, set)) count++;
+			CPU_SET(first, set);
+		}
+		while (*list == ',' || *list == ' ' || *list == '\n') list++;
+	}
+	return count;
+}
+
+/* the cpus of a NUMA node from sysfs, returns 0 if there is no such node */
+static int omp_numa_node_cpus(int node, cpu_set_t * set) {
+	char path[128];
+	char list[1024];
+	CPU_ZERO(set);
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE * fp = fopen(path, "r");
+	if (fp == NULL) return 0;
+	int count = 0;
+	if (fgets(list, sizeof(list), fp) != NULL) count = omp_cpulist_parse(list, set);
+	fclose(fp);
+	return count;
+}
+
+/* the NUMA node of the first cpu of set, -1 if not known */
+static int omp_cpus_numa_node(cpu_set_t * set) {
+	cpu_set_t node_cpus;
+	int node, cpu;
+	for (cpu=0; cpu<CPU_SETSIZE && !CPU_ISSET(cpu, set); cpu++);
+	if (cpu == CPU_SETSIZE) return -1;
+	for (node=0; node<OMP_MAX_NUMA_NODES; node++) {
+		if (omp_numa_node_cpus(node, &node_cpus) && CPU_ISSET(cpu, &node_cpus)) return node;
+	}
+	return -1;
+}
+
+/**
+ * bind the k-th of num_thsim THSIM devices as told by OMP_THSIM_BIND:
+ * "numa": the device owns a NUMA node, round robin over the nodes;
+ * "cores": the cpus the process may run on are cut into num_thsim contiguous sets;
+ * "<cpulist>:<cpulist>:...": the device owns the k-th cpulist, e.g. "0-9:10-19".
+ * The cpus are set in dev->bind_cpus and the node they belong to in dev->numa_node. The helper thread binds itself and its
+ * kernel team to them (see omp_thsim_bind_self) and the device memory is allocated on the node
+ */
+static void omp_thsim_bind(omp_device_t * dev, int k, int num_thsim, const char * bind) {
+	cpu_set_t * set = (cpu_set_t *) malloc(sizeof(cpu_set_t));
+	int count = 0;
+	int node = -1;
+	CPU_ZERO(set);
+	if (strcmp(bind, "numa") == 0) {
+		int nodes[OMP_MAX_NUMA_NODES];
+		int num_nodes = 0;
+		cpu_set_t node_cpus;
+		for (node=0; node<OMP_MAX_NUMA_NODES; node++)
+			if (omp_numa_node_cpus(node, &node_cpus)) nodes[num_nodes++] = node;
+		node = -1;
+		if (num_nodes > 0) {
+			node = nodes[k % num_nodes];
+			count = omp_numa_node_cpus(node, set);
+		}
+	} else if (strcmp(bind, "cores") == 0) {
+		cpu_set_t allowed;
+		int cpus[CPU_SETSIZE];
+		int num_cpus = 0, cpu;
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+			for (cpu=0; cpu<CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &allowed)) cpus[num_cpus++] = cpu;
+		}
+		if (num_cpus >= num_thsim) { /* the first num_cpus % num_thsim devices get one more cpu */
+			int share = num_cpus / num_thsim, extra = num_cpus % num_thsim;
+			int start = k * share + (k < extra ? k : extra);
+			count = share + (k < extra ? 1 : 0);
+			for (cpu=start; cpu<start+count; cpu++) CPU_SET(cpus[cpu], set);
+		} else if (num_cpus > 0) { /* more devices than cpus, they share */
+			CPU_SET(cpus[k % num_cpus], set);
+			count = 1;
+		}
+		node = omp_cpus_numa_node(set);
+	} else {
+		int num_lists = 1, i;
+		const char * list = bind;
+		for (i=0; bind[i] != '\0'; i++) if (bind[i] == ':') num_lists++;
+		for (i=0; i<k % num_lists; i++) list = strchr(list, ':') + 1;
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "%.*s", (int) strcspn(list, ":"), list);
+		count = omp_cpulist_parse(buf, set);
+		node = omp_cpus_numa_node(set);
+	}
+
+	if (count == 0) {
+		fprintf(stderr, "cannot bind THSIM dev %d with OMP_THSIM_BIND=%s, it is not bound\n", dev->id, bind);
+		free(set);
+		return;
+	}
+	dev->bind_cpus = set;
+	dev->num_bind_cpus = count;
+	dev->numa_node = node;
+}
+
+/* called by the helper thread of a bound THSIM device, the threads of its kernel team inherit the cpus */
+void omp_thsim_bind_self(omp_device_t * dev) {
+	if (dev->type != OMP_DEVICE_THSIM || dev->bind_cpus == NULL) return;
+	int rt = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t *) dev->bind_cpus);
+	if (rt) fprintf(stderr, "cannot bind the helper thread of THSIM dev %d: %s\n", dev->id, strerror(rt));
+#if defined (_OPENMP)
+	omp_set_num_threads(dev->num_bind_cpus);
+#endif
+}
+
+/* the device memory of a bound THSIM device, page aligned, preferably on its node and first touched so it is placed now */
+static void * omp_thsim_node_alloc(omp_device_t * dev, long size) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	long bytes = (size + page_size - 1) / page_size * page_size;
+	void * ptr;
+	long i;
+	if (posix_memalign(&ptr, page_size, bytes) != 0) return NULL;
+#if defined (SYS_mbind)
+	if (dev->numa_node >= 0 && dev->numa_node < 8 * sizeof(unsigned long)) {
+		unsigned long nodemask = 1UL << dev->numa_node;
+		syscall(SYS_mbind, ptr, bytes, OMP_MPOL_PREFERRED, &nodemask, 8 * sizeof(unsigned long), 0); /* best effort */
+	}
+#endif
+	for (i=0; i<bytes; i+=page_size) ((volatile char*)ptr)[i] = 0;
+	return ptr;
+}
+
+/* the cpulist of a cpu set, e.g. "0-3,8" */
+static void omp_cpulist_format(cpu_set_t * set, char * list, int size) {
+	int cpu, len = 0;
+	list[0] = '\0';
+	for (cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, set)) continue;
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+		if (last > cpu) len += snprintf(list + len, size > len ? size - len : 0, "%s%d-%d", len ? "," : "", cpu, last);
+		else len += snprintf(list + len, size > len ? size - len : 0, "%s%d", len ? "," : "", cpu);
+		cpu = last;
+	}
+}
+
 /* init the device objects, num_of_devices, helper threads, default_device_var ICV etc
  *
  */
@@ -130,7 +338,10 @@ int omp_init_devices() {
 	omp_host_dev->status = 1;
 	omp_host_dev->resident_data_maps = NULL;
 	omp_host_dev->next = omp_devices;
-	omp_host_dev->offload_request = NULL;
+	omp_host_dev->offload_queue = NULL;
+	omp_host_dev->offload_pending = NULL;
+	omp_host_dev->offload_stack = NULL;
+	omp_host_dev->offload_stack_size = 0;
 	omp_host_dev->offload_stack_top = -1;
 
 
@@ -142,6 +353,32 @@ int omp_init_devices() {
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 	pthread_setconcurrency(omp_num_devices+1);
 
+	char * mem_pool_str = getenv("OMP_DEV_MEM_POOL");
+	if (mem_pool_str != NULL) sscanf(mem_pool_str, "%d", &omp_dev_mem_pool_enabled);
+	long resident_max_bytes = -1;
+	char * resident_max_str = getenv("OMP_RESIDENT_DATA_MAX");
+	if (resident_max_str != NULL) {
+		long mb;
+		sscanf(resident_max_str, "%ld", &mb);
+		if (mb >= 0) resident_max_bytes = mb * 1024 * 1024;
+	}
+	char * strided_copy_str = getenv("OMP_STRIDED_COPY");
+	if (strided_copy_str != NULL) sscanf(strided_copy_str, "%d", &omp_map_strided_copy_enabled);
+
+	char * halo_aggregate_str = getenv("OMP_HALO_AGGREGATE");
+	if (halo_aggregate_str != NULL) sscanf(halo_aggregate_str, "%d", &omp_halo_aggregate);
+
+	char * halo_sync_str = getenv("OMP_HALO_SYNC");
+	if (halo_sync_str != NULL) sscanf(halo_sync_str, "%d", &omp_halo_sync);
+
+	char * helper_spin_str = getenv("OMP_HELPER_SPIN");
+	if (helper_spin_str != NULL) {
+		sscanf(helper_spin_str, "%d", &omp_helper_spin_max);
+		if (omp_helper_spin_max < 0) omp_helper_spin_max = 0;
+	}
+
+	char * thsim_bind_str = getenv("OMP_THSIM_BIND");
+
 	int j = 0;
 	for (i=0; i<omp_num_devices; i++) {
 		omp_device_t * dev = &omp_devices[i];
@@ -162,117 +399,1366 @@ int omp_init_devices() {
 			dev->sysid = i;
 		}
 		dev->status = 1;
+		dev->calibrated = 0;
+		dev->d2d_bandwidth = NULL;
+		dev->numa_node = -1;
+		dev->locality = NULL;
+		dev->bind_cpus = NULL;
+		dev->num_bind_cpus = 0;
+		if (dev->type == OMP_DEVICE_THSIM && thsim_bind_str != NULL && strcmp(thsim_bind_str, "0") != 0)
+			omp_thsim_bind(dev, i - num_nvgpu_dev, num_thsim_dev, thsim_bind_str);
 		dev->resident_data_maps = NULL;
+		pthread_mutex_init(&dev->resident_lock, NULL);
+		dev->resident_bytes = 0;
+		dev->resident_max_bytes = resident_max_bytes;
+		dev->resident_hits = 0;
+		dev->resident_misses = 0;
+		dev->resident_evictions = 0;
+		dev->resident_bytes_saved = 0;
 		dev->next = &omp_devices[i+1];
-		dev->offload_request = NULL;
+		dev->offload_queue = NULL;
+		dev->offload_pending = NULL;
+		dev->offload_stack = NULL;
+		dev->offload_stack_size = 0;
 		dev->offload_stack_top = -1;
+		pthread_mutex_init(&dev->helper_mutex, NULL);
+		pthread_cond_init(&dev->helper_cond, NULL);
+		dev->helper_parked = 0;
+		dev->helper_spin = omp_helper_spin_max;
+		omp_dev_mem_pool_init(dev);
 		omp_init_dev_specific(dev);
 
 		int rt = pthread_create(&dev->helperth, &attr, (void *(*)(void *))helper_thread_main, (void *) dev);
 		if (rt) {fprintf(stderr, "cannot create helper threads for devices.\n"); exit(1); }
 	}
+	omp_marshal_pool_init(omp_num_devices);
+	omp_calibrate_devices();
+	omp_device_locality_init();
+	for (i=0; i<omp_num_devices; i++) omp_devices[i].dist_weight = omp_devices[i].real_flopss > 0.0 ? omp_devices[i].real_flopss : 1.0;
+
+	/* the weights for AUTO distribution given by users, e.g. "4,1,1" */
+	char * dist_weights_str = getenv("OMP_DIST_WEIGHTS");
+	if (dist_weights_str != NULL) {
+		for (i=0; i<omp_num_devices; i++) omp_devices[i].dist_weight = 1.0; /* for the devices not listed */
+		char * weights = strdup(dist_weights_str);
+		char * token = strtok(weights, ",");
+		for (i=0; i<omp_num_devices && token != NULL; i++) {
+			double w;
+			if (sscanf(token, "%lf", &w) == 1 && w > 0.0) omp_devices[i].dist_weight = w;
+			token = strtok(NULL, ",");
+		}
+		free(weights);
+	}
 	if (omp_num_devices) {
 		default_device_var = 0;
 		omp_devices[omp_num_devices-1].next = NULL;
 	}
 	printf("System has total %d devices(%d GPU and %d THSIM devices).\n", omp_num_devices, num_nvgpu_dev, num_thsim_dev);
+	for (i=0; i<omp_num_devices; i++) {
+		omp_device_t * dev = &omp_devices[i];
+		if (dev->bind_cpus == NULL) continue;
+		char list[256];
+		omp_cpulist_format((cpu_set_t *) dev->bind_cpus, list, sizeof(list));
+		printf("THSIM dev %d is bound to cpus %s (%d cpus) on NUMA node %d\n", dev->id, list, dev->num_bind_cpus, dev->numa_node);
+	}
 	printf("The number of each type of devices can be controlled by environment variables:\n");
 	printf("\tOMP_NUM_THSIM_DEVICES for THSIM devices (default 0)\n");
 	printf("\tOMP_NVGPU_DEVICES for selecting specific NVGPU devices (e.g., \"0,2,3\", i.e. ,separated list with no spaces)\n");
 	printf("\tOMP_NUM_NVGPU_DEVICES for selecting a number of NVIDIA GPU devices from dev 0 (default, total available, overwritten by OMP_NVGPU_DEVICES)\n");
 	printf("\tTo make a specific number of devices available, use OMP_NUM_ACTIVE_DEVICES (default, total number of system devices)\n");
+	printf("\tOMP_HELPER_SPIN for the max number of spin iterations of an idle helper thread before it parks (default %d, 0 for parking immediately)\n", OMP_HELPER_SPIN_DEFAULT);
+	printf("\tOMP_DEV_MEM_POOL=0 to disable the caching of device memory and host staging buffers (default 1)\n");
+	printf("\tOMP_DEV_MEM_POOL_MAX_CACHED and OMP_STAGING_POOL_MAX_CACHED for the max cached device memory and host staging buffers in MB per device\n");
+	printf("\tOMP_DEV_MEM_POOL_STATS=1 to print the statistics of device memory pools when devices are finalized\n");
+	printf("\tOMP_DIST_WEIGHTS for the relative speed of each device used by AUTO distribution (e.g., \"4,1,1\", default estimated from device properties)\n");
+	printf("\tOMP_RESIDENT_DATA_MAX for the max dev mem in MB per device kept by resident data maps (default no limit)\n");
+	printf("\tOMP_STRIDED_COPY=0 to marshal noncontiguous array regions instead of copying them with strided memcpy (default 1)\n");
+	printf("\tOMP_HALO_AGGREGATE=0 to exchange the halo of each map separately, 2 to always pack the halo regions of all the maps for a neighbor into one transfer (default 1, when the transfers saved cost more than the packing)\n");
+	printf("\tOMP_HALO_SYNC=0 for all the devices of an offloading to wait at a barrier around its halo exchange (default 1, each device waits for its neighbors only)\n");
+	printf("\tOMP_CALIBRATE=0 to use the device performance estimated from the device properties instead of measuring it, 2 to measure it again (default 1, measure what is not in the calibration cache)\n");
+	printf("\tOMP_CALIBRATION_FILE for the calibration cache (default $HOME/.homp_calibration)\n");
+	printf("\tOMP_THSIM_BIND to bind each THSIM device to a NUMA node (\"numa\"), to a share of the cpus (\"cores\") or to a cpulist (e.g., \"0-9:10-19\", :separated list), its helper thread and kernel team run there and its memory is on the node (default not bound)\n");
+	printf("\tOMP_DEV_LOCALITY for the NUMA node and PCIe path of each device (e.g., \"node0/sw0/gpu0,node0/sw1/gpu1\", default read from sysfs)\n");
+	printf("\tOMP_DEV_PLACEMENT=0 to place the devices in the grid topology in the given order, 2 to also print the estimated halo exchange cost of the placement (default 1)\n");
+	printf("\tOMP_MARSHAL_THREADS for the number of threads that help marshalling large array regions (now %d)\n", omp_marshal_num_threads);
 	return omp_num_devices;
 }
 // terminate helper threads
 void omp_fini_devices() {
 	int i;
 
+	char * mem_pool_stats_str = getenv("OMP_DEV_MEM_POOL_STATS");
+	int mem_pool_stats = mem_pool_stats_str != NULL && atoi(mem_pool_stats_str) != 0;
+
 	omp_device_complete = 1;
 	for (i=0; i<omp_num_devices; i++) {
 		omp_device_t * dev = &omp_devices[i];
+		omp_helper_notify(dev);
 		int rt = pthread_join(dev->helperth, NULL);
+		pthread_mutex_destroy(&dev->helper_mutex);
+		pthread_cond_destroy(&dev->helper_cond);
+		if (mem_pool_stats) {
+			printf("dev %d resident maps: %ld hits, %ld misses, %ld evictions, %.2f MB transfers saved, %.2f MB resident\n", dev->id,
+					dev->resident_hits, dev->resident_misses, dev->resident_evictions, dev->resident_bytes_saved/(1024.0*1024.0),
+					dev->resident_bytes/(1024.0*1024.0));
+			omp_dev_mem_pool_print_stats(dev);
+		}
+		omp_set_current_device_dev(dev);
+		omp_resident_maps_fini(dev);
+		free(dev->offload_stack);
+		free(dev->d2d_bandwidth);
+		free(dev->locality);
+		free(dev->bind_cpus);
+		omp_dev_mem_pool_fini(dev);
 		omp_device_type_t devtype = dev->type;
 #if defined (DEVICE_NVGPU_SUPPORT)
 		if (devtype == OMP_DEVICE_NVGPU) {
 			free(dev->dev_properties);
 		}
-#endif
+#endif
+	}
+
+	omp_marshal_pool_fini();
+	free(omp_host_dev);
+}
+
+int omp_set_current_device_dev(omp_device_t * d) {
+#if defined (DEVICE_NVGPU_SUPPORT)
+    int result;
+	if (d->type == OMP_DEVICE_NVGPU) {
+		result = cudaSetDevice(d->sysid);
+		devcall_assert (result);
+	}
+#endif
+	return d->id;
+}
+
+int omp_map_strided_copy_enabled = 1;
+
+/**
+ * copy the region of a strided_copy map between the original array (map_buffer points to the first element of the region)
+ * and the dev mem, in which the region is dense. stream == NULL for sync copy
+ */
+static void omp_map_strided_copy(omp_data_map_t * map, int to_dev, omp_dev_stream_t * stream) {
+	long width, height, depth, spitch, sheight;
+	omp_map_region_pitch(map, &width, &height, &depth, &spitch, &sheight);
+	if (depth == 1) {
+		if (to_dev && stream == NULL) omp_map_memcpy_2d_to(map->map_dev_ptr, width, map->dev, map->map_buffer, spitch, width, height);
+		else if (to_dev) omp_map_memcpy_2d_to_async(map->map_dev_ptr, width, map->dev, map->map_buffer, spitch, width, height, stream);
+		else if (stream == NULL) omp_map_memcpy_2d_from(map->map_buffer, spitch, map->map_dev_ptr, width, map->dev, width, height);
+		else omp_map_memcpy_2d_from_async(map->map_buffer, spitch, map->map_dev_ptr, width, map->dev, width, height, stream);
+	} else {
+		if (to_dev && stream == NULL) omp_map_memcpy_3d_to(map->map_dev_ptr, width, height, map->dev, map->map_buffer, spitch, sheight, width, height, depth);
+		else if (to_dev) omp_map_memcpy_3d_to_async(map->map_dev_ptr, width, height, map->dev, map->map_buffer, spitch, sheight, width, height, depth, stream);
+		else if (stream == NULL) omp_map_memcpy_3d_from(map->map_buffer, spitch, sheight, map->map_dev_ptr, width, height, map->dev, width, height, depth);
+		else omp_map_memcpy_3d_from_async(map->map_buffer, spitch, sheight, map->map_dev_ptr, width, height, map->dev, width, height, depth, stream);
+	}
+}
+
+void omp_map_mapto(omp_data_map_t * map) {
+	if (map->map_type != OMP_DATA_MAP_COPY) return;
+	if (map->resident != NULL && !omp_map_resident_need_mapto(map)) return;
+	if (map->strided_copy) omp_map_strided_copy(map, 1, NULL);
+	else omp_map_memcpy_to((void*)map->map_dev_ptr, map->dev, (void*)map->map_buffer, map->map_size);
+}
+
+void omp_map_mapto_async(omp_data_map_t * map, omp_dev_stream_t * stream) {
+	if (map->map_type != OMP_DATA_MAP_COPY) return;
+	if (map->resident != NULL && !omp_map_resident_need_mapto(map)) return;
+	if (map->strided_copy) omp_map_strided_copy(map, 1, stream);
+	else omp_map_memcpy_to_async((void*)map->map_dev_ptr, map->dev, (void*)map->map_buffer, map->map_size, stream);
+}
+
+/* a resident map is not copied back but marked dev_dirty, see omp_map_update_from */
+void omp_map_mapfrom(omp_data_map_t * map) {
+	if (map->map_type != OMP_DATA_MAP_COPY) return;
+	if (map->resident != NULL) {
+		omp_map_resident_set_dev_dirty(map);
+		return;
+	}
+	if (map->strided_copy) omp_map_strided_copy(map, 0, NULL);
+	else omp_map_memcpy_from((void*)map->map_buffer, (void*)map->map_dev_ptr, map->dev, map->map_size); /* memcpy from device to host */
+}
+
+void omp_map_mapfrom_async(omp_data_map_t * map, omp_dev_stream_t * stream) {
+	if (map->map_type != OMP_DATA_MAP_COPY) return;
+	if (map->resident != NULL) {
+		omp_map_resident_set_dev_dirty(map);
+		return;
+	}
+	if (map->strided_copy) omp_map_strided_copy(map, 0, stream);
+	else omp_map_memcpy_from_async((void*)map->map_buffer, (void*)map->map_dev_ptr, map->dev, map->map_size, stream); /* memcpy from device to host */
+}
+
+/* the allocator of the pool, i.e. device memory or page-locked host memory for the staging pool, return NULL if it fails */
+static void * omp_mem_pool_alloc(omp_device_t * dev, omp_dev_mem_pool_t * pool, long size) {
+	omp_device_type_t devtype = dev->type;
+	void * ptr = NULL;
+	if (pool->host_staging) {
+		long page_size = sysconf(_SC_PAGESIZE);
+		long i;
+#if defined (DEVICE_NVGPU_SUPPORT)
+		if (devtype == OMP_DEVICE_NVGPU) {
+			if (cudaHostAlloc(&ptr, size, cudaHostAllocPortable) != cudaSuccess) return NULL;
+		} else
+#endif
+		{
+			if (posix_memalign(&ptr, page_size, size) != 0) return NULL;
+			mlock(ptr, size); /* best effort, it fails if it is over RLIMIT_MEMLOCK */
+		}
+		/* first touch by the calling (helper) thread so the pages are placed on its NUMA node */
+		for (i=0; i<size; i+=page_size) ((volatile char*)ptr)[i] = 0;
+		return ptr;
+	}
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		if (cudaMalloc(&ptr, size) != cudaSuccess) ptr = NULL;
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		if (dev->bind_cpus != NULL) ptr = omp_thsim_node_alloc(dev, size);
+		else ptr = malloc(size);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+	return ptr;
+}
+
+static void omp_mem_pool_free(omp_device_t * dev, omp_dev_mem_pool_t * pool, void * ptr, long size) {
+	omp_device_type_t devtype = dev->type;
+	if (pool->host_staging) {
+#if defined (DEVICE_NVGPU_SUPPORT)
+		if (devtype == OMP_DEVICE_NVGPU) {
+			cudaError_t result = cudaFreeHost(ptr);
+			devcall_assert(result);
+		} else
+#endif
+		{
+			munlock(ptr, size);
+			free(ptr);
+		}
+		return;
+	}
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+	    cudaError_t result = cudaFree(ptr);
+	    devcall_assert(result);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		free(ptr);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+int omp_dev_mem_pool_enabled = 1;
+
+/* the size class of size: <= 256 bytes is class 0, and (2^k, 2^(k+1)] is cut into 4 classes of 2^(k-2) bytes each */
+static int omp_dev_mem_pool_bin(long size, long * class_size) {
+	if (size <= 256) {
+		*class_size = 256;
+		return 0;
+	}
+	int k = 63 - __builtin_clzl((unsigned long)(size - 1)); /* 2^k < size <= 2^(k+1) */
+	long base = 1L << k;
+	long step = base >> 2;
+	long j = (size - base + step - 1) / step;
+	*class_size = base + j * step;
+	int bin = (k - 8) * 4 + j;
+	if (bin >= OMP_DEV_MEM_POOL_NUM_BINS) {
+		fprintf(stderr, "memory request of %ld bytes is too large\n", size);
+		abort();
+	}
+	return bin;
+}
+
+#define omp_dev_mem_pool_hash(ptr) ((((unsigned long)(ptr)) >> 8) % OMP_DEV_MEM_POOL_HASH_SIZE)
+
+static void omp_mem_pool_init(omp_dev_mem_pool_t * pool, int host_staging, const char * max_cached_env) {
+	memset(pool, 0, sizeof(omp_dev_mem_pool_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->host_staging = host_staging;
+	pool->max_cached = -1;
+	char * max_cached_str = getenv(max_cached_env);
+	if (max_cached_str != NULL) {
+		long mb;
+		sscanf(max_cached_str, "%ld", &mb);
+		if (mb >= 0) pool->max_cached = mb * 1024 * 1024;
+	}
+}
+
+/* init the device memory pool and the host staging pool of the device */
+void omp_dev_mem_pool_init(omp_device_t * dev) {
+	omp_mem_pool_init(&dev->mem_pool, 0, "OMP_DEV_MEM_POOL_MAX_CACHED");
+	omp_mem_pool_init(&dev->staging_pool, 1, "OMP_STAGING_POOL_MAX_CACHED");
+}
+
+/* release cached blocks, from the largest class, until at most max_cached bytes are cached. The pool lock must be held */
+static void omp_mem_pool_release(omp_device_t * dev, omp_dev_mem_pool_t * pool, long max_cached) {
+	int bin;
+	for (bin=OMP_DEV_MEM_POOL_NUM_BINS-1; bin>=0 && pool->bytes_cached > max_cached; bin--) {
+		while (pool->bins[bin] != NULL && pool->bytes_cached > max_cached) {
+			omp_dev_mem_block_t * block = pool->bins[bin];
+			pool->bins[bin] = block->next;
+			omp_mem_pool_free(dev, pool, block->ptr, block->size);
+			pool->bytes_cached -= block->size;
+			pool->num_dev_frees++;
+			pool->num_trims++;
+			block->next = pool->spare;
+			pool->spare = block;
+		}
+	}
+}
+
+void omp_dev_mem_pool_trim(omp_device_t * dev, long max_cached) {
+	omp_dev_mem_pool_t * pool = &dev->mem_pool;
+	pthread_mutex_lock(&pool->lock);
+	omp_mem_pool_release(dev, pool, max_cached);
+	pthread_mutex_unlock(&pool->lock);
+	pool = &dev->staging_pool;
+	pthread_mutex_lock(&pool->lock);
+	omp_mem_pool_release(dev, pool, max_cached);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* release all the cached blocks and the descriptors, the blocks still in use are left to the system */
+static void omp_mem_pool_fini(omp_device_t * dev, omp_dev_mem_pool_t * pool) {
+	int i;
+	for (i=0; i<OMP_DEV_MEM_POOL_HASH_SIZE; i++) {
+		while (pool->used[i] != NULL) {
+			omp_dev_mem_block_t * block = pool->used[i];
+			pool->used[i] = block->next;
+			free(block);
+		}
+	}
+	while (pool->spare != NULL) {
+		omp_dev_mem_block_t * block = pool->spare;
+		pool->spare = block->next;
+		free(block);
+	}
+	pthread_mutex_destroy(&pool->lock);
+}
+
+void omp_dev_mem_pool_fini(omp_device_t * dev) {
+	omp_dev_mem_pool_trim(dev, 0);
+	omp_mem_pool_fini(dev, &dev->mem_pool);
+	omp_mem_pool_fini(dev, &dev->staging_pool);
+}
+
+static void omp_mem_pool_print_stats(omp_device_t * dev, omp_dev_mem_pool_t * pool, const char * name) {
+	printf("dev %d %s pool: %ld allocs (%ld hits, %.1f%%), %ld frees, %ld system allocs, %ld system frees (%ld trimmed), "
+			"high-water: %.2f MB, in use: %.2f MB, cached: %.2f MB\n", dev->id, name, pool->num_allocs, pool->num_hits,
+			pool->num_allocs > 0 ? 100.0 * pool->num_hits / pool->num_allocs : 0.0, pool->num_frees, pool->num_dev_allocs,
+			pool->num_dev_frees, pool->num_trims, pool->high_water/(1024.0*1024.0), pool->bytes_used/(1024.0*1024.0),
+			pool->bytes_cached/(1024.0*1024.0));
+}
+
+void omp_dev_mem_pool_print_stats(omp_device_t * dev) {
+	omp_mem_pool_print_stats(dev, &dev->mem_pool, "mem");
+	omp_mem_pool_print_stats(dev, &dev->staging_pool, "staging");
+}
+
+/**
+ * allocate from a caching pool of the device, see omp_dev_mem_pool_t. A cached block of the same size class is
+ * reused if there is one, otherwise a new block is allocated from the system after cached blocks are released so the pool
+ * stays under its high-water mark. If the system is out of memory, all the cached blocks are released and it is tried again.
+ */
+static void * omp_mem_pool_malloc(omp_device_t * dev, omp_dev_mem_pool_t * pool, long size) {
+	long class_size;
+	int bin = omp_dev_mem_pool_bin(size, &class_size);
+	omp_dev_mem_block_t * block;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->num_allocs++;
+	block = pool->bins[bin];
+	if (block != NULL) {
+		pool->bins[bin] = block->next;
+		pool->bytes_cached -= class_size;
+		pool->num_hits++;
+	} else {
+		long high_water = pool->bytes_used + class_size > pool->high_water ? pool->bytes_used + class_size : pool->high_water;
+		omp_mem_pool_release(dev, pool, high_water - pool->bytes_used - class_size);
+		void * ptr = omp_mem_pool_alloc(dev, pool, class_size);
+		if (ptr == NULL) {
+			omp_mem_pool_release(dev, pool, 0);
+			ptr = omp_mem_pool_alloc(dev, pool, class_size);
+		}
+		if (ptr == NULL) {
+			pthread_mutex_unlock(&pool->lock);
+			fprintf(stderr, "cannot allocate %ld bytes of mem for device %d\n", size, dev->id);
+			return NULL;
+		}
+		pool->num_dev_allocs++;
+		if (pool->spare != NULL) {
+			block = pool->spare;
+			pool->spare = block->next;
+		} else block = (omp_dev_mem_block_t *) malloc(sizeof(omp_dev_mem_block_t));
+		block->ptr = ptr;
+		block->size = class_size;
+		block->bin = bin;
+	}
+	int h = omp_dev_mem_pool_hash(block->ptr);
+	block->next = pool->used[h];
+	pool->used[h] = block;
+	pool->bytes_used += class_size;
+	if (pool->bytes_used > pool->high_water) pool->high_water = pool->bytes_used;
+	pthread_mutex_unlock(&pool->lock);
+
+	return block->ptr;
+}
+
+static void omp_mem_pool_return(omp_device_t * dev, omp_dev_mem_pool_t * pool, void * ptr) {
+	if (ptr == NULL) return;
+	pthread_mutex_lock(&pool->lock);
+	omp_dev_mem_block_t ** prev = &pool->used[omp_dev_mem_pool_hash(ptr)];
+	while (*prev != NULL && (*prev)->ptr != ptr) prev = &(*prev)->next;
+	omp_dev_mem_block_t * block = *prev;
+	if (block == NULL) {
+		pthread_mutex_unlock(&pool->lock);
+		fprintf(stderr, "mem %p is not allocated from the pool of device %d\n", ptr, dev->id);
+		abort();
+	}
+	*prev = block->next;
+	block->next = pool->bins[block->bin];
+	pool->bins[block->bin] = block;
+	pool->bytes_used -= block->size;
+	pool->bytes_cached += block->size;
+	pool->num_frees++;
+	if (pool->max_cached >= 0) omp_mem_pool_release(dev, pool, pool->max_cached);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void * omp_map_malloc_dev(omp_device_t * dev, long size) {
+	if (!omp_dev_mem_pool_enabled) return omp_mem_pool_alloc(dev, &dev->mem_pool, size);
+	return omp_mem_pool_malloc(dev, &dev->mem_pool, size);
+}
+
+void omp_map_free_dev(omp_device_t * dev, void * ptr) {
+	if (!omp_dev_mem_pool_enabled) omp_mem_pool_free(dev, &dev->mem_pool, ptr, 0);
+	else omp_mem_pool_return(dev, &dev->mem_pool, ptr);
+}
+
+/**
+ * host staging buffers, e.g. for marshalling, halo relay and reduction scratch. They are page-locked (pinned for NVGPU so
+ * async memcpy is really async) and first touched by the calling thread, which is the helper thread of dev in most
+ * cases, so they are local to the NUMA node of the device. Buffers are cached in the staging pool of dev the same way as
+ * omp_map_malloc_dev. With OMP_DEV_MEM_POOL=0, they are plain malloc buffers.
+ */
+void * omp_map_malloc_staging(omp_device_t * dev, long size) {
+	if (!omp_dev_mem_pool_enabled) return malloc(size);
+	return omp_mem_pool_malloc(dev, &dev->staging_pool, size);
+}
+
+void omp_map_free_staging(omp_device_t * dev, void * ptr) {
+	if (!omp_dev_mem_pool_enabled) free(ptr);
+	else omp_mem_pool_return(dev, &dev->staging_pool, ptr);
+}
+
+/**************************** device calibration, see omp_calibrate_devices *******************************/
+
+#define OMP_CALIBRATION_KEY_LENGTH 128
+#define OMP_CALIBRATION_BYTES (16L * 1024 * 1024) /* the size of the copies for measuring bandwidth */
+#define OMP_CALIBRATION_SMALL_BYTES 8 /* the size of the copies for measuring latency */
+#define OMP_CALIBRATION_SMALL_COPIES 64
+#define OMP_CALIBRATION_REPEATS 3 /* the best of the repeats is taken */
+#define OMP_CALIBRATION_FLOP_ITERATIONS (4L * 1024 * 1024)
+
+/* an entry of the calibration cache, a device if peer is empty, or a device pair with the bandwidth from key to peer */
+typedef struct omp_calibration_record {
+	char key[OMP_CALIBRATION_KEY_LENGTH];
+	char peer[OMP_CALIBRATION_KEY_LENGTH];
+	double h2d_bandwidth;
+	double h2d_latency;
+	double d2h_bandwidth;
+	double d2h_latency;
+	double mem_bandwidth;
+	double flopss; /* <= 0 if it is not measured */
+	double d2d_bandwidth;
+	int fresh; /* measured by this process, not yet in the cache file */
+} omp_calibration_record_t;
+
+typedef struct omp_calibration_cache {
+	omp_calibration_record_t * records;
+	int num_records;
+	int size;
+} omp_calibration_cache_t;
+
+static void omp_calibration_key_append(char * key, const char * str) {
+	int len = strlen(key);
+	for (; *str != '\0' && len < OMP_CALIBRATION_KEY_LENGTH - 1; str++) key[len++] = (*str == ' ' || *str == '\t' || *str == '\n') ? '_' : *str;
+	key[len] = '\0';
+}
+
+/* the identity of a device in the calibration cache, the devices with the same key are measured only once */
+static void omp_device_calibration_key(omp_device_t * dev, char * key) {
+	char buf[OMP_CALIBRATION_KEY_LENGTH];
+	key[0] = '\0';
+	omp_device_type_t devtype = dev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		struct cudaDeviceProp * prop = (struct cudaDeviceProp*)dev->dev_properties;
+		omp_calibration_key_append(key, "NVGPU/");
+		omp_calibration_key_append(key, prop->name);
+		sprintf(buf, "/%04x:%02x:%02x", prop->pciDomainID, prop->pciBusID, prop->pciDeviceID);
+		omp_calibration_key_append(key, buf);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		/* a helper thread of the host, identified by the cpu model and frequency. The model is read once for all the devices */
+		static char model[OMP_CALIBRATION_KEY_LENGTH] = "";
+		if (model[0] == '\0') {
+			char line[256];
+			char * name;
+			strcpy(model, "cpu");
+			FILE * fp = fopen("/proc/cpuinfo", "r");
+			if (fp != NULL) {
+				while (fgets(line, sizeof(line), fp) != NULL) {
+					if (strncmp(line, "model name", 10) != 0 || (name = strchr(line, ':')) == NULL) continue;
+					name++;
+					while (*name == ' ') name++;
+					int len = strlen(name);
+					while (len > 0 && (name[len-1] == '\n' || name[len-1] == ' ')) name[--len] = '\0';
+					if (len > 0) snprintf(model, sizeof(model), "%s", name);
+					break;
+				}
+				fclose(fp);
+			}
+		}
+		omp_calibration_key_append(key, "THSIM/");
+		omp_calibration_key_append(key, model);
+		sprintf(buf, "/%luMHz", dev->core_frequency / 1000000UL);
+		omp_calibration_key_append(key, buf);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+static omp_calibration_record_t * omp_calibration_cache_find(omp_calibration_cache_t * cache, const char * key, const char * peer) {
+	int i;
+	/* the later records replace the earlier ones of the same device */
+	for (i=cache->num_records-1; i>=0; i--) {
+		omp_calibration_record_t * rec = &cache->records[i];
+		if (strcmp(rec->key, key) == 0 && strcmp(rec->peer, peer) == 0) return rec;
+	}
+	return NULL;
+}
+
+static omp_calibration_record_t * omp_calibration_cache_add(omp_calibration_cache_t * cache) {
+	if (cache->num_records == cache->size) {
+		cache->size = cache->size > 0 ? cache->size * 2 : 16;
+		cache->records = (omp_calibration_record_t *) realloc(cache->records, sizeof(omp_calibration_record_t) * cache->size);
+	}
+	omp_calibration_record_t * rec = &cache->records[cache->num_records++];
+	memset(rec, 0, sizeof(omp_calibration_record_t));
+	return rec;
+}
+
+/* the records of the cache file, lines of "device <key> <h2d bw> <h2d lat> <d2h bw> <d2h lat> <mem bw> <flops>" and
+ * "pair <key> <peer key> <bw>", bandwidths in bytes/s and latencies in seconds. A malformed line is skipped
+ */
+static void omp_calibration_cache_load(omp_calibration_cache_t * cache, const char * path) {
+	char line[3 * OMP_CALIBRATION_KEY_LENGTH];
+	char key[OMP_CALIBRATION_KEY_LENGTH];
+	char peer[OMP_CALIBRATION_KEY_LENGTH];
+	FILE * fp = fopen(path, "r");
+	if (fp == NULL) return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		double v[6];
+		if (sscanf(line, "device %127s %lf %lf %lf %lf %lf %lf", key, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) == 7) {
+			omp_calibration_record_t * rec = omp_calibration_cache_add(cache);
+			strcpy(rec->key, key);
+			rec->h2d_bandwidth = v[0];
+			rec->h2d_latency = v[1];
+			rec->d2h_bandwidth = v[2];
+			rec->d2h_latency = v[3];
+			rec->mem_bandwidth = v[4];
+			rec->flopss = v[5];
+		} else if (sscanf(line, "pair %127s %127s %lf", key, peer, &v[0]) == 3) {
+			omp_calibration_record_t * rec = omp_calibration_cache_add(cache);
+			strcpy(rec->key, key);
+			strcpy(rec->peer, peer);
+			rec->d2d_bandwidth = v[0];
+		}
+	}
+	fclose(fp);
+}
+
+/**
+ * append the records measured by this process, or with rewrite write the whole cache anew, keeping only the latest record
+ * of each device and pair so that a re-measured device replaces its old one. Return the number of measured records
+ * written, -1 if the file cannot be written
+ */
+static int omp_calibration_cache_save(omp_calibration_cache_t * cache, const char * path, int rewrite) {
+	int i;
+	int num_written = 0;
+	for (i=0; i<cache->num_records; i++) if (cache->records[i].fresh) break;
+	if (i == cache->num_records) return 0;
+	FILE * fp = fopen(path, rewrite ? "w" : "a");
+	if (fp == NULL) return -1;
+	if (ftell(fp) == 0) fprintf(fp, "# homp device calibration, bandwidths in bytes/s and latencies in seconds, delete the file to re-measure\n");
+	for (i=0; i<cache->num_records; i++) {
+		omp_calibration_record_t * rec = &cache->records[i];
+		if (rewrite ? omp_calibration_cache_find(cache, rec->key, rec->peer) != rec : !rec->fresh) continue;
+		if (rec->peer[0] == '\0')
+			fprintf(fp, "device %s %g %g %g %g %g %g\n", rec->key, rec->h2d_bandwidth, rec->h2d_latency, rec->d2h_bandwidth,
+					rec->d2h_latency, rec->mem_bandwidth, rec->flopss);
+		else fprintf(fp, "pair %s %s %g\n", rec->key, rec->peer, rec->d2d_bandwidth);
+		if (rec->fresh) num_written++;
+		rec->fresh = 0;
+	}
+	fclose(fp);
+	return num_written;
+}
+
+/* the sustained flops/s of the calling thread, which is what a THSIM kernel runs on, with independent multiply-add chains */
+static double omp_calibration_host_flopss() {
+	double a0 = 1.0, a1 = 1.1, a2 = 1.2, a3 = 1.3, a4 = 1.4, a5 = 1.5, a6 = 1.6, a7 = 1.7;
+	const double m = 0.999999, c = 1.0e-7;
+	double best = 0.0;
+	long i;
+	int r;
+	for (r=0; r<OMP_CALIBRATION_REPEATS; r++) {
+		double t = read_timer_ms();
+		for (i=0; i<OMP_CALIBRATION_FLOP_ITERATIONS; i++) {
+			a0 = a0 * m + c; a1 = a1 * m + c; a2 = a2 * m + c; a3 = a3 * m + c;
+			a4 = a4 * m + c; a5 = a5 * m + c; a6 = a6 * m + c; a7 = a7 * m + c;
+		}
+		t = read_timer_ms() - t;
+		double flopss = t > 0.0 ? 16.0 * OMP_CALIBRATION_FLOP_ITERATIONS / (t / 1000.0) : 0.0;
+		if (flopss > best) best = flopss;
+	}
+	/* keep the chains alive */
+	volatile double sink = a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7;
+	(void) sink;
+	return best;
+}
+
+/* the best time in seconds of the copies of kind 0: host to dev, 1: dev to host, 2: dev to dev (on the same device or to peer) */
+static double omp_calibration_copy_time(omp_device_t * dev, omp_device_t * peer, int kind, void * dst, void * src, long size, int copies) {
+	double best = -1.0;
+	int r, k;
+	for (r=0; r<OMP_CALIBRATION_REPEATS; r++) {
+		double t = read_timer_ms();
+		for (k=0; k<copies; k++) {
+			if (kind == 0) omp_map_memcpy_to(dst, dev, src, size);
+			else if (kind == 1) omp_map_memcpy_from(dst, src, dev, size);
+			else omp_map_memcpy_DeviceToDevice(dst, peer, src, dev, size);
+		}
+		t = (read_timer_ms() - t) / 1000.0 / copies;
+		if (best < 0.0 || t < best) best = t;
+	}
+	return best;
+}
+
+static void omp_calibrate_device(omp_device_t * dev, omp_calibration_record_t * rec) {
+	long size = OMP_CALIBRATION_BYTES;
+	omp_set_current_device_dev(dev);
+	void * host = omp_mem_pool_alloc(dev, &dev->staging_pool, size);
+	void * dev_a = omp_mem_pool_alloc(dev, &dev->mem_pool, size);
+	void * dev_b = omp_mem_pool_alloc(dev, &dev->mem_pool, size);
+	if (host == NULL || dev_a == NULL || dev_b == NULL) {
+		fprintf(stderr, "cannot allocate memory for calibrating device %d\n", dev->id);
+		abort();
+	}
+	memset(host, 1, size);
+	omp_map_memcpy_to(dev_b, dev, host, size); /* touch the pages first */
+
+	double t = omp_calibration_copy_time(dev, NULL, 0, dev_a, host, size, 1);
+	rec->h2d_bandwidth = t > 0.0 ? size / t : 0.0;
+	rec->h2d_latency = omp_calibration_copy_time(dev, NULL, 0, dev_a, host, OMP_CALIBRATION_SMALL_BYTES, OMP_CALIBRATION_SMALL_COPIES);
+	t = omp_calibration_copy_time(dev, NULL, 1, host, dev_a, size, 1);
+	rec->d2h_bandwidth = t > 0.0 ? size / t : 0.0;
+	rec->d2h_latency = omp_calibration_copy_time(dev, NULL, 1, host, dev_a, OMP_CALIBRATION_SMALL_BYTES, OMP_CALIBRATION_SMALL_COPIES);
+	/* a copy within the device memory reads and writes each byte */
+	t = omp_calibration_copy_time(dev, dev, 2, dev_b, dev_a, size, 1);
+	rec->mem_bandwidth = t > 0.0 ? 2.0 * size / t : 0.0;
+
+	omp_device_type_t devtype = dev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		rec->flopss = 0.0; /* the runtime has no kernel of its own to measure with, the estimate from the properties is kept */
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		rec->flopss = omp_calibration_host_flopss();
+	}
+
+	omp_mem_pool_free(dev, &dev->mem_pool, dev_a, size);
+	omp_mem_pool_free(dev, &dev->mem_pool, dev_b, size);
+	omp_mem_pool_free(dev, &dev->staging_pool, host, size);
+}
+
+/* the bandwidth of copies from the dev memory of src to that of dst */
+static double omp_calibrate_device_pair(omp_device_t * src, omp_device_t * dst) {
+	long size = OMP_CALIBRATION_BYTES;
+	omp_set_current_device_dev(dst);
+	void * dst_ptr = omp_mem_pool_alloc(dst, &dst->mem_pool, size);
+	omp_set_current_device_dev(src);
+	void * src_ptr = omp_mem_pool_alloc(src, &src->mem_pool, size);
+	if (dst_ptr == NULL || src_ptr == NULL) {
+		fprintf(stderr, "cannot allocate memory for calibrating the copies from device %d to %d\n", src->id, dst->id);
+		abort();
+	}
+	omp_map_memcpy_DeviceToDevice(dst_ptr, dst, src_ptr, src, size); /* touch the pages first */
+	double t = omp_calibration_copy_time(src, dst, 2, dst_ptr, src_ptr, size, 1);
+	omp_mem_pool_free(src, &src->mem_pool, src_ptr, size);
+	omp_set_current_device_dev(dst);
+	omp_mem_pool_free(dst, &dst->mem_pool, dst_ptr, size);
+	return t > 0.0 ? size / t : 0.0;
+}
+
+/**
+ * fill in the measured performance of the devices: host-dev bandwidth and latency in both directions, the bandwidth of
+ * the dev memory, the sustained flops/s and the dev-to-dev bandwidth of each pair. The measurements are kept in a cache
+ * file (OMP_CALIBRATION_FILE, default $HOME/.homp_calibration) keyed by the identity of the device, so only the devices
+ * and pairs not in the cache are measured, and each of them once no matter how many devices of the same identity there are.
+ * OMP_CALIBRATE=0 disables it and keeps the estimates from the device properties, OMP_CALIBRATE=2 measures all again and
+ * rewrites the cache with the new records in place of the old ones of the devices.
+ * It is called by omp_init_devices before any offloading
+ */
+void omp_calibrate_devices() {
+	int mode = 1;
+	char * calibrate_str = getenv("OMP_CALIBRATE");
+	if (calibrate_str != NULL) sscanf(calibrate_str, "%d", &mode);
+	if (mode <= 0 || omp_num_devices == 0) return;
+
+	char path[1024];
+	char * path_str = getenv("OMP_CALIBRATION_FILE");
+	char * home = getenv("HOME");
+	if (path_str != NULL) snprintf(path, sizeof(path), "%s", path_str);
+	else if (home != NULL) snprintf(path, sizeof(path), "%s/.homp_calibration", home);
+	else path[0] = '\0';
+
+	double time = read_timer_ms();
+	omp_calibration_cache_t cache;
+	cache.records = NULL;
+	cache.num_records = 0;
+	cache.size = 0;
+	/* with OMP_CALIBRATE=2 the cache is still loaded, so the records of other devices are kept when it is rewritten */
+	if (path[0] != '\0') omp_calibration_cache_load(&cache, path);
+
+	char keys[omp_num_devices][OMP_CALIBRATION_KEY_LENGTH];
+	int num_measured = 0;
+	int i, j;
+	for (i=0; i<omp_num_devices; i++) {
+		omp_device_t * dev = &omp_devices[i];
+		omp_device_calibration_key(dev, keys[i]);
+		omp_calibration_record_t * rec = omp_calibration_cache_find(&cache, keys[i], "");
+		if (rec != NULL && mode >= 2 && !rec->fresh) rec = NULL; /* measured again, once for the devices of the same identity */
+		if (rec == NULL) {
+			rec = omp_calibration_cache_add(&cache);
+			strcpy(rec->key, keys[i]);
+			omp_calibrate_device(dev, rec);
+			rec->fresh = 1;
+			num_measured++;
+		}
+		dev->h2d_bandwidth = rec->h2d_bandwidth;
+		dev->h2d_latency = rec->h2d_latency;
+		dev->d2h_bandwidth = rec->d2h_bandwidth;
+		dev->d2h_latency = rec->d2h_latency;
+		dev->mem_bandwidth = rec->mem_bandwidth;
+		dev->bandwidth = (unsigned long) (rec->h2d_bandwidth < rec->d2h_bandwidth ? rec->h2d_bandwidth : rec->d2h_bandwidth);
+		if (rec->flopss > 0.0) dev->real_flopss = rec->flopss;
+		dev->calibrated = 1;
+		dev->d2d_bandwidth = (double *) malloc(sizeof(double) * omp_num_devices);
+	}
+
+	for (i=0; i<omp_num_devices; i++) {
+		omp_device_t * src = &omp_devices[i];
+		for (j=0; j<omp_num_devices; j++) {
+			omp_device_t * dst = &omp_devices[j];
+			if (i == j) {
+				src->d2d_bandwidth[j] = src->mem_bandwidth / 2.0;
+				continue;
+			}
+			/* there is no direct copy between devices of different types, it is relayed by the host */
+			if (src->type != dst->type || !omp_map_enable_memcpy_DeviceToDevice(dst, src)) {
+				double relay = 0.0;
+				if (src->d2h_bandwidth > 0.0 && dst->h2d_bandwidth > 0.0) relay = 1.0 / (1.0 / src->d2h_bandwidth + 1.0 / dst->h2d_bandwidth);
+				src->d2d_bandwidth[j] = relay;
+				continue;
+			}
+			omp_calibration_record_t * rec = omp_calibration_cache_find(&cache, keys[i], keys[j]);
+			if (rec != NULL && mode >= 2 && !rec->fresh) rec = NULL;
+			if (rec == NULL) {
+				rec = omp_calibration_cache_add(&cache);
+				strcpy(rec->key, keys[i]);
+				strcpy(rec->peer, keys[j]);
+				rec->d2d_bandwidth = omp_calibrate_device_pair(src, dst);
+				rec->fresh = 1;
+				num_measured++;
+			}
+			src->d2d_bandwidth[j] = rec->d2d_bandwidth;
+		}
+	}
+
+	int saved = path[0] != '\0' ? omp_calibration_cache_save(&cache, path, mode >= 2) : -1;
+	time = read_timer_ms() - time;
+	if (num_measured == 0) {
+		printf("Device calibration loaded from %s in %.1f us.\n", path, time * 1000.0);
+	} else {
+		printf("Device calibration measured %d devices/pairs in %.1f ms", num_measured, time);
+		if (saved > 0) printf(", saved to %s", path);
+		else printf(", not saved (set OMP_CALIBRATION_FILE to a writable file)");
+		printf(".\n");
+		for (i=0; i<omp_num_devices; i++) {
+			omp_device_t * dev = &omp_devices[i];
+			printf("\tdev %d (%s): H2D %.2f GB/s %.2f us, D2H %.2f GB/s %.2f us, mem %.2f GB/s, %.2f GFLOPS\n", dev->id, keys[i],
+					dev->h2d_bandwidth / 1.0e9, dev->h2d_latency * 1.0e6, dev->d2h_bandwidth / 1.0e9, dev->d2h_latency * 1.0e6,
+					dev->mem_bandwidth / 1.0e9, dev->real_flopss / 1.0e9);
+		}
+	}
+	free(cache.records);
+}
+
+/**************************** device locality, see omp_device_distance *******************************/
+#define OMP_NUMA_CROSS_HOPS 8 /* the extra cost of crossing NUMA nodes, where the copies are relayed through the host */
+#define OMP_LOCALITY_LENGTH 512
+
+#if defined (DEVICE_NVGPU_SUPPORT)
+/* the NUMA node of a sysfs device directory, -1 if not known */
+static int omp_sysfs_numa_node(const char * dir) {
+	char path[OMP_LOCALITY_LENGTH];
+	int node = -1;
+	snprintf(path, sizeof(path), "%s/numa_node", dir);
+	FILE * fp = fopen(path, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%d", &node) != 1) node = -1;
+		fclose(fp);
+	}
+	return node;
+}
+#endif
+
+/* the locality of a device from sysfs: the NUMA node followed by the path of the PCIe bridges down to the device */
+static void omp_device_sysfs_locality(omp_device_t * dev, char * locality) {
+	omp_device_type_t devtype = dev->type;
+	locality[0] = '\0';
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		struct cudaDeviceProp * prop = (struct cudaDeviceProp*)dev->dev_properties;
+		char busid[32];
+		char link[OMP_LOCALITY_LENGTH];
+		char dir[PATH_MAX];
+		sprintf(busid, "%04x:%02x:%02x.0", prop->pciDomainID, prop->pciBusID, prop->pciDeviceID);
+		snprintf(link, sizeof(link), "/sys/bus/pci/devices/%s", busid);
+		if (realpath(link, dir) == NULL) {
+			snprintf(locality, OMP_LOCALITY_LENGTH, "%s", busid); /* no sysfs, the GPUs are only told apart */
+			return;
+		}
+		dev->numa_node = omp_sysfs_numa_node(dir);
+		const char * pci = strstr(dir, "/pci");
+		if (pci == NULL) pci = dir;
+		if (dev->numa_node >= 0) snprintf(locality, OMP_LOCALITY_LENGTH, "node%d%s", dev->numa_node, pci);
+		else snprintf(locality, OMP_LOCALITY_LENGTH, "%s", pci);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		/* a helper thread, it is anywhere in the host unless it is bound to a NUMA node */
+		if (dev->numa_node >= 0) snprintf(locality, OMP_LOCALITY_LENGTH, "node%d", dev->numa_node);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+/**
+ * find where each device sits in the machine, from sysfs or from OMP_DEV_LOCALITY, a ,separated list of the paths of the
+ * devices in the order of their ids, e.g. "node0/sw0/gpu0,node0/sw0/gpu1,node1/sw2/gpu2" as read from the lstopo output of a
+ * machine. The components of a path are separated by / and a path that starts with "node<n>" gives the NUMA node
+ */
+void omp_device_locality_init() {
+	char locality[OMP_LOCALITY_LENGTH];
+	int i;
+	for (i=0; i<omp_num_devices; i++) {
+		omp_device_t * dev = &omp_devices[i];
+		omp_device_sysfs_locality(dev, locality);
+		dev->locality = strdup(locality);
+	}
+
+	char * locality_str = getenv("OMP_DEV_LOCALITY");
+	if (locality_str == NULL) return;
+	char * paths = strdup(locality_str);
+	char * saveptr;
+	char * token = strtok_r(paths, ",", &saveptr);
+	for (i=0; i<omp_num_devices && token != NULL; i++) {
+		omp_device_t * dev = &omp_devices[i];
+		free(dev->locality);
+		dev->locality = strdup(token);
+		if (sscanf(token, "node%d", &dev->numa_node) != 1) dev->numa_node = -1;
+		token = strtok_r(NULL, ",", &saveptr);
+	}
+	free(paths);
+}
+
+/* the number of components of a locality path */
+static int omp_locality_depth(const char * path) {
+	int depth = 0;
+	while (*path != '\0') {
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+		depth++;
+		while (*path != '\0' && *path != '/') path++;
+	}
+	return depth;
+}
+
+/**
+ * the hops between two devices in the tree of their locality paths, i.e. up from dev to the closest common bridge and down
+ * to peer, e.g. 2 for two GPUs under the same PCIe switch. Crossing NUMA nodes adds OMP_NUMA_CROSS_HOPS
+ */
+int omp_device_distance(omp_device_t * dev, omp_device_t * peer) {
+	if (dev == peer) return 0;
+	const char * a = dev->locality != NULL ? dev->locality : "";
+	const char * b = peer->locality != NULL ? peer->locality : "";
+	while (1) {
+		while (*a == '/') a++;
+		while (*b == '/') b++;
+		int la = strcspn(a, "/");
+		int lb = strcspn(b, "/");
+		if (la == 0 || la != lb || strncmp(a, b, la) != 0) break;
+		a += la;
+		b += lb;
+	}
+	int hops = omp_locality_depth(a) + omp_locality_depth(b);
+	if (dev->numa_node >= 0 && peer->numa_node >= 0 && dev->numa_node != peer->numa_node) hops += OMP_NUMA_CROSS_HOPS;
+	return hops;
+}
+
+/**************************** resident data maps, see omp_resident_map_t *******************************/
+
+/* the host address range covered by the region of a map that is not marshalled */
+static void omp_map_host_range(omp_data_map_t * map, char ** begin, char ** end) {
+	long width, height, depth, spitch, sheight;
+	*begin = map->map_buffer;
+	if (map->strided_copy) {
+		omp_map_region_pitch(map, &width, &height, &depth, &spitch, &sheight);
+		*end = map->map_buffer + spitch * sheight * (depth - 1) + spitch * (height - 1) + width;
+	} else *end = map->map_buffer + map->map_size;
+}
+
+/* the same region of the same array */
+static int omp_resident_map_match(omp_resident_map_t * rmap, omp_data_map_t * map) {
+	omp_data_map_info_t * info = map->info;
+	int i;
+	if (rmap->info.source_ptr != info->source_ptr || rmap->info.num_dims != info->num_dims ||
+			rmap->info.sizeof_element != info->sizeof_element || rmap->map.strided_copy != map->strided_copy) return 0;
+	for (i=0; i<info->num_dims; i++) {
+		if (rmap->dims[i] != info->dims[i] || rmap->map.map_dist[i].offset != map->map_dist[i].offset ||
+				rmap->map.map_dist[i].length != map->map_dist[i].length) return 0;
+	}
+	return 1;
+}
+
+/* the resident_lock of dev must be held for the following list operations */
+static void omp_resident_map_unlink(omp_device_t * dev, omp_resident_map_t * rmap) {
+	if (rmap->prev != NULL) rmap->prev->next = rmap->next;
+	else dev->resident_data_maps = rmap->next;
+	if (rmap->next != NULL) rmap->next->prev = rmap->prev;
+	rmap->prev = rmap->next = NULL;
+}
+
+static void omp_resident_map_push_front(omp_device_t * dev, omp_resident_map_t * rmap) {
+	rmap->prev = NULL;
+	rmap->next = dev->resident_data_maps;
+	if (rmap->next != NULL) rmap->next->prev = rmap;
+	dev->resident_data_maps = rmap;
+}
+
+/* the least recently used one that is not referenced */
+static omp_resident_map_t * omp_resident_map_lru_victim(omp_device_t * dev) {
+	omp_resident_map_t * rmap, * victim = NULL;
+	for (rmap = dev->resident_data_maps; rmap != NULL; rmap = rmap->next) {
+		if (rmap->refcount == 0) victim = rmap;
+	}
+	return victim;
+}
+
+/* copy the dev data back if it is dirty and flush is set, and free the dev mem and the map */
+static void omp_resident_map_evict(omp_device_t * dev, omp_resident_map_t * rmap, int flush) {
+	if (flush && rmap->dev_dirty) omp_map_mapfrom(&rmap->map);
+	omp_resident_map_unlink(dev, rmap);
+	omp_map_free_dev(dev, rmap->map.map_dev_ptr);
+	dev->resident_bytes -= rmap->map.map_size;
+	free(rmap);
+}
+
+static void omp_resident_map_shrink(omp_device_t * dev, long size) {
+	omp_resident_map_t * victim;
+	if (dev->resident_max_bytes < 0) return;
+	while (dev->resident_bytes + size > dev->resident_max_bytes && (victim = omp_resident_map_lru_victim(dev)) != NULL) {
+		omp_resident_map_evict(dev, victim, 1);
+		dev->resident_evictions++;
+	}
+}
+
+/**
+ * find the resident map of the region of map on its device, or create one, and return its dev mem. A new one is marked
+ * host_dirty so the region is copied in by omp_map_mapto. Unreferenced resident maps overlapping with the region are
+ * dropped (and copied back if dirty) since they become stale.
+ */
+char * omp_map_resident_acquire(omp_data_map_t * map) {
+	omp_device_t * dev = map->dev;
+	omp_resident_map_t * rmap, * next;
+	char * begin, * end;
+	omp_map_host_range(map, &begin, &end);
+
+	pthread_mutex_lock(&dev->resident_lock);
+	for (rmap = dev->resident_data_maps; rmap != NULL; rmap = next) {
+		next = rmap->next;
+		if (omp_resident_map_match(rmap, map)) break;
+		if (rmap->refcount == 0 && rmap->host_begin < end && begin < rmap->host_end) {
+			omp_resident_map_evict(dev, rmap, 1);
+			dev->resident_evictions++;
+		}
+	}
+	if (rmap != NULL) {
+		omp_resident_map_unlink(dev, rmap);
+		dev->resident_hits++;
+	} else {
+		omp_resident_map_shrink(dev, map->map_size);
+		rmap = (omp_resident_map_t *) malloc(sizeof(omp_resident_map_t));
+		memcpy(&rmap->info, map->info, sizeof(omp_data_map_info_t));
+		memcpy(rmap->dims, map->info->dims, sizeof(long) * map->info->num_dims);
+		rmap->info.dims = rmap->dims;
+		rmap->info.maps = NULL;
+		rmap->info.dist = NULL;
+		rmap->info.halo_info = NULL;
+		memcpy(&rmap->map, map, sizeof(omp_data_map_t));
+		rmap->map.info = &rmap->info;
+		rmap->map.resident = NULL;
+		rmap->map.map_dev_ptr = omp_map_malloc_dev(dev, map->map_size);
+		rmap->host_begin = begin;
+		rmap->host_end = end;
+		rmap->refcount = 0;
+		rmap->host_dirty = 1;
+		rmap->dev_dirty = 0;
+		dev->resident_bytes += map->map_size;
+		dev->resident_misses++;
+	}
+	rmap->refcount++;
+	omp_resident_map_push_front(dev, rmap);
+	map->resident = rmap;
+	pthread_mutex_unlock(&dev->resident_lock);
+	return rmap->map.map_dev_ptr;
+}
+
+/* the offloading is done with the resident map, it stays on the device until evicted or released */
+void omp_map_resident_release(omp_data_map_t * map) {
+	omp_device_t * dev = map->dev;
+	pthread_mutex_lock(&dev->resident_lock);
+	map->resident->refcount--;
+	omp_resident_map_shrink(dev, 0);
+	pthread_mutex_unlock(&dev->resident_lock);
+	map->resident = NULL;
+}
+
+/* called by omp_map_mapto, return whether the region needs to be copied to the device */
+int omp_map_resident_need_mapto(omp_data_map_t * map) {
+	omp_device_t * dev = map->dev;
+	omp_resident_map_t * rmap = map->resident;
+	pthread_mutex_lock(&dev->resident_lock);
+	int need = rmap->host_dirty;
+	rmap->host_dirty = 0;
+	if (!need) dev->resident_bytes_saved += map->map_size;
+	pthread_mutex_unlock(&dev->resident_lock);
+	return need;
+}
+
+/* called by omp_map_mapfrom instead of copying the region back */
+void omp_map_resident_set_dev_dirty(omp_data_map_t * map) {
+	omp_device_t * dev = map->dev;
+	pthread_mutex_lock(&dev->resident_lock);
+	map->resident->dev_dirty = 1;
+	pthread_mutex_unlock(&dev->resident_lock);
+}
+
+/**
+ * the host has changed [host_ptr, host_ptr+size), the resident maps overlapping with it on all devices are copied to the
+ * device at their next use. Changes made on the device but not yet copied back are overwritten.
+ */
+void omp_map_update_to(void * host_ptr, long size) {
+	char * begin = (char *) host_ptr;
+	char * end = begin + size;
+	int i;
+	for (i=0; i<omp_num_devices; i++) {
+		omp_device_t * dev = &omp_devices[i];
+		omp_resident_map_t * rmap;
+		pthread_mutex_lock(&dev->resident_lock);
+		for (rmap = dev->resident_data_maps; rmap != NULL; rmap = rmap->next) {
+			if (rmap->host_begin < end && begin < rmap->host_end) {
+				rmap->host_dirty = 1;
+				rmap->dev_dirty = 0;
+			}
+		}
+		pthread_mutex_unlock(&dev->resident_lock);
+	}
+}
+
+/**
+ * copy back the device changes of the resident maps overlapping with [host_ptr, host_ptr+size), the whole region of
+ * each resident map is copied. It must not be called while an offloading that writes them is running
+ */
+void omp_map_update_from(void * host_ptr, long size) {
+	char * begin = (char *) host_ptr;
+	char * end = begin + size;
+	int i;
+	for (i=0; i<omp_num_devices; i++) {
+		omp_device_t * dev = &omp_devices[i];
+		omp_resident_map_t * rmap;
+		pthread_mutex_lock(&dev->resident_lock);
+		for (rmap = dev->resident_data_maps; rmap != NULL; rmap = rmap->next) {
+			if (rmap->dev_dirty && rmap->host_begin < end && begin < rmap->host_end) {
+				omp_set_current_device_dev(dev);
+				omp_map_mapfrom(&rmap->map);
+				rmap->dev_dirty = 0;
+			}
+		}
+		pthread_mutex_unlock(&dev->resident_lock);
+	}
+}
+
+/**
+ * release the resident maps overlapping with [host_ptr, host_ptr+size) on all devices, device changes are copied back
+ * first. It must be called before the host memory is freed
+ */
+void omp_map_release_resident(void * host_ptr, long size) {
+	char * begin = (char *) host_ptr;
+	char * end = begin + size;
+	int i;
+	for (i=0; i<omp_num_devices; i++) {
+		omp_device_t * dev = &omp_devices[i];
+		omp_resident_map_t * rmap, * next;
+		pthread_mutex_lock(&dev->resident_lock);
+		for (rmap = dev->resident_data_maps; rmap != NULL; rmap = next) {
+			next = rmap->next;
+			if (rmap->host_begin < end && begin < rmap->host_end) {
+				if (rmap->refcount > 0) {
+					fprintf(stderr, "resident map of %s on dev %d is still used by an offloading, not released\n", rmap->info.symbol, dev->id);
+					continue;
+				}
+				omp_set_current_device_dev(dev);
+				omp_resident_map_evict(dev, rmap, 1);
+			}
+		}
+		pthread_mutex_unlock(&dev->resident_lock);
+	}
+}
+
+/* free all the resident maps of dev without copying back, called by omp_fini_devices */
+void omp_resident_maps_fini(omp_device_t * dev) {
+	pthread_mutex_lock(&dev->resident_lock);
+	while (dev->resident_data_maps != NULL) omp_resident_map_evict(dev, dev->resident_data_maps, 0);
+	pthread_mutex_unlock(&dev->resident_lock);
+	pthread_mutex_destroy(&dev->resident_lock);
+}
+
+/**
+ * THSIM stream: an in-order queue of operations executed by a stream worker thread. Each stream created by
+ * omp_stream_create (not the dev default one) has its own worker, thus operations of different streams
+ * run concurrently. The dev default stream (myStream == NULL) executes operations immediately in the calling thread, which
+ * is also in order.
+ *
+ * Each op gets a ticket (its position in the stream), an op is completed when num_completed >= its ticket. Events
+ * recorded on a stream keep the ticket so others can wait for them.
+ */
+typedef enum omp_thsim_stream_op_kind {
+	OMP_THSIM_STREAM_OP_MEMCPY,
+	OMP_THSIM_STREAM_OP_MEMCPY_3D,
+	OMP_THSIM_STREAM_OP_KERNEL,
+	OMP_THSIM_STREAM_OP_TIMER,
+	OMP_THSIM_STREAM_OP_WAIT,
+} omp_thsim_stream_op_kind_t;
+
+typedef struct omp_thsim_stream omp_thsim_stream_t;
+typedef struct omp_thsim_stream_op {
+	omp_thsim_stream_op_kind_t kind;
+	void * dst;	/* memcpy */
+	const void * src;
+	long size;
+	long dpitch, dheight, spitch, sheight, height, depth; /* strided memcpy, size is the width */
+	void (*kernel_launcher)(omp_offloading_t *, void *); /* kernel */
+	omp_offloading_t * off;
+	void * args;
+	double * time; /* timer */
+	omp_thsim_stream_t * wait_stream; /* wait for the op of another stream */
+	long wait_ticket;
+} omp_thsim_stream_op_t;
+
+#define OMP_THSIM_STREAM_QUEUE_SIZE 256
+struct omp_thsim_stream {
+	pthread_t worker;
+	pthread_mutex_t mutex;
+	pthread_cond_t op_cond; /* the worker waits on it for new ops */
+	pthread_cond_t done_cond; /* others wait on it for the completion of ops */
+	omp_thsim_stream_op_t ops[OMP_THSIM_STREAM_QUEUE_SIZE];
+	volatile long num_submitted;
+	volatile long num_completed;
+	int terminate;
+};
+
+static void omp_thsim_stream_wait_ticket(omp_thsim_stream_t * st, long ticket) {
+	if (st->num_completed >= ticket) return;
+	pthread_mutex_lock(&st->mutex);
+	while (st->num_completed < ticket) pthread_cond_wait(&st->done_cond, &st->mutex);
+	pthread_mutex_unlock(&st->mutex);
+}
+
+/* strided copy of depth x height lines of width bytes, see cudaMemcpy3D. Lines contiguous in both dst and src are copied at once */
+static void omp_thsim_memcpy_3d(char * dst, long dpitch, long dheight, const char * src, long spitch, long sheight, long width, long height, long depth) {
+	long j, k;
+	if (width == dpitch && width == spitch) {
+		if (height == dheight && height == sheight) {
+			memcpy(dst, src, width * height * depth);
+			return;
+		}
+		for (k=0; k<depth; k++) memcpy(&dst[k*dpitch*dheight], &src[k*spitch*sheight], width * height);
+		return;
+	}
+	for (k=0; k<depth; k++) {
+		char * d = &dst[k*dpitch*dheight];
+		const char * s = &src[k*spitch*sheight];
+		for (j=0; j<height; j++) {
+			memcpy(d, s, width);
+			d += dpitch;
+			s += spitch;
+		}
 	}
+}
 
-	free(omp_host_dev);
+static void omp_thsim_stream_exec_op(omp_thsim_stream_op_t * op) {
+	switch (op->kind) {
+	case OMP_THSIM_STREAM_OP_MEMCPY:
+		memcpy(op->dst, op->src, op->size);
+		break;
+	case OMP_THSIM_STREAM_OP_MEMCPY_3D:
+		omp_thsim_memcpy_3d((char *)op->dst, op->dpitch, op->dheight, (const char *)op->src, op->spitch, op->sheight, op->size, op->height, op->depth);
+		break;
+	case OMP_THSIM_STREAM_OP_KERNEL:
+		op->kernel_launcher(op->off, op->args);
+		break;
+	case OMP_THSIM_STREAM_OP_TIMER:
+		*op->time = read_timer_ms();
+		break;
+	case OMP_THSIM_STREAM_OP_WAIT:
+		omp_thsim_stream_wait_ticket(op->wait_stream, op->wait_ticket);
+		break;
+	}
 }
 
-int omp_set_current_device_dev(omp_device_t * d) {
-#if defined (DEVICE_NVGPU_SUPPORT)
-    int result;
-	if (d->type == OMP_DEVICE_NVGPU) {
-		result = cudaSetDevice(d->sysid);
-		devcall_assert (result);
+static void * omp_thsim_stream_worker(void * arg) {
+	omp_thsim_stream_t * st = (omp_thsim_stream_t *) arg;
+	pthread_mutex_lock(&st->mutex);
+	while (1) {
+		while (st->num_submitted == st->num_completed && !st->terminate) pthread_cond_wait(&st->op_cond, &st->mutex);
+		if (st->num_submitted == st->num_completed) break; /* terminate */
+		omp_thsim_stream_op_t op = st->ops[st->num_completed % OMP_THSIM_STREAM_QUEUE_SIZE];
+		pthread_mutex_unlock(&st->mutex);
+		omp_thsim_stream_exec_op(&op);
+		pthread_mutex_lock(&st->mutex);
+		st->num_completed++;
+		pthread_cond_broadcast(&st->done_cond);
 	}
-#endif
-	return d->id;
+	pthread_mutex_unlock(&st->mutex);
+	return NULL;
 }
 
-void omp_map_mapto(omp_data_map_t * map) {
-	if (map->map_type == OMP_DATA_MAP_COPY) omp_map_memcpy_to((void*)map->map_dev_ptr, map->dev, (void*)map->map_buffer, map->map_size);
+/**
+ * submit an op to the stream, return the ticket of the op. If called from the stream's own worker (e.g. a kernel that does
+ * async memcpy on its stream), the op is executed right away since the worker is already at this position of the stream
+ */
+static long omp_thsim_stream_submit(omp_dev_stream_t * stream, omp_thsim_stream_op_t * op) {
+	omp_thsim_stream_t * st = stream == NULL ? NULL : (omp_thsim_stream_t *) stream->systream.myStream;
+	if (st == NULL || pthread_equal(pthread_self(), st->worker)) {
+		omp_thsim_stream_exec_op(op);
+		return 0;
+	}
+	pthread_mutex_lock(&st->mutex);
+	while (st->num_submitted - st->num_completed >= OMP_THSIM_STREAM_QUEUE_SIZE) pthread_cond_wait(&st->done_cond, &st->mutex);
+	st->ops[st->num_submitted % OMP_THSIM_STREAM_QUEUE_SIZE] = *op;
+	long ticket = ++st->num_submitted;
+	pthread_cond_signal(&st->op_cond);
+	pthread_mutex_unlock(&st->mutex);
+	return ticket;
 }
 
-void omp_map_mapto_async(omp_data_map_t * map, omp_dev_stream_t * stream) {
-	if (map->map_type == OMP_DATA_MAP_COPY) omp_map_memcpy_to_async((void*)map->map_dev_ptr, map->dev, (void*)map->map_buffer, map->map_size, stream);
+static void omp_thsim_stream_memcpy(void * dst, const void * src, long size, omp_dev_stream_t * stream) {
+	omp_thsim_stream_op_t op;
+	op.kind = OMP_THSIM_STREAM_OP_MEMCPY;
+	op.dst = dst;
+	op.src = src;
+	op.size = size;
+	omp_thsim_stream_submit(stream, &op);
 }
 
-void omp_map_mapfrom(omp_data_map_t * map) {
-	if (map->map_type == OMP_DATA_MAP_COPY)
-		omp_map_memcpy_from((void*)map->map_buffer, (void*)map->map_dev_ptr, map->dev, map->map_size); /* memcpy from host to device */
+static void omp_thsim_stream_memcpy_3d(void * dst, long dpitch, long dheight, const void * src, long spitch, long sheight,
+		long width, long height, long depth, omp_dev_stream_t * stream) {
+	omp_thsim_stream_op_t op;
+	op.kind = OMP_THSIM_STREAM_OP_MEMCPY_3D;
+	op.dst = dst;
+	op.dpitch = dpitch;
+	op.dheight = dheight;
+	op.src = src;
+	op.spitch = spitch;
+	op.sheight = sheight;
+	op.size = width;
+	op.height = height;
+	op.depth = depth;
+	omp_thsim_stream_submit(stream, &op);
 }
 
-void omp_map_mapfrom_async(omp_data_map_t * map, omp_dev_stream_t * stream) {
-	if (map->map_type == OMP_DATA_MAP_COPY)
-		omp_map_memcpy_from_async((void*)map->map_buffer, (void*)map->map_dev_ptr, map->dev, map->map_size, stream); /* memcpy from host to device */
+static long omp_thsim_stream_timer(double * time, omp_dev_stream_t * stream) {
+	omp_thsim_stream_op_t op;
+	op.kind = OMP_THSIM_STREAM_OP_TIMER;
+	op.time = time;
+	return omp_thsim_stream_submit(stream, &op);
 }
 
-void * omp_map_malloc_dev(omp_device_t * dev, long size) {
-	omp_device_type_t devtype = dev->type;
-	void * ptr = NULL;
+void omp_map_memcpy_to(void * dst, omp_device_t * dstdev, const void * src, long size) {
+	omp_device_type_t devtype = dstdev->type;
 #if defined (DEVICE_NVGPU_SUPPORT)
 	if (devtype == OMP_DEVICE_NVGPU) {
-		if (cudaErrorMemoryAllocation == cudaMalloc(&ptr, size)) {
-			fprintf(stderr, "cudaMalloc error to allocate mem on device\n");
-		}
+	    cudaError_t result;
+	    result = cudaMemcpy((void *)dst,(const void *)src,size, cudaMemcpyHostToDevice);
+	    devcall_assert(result);
 	} else
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
-		ptr = malloc(size);
+		memcpy((void *)dst,(const void *)src,size);
 	} else {
 		fprintf(stderr, "device type is not supported for this call\n");
 		abort();
 	}
-	return ptr;
 }
 
-void omp_map_free_dev(omp_device_t * dev, void * ptr) {
-	omp_device_type_t devtype = dev->type;
+void omp_map_memcpy_to_async(void * dst, omp_device_t * dstdev, const void * src, long size, omp_dev_stream_t * stream) {
+	omp_device_type_t devtype = dstdev->type;
 #if defined (DEVICE_NVGPU_SUPPORT)
 	if (devtype == OMP_DEVICE_NVGPU) {
-	    cudaError_t result = cudaFree(ptr);
-	    devcall_assert(result);
+		cudaError_t result;
+		result = cudaMemcpyAsync((void *)dst,(const void *)src,size, cudaMemcpyHostToDevice, stream->systream.cudaStream);
+		devcall_assert(result);
 	} else
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
-		free(ptr);
+		omp_thsim_stream_memcpy(dst, src, size, stream);
 	} else {
 		fprintf(stderr, "device type is not supported for this call\n");
 		abort();
 	}
 }
 
-void omp_map_memcpy_to(void * dst, omp_device_t * dstdev, const void * src, long size) {
-	omp_device_type_t devtype = dstdev->type;
+void omp_map_memcpy_from(void * dst, const void * src, omp_device_t * srcdev, long size) {
+	omp_device_type_t devtype = srcdev->type;
 #if defined (DEVICE_NVGPU_SUPPORT)
 	if (devtype == OMP_DEVICE_NVGPU) {
-	    cudaError_t result;
-	    result = cudaMemcpy((void *)dst,(const void *)src,size, cudaMemcpyHostToDevice);
-	    devcall_assert(result);
+		cudaError_t result;
+	    result = cudaMemcpy((void *)dst,(const void *)src,size, cudaMemcpyDeviceToHost);
+		devcall_assert(result);
 	} else
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
@@ -283,56 +1769,168 @@ void omp_map_memcpy_to(void * dst, omp_device_t * dstdev, const void * src, long
 	}
 }
 
-void omp_map_memcpy_to_async(void * dst, omp_device_t * dstdev, const void * src, long size, omp_dev_stream_t * stream) {
+/**
+ *  device to host, async */
+void omp_map_memcpy_from_async(void * dst, const void * src, omp_device_t * srcdev, long size, omp_dev_stream_t * stream) {
+	omp_device_type_t devtype = srcdev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaMemcpyAsync((void *)dst,(const void *)src,size, cudaMemcpyDeviceToHost, stream->systream.cudaStream);
+		devcall_assert(result);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_memcpy(dst, src, size, stream);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+/**
+ * strided copies between host and device: height lines of width bytes, dpitch and spitch are the distances in bytes
+ * between two lines in dst and src. The 3d ones copy depth slices of height lines, dheight and sheight are the number of
+ * lines between two slices, the same as cudaMemcpy3D. They are used to copy noncontiguous array regions without marshalling.
+ */
+#if defined (DEVICE_NVGPU_SUPPORT)
+static void omp_nvgpu_memcpy_3d(void * dst, long dpitch, long dheight, const void * src, long spitch, long sheight,
+		long width, long height, long depth, enum cudaMemcpyKind kind, cudaStream_t stream, int async) {
+	cudaError_t result;
+	cudaMemcpy3DParms p;
+	memset(&p, 0, sizeof(cudaMemcpy3DParms));
+	p.srcPtr = make_cudaPitchedPtr((void *)src, spitch, width, sheight);
+	p.dstPtr = make_cudaPitchedPtr(dst, dpitch, width, dheight);
+	p.extent = make_cudaExtent(width, height, depth);
+	p.kind = kind;
+	if (async) result = cudaMemcpy3DAsync(&p, stream);
+	else result = cudaMemcpy3D(&p);
+	devcall_assert(result);
+}
+#endif
+
+void omp_map_memcpy_2d_to(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, long width, long height) {
 	omp_device_type_t devtype = dstdev->type;
 #if defined (DEVICE_NVGPU_SUPPORT)
 	if (devtype == OMP_DEVICE_NVGPU) {
 		cudaError_t result;
-		result = cudaMemcpyAsync((void *)dst,(const void *)src,size, cudaMemcpyHostToDevice, stream->systream.cudaStream);
+		result = cudaMemcpy2D(dst, dpitch, src, spitch, width, height, cudaMemcpyHostToDevice);
 		devcall_assert(result);
 	} else
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
-//		fprintf(stderr, "no async call support, use sync memcpy call\n");
-		memcpy((void *)dst,(const void *)src,size);
+		omp_thsim_memcpy_3d((char *)dst, dpitch, height, (const char *)src, spitch, height, width, height, 1);
 	} else {
 		fprintf(stderr, "device type is not supported for this call\n");
 		abort();
 	}
 }
 
-void omp_map_memcpy_from(void * dst, const void * src, omp_device_t * srcdev, long size) {
+void omp_map_memcpy_2d_to_async(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, long width, long height, omp_dev_stream_t * stream) {
+	omp_device_type_t devtype = dstdev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaMemcpy2DAsync(dst, dpitch, src, spitch, width, height, cudaMemcpyHostToDevice, stream->systream.cudaStream);
+		devcall_assert(result);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_memcpy_3d(dst, dpitch, height, src, spitch, height, width, height, 1, stream);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+void omp_map_memcpy_2d_from(void * dst, long dpitch, const void * src, long spitch, omp_device_t * srcdev, long width, long height) {
 	omp_device_type_t devtype = srcdev->type;
 #if defined (DEVICE_NVGPU_SUPPORT)
 	if (devtype == OMP_DEVICE_NVGPU) {
 		cudaError_t result;
-	    result = cudaMemcpy((void *)dst,(const void *)src,size, cudaMemcpyDeviceToHost);
+		result = cudaMemcpy2D(dst, dpitch, src, spitch, width, height, cudaMemcpyDeviceToHost);
 		devcall_assert(result);
 	} else
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
-		memcpy((void *)dst,(const void *)src,size);
+		omp_thsim_memcpy_3d((char *)dst, dpitch, height, (const char *)src, spitch, height, width, height, 1);
 	} else {
 		fprintf(stderr, "device type is not supported for this call\n");
 		abort();
 	}
 }
 
-/**
- *  device to host, async */
-void omp_map_memcpy_from_async(void * dst, const void * src, omp_device_t * srcdev, long size, omp_dev_stream_t * stream) {
+void omp_map_memcpy_2d_from_async(void * dst, long dpitch, const void * src, long spitch, omp_device_t * srcdev, long width, long height, omp_dev_stream_t * stream) {
 	omp_device_type_t devtype = srcdev->type;
 #if defined (DEVICE_NVGPU_SUPPORT)
 	if (devtype == OMP_DEVICE_NVGPU) {
 		cudaError_t result;
-		result = cudaMemcpyAsync((void *)dst,(const void *)src,size, cudaMemcpyDeviceToHost, stream->systream.cudaStream);
+		result = cudaMemcpy2DAsync(dst, dpitch, src, spitch, width, height, cudaMemcpyDeviceToHost, stream->systream.cudaStream);
 		devcall_assert(result);
 	} else
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
-//		fprintf(stderr, "no async call support, use sync memcpy call\n");
-		memcpy((void *)dst,(const void *)src,size);
-//		printf("memcpy from: dest: %X, src: %X, size: %d\n", map->map_buffer, map->map_dev_ptr);
+		omp_thsim_stream_memcpy_3d(dst, dpitch, height, src, spitch, height, width, height, 1, stream);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+void omp_map_memcpy_3d_to(void * dst, long dpitch, long dheight, omp_device_t * dstdev, const void * src, long spitch, long sheight, long width, long height, long depth) {
+	omp_device_type_t devtype = dstdev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		omp_nvgpu_memcpy_3d(dst, dpitch, dheight, src, spitch, sheight, width, height, depth, cudaMemcpyHostToDevice, 0, 0);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_memcpy_3d((char *)dst, dpitch, dheight, (const char *)src, spitch, sheight, width, height, depth);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+void omp_map_memcpy_3d_to_async(void * dst, long dpitch, long dheight, omp_device_t * dstdev, const void * src, long spitch, long sheight, long width, long height, long depth, omp_dev_stream_t * stream) {
+	omp_device_type_t devtype = dstdev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		omp_nvgpu_memcpy_3d(dst, dpitch, dheight, src, spitch, sheight, width, height, depth, cudaMemcpyHostToDevice, stream->systream.cudaStream, 1);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_memcpy_3d(dst, dpitch, dheight, src, spitch, sheight, width, height, depth, stream);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+void omp_map_memcpy_3d_from(void * dst, long dpitch, long dheight, const void * src, long spitch, long sheight, omp_device_t * srcdev, long width, long height, long depth) {
+	omp_device_type_t devtype = srcdev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		omp_nvgpu_memcpy_3d(dst, dpitch, dheight, src, spitch, sheight, width, height, depth, cudaMemcpyDeviceToHost, 0, 0);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_memcpy_3d((char *)dst, dpitch, dheight, (const char *)src, spitch, sheight, width, height, depth);
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+void omp_map_memcpy_3d_from_async(void * dst, long dpitch, long dheight, const void * src, long spitch, long sheight, omp_device_t * srcdev, long width, long height, long depth, omp_dev_stream_t * stream) {
+	omp_device_type_t devtype = srcdev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		omp_nvgpu_memcpy_3d(dst, dpitch, dheight, src, spitch, sheight, width, height, depth, cudaMemcpyDeviceToHost, stream->systream.cudaStream, 1);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_memcpy_3d(dst, dpitch, dheight, src, spitch, sheight, width, height, depth, stream);
 	} else {
 		fprintf(stderr, "device type is not supported for this call\n");
 		abort();
@@ -393,6 +1991,47 @@ void omp_map_memcpy_DeviceToDevice(void * dst, omp_device_t * dstdev, void * src
 	}
 }
 
+/* height lines of width bytes between the dev mem of two devices, e.g. the halo regions of a map, see omp_halo_region_pull */
+void omp_map_memcpy_2d_DeviceToDevice(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, omp_device_t * srcdev, long width, long height) {
+	omp_device_type_t dst_devtype = dstdev->type;
+	omp_device_type_t src_devtype = srcdev->type;
+
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (dst_devtype == OMP_DEVICE_NVGPU && src_devtype == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaMemcpy2D(dst, dpitch, src, spitch, width, height, cudaMemcpyDeviceToDevice);
+		devcall_assert(result);
+	} else
+#endif
+	if (dst_devtype == OMP_DEVICE_THSIM && src_devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_memcpy_3d((char *)dst, dpitch, height, (const char *)src, spitch, height, width, height, 1);
+	} else {
+		fprintf(stderr, "device type is not supported for this call, currently we only support p2p copy between GPU-GPU and TH-TH\n");
+		abort();
+	}
+}
+
+/* the async version of omp_map_memcpy_2d_DeviceToDevice, e.g. for packing the halo regions of maps, see omp_halo_exchange_aggregate */
+void omp_map_memcpy_2d_DeviceToDeviceAsync(void * dst, long dpitch, omp_device_t * dstdev, const void * src, long spitch, omp_device_t * srcdev,
+		long width, long height, omp_dev_stream_t * stream) {
+	omp_device_type_t dst_devtype = dstdev->type;
+	omp_device_type_t src_devtype = srcdev->type;
+
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (dst_devtype == OMP_DEVICE_NVGPU && src_devtype == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaMemcpy2DAsync(dst, dpitch, src, spitch, width, height, cudaMemcpyDeviceToDevice, stream->systream.cudaStream);
+		devcall_assert(result);
+	} else
+#endif
+	if (dst_devtype == OMP_DEVICE_THSIM && src_devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_memcpy_3d(dst, dpitch, height, src, spitch, height, width, height, 1, stream);
+	} else {
+		fprintf(stderr, "device type is not supported for this call, currently we only support p2p copy between GPU-GPU and TH-TH\n");
+		abort();
+	}
+}
+
 /** it is a push operation, i.e. src push data to dst */
 void omp_map_memcpy_DeviceToDeviceAsync(void * dst, omp_device_t * dstdev, void * src, omp_device_t * srcdev, int size, omp_dev_stream_t * srcstream) {
 	omp_device_type_t dst_devtype = dstdev->type;
@@ -408,7 +2047,7 @@ void omp_map_memcpy_DeviceToDeviceAsync(void * dst, omp_device_t * dstdev, void
 	} else
 #endif
 	if (dst_devtype == OMP_DEVICE_THSIM && src_devtype == OMP_DEVICE_THSIM) {
-		memcpy((void *)dst, (const void *)src, size);
+		omp_thsim_stream_memcpy(dst, src, size, srcstream);
 	} else {
 		fprintf(stderr, "device type is not supported for this call, currently we only support p2p copy between GPU-GPU and TH-TH\n");
 		abort();
@@ -453,12 +2092,42 @@ void omp_stream_create(omp_device_t * d, omp_dev_stream_t * stream, int using_de
 	} else
 #endif
 	if (d->type == OMP_DEVICE_THSIM){
-		/* do nothing */
+		if (using_dev_default) stream->systream.myStream = NULL;
+		else {
+			omp_thsim_stream_t * st = (omp_thsim_stream_t *) malloc(sizeof(omp_thsim_stream_t));
+			pthread_mutex_init(&st->mutex, NULL);
+			pthread_cond_init(&st->op_cond, NULL);
+			pthread_cond_init(&st->done_cond, NULL);
+			st->num_submitted = 0;
+			st->num_completed = 0;
+			st->terminate = 0;
+			int rt = pthread_create(&st->worker, NULL, omp_thsim_stream_worker, st);
+			if (rt) {fprintf(stderr, "cannot create worker thread for THSIM stream.\n"); exit(1); }
+			stream->systream.myStream = st;
+		}
 	} else {
 
 	}
 }
 
+/**
+ * launch the kernel in the stream, for THSIM the launcher is called by the stream worker in order with other operations of
+ * the stream. For NVGPU, the launcher itself launches the kernel to the stream of the off
+ */
+void omp_stream_launch_kernel(omp_dev_stream_t * stream, void (*kernel_launcher)(omp_offloading_t *, void *), omp_offloading_t * off, void * args) {
+	omp_device_type_t devtype = stream->dev->type;
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_op_t op;
+		op.kind = OMP_THSIM_STREAM_OP_KERNEL;
+		op.kernel_launcher = kernel_launcher;
+		op.off = off;
+		op.args = args;
+		omp_thsim_stream_submit(stream, &op);
+	} else {
+		kernel_launcher(off, args);
+	}
+}
+
 /**
  * sync device by syncing the stream so all the pending calls the stream are completed
  *
@@ -471,9 +2140,12 @@ void omp_stream_sync(omp_dev_stream_t *st) {
 		cudaError_t result;
 		result = cudaStreamSynchronize(st->systream.cudaStream);
 		devcall_assert(result);
-	}
-#else
+	} else
 #endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_t * tst = (omp_thsim_stream_t *) st->systream.myStream;
+		if (tst != NULL && !pthread_equal(pthread_self(), tst->worker)) omp_thsim_stream_wait_ticket(tst, tst->num_submitted);
+	}
 }
 
 void omp_stream_destroy(omp_dev_stream_t * st) {
@@ -483,9 +2155,96 @@ void omp_stream_destroy(omp_dev_stream_t * st) {
 		cudaError_t result;
 		result = cudaStreamDestroy(st->systream.cudaStream);
 		devcall_assert(result);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM && st->systream.myStream != NULL) {
+		omp_thsim_stream_t * tst = (omp_thsim_stream_t *) st->systream.myStream;
+		pthread_mutex_lock(&tst->mutex);
+		tst->terminate = 1;
+		pthread_cond_signal(&tst->op_cond);
+		pthread_mutex_unlock(&tst->mutex);
+		pthread_join(tst->worker, NULL); /* the worker drains the queue before it quits */
+		pthread_mutex_destroy(&tst->mutex);
+		pthread_cond_destroy(&tst->op_cond);
+		pthread_cond_destroy(&tst->done_cond);
+		free(tst);
+		st->systream.myStream = NULL;
 	}
-#else
+}
+
+/**
+ * make all the future work submitted to stream wait for the completion of the event (its stop record), the host is not blocked
+ * unless stream is the THSIM dev default stream which executes in the calling thread
+ */
+void omp_stream_wait_event(omp_dev_stream_t * stream, omp_event_t * ev) {
+	omp_device_type_t devtype = stream->dev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU && ev->dev->type == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaStreamWaitEvent(stream->systream.cudaStream, ev->stop_event_dev, 0);
+		devcall_assert(result);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_t * evst = ev->stream == NULL || ev->dev->type != OMP_DEVICE_THSIM ? NULL : (omp_thsim_stream_t *) ev->stream->systream.myStream;
+		if (evst == NULL || ev->stream == stream) return; /* already completed, or in order */
+		if (stream->systream.myStream == NULL) {
+			omp_event_sync(ev);
+		} else {
+			omp_thsim_stream_op_t op;
+			op.kind = OMP_THSIM_STREAM_OP_WAIT;
+			op.wait_stream = evst;
+			op.wait_ticket = ev->stream_ticket;
+			omp_thsim_stream_submit(stream, &op);
+		}
+	} else {
+		omp_event_sync(ev);
+	}
+}
+
+/**
+ * record the current position of stream in ev (as its stop record, without timing), so others can wait for the work
+ * submitted to stream so far with omp_stream_wait_event or omp_event_sync. ev must be a device-record event of stream's dev
+ */
+void omp_stream_record_event(omp_dev_stream_t * stream, omp_event_t * ev) {
+	omp_device_type_t devtype = stream->dev->type;
+	ev->stream = stream;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaEventRecord(ev->stop_event_dev, stream->systream.cudaStream);
+		devcall_assert(result);
+	} else
+#endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_t * tst = (omp_thsim_stream_t *) stream->systream.myStream;
+		if (tst == NULL) ev->stream_ticket = 0; /* the dev default stream has done it already */
+		else {
+			pthread_mutex_lock(&tst->mutex);
+			ev->stream_ticket = tst->num_submitted;
+			pthread_mutex_unlock(&tst->mutex);
+		}
+	} else {
+		fprintf(stderr, "device type is not supported for this call\n");
+		abort();
+	}
+}
+
+/* block the calling thread until the event (its stop record) completes */
+void omp_event_sync(omp_event_t * ev) {
+	if (ev->record_method != OMP_EVENT_DEV_RECORD && ev->record_method != OMP_EVENT_HOST_DEV_RECORD) return;
+	omp_device_type_t devtype = ev->dev->type;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (devtype == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaEventSynchronize(ev->stop_event_dev);
+		devcall_assert(result);
+	} else
 #endif
+	if (devtype == OMP_DEVICE_THSIM) {
+		omp_thsim_stream_t * tst = ev->stream == NULL ? NULL : (omp_thsim_stream_t *) ev->stream->systream.myStream;
+		if (tst != NULL && !pthread_equal(pthread_self(), tst->worker)) omp_thsim_stream_wait_ticket(tst, ev->stream_ticket);
+	}
 }
 
 /* the event msg has limited length defined by OMP_EVENT_MSG_LENGTH macro, additional char will be cut off */
@@ -498,6 +2257,8 @@ void omp_event_init(omp_event_t * ev, omp_device_t * dev, omp_event_record_metho
 	ev->elapsed_dev = ev->elapsed_host = 0.0;
 	ev->event_name = NULL;
 	ev->event_description[0] = '\0';
+	ev->stream = NULL;
+	ev->stream_ticket = 0;
 	if (record_method == OMP_EVENT_DEV_RECORD || record_method == OMP_EVENT_HOST_DEV_RECORD) {
 #if defined (DEVICE_NVGPU_SUPPORT)
 		if (devtype == OMP_DEVICE_NVGPU) {
@@ -518,6 +2279,20 @@ void omp_event_init(omp_event_t * ev, omp_device_t * dev, omp_event_record_metho
 	//omp_event_print(ev);
 }
 
+/* release what omp_event_init created on the device, the event has to be inited again before it is recorded */
+void omp_event_destroy(omp_event_t * ev) {
+	if (ev->record_method != OMP_EVENT_DEV_RECORD && ev->record_method != OMP_EVENT_HOST_DEV_RECORD) return;
+#if defined (DEVICE_NVGPU_SUPPORT)
+	if (ev->dev->type == OMP_DEVICE_NVGPU) {
+		cudaError_t result;
+		result = cudaEventDestroy(ev->start_event_dev);
+		devcall_assert(result);
+		result = cudaEventDestroy(ev->stop_event_dev);
+		devcall_assert(result);
+	}
+#endif
+}
+
 void omp_event_print(omp_event_t * ev) {
 	printf("ev: %X, dev: %X, stream: %X, record method: %d, name: %s, description: %s\n", ev, ev->dev,
 			ev->stream, ev->record_method, ev->event_name, ev->event_description);
@@ -548,7 +2323,9 @@ void omp_event_record_start(omp_event_t * ev, omp_dev_stream_t * stream,  const
 			devcall_assert(result);
 		} else
 #endif
-		if (devtype == OMP_DEVICE_THSIM || devtype == OMP_DEVICE_HOST) {
+		if (devtype == OMP_DEVICE_THSIM) {
+			omp_thsim_stream_timer(&ev->start_time_dev, stream);
+		} else if (devtype == OMP_DEVICE_HOST) {
 			ev->start_time_dev = read_timer_ms();
 		} else {
 			fprintf(stderr, "other type of devices are not yet supported to start event recording\n");
@@ -574,8 +2351,7 @@ void omp_event_record_stop(omp_event_t * ev) {
 		} else
 #endif
 		if (devtype == OMP_DEVICE_THSIM) {
-			ev->stop_time_dev = read_timer_ms();
-
+			ev->stream_ticket = omp_thsim_stream_timer(&ev->stop_time_dev, stream);
 		} else {
 			fprintf(stderr, "other type of devices are not yet supported to stop event record\n");
 		}
@@ -606,6 +2382,7 @@ static double omp_event_elapsed_ms_dev(omp_event_t * ev) {
 	} else
 #endif
 	if (devtype == OMP_DEVICE_THSIM) {
+		omp_event_sync(ev);
 		elapsed = ev->stop_time_dev - ev->start_time_dev;
 	} else {
 		fprintf(stderr, "other type of devices are not yet supported to calculate elapsed\n");